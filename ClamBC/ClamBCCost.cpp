@@ -0,0 +1,370 @@
+/*
+ *  Compile LLVM bytecode to ClamAV bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#include "ClamBCCost.h"
+#include "ClamBCModule.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Constants.h"
+#include "llvm/DerivedTypes.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/Instructions.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetData.h"
+
+using namespace llvm;
+
+// Loops that may run longer than this are assumed to depend on the file size.
+static const uint64_t MaxKnownTripCount = 65536;
+
+static uint64_t satAdd(uint64_t A, uint64_t B)
+{
+  return A + B < A ? ~0ULL : A + B;
+}
+
+static uint64_t satMul(uint64_t A, uint64_t B)
+{
+  if (A && B > ~0ULL / A)
+    return ~0ULL;
+  return A * B;
+}
+
+ClamBCCost &ClamBCCost::operator+=(const ClamBCCost &RHS)
+{
+  for (unsigned i=0;i<3;i++)
+    C[i] = satAdd(C[i], RHS.C[i]);
+  return *this;
+}
+
+ClamBCCost ClamBCCost::operator*(const ClamBCCost &RHS) const
+{
+  ClamBCCost R;
+  for (unsigned i=0;i<3;i++)
+    for (unsigned j=0;j<3;j++) {
+      unsigned k = i+j > 2 ? 2 : i+j;
+      R.C[k] = satAdd(R.C[k], satMul(C[i], RHS.C[j]));
+    }
+  return R;
+}
+
+uint64_t ClamBCCost::at(uint64_t Size) const
+{
+  return satAdd(C[0], satAdd(satMul(C[1], Size),
+                             satMul(C[2], satMul(Size, Size))));
+}
+
+// The cost of an API call, relative to a simple instruction.
+static unsigned getAPICost(StringRef Name)
+{
+  if (Name == "inflate_process" || Name == "jsnorm_process" ||
+      Name == "lzma_process" || Name == "bzip2_process")
+    return 1000;
+  if (Name == "disasm_x86" || Name == "matchicon")
+    return 100;
+  return 10;
+}
+
+uint64_t ClamBCCostModel::getInstructionWeight(const Instruction *I)
+{
+  if (const MemIntrinsic *MI = dyn_cast<MemIntrinsic>(I)) {
+    // a word at a time
+    uint64_t Len = 1024;
+    if (const ConstantInt *CI = dyn_cast<ConstantInt>(MI->getLength()))
+      Len = CI->getLimitedValue();
+    return satAdd(2, Len/8);
+  }
+  if (const CallInst *CI = dyn_cast<CallInst>(I)) {
+    const Function *Callee = CI->getCalledFunction();
+    if (Callee && Callee->isDeclaration())
+      return getAPICost(Callee->getName());
+    if (Callee)
+      return 5;
+  }
+  switch (I->getOpcode()) {
+  case Instruction::Mul:
+    return 3;
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+    return 8;
+  case Instruction::Load:
+  case Instruction::Store:
+  case Instruction::GetElementPtr:
+    return 2;
+  }
+  return 1;
+}
+
+// Returns how often the header of a loop runs per entry into the loop, or 0
+// if unknown.
+static uint64_t getTripCount(Loop *L, ScalarEvolution &SE)
+{
+  const SCEV *Count = SE.getBackedgeTakenCount(L);
+  if (isa<SCEVCouldNotCompute>(Count))
+    Count = SE.getMaxBackedgeTakenCount(L);
+  if (const SCEVConstant *C = dyn_cast<SCEVConstant>(Count)) {
+    const APInt &V = C->getValue()->getValue();
+    if (V.getActiveBits() <= 64 && V.getZExtValue() < MaxKnownTripCount)
+      return V.getZExtValue() + 1;
+  }
+  return 0;
+}
+
+static uint64_t getObjectSize(const Value *V, const TargetData *TD)
+{
+  V = V->stripPointerCasts()->getUnderlyingObject();
+  const Type *Ty = 0;
+  if (const AllocaInst *AI = dyn_cast<AllocaInst>(V)) {
+    if (!AI->isArrayAllocation())
+      Ty = AI->getAllocatedType();
+  } else if (const GlobalVariable *GV = dyn_cast<GlobalVariable>(V))
+    Ty = GV->getType()->getElementType();
+  return Ty ? TD->getTypeAllocSize(Ty) : 0;
+}
+
+// Returns the most bytes of the file that a call to an API can read.
+ClamBCCost ClamBCCostModel::getBytesRead(const Function *Callee,
+                                         const Value *Buffer,
+                                         const Value *Size,
+                                         ScalarEvolution &SE)
+{
+  StringRef Name = Callee->getName();
+  if (Name == "file_byteat")
+    return ClamBCCost(1);
+  // these scan the file from the current position
+  if (Name == "file_find" || Name == "file_find_limit")
+    return ClamBCCost::perByte(1);
+  if ((Name != "read" && Name != "fill_buffer") || !Buffer || !Size)
+    return ClamBCCost();
+  uint64_t Max = ~0ULL;
+  if (SE.isSCEVable(Size->getType()))
+    Max = SE.getUnsignedRange(SE.getSCEV(const_cast<Value*>(Size)))
+      .getUnsignedMax().getLimitedValue();
+  // the runtime checks make sure the buffer is large enough
+  if (uint64_t ObjSize = getObjectSize(Buffer, TD))
+    Max = std::min(Max, ObjSize);
+  // a read can't return more than the file
+  if (Max > MaxKnownTripCount)
+    return ClamBCCost::perByte(1);
+  return ClamBCCost(Max);
+}
+
+void ClamBCCostModel::addFunction(Function &F, unsigned ID, ClamBCRegAlloc *RA,
+                                  LoopInfo &LI, ScalarEvolution &SE)
+{
+  Order.push_back(&F);
+  FunctionCost &FC = Functions[&F];
+  FC.Name = F.getName();
+  FC.ID = ID;
+  FC.Instructions = 0;
+  FC.Weighted = 0;
+  FC.TotalDone = false;
+
+  DenseMap<const Loop*, uint64_t> TripCounts;
+  unsigned BBID = 0;
+  for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB, ++BBID) {
+    // how often the block runs per call of the function
+    ClamBCCost Freq(1);
+    Loop *L = LI.getLoopFor(BB);
+    for (Loop *P = L; P; P = P->getParentLoop()) {
+      if (!TripCounts.count(P))
+        TripCounts[P] = getTripCount(P, SE);
+      uint64_t N = TripCounts[P];
+      Freq = Freq * (N ? ClamBCCost(N) : ClamBCCost::perByte(1));
+    }
+    if (L && L->getHeader() == &*BB) {
+      LoopCost LC;
+      LC.Header = BB->hasName() ? BB->getNameStr() : "bb" + utostr(BBID);
+      LC.Depth = L->getLoopDepth();
+      LC.TripCount = TripCounts[L];
+      FC.Loops.push_back(LC);
+    }
+
+    uint64_t Weight = 0;
+    for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+      if (isa<AllocaInst>(I) || isa<DbgInfoIntrinsic>(I))
+        continue;
+      if (!isa<TerminatorInst>(I) && RA->skipInstruction(I))
+        continue;
+      uint64_t W = getInstructionWeight(I);
+      if (isa<MemIntrinsic>(I))
+        ;
+      else if (CallInst *CI = dyn_cast<CallInst>(I)) {
+        Function *Callee = CI->getCalledFunction();
+        if (Callee && Callee->isDeclaration()) {
+          APICallCost &AC = FC.APICalls[Callee->getName()];
+          AC.Sites++;
+          AC.Executed += Freq;
+          FC.BytesRead += Freq *
+            getBytesRead(Callee,
+                         CI->getNumOperands() > 1 ? CI->getOperand(1) : 0,
+                         CI->getNumOperands() > 2 ? CI->getOperand(2) : 0, SE);
+        } else if (Callee)
+          FC.Calls.push_back(std::make_pair(Callee, Freq));
+      }
+      FC.Instructions++;
+      Weight = satAdd(Weight, W);
+    }
+    FC.Weighted = satAdd(FC.Weighted, Weight);
+    FC.Cost += Freq * ClamBCCost(Weight);
+  }
+}
+
+ClamBCCostModel::FunctionCost &ClamBCCostModel::computeTotal(const Function *F)
+{
+  FunctionCost &FC = Functions[F];
+  if (FC.TotalDone)
+    return FC;
+  // there is no recursion in bytecode
+  FC.TotalDone = true;
+  FC.TotalCost = FC.Cost;
+  FC.TotalBytesRead = FC.BytesRead;
+  for (unsigned i=0;i<FC.Calls.size();i++) {
+    if (!Functions.count(FC.Calls[i].first))
+      continue;
+    FunctionCost &Callee = computeTotal(FC.Calls[i].first);
+    FC.TotalCost += FC.Calls[i].second * Callee.TotalCost;
+    FC.TotalBytesRead += FC.Calls[i].second * Callee.TotalBytesRead;
+  }
+  return FC;
+}
+
+static void printCost(raw_ostream &Out, const ClamBCCost &C)
+{
+  Out << C.C[0];
+  if (C.C[1])
+    Out << " + " << C.C[1] << "*size";
+  if (C.C[2])
+    Out << " + " << C.C[2] << "*size^2";
+}
+
+void ClamBCCostModel::print(raw_ostream &Out)
+{
+  for (unsigned i=0;i<Order.size();i++) {
+    FunctionCost &FC = computeTotal(Order[i]);
+    Out << "Cost of function " << FC.ID << ": " << FC.Name << "\n";
+    Out << "  instructions: " << FC.Instructions << ", weighted: "
+      << FC.Weighted << "\n";
+    for (unsigned j=0;j<FC.Loops.size();j++) {
+      const LoopCost &LC = FC.Loops[j];
+      Out << "  loop " << LC.Header << " (depth " << LC.Depth << "): ";
+      if (LC.TripCount)
+        Out << LC.TripCount << " iterations\n";
+      else
+        Out << "unknown iterations, assumed once per file byte\n";
+    }
+    for (std::map<std::string, APICallCost>::iterator I=FC.APICalls.begin(),
+         E=FC.APICalls.end(); I != E; ++I) {
+      Out << "  API " << I->first << ": " << I->second.Sites
+        << " call sites, executed ";
+      printCost(Out, I->second.Executed);
+      Out << " times\n";
+    }
+    Out << "  cost: ";
+    printCost(Out, FC.Cost);
+    Out << ", with callees: ";
+    printCost(Out, FC.TotalCost);
+    Out << "\n  bytes read: ";
+    printCost(Out, FC.BytesRead);
+    Out << ", with callees: ";
+    printCost(Out, FC.TotalBytesRead);
+    Out << "\n\n";
+  }
+}
+
+static void printJSONString(raw_ostream &Out, StringRef S)
+{
+  Out << '"';
+  for (unsigned i=0;i<S.size();i++) {
+    unsigned char c = S[i];
+    if (c == '"' || c == '\\')
+      Out << '\\' << c;
+    else if (c < 0x20)
+      Out << "\\u00" << hexdigit(c >> 4) << hexdigit(c & 15);
+    else
+      Out << c;
+  }
+  Out << '"';
+}
+
+static void printJSONCost(raw_ostream &Out, const ClamBCCost &C)
+{
+  Out << "{\"constant\": " << C.C[0] << ", \"per_byte\": " << C.C[1]
+    << ", \"superlinear\": " << C.C[2] << "}";
+}
+
+void ClamBCCostModel::printJSON(raw_ostream &Out)
+{
+  const Function *Entry = 0;
+  Out << "{\n  \"functions\": [";
+  for (unsigned i=0;i<Order.size();i++) {
+    FunctionCost &FC = computeTotal(Order[i]);
+    if (FC.Name == "entrypoint")
+      Entry = Order[i];
+    Out << (i ? ",\n" : "\n") << "    {\"id\": " << FC.ID << ", \"name\": ";
+    printJSONString(Out, FC.Name);
+    Out << ", \"instructions\": " << FC.Instructions
+      << ", \"weighted_instructions\": " << FC.Weighted << ",\n";
+    Out << "     \"cost\": ";
+    printJSONCost(Out, FC.Cost);
+    Out << ", \"total_cost\": ";
+    printJSONCost(Out, FC.TotalCost);
+    Out << ",\n     \"bytes_read\": ";
+    printJSONCost(Out, FC.BytesRead);
+    Out << ", \"total_bytes_read\": ";
+    printJSONCost(Out, FC.TotalBytesRead);
+    Out << ",\n     \"loops\": [";
+    for (unsigned j=0;j<FC.Loops.size();j++) {
+      const LoopCost &LC = FC.Loops[j];
+      Out << (j ? ", " : "") << "{\"header\": ";
+      printJSONString(Out, LC.Header);
+      Out << ", \"depth\": " << LC.Depth << ", \"trip_count\": ";
+      if (LC.TripCount)
+        Out << LC.TripCount;
+      else
+        Out << "null";
+      Out << "}";
+    }
+    Out << "],\n     \"api_calls\": {";
+    for (std::map<std::string, APICallCost>::iterator I=FC.APICalls.begin(),
+         E=FC.APICalls.end(); I != E; ++I) {
+      Out << (I == FC.APICalls.begin() ? "" : ", ");
+      printJSONString(Out, I->first);
+      Out << ": {\"sites\": " << I->second.Sites << ", \"executed\": ";
+      printJSONCost(Out, I->second.Executed);
+      Out << "}";
+    }
+    Out << "}}";
+  }
+  Out << "\n  ]";
+  if (Entry) {
+    FunctionCost &FC = computeTotal(Entry);
+    Out << ",\n  \"entrypoint\": {\"cost_per_mb\": " << FC.TotalCost.at(1<<20)
+      << ", \"bytes_read_per_mb\": " << FC.TotalBytesRead.at(1<<20)
+      << ", \"superlinear\": "
+      << (FC.TotalCost.superlinear() ? "true" : "false") << "}";
+  }
+  Out << "\n}\n";
+}
@@ -0,0 +1,108 @@
+/*
+ *  Compile LLVM bytecode to ClamAV bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#ifndef CLAMBC_COST_H
+#define CLAMBC_COST_H
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/System/DataTypes.h"
+#include <map>
+#include <string>
+#include <vector>
+
+class ClamBCRegAlloc;
+
+namespace llvm {
+  class Function;
+  class Instruction;
+  class LoopInfo;
+  class ScalarEvolution;
+  class TargetData;
+  class Value;
+  class raw_ostream;
+}
+
+// A static estimate as a function of the file size: C[0] + C[1]*size +
+// C[2]*size^2, where the last term also stands for higher powers.
+// Saturates instead of wrapping around.
+struct ClamBCCost {
+  uint64_t C[3];
+
+  ClamBCCost(uint64_t Constant = 0) { C[0] = Constant; C[1] = C[2] = 0; }
+  ClamBCCost &operator+=(const ClamBCCost &RHS);
+  ClamBCCost operator*(const ClamBCCost &RHS) const;
+  // The value for a file of Size bytes.
+  uint64_t at(uint64_t Size) const;
+  bool superlinear() const { return C[2] != 0; }
+  static ClamBCCost perByte(uint64_t N) {
+    ClamBCCost R; R.C[1] = N; return R;
+  }
+};
+
+// Estimates the execution time of the functions of a bytecode from the code
+// that is written out: instructions weighted by opcode, multiplied by the
+// trip counts of the loops around them. Loops with an unknown trip count are
+// assumed to run once per byte of the file.
+class ClamBCCostModel {
+public:
+  explicit ClamBCCostModel(const llvm::TargetData *TD) : TD(TD) {}
+  void addFunction(llvm::Function &F, unsigned ID, ClamBCRegAlloc *RA,
+                   llvm::LoopInfo &LI, llvm::ScalarEvolution &SE);
+  // Writes the estimates in the format of the compilation map.
+  void print(llvm::raw_ostream &Out);
+  void printJSON(llvm::raw_ostream &Out);
+  // The cost of running the instruction once, relative to a simple
+  // arithmetic instruction. API calls are the most expensive.
+  static uint64_t getInstructionWeight(const llvm::Instruction *I);
+private:
+  struct LoopCost {
+    std::string Header;
+    unsigned Depth;
+    // 0 if unknown
+    uint64_t TripCount;
+  };
+  struct APICallCost {
+    unsigned Sites;
+    ClamBCCost Executed;
+  };
+  struct FunctionCost {
+    std::string Name;
+    unsigned ID;
+    unsigned Instructions;
+    uint64_t Weighted;
+    ClamBCCost Cost;
+    ClamBCCost BytesRead;
+    std::vector<LoopCost> Loops;
+    std::map<std::string, APICallCost> APICalls;
+    std::vector<std::pair<const llvm::Function*, ClamBCCost> > Calls;
+    // including the callees
+    ClamBCCost TotalCost;
+    ClamBCCost TotalBytesRead;
+    bool TotalDone;
+  };
+  ClamBCCost getBytesRead(const llvm::Function *Callee,
+                          const llvm::Value *Buffer, const llvm::Value *Size,
+                          llvm::ScalarEvolution &SE);
+  FunctionCost &computeTotal(const llvm::Function *F);
+  const llvm::TargetData *TD;
+  std::vector<const llvm::Function*> Order;
+  llvm::DenseMap<const llvm::Function*, FunctionCost> Functions;
+};
+#endif
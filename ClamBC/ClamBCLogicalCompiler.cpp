@@ -28,6 +28,7 @@
 #include "ClamBCDiagnostics.h"
 #include "ClamBCModule.h"
 #include "ClamBCCommon.h"
+#include "ClamBCPrefilter.h"
 #include "llvm/ADT/FoldingSet.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/StringSet.h"
@@ -41,6 +42,7 @@
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
 #include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ConstantRange.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/InstIterator.h"
@@ -52,6 +54,7 @@
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Type.h"
+#include <set>
 
 using namespace llvm;
 
@@ -62,6 +65,7 @@ public:
   ClamBCLogicalCompiler() : ModulePass((uintptr_t)&ID) {}
   virtual bool runOnModule(Module &M);
   virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<ClamBCPrefilter>();
     AU.setPreservesCFG();
   }
 private:
@@ -72,6 +76,8 @@ private:
                                const std::string &icon2,
 			       const std::string &container,
                                int kind);
+  bool compilePrefilter(Module &M, unsigned target, unsigned min,
+                        unsigned max);
   bool validateVirusName(const std::string& name, Module &M, bool suffix=false);
   bool compileVirusNames(Module &M, unsigned kind);
 };
@@ -330,7 +336,7 @@ public:
     if (LHS->op0 != RHS->op0)
       return LHS->op0 < RHS->op0;
     if (LHS->op1 != RHS->op1)
-      return LHS->op0 < RHS->op0;
+      return LHS->op1 < RHS->op1;
     if (LHS->children.size() != RHS->children.size())
       return LHS->children.size() < RHS->children.size();
     for (const_iterator I=LHS->begin(), J=RHS->begin(), E=LHS->end(); I != E; ++I, ++J) {
@@ -391,6 +397,19 @@ public:
     return getOr(V);
   }
 
+  // Builds an AND or OR with the children in the given order, they must
+  // already be folded by getAnd/getOr.
+  static LogicalNode *getOrdered(enum LogicalKind kind,
+                                 const std::vector<LogicalNode*>& V)
+  {
+    assert((kind == LOG_AND || kind == LOG_OR) && V.size() > 1);
+    LogicalNode N(V[0]->Set, kind);
+    N.children = V;
+    return getNode(N);
+  }
+
+  LogicalNodes &getSet() const { return Set; }
+
   const uint32_t op0, op1;
   const enum LogicalKind kind;
   typedef std::vector<LogicalNode*>::const_iterator const_iterator;
@@ -990,7 +1009,601 @@ static std::string node2String(LogicalNode *node, unsigned &groups)
   }
 }
 
-bool validateNDB(const char *S, Module *M, Value *Signatures)
+static cl::opt<bool>
+OptimizeLogical("clambc-lsig-optimize", cl::Hidden, cl::init(true),
+                cl::desc("Minimize the logical signature expression"));
+
+static cl::opt<unsigned>
+MinSelectivity("clambc-min-selectivity", cl::init(25),
+               cl::desc("Subsignatures scoring lower than this (0-100) have "
+                        "low selectivity"));
+
+static cl::opt<bool>
+GeneratePrefilter("clambc-prefilter", cl::init(false),
+                  cl::desc("Generate a logical signature for bytecodes that "
+                           "check the file's magic in the entrypoint"));
+
+static cl::opt<bool>
+SelectivityError("clambc-selectivity-error", cl::init(false),
+                 cl::desc("Reject logical signatures that can match with "
+                          "only low selectivity subsignatures"));
+
+// Estimate of how selective a subsignature is. The ones that aren't cause
+// a lot of work for libclamav's Aho-Corasick and Boyer-Moore matchers on
+// every scanned file: they have a short static part, many wildcards, or can
+// match anywhere in the file.
+struct SubSignatureScore {
+  enum OffsetKind {
+    OFFSET_ANY,// no offset, or '*'
+    OFFSET_FLOATING,// anchored offset with a ,n range
+    OFFSET_ANCHORED,// absolute, EP, Sx, SL or EOF offset
+    OFFSET_VI// version information
+  };
+  SubSignatureScore()
+    : Anchor(0), Bits(0), WildcardDensity(0), LeadingWildcard(false),
+      Offset(OFFSET_ANY), Score(0) {}
+  // Longest run of fixed bytes, this is what the matchers look for.
+  unsigned Anchor;
+  // Number of fixed bits in the pattern.
+  unsigned Bits;
+  // Percentage of wildcards, jumps and alternatives in the pattern.
+  unsigned WildcardDensity;
+  bool LeadingWildcard;
+  OffsetKind Offset;
+  // 0 (matches often and is expensive) to 100.
+  unsigned Score;
+
+  bool isLowSelectivity() const { return Score < MinSelectivity; }
+  void computeScore(StringRef Pattern);
+  std::string toString() const;
+};
+
+void SubSignatureScore::computeScore(StringRef Pattern)
+{
+  unsigned run = 0, bytes = 0, wildcards = 0;
+  for (size_t i=0;i<Pattern.size();) {
+    char c = Pattern[i];
+    if (isxdigit(c) || c == '?') {
+      char c2 = i+1 < Pattern.size() ? Pattern[i+1] : '?';
+      unsigned fixed = (isxdigit(c) ? 1 : 0) + (isxdigit(c2) ? 1 : 0);
+      Bits += 4*fixed;
+      if (fixed == 2) {
+        bytes++;
+        Anchor = std::max(Anchor, ++run);
+      } else {
+        wildcards++;
+        run = 0;
+        LeadingWildcard |= !i;
+      }
+      i += 2;
+      continue;
+    }
+    run = 0;
+    if (c == '!') {
+      i++;
+      continue;
+    }
+    // jumps and alternatives: *, {n-m}, [n-m], (aa|bb)
+    wildcards++;
+    LeadingWildcard |= !i;
+    char close = c == '(' ? ')' : c == '{' ? '}' : c == '[' ? ']' : 0;
+    size_t end = close ? Pattern.find(close, i) : i;
+    i = end == StringRef::npos ? Pattern.size() : end+1;
+  }
+  WildcardDensity = bytes + wildcards ? wildcards*100/(bytes + wildcards) :
+    100;
+
+  // Patterns are looked up by their static part, 16 bytes is as good as it
+  // gets. A fixed offset means a match elsewhere is rejected right away.
+  int score = std::min(Anchor, 16u)*5;
+  if (Offset == OFFSET_ANCHORED || Offset == OFFSET_VI)
+    score += 30;
+  else if (Offset == OFFSET_FLOATING)
+    score += 15;
+  if (LeadingWildcard)
+    score -= 20;
+  score -= WildcardDensity/5;
+  Score = std::max(std::min(score, 100), 0);
+}
+
+std::string SubSignatureScore::toString() const
+{
+  static const char *offsets[] = {"any", "floating", "anchored", "VI"};
+  return ("score "+Twine(Score)+", anchor "+Twine(Anchor)+" bytes, wildcards "+
+          Twine(WildcardDensity)+"%, offset "+offsets[Offset]+
+          (LeadingWildcard ? ", leading wildcard" : "")+
+          (isLowSelectivity() ? ", low selectivity" : "")).str();
+}
+
+// Boolean minimization of the logical expression, before it is turned into a
+// string:
+//  - merges the count ranges of the same subsignature:
+//    (0>1)&(0<5)&(0>2) -> (0>2)&(0<5), (0=0)|0 -> true
+//  - absorption: (a|b)&a -> a, (a&b)|a -> a, (0>2)&0 -> (0>2)
+//  - a&f(a) -> a&f(true), a|f(a) -> a|f(false)
+//  - factors common terms out: (a&b)|(a&c) -> a&(b|c), and its dual,
+//    when that reduces the number of groups
+//  - orders the operands of AND and OR, so that libclamav can stop evaluating
+//    as early as possible: AND starts with the subexpressions that are least
+//    likely to match, OR with the ones that are most likely to match, and
+//    the ones with fewer subsignatures come first among equals.
+class LogicalOptimizer {
+public:
+  LogicalOptimizer(const std::vector<SubSignatureScore> &Scores)
+    : Scores(Scores) {}
+  LogicalNode *optimize(LogicalNode *Node);
+private:
+  // The count of a subsignature's matches is in [Min, Max].
+  struct CountRange {
+    LogicalNode *SubSig;
+    uint32_t Min, Max;
+  };
+  typedef std::pair<CountRange, LogicalNode*> RangeNode;
+  // Operand of an AND/OR, and the keys it is sorted by.
+  struct Operand {
+    LogicalNode *Node;
+    unsigned Bits, Cost;
+  };
+  const std::vector<SubSignatureScore> &Scores;
+  DenseMap<LogicalNode*, LogicalNode*> Optimized;
+
+  static bool getCountRange(LogicalNode *Node, CountRange &R);
+  static void getRangeNodes(const CountRange &R,
+                            std::vector<LogicalNode*> &Nodes);
+  static bool rangeOrder(const RangeNode &LHS, const RangeNode &RHS);
+  static bool implies(LogicalNode *A, LogicalNode *B);
+  static unsigned getCost(LogicalNode *Node);
+  unsigned getBits(LogicalNode *Node);
+  LogicalNode *mergeRanges(LogicalNode *Node);
+  LogicalNode *absorb(LogicalNode *Node);
+  static LogicalNode *assume(LogicalNode *Node, LogicalNode *Term,
+                             bool Value);
+  LogicalNode *propagate(LogicalNode *Node);
+  LogicalNode *factor(LogicalNode *Node);
+  LogicalNode *order(LogicalNode *Node);
+  static bool andOrder(const Operand &LHS, const Operand &RHS);
+  static bool orOrder(const Operand &LHS, const Operand &RHS);
+};
+
+static unsigned getGroups(LogicalNode *Node)
+{
+  unsigned groups = 0;
+  node2String(Node, groups);
+  return groups;
+}
+
+// Number of subsignature counts that libclamav has to look at.
+unsigned LogicalOptimizer::getCost(LogicalNode *Node)
+{
+  if (Node->kind == LOG_SUBSIGNATURE)
+    return 1;
+  unsigned cost = 0;
+  for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E; ++I)
+    cost += getCost(*I);
+  return cost;
+}
+
+// Estimate of how unlikely it is that Node is true, log2 of the inverse
+// probability, assuming that the subsignatures match independently.
+unsigned LogicalOptimizer::getBits(LogicalNode *Node)
+{
+  const unsigned maxBits = 1024;
+  unsigned bits;
+  switch (Node->kind) {
+  case LOG_SUBSIGNATURE:
+    if (Node->op0 >= Scores.size())
+      return 0;
+    return std::min(Scores[Node->op0].Bits, maxBits);
+  case LOG_TRUE:
+    return 0;
+  case LOG_FALSE:
+    return maxBits;
+  case LOG_AND:
+    bits = 0;
+    for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E;
+         ++I)
+      bits = std::min(bits + getBits(*I), maxBits);
+    return bits;
+  case LOG_GT:
+    // count > n needs n+1 matches
+    return std::min((uint64_t)getBits(Node->front())*(Node->op0+1),
+                    (uint64_t)maxBits);
+  case LOG_LT:
+    // usually true, the subsignatures rarely match
+    return 0;
+  case LOG_EQ:
+    return Node->op0 ? getBits(Node->front()) : 0;
+  default:
+    // OR, and sums of counts: as likely as the most likely operand
+    bits = maxBits;
+    for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E;
+         ++I)
+      bits = std::min(bits, getBits(*I));
+    return bits;
+  }
+}
+
+bool LogicalOptimizer::getCountRange(LogicalNode *Node, CountRange &R)
+{
+  if (Node->kind == LOG_AND && Node->size() == 2) {
+    // (a>x)&(a<y)
+    CountRange R2;
+    if (!getCountRange(Node->front(), R) ||
+        !getCountRange(*(Node->begin()+1), R2) || R.SubSig != R2.SubSig)
+      return false;
+    R.Min = std::max(R.Min, R2.Min);
+    R.Max = std::min(R.Max, R2.Max);
+    return R.Min <= R.Max;
+  }
+  if (Node->kind == LOG_SUBSIGNATURE) {
+    // a -> a > 0
+    R.SubSig = Node;
+    R.Min = 1;
+    R.Max = ~0u;
+    return true;
+  }
+  if (Node->kind != LOG_EQ && Node->kind != LOG_GT && Node->kind != LOG_LT)
+    return false;
+  R.SubSig = Node->front();
+  // =X,Y also checks the number of different subsignatures
+  if (R.SubSig->kind != LOG_SUBSIGNATURE || Node->op1 != ~0u)
+    return false;
+  if (Node->kind == LOG_GT && Node->op0 == ~0u)
+    return false;
+  switch (Node->kind) {
+  case LOG_EQ:
+    R.Min = R.Max = Node->op0;
+    break;
+  case LOG_GT:
+    R.Min = Node->op0+1;
+    R.Max = ~0u;
+    break;
+  default:
+    R.Min = 0;
+    R.Max = Node->op0-1;
+    break;
+  }
+  return true;
+}
+
+// The nodes whose AND is the range, none for the full range.
+void LogicalOptimizer::getRangeNodes(const CountRange &R,
+                                     std::vector<LogicalNode*> &Nodes)
+{
+  assert(R.Min <= R.Max);
+  if (R.Min == R.Max) {
+    Nodes.push_back(LogicalNode::getEQ(R.SubSig, R.Min));
+    return;
+  }
+  if (R.Min)
+    Nodes.push_back(LogicalNode::getGT(R.SubSig, R.Min-1));
+  if (R.Max != ~0u)
+    Nodes.push_back(LogicalNode::getLT(R.SubSig, R.Max+1));
+}
+
+bool LogicalOptimizer::rangeOrder(const RangeNode &LHS, const RangeNode &RHS)
+{
+  if (LHS.first.Min != RHS.first.Min)
+    return LHS.first.Min < RHS.first.Min;
+  return LHS.first.Max < RHS.first.Max;
+}
+
+// Whether B is true whenever A is true.
+bool LogicalOptimizer::implies(LogicalNode *A, LogicalNode *B)
+{
+  if (A == B || A->kind == LOG_FALSE || B->kind == LOG_TRUE)
+    return true;
+  CountRange RA, RB;
+  if (getCountRange(A, RA) && getCountRange(B, RB))
+    return RA.SubSig == RB.SubSig && RA.Min >= RB.Min && RA.Max <= RB.Max;
+  if (A->kind == LOG_AND) {
+    for (LogicalNode::const_iterator I=A->begin(), E=A->end(); I != E; ++I)
+      if (implies(*I, B))
+        return true;
+  }
+  if (B->kind == LOG_OR) {
+    for (LogicalNode::const_iterator I=B->begin(), E=B->end(); I != E; ++I)
+      if (implies(A, *I))
+        return true;
+  }
+  if (A->kind == LOG_OR) {
+    bool all = true;
+    for (LogicalNode::const_iterator I=A->begin(), E=A->end(); I != E && all;
+         ++I)
+      all = implies(*I, B);
+    if (all)
+      return true;
+  }
+  if (B->kind == LOG_AND) {
+    bool all = true;
+    for (LogicalNode::const_iterator I=B->begin(), E=B->end(); I != E && all;
+         ++I)
+      all = implies(A, *I);
+    if (all)
+      return true;
+  }
+  return false;
+}
+
+LogicalNode *LogicalOptimizer::mergeRanges(LogicalNode *Node)
+{
+  bool isAnd = Node->kind == LOG_AND;
+  std::vector<LogicalNode*> nodes;
+  // ranges of each subsignature, in order of appearance
+  std::vector<LogicalNode*> subsigs;
+  DenseMap<LogicalNode*, std::vector<RangeNode> > ranges;
+  for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E;
+       ++I) {
+    CountRange R;
+    if (!getCountRange(*I, R)) {
+      nodes.push_back(*I);
+      continue;
+    }
+    std::vector<RangeNode> &V = ranges[R.SubSig];
+    if (V.empty())
+      subsigs.push_back(R.SubSig);
+    V.push_back(std::make_pair(R, *I));
+  }
+  for (std::vector<LogicalNode*>::iterator I=subsigs.begin(),
+       E=subsigs.end(); I != E; ++I) {
+    std::vector<RangeNode> &V = ranges[*I];
+    if (isAnd) {
+      // intersect all ranges
+      CountRange R = V[0].first;
+      for (unsigned i=1;i<V.size();i++) {
+        R.Min = std::max(R.Min, V[i].first.Min);
+        R.Max = std::min(R.Max, V[i].first.Max);
+      }
+      if (R.Min > R.Max)
+        return LogicalNode::getFalse(Node->getSet());
+      getRangeNodes(R, nodes);
+      continue;
+    }
+    // Unite the overlapping and adjacent ranges. Keep the original nodes
+    // when the union would need both a > and a <, since that is an extra
+    // group.
+    std::sort(V.begin(), V.end(), rangeOrder);
+    for (unsigned i=0;i<V.size();) {
+      CountRange R = V[i].first;
+      unsigned j = i+1;
+      while (j < V.size() && R.Max != ~0u && V[j].first.Min <= R.Max+1) {
+        R.Max = std::max(R.Max, V[j].first.Max);
+        j++;
+      }
+      if (!R.Min && R.Max == ~0u)
+        return LogicalNode::getTrue(Node->getSet());
+      std::vector<LogicalNode*> merged;
+      getRangeNodes(R, merged);
+      if (j == i+1 || merged.size() > 1) {
+        for (;i<j;i++)
+          nodes.push_back(V[i].second);
+      } else {
+        nodes.push_back(merged[0]);
+        i = j;
+      }
+    }
+  }
+  return isAnd ? LogicalNode::getAnd(Node->getSet(), nodes) :
+    LogicalNode::getOr(Node->getSet(), nodes);
+}
+
+LogicalNode *LogicalOptimizer::absorb(LogicalNode *Node)
+{
+  bool isAnd = Node->kind == LOG_AND;
+  std::vector<LogicalNode*> children(Node->begin(), Node->end());
+  std::vector<bool> removed(children.size());
+  bool changed = false;
+  for (unsigned i=0;i<children.size();i++) {
+    for (unsigned j=0;j<children.size();j++) {
+      if (i == j || removed[j])
+        continue;
+      // a & (a|b) -> a, a | (a&b) -> a
+      if (isAnd ? implies(children[j], children[i]) :
+          implies(children[i], children[j])) {
+        removed[i] = changed = true;
+        break;
+      }
+    }
+  }
+  if (!changed)
+    return Node;
+  std::vector<LogicalNode*> nodes;
+  for (unsigned i=0;i<children.size();i++)
+    if (!removed[i])
+      nodes.push_back(children[i]);
+  return isAnd ? LogicalNode::getAnd(Node->getSet(), nodes) :
+    LogicalNode::getOr(Node->getSet(), nodes);
+}
+
+// Replaces Term with Value in Node, and the counts of the same subsignature
+// that follow from it.
+LogicalNode *LogicalOptimizer::assume(LogicalNode *Node, LogicalNode *Term,
+                                      bool Value)
+{
+  LogicalNodes &Set = Node->getSet();
+  if (Node == Term)
+    return Value ? LogicalNode::getTrue(Set) : LogicalNode::getFalse(Set);
+  CountRange RN, RT;
+  if (getCountRange(Node, RN) && getCountRange(Term, RT) &&
+      RN.SubSig == RT.SubSig) {
+    if (Value) {
+      if (RT.Min >= RN.Min && RT.Max <= RN.Max)
+        return LogicalNode::getTrue(Set);
+      if (RT.Min > RN.Max || RT.Max < RN.Min)
+        return LogicalNode::getFalse(Set);
+      return Node;
+    }
+    // the count is outside of RT
+    if (RN.Min >= RT.Min && RN.Max <= RT.Max)
+      return LogicalNode::getFalse(Set);
+    if ((!RT.Min || (!RN.Min && RN.Max >= RT.Min-1)) &&
+        (RT.Max == ~0u || (RN.Max == ~0u && RN.Min <= RT.Max+1)))
+      return LogicalNode::getTrue(Set);
+    return Node;
+  }
+  if (Node->kind != LOG_AND && Node->kind != LOG_OR)
+    return Node;
+  std::vector<LogicalNode*> children;
+  bool changed = false;
+  for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E;
+       ++I) {
+    children.push_back(assume(*I, Term, Value));
+    changed |= children.back() != *I;
+  }
+  if (!changed)
+    return Node;
+  return Node->kind == LOG_AND ? LogicalNode::getAnd(Set, children) :
+    LogicalNode::getOr(Set, children);
+}
+
+LogicalNode *LogicalOptimizer::propagate(LogicalNode *Node)
+{
+  bool isAnd = Node->kind == LOG_AND;
+  std::vector<LogicalNode*> children(Node->begin(), Node->end());
+  bool changed = false;
+  for (unsigned i=0;i<children.size();i++) {
+    LogicalNode *Term = children[i];
+    // a & f(a) -> a & f(true), a | f(a) -> a | f(false)
+    for (unsigned j=0;j<children.size();j++) {
+      if (i == j || (children[j]->kind != LOG_AND &&
+                     children[j]->kind != LOG_OR))
+        continue;
+      LogicalNode *N = assume(children[j], Term, isAnd);
+      if (N != children[j]) {
+        children[j] = N;
+        changed = true;
+      }
+    }
+  }
+  if (!changed)
+    return Node;
+  return optimize(isAnd ? LogicalNode::getAnd(Node->getSet(), children) :
+                  LogicalNode::getOr(Node->getSet(), children));
+}
+
+LogicalNode *LogicalOptimizer::factor(LogicalNode *Node)
+{
+  LogicalNodes &Set = Node->getSet();
+  enum LogicalKind inner = Node->kind == LOG_OR ? LOG_AND : LOG_OR;
+  // find the term that appears in most operands
+  DenseMap<LogicalNode*, unsigned> uses;
+  LogicalNode *best = 0;
+  for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E;
+       ++I) {
+    if ((*I)->kind != inner)
+      continue;
+    for (LogicalNode::const_iterator J=(*I)->begin(), JE=(*I)->end(); J != JE;
+         ++J) {
+      unsigned n = ++uses[*J];
+      if (n > 1 && (!best || n > uses[best]))
+        best = *J;
+    }
+  }
+  if (!best)
+    return Node;
+  std::vector<LogicalNode*> rest, others;
+  for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E;
+       ++I) {
+    if ((*I)->kind != inner ||
+        std::find((*I)->begin(), (*I)->end(), best) == (*I)->end()) {
+      others.push_back(*I);
+      continue;
+    }
+    std::vector<LogicalNode*> terms;
+    for (LogicalNode::const_iterator J=(*I)->begin(), JE=(*I)->end(); J != JE;
+         ++J)
+      if (*J != best)
+        terms.push_back(*J);
+    rest.push_back(inner == LOG_AND ? LogicalNode::getAnd(Set, terms) :
+                   LogicalNode::getOr(Set, terms));
+  }
+  // (a&b)|(a&c) -> a&(b|c), (a|b)&(a|c) -> a|(b&c)
+  LogicalNode *factored = inner == LOG_AND ?
+    LogicalNode::getAnd(best, LogicalNode::getOr(Set, rest)) :
+    LogicalNode::getOr(best, LogicalNode::getAnd(Set, rest));
+  others.push_back(factored);
+  LogicalNode *result = optimize(Node->kind == LOG_OR ?
+                                 LogicalNode::getOr(Set, others) :
+                                 LogicalNode::getAnd(Set, others));
+  unsigned oldGroups = getGroups(Node), newGroups = getGroups(result);
+  if (newGroups < oldGroups ||
+      (newGroups == oldGroups && getCost(result) < getCost(Node)))
+    return result;
+  return Node;
+}
+
+bool LogicalOptimizer::andOrder(const Operand &LHS, const Operand &RHS)
+{
+  if (LHS.Bits != RHS.Bits)
+    return LHS.Bits > RHS.Bits;
+  if (LHS.Cost != RHS.Cost)
+    return LHS.Cost < RHS.Cost;
+  return LogicalNode::compare_lt(LHS.Node, RHS.Node);
+}
+
+bool LogicalOptimizer::orOrder(const Operand &LHS, const Operand &RHS)
+{
+  if (LHS.Bits != RHS.Bits)
+    return LHS.Bits < RHS.Bits;
+  if (LHS.Cost != RHS.Cost)
+    return LHS.Cost < RHS.Cost;
+  return LogicalNode::compare_lt(LHS.Node, RHS.Node);
+}
+
+LogicalNode *LogicalOptimizer::order(LogicalNode *Node)
+{
+  std::vector<Operand> operands;
+  for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E;
+       ++I) {
+    Operand Op;
+    Op.Node = *I;
+    Op.Bits = getBits(*I);
+    Op.Cost = getCost(*I);
+    operands.push_back(Op);
+  }
+  std::sort(operands.begin(), operands.end(),
+            Node->kind == LOG_AND ? andOrder : orOrder);
+  std::vector<LogicalNode*> nodes;
+  for (std::vector<Operand>::iterator I=operands.begin(), E=operands.end();
+       I != E; ++I)
+    nodes.push_back(I->Node);
+  return LogicalNode::getOrdered(Node->kind, nodes);
+}
+
+LogicalNode *LogicalOptimizer::optimize(LogicalNode *Node)
+{
+  if (Node->kind != LOG_AND && Node->kind != LOG_OR)
+    return Node;
+  DenseMap<LogicalNode*, LogicalNode*>::iterator I = Optimized.find(Node);
+  if (I != Optimized.end())
+    return I->second;
+  std::vector<LogicalNode*> children;
+  for (LogicalNode::const_iterator J=Node->begin(), E=Node->end(); J != E;
+       ++J)
+    children.push_back(optimize(*J));
+  enum LogicalKind kind = Node->kind;
+  LogicalNode *N = kind == LOG_AND ?
+    LogicalNode::getAnd(Node->getSet(), children) :
+    LogicalNode::getOr(Node->getSet(), children);
+  if (N->kind == kind)
+    N = mergeRanges(N);
+  if (N->kind == kind)
+    N = absorb(N);
+  if (N->kind == kind)
+    N = propagate(N);
+  if (N->kind == kind)
+    N = factor(N);
+  if (N->kind == LOG_AND || N->kind == LOG_OR)
+    N = order(N);
+  Optimized[Node] = N;
+  Optimized[N] = N;
+  return N;
+}
+
+// Validates the pattern and offset of a subsignature, and scores its
+// selectivity.
+bool validateNDB(const char *S, Module *M, Value *Signatures,
+                 SubSignatureScore &Score)
 {
   StringRef Pattern(S);
   bool valid = true;
@@ -1001,6 +1614,8 @@ bool validateNDB(const char *S, Module *M, Value *Signatures)
     // Attempt to fully validate the anchor/offset.
     StringRef offset = Pattern.substr(0, offsetp);
     size_t floating = offset.find(",");
+    Score.Offset = floating != StringRef::npos ?
+      SubSignatureScore::OFFSET_FLOATING : SubSignatureScore::OFFSET_ANCHORED;
     if (floating != StringRef::npos) {
       unsigned R;
       StringRef floatO = offset.substr(floating+1);
@@ -1017,6 +1632,7 @@ bool validateNDB(const char *S, Module *M, Value *Signatures)
                            M, Signatures);
       valid = false;
     } else if (S[0] == '*') {
+      Score.Offset = SubSignatureScore::OFFSET_ANY;
       if (S[1] != ':') {
         printDiagnosticValue("Offset ANY ('*') followed by garbage: '"
                              +Twine(offset)+"'", M, Signatures);
@@ -1029,7 +1645,9 @@ bool validateNDB(const char *S, Module *M, Value *Signatures)
                              +Twine(offset)+"'", M, Signatures);
         valid = false;
       }
-    } else if (!offset.equals("VI")) {
+    } else if (offset.equals("VI")) {
+      Score.Offset = SubSignatureScore::OFFSET_VI;
+    } else {
       size_t n1 = offset.find("+");
       size_t n2 = offset.find("-");
       if (n2 < n1)
@@ -1082,6 +1700,7 @@ bool validateNDB(const char *S, Module *M, Value *Signatures)
     valid = false;
     break;
   }
+  Score.computeScore(Pattern);
   return valid;
 }
 static const char *json_api_funcs[] = {"json_is_active", "json_get_object", "json_get_type", 
@@ -1184,6 +1803,56 @@ static bool checkMinimum(llvm::Module *M, std::string s, unsigned min, unsigned
       return false;
 }
 
+// Whether the expression can only be true when a subsignature that doesn't
+// have low selectivity matches.
+static bool requiresSelective(LogicalNode *Node,
+                              const std::vector<SubSignatureScore> &Scores)
+{
+  switch (Node->kind) {
+  case LOG_SUBSIGNATURE:
+    return Node->op0 < Scores.size() && !Scores[Node->op0].isLowSelectivity();
+  case LOG_FALSE:
+    return true;
+  case LOG_EQ:
+    // a == 0 is true when nothing matched
+    return Node->op0 && requiresSelective(Node->front(), Scores);
+  case LOG_GT:
+    return requiresSelective(Node->front(), Scores);
+  case LOG_AND:
+    for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E;
+         ++I)
+      if (requiresSelective(*I, Scores))
+        return true;
+    return false;
+  case LOG_OR:
+  case LOG_ADDSUM:
+  case LOG_ADDUNIQ:
+  case LOG_ADDBOTH:
+    for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E;
+         ++I)
+      if (!requiresSelective(*I, Scores))
+        return false;
+    return true;
+  default:
+    // a < b, constants, a + c
+    return false;
+  }
+}
+
+static void getLowSelectivity(LogicalNode *Node,
+                              const std::vector<SubSignatureScore> &Scores,
+                              std::set<unsigned> &Low)
+{
+  if (Node->kind == LOG_SUBSIGNATURE) {
+    if (Node->op0 < Scores.size() && Scores[Node->op0].isLowSelectivity())
+      Low.insert(Node->op0);
+    return;
+  }
+  for (LogicalNode::const_iterator I=Node->begin(), E=Node->end(); I != E;
+       ++I)
+    getLowSelectivity(*I, Scores, Low);
+}
+
 bool ClamBCLogicalCompiler::compileLogicalSignature(Function &F, unsigned target,
                                                     unsigned min, unsigned max,
                                                     const std::string& icon1,
@@ -1231,6 +1900,8 @@ bool ClamBCLogicalCompiler::compileLogicalSignature(Function &F, unsigned target
 
   std::vector<std::string> SubSignatures;
   SubSignatures.resize(n/2);
+  std::vector<SubSignatureScore> Scores;
+  Scores.resize(n/2);
   bool valid = true;
   for (unsigned i=0;i<n;i += 2) {
     Constant *C = CS->getOperand(i);
@@ -1254,12 +1925,17 @@ bool ClamBCLogicalCompiler::compileLogicalSignature(Function &F, unsigned target
     if (offsetp == StringRef::npos)
 	offsetp = 0;
     std::transform(String.begin()+offsetp, String.end(), String.begin()+offsetp, ::tolower);
-    valid = validateNDB(String.c_str(), F.getParent(), NewGV);
+    if (!validateNDB(String.c_str(), F.getParent(), NewGV, Scores[id]))
+      valid = false;
     SubSignatures[id] = String;
   }
   LogicalNode *node = compiler.compile(F);
   if (!node)
     return false;
+  if (OptimizeLogical) {
+    LogicalOptimizer optimizer(Scores);
+    node = optimizer.optimize(node);
+  }
   if (node->kind == LOG_TRUE) {
     printDiagnostic("Logical signature: expression is always true", &F);
     return false;
@@ -1270,6 +1946,35 @@ bool ClamBCLogicalCompiler::compileLogicalSignature(Function &F, unsigned target
   }
   if (!valid)
     return false;
+
+  // The scores are printed in the -clambc-map output.
+  NamedMDNode *ScoreMD =
+    F.getParent()->getOrInsertNamedMetadata("clambc.subsignatures");
+  for (unsigned i=0;i<SubSignatures.size();i++) {
+    Value *S = MDString::get(F.getContext(),
+                             ("Subsignature "+Twine(i)+": "+
+                              Scores[i].toString()+": "+
+                              SubSignatures[i]).str());
+    ScoreMD->addOperand(MDNode::get(F.getContext(), &S, 1));
+  }
+  if (!requiresSelective(node, Scores)) {
+    std::set<unsigned> low;
+    getLowSelectivity(node, Scores, low);
+    std::string ids;
+    for (std::set<unsigned>::iterator I=low.begin(), E=low.end(); I != E;
+         ++I)
+      ids += (ids.empty() ? "" : ", ")+Twine(*I).str();
+    std::string Msg = low.empty() ?
+      "Logical signature can match without any subsignature matching" :
+      "Logical signature can match with only low selectivity subsignatures ("+
+      ids+"), which are expensive to match on every file";
+    if (SelectivityError) {
+      printDiagnostic(Msg, &F);
+      return false;
+    }
+    printWarning(Msg, &F);
+  }
+
   unsigned groups = 0;
   LogicalSignature = virusnames;
   if (min || max || !icon1.empty() || !icon2.empty()) {
@@ -1334,6 +2039,43 @@ bool ClamBCLogicalCompiler::compileLogicalSignature(Function &F, unsigned target
   return true;
 }
 
+// A bytecode without a hook or logical_trigger is run on every file. When its
+// entrypoint starts by checking some bytes at fixed offsets, a logical
+// signature matching those bytes can trigger it instead.
+bool ClamBCLogicalCompiler::compilePrefilter(Module &M, unsigned target,
+                                             unsigned min, unsigned max)
+{
+  Function *Entry = M.getFunction("entrypoint");
+  if (!Entry || Entry->isDeclaration())
+    return false;
+  const std::vector<std::string> &Patterns =
+    getAnalysis<ClamBCPrefilter>(*Entry).getPatterns();
+  if (Patterns.empty() || Patterns.size() > 64)
+    return false;
+  // Don't trade running the bytecode for something as expensive.
+  bool selective = false;
+  for (unsigned i=0;i<Patterns.size();i++) {
+    SubSignatureScore Score;
+    Score.Offset = SubSignatureScore::OFFSET_ANCHORED;
+    Score.computeScore(StringRef(Patterns[i]).split(':').second);
+    selective |= !Score.isLowSelectivity();
+  }
+  if (!selective)
+    return false;
+
+  std::string expr;
+  for (unsigned i=0;i<Patterns.size();i++)
+    expr += (i ? "&" : "")+Twine(i).str();
+  if (Patterns.size() > 1)
+    expr = "("+expr+")";
+  LogicalSignature = (virusnames+";Engine:"+Twine(min)+"-"+
+                      Twine(max ? max : 255)+",Target:"+Twine(target)+
+                      ";"+expr).str();
+  for (unsigned i=0;i<Patterns.size();i++)
+    LogicalSignature += ";"+Patterns[i];
+  return checkMinimum(&M, LogicalSignature, min, target, BC_LOGICAL);
+}
+
 bool ClamBCLogicalCompiler::validateVirusName(const std::string& name,
                                               Module &M, bool Suffix)
 {
@@ -1487,6 +2229,14 @@ bool ClamBCLogicalCompiler::compileVirusNames(Module &M, unsigned kind)
   return Valid;
 }
 
+static void setKind(GlobalVariable *GVKind, unsigned kind)
+{
+  GVKind->setLinkage(GlobalValue::ExternalLinkage);
+  GVKind->setInitializer(ConstantInt::get(Type::getInt16Ty(GVKind->getContext()),
+                                          kind));
+  GVKind->setConstant(true);
+}
+
 bool ClamBCLogicalCompiler::runOnModule(Module &M)
 {
   bool Valid = true;
@@ -1501,13 +2251,8 @@ bool ClamBCLogicalCompiler::runOnModule(Module &M)
   }
   Function *F = M.getFunction("logical_trigger");
   // bytecode with a logical_trigger is always logical
-  if (F && !kind) {
-    kind = 256;
-    GVKind->setLinkage(GlobalValue::ExternalLinkage);
-    GVKind->setInitializer(ConstantInt::get(Type::getInt16Ty(GVKind->getContext()),
-                                            kind));
-    GVKind->setConstant(true);
-  }
+  if (F && !kind)
+    setKind(GVKind, kind = BC_LOGICAL);
   if (!compileVirusNames(M, kind)) {
     if (!kind || kind == BC_STARTUP)
       return true;
@@ -1600,6 +2345,19 @@ bool ClamBCLogicalCompiler::runOnModule(Module &M)
     Node->addOperand(N);
     if (F->use_empty())
       F->eraseFromParent();
+  } else if (!kind && Valid && GVKind && GeneratePrefilter &&
+             !hasJSONUsage(&M)) {
+    unsigned target = 0;
+    GV = M.getGlobalVariable("__Target");
+    if (GV && GV->hasDefinitiveInitializer())
+      target = cast<ConstantInt>(GV->getInitializer())->getValue().getZExtValue();
+    if (compilePrefilter(M, target, funcmin, funcmax)) {
+      setKind(GVKind, kind = BC_LOGICAL);
+      NamedMDNode *Node = M.getOrInsertNamedMetadata("clambc.logicalsignature");
+      Value *S = MDString::get(M.getContext(), LogicalSignature);
+      MDNode *N = MDNode::get(M.getContext(),  &S, 1);
+      Node->addOperand(N);
+    }
   }
   if (!Valid) {
     errs() << "lsig not valid!\n";
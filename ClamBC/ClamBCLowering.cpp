@@ -64,6 +64,7 @@ public:
   virtual bool runOnModule(Module &M);
   virtual void getAnalysisUsage(AnalysisUsage &AU) const {
 //    AU.addRequired<TargetData>();
+    AU.setPreservesCFG();
   }
 private:
   bool final;
@@ -315,9 +316,12 @@ void ClamBCLowering::downsizeIntrinsics(Function &F)
 {
   LLVMContext &Context = F.getContext();
   std::vector<Instruction *> InstDel;
-  Function *MemCpy32 = NULL, *MemSet32 = NULL, *MemMove32 = NULL;
+  /* reuse the i32 memory intrinsics declared while lowering other functions */
+  Module *M = F.getParent();
+  Function *MemCpy32 = M->getFunction("llvm.memcpy.i32");
+  Function *MemSet32 = M->getFunction("llvm.memset.i32");
+  Function *MemMove32 = M->getFunction("llvm.memmove.i32");
 
-  /* TODO - search for pre-existing i32 memory intrinsics */
   //MemCpy32 = Intrinsic::getDeclaration(F.getParent(), Intrinsic::memcpy, args);
   //MemSet32 = Intrinsic::getDeclaration(F.getParent(), Intrinsic::memset, args);
   //MemMove32 = Intrinsic::getDeclaration(F.getParent(), Intrinsic::memmove, args);
@@ -45,12 +45,14 @@
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetData.h"
+#include "llvm/System/Path.h"
 #include "llvm/System/Process.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Type.h"
+#include <algorithm>
 using namespace llvm;
 
 static cl::opt<bool>
@@ -63,9 +65,25 @@ SrcFile("clambc-src",cl::desc("Source file"),
                        "to this compiled file"),
         cl::init(""));
 
+static cl::opt<unsigned>
+Timestamp("clambc-timestamp",
+          cl::desc("Compile timestamp to embed, in seconds since the Epoch "
+                   "(default: $SOURCE_DATE_EPOCH, or the current time)"),
+          cl::value_desc("seconds"));
+
+static cl::opt<bool>
+BinaryFormat("clambc-binary", cl::init(false),
+             cl::desc("Write bytecode in the compact binary format instead of "
+                      "the text format"));
+
+// The binary format starts with this magic, followed by a version byte.
+static const char BinaryMagic[] = "ClamBCB";
+static const unsigned char BinaryVersion = 1;
+
 ClamBCModule::ClamBCModule(llvm::formatted_raw_ostream &o,
                            const std::vector<std::string> &APIList)
-: ModulePass(&ID), Out(lineBuffer), OutReal(o), lastLinePos(0), maxLineLength(0), anyDbgIds(false) {
+: ModulePass(&ID), Out(lineBuffer), OutReal(o), bodyOut(body), spool(0),
+  lines(0), maxLineLength(0), anyDbgIds(false) {
   unsigned id = 1;
   for (std::vector<std::string>::const_iterator I=APIList.begin(), E=APIList.end();
        I != E; ++I) {
@@ -173,6 +191,8 @@ bool ClamBCModule::runOnModule(Module &M)
     extraTypes.push_back(Ty);
   }
 
+  mergeStringSuffixes(M);
+
   std::vector<const Type*> types;
   //cid=1;
   fid=1;
@@ -431,6 +451,21 @@ void ClamBCModule::describeType(llvm::raw_ostream &Out, const Type *Ty, Module
 
 extern "C" const char *clambc_getversion(void);
 
+// The timestamp can be overridden to make the output reproducible, so that
+// outputs from the compilation cache are identical to freshly compiled ones.
+static uint64_t getCompileTimestamp()
+{
+  if (Timestamp.getNumOccurrences())
+    return Timestamp;
+  if (const char *epoch = getenv("SOURCE_DATE_EPOCH")) {
+    char *end;
+    unsigned long long t = strtoull(epoch, &end, 10);
+    if (*epoch && !*end)
+      return t;
+  }
+  return sys::TimeValue::now().toEpochTime();
+}
+
 void ClamBCModule::printString(raw_ostream &Out, const char *string, 
                                unsigned maxlength)
 {
@@ -457,8 +492,8 @@ static bool checkFunctionalityLevel(unsigned query, unsigned min, unsigned max)
   return true;
 }
 
-void ClamBCModule::printModuleHeader(Module &M, unsigned startTID, unsigned
-                                     maxLine)
+void ClamBCModule::printModuleHeader(raw_ostream &OutReal, Module &M,
+                                     unsigned startTID, unsigned maxLine)
 {
   NamedMDNode *MinFunc = M.getNamedMetadata("clambc.funcmin");
   NamedMDNode *MaxFunc = M.getNamedMetadata("clambc.funcmax");
@@ -473,7 +508,8 @@ void ClamBCModule::printModuleHeader(Module &M, unsigned startTID, unsigned
       getZExtValue();
   }
 
-  OutReal << "ClamBC";
+  if (!BinaryFormat)
+    OutReal << BC_HEADER;
   // Print functionality level
   // 0.96 only knows to skip based on bytecode format level, and has no min/max
   // verification.
@@ -490,7 +526,7 @@ void ClamBCModule::printModuleHeader(Module &M, unsigned startTID, unsigned
   else
     printNumber(OutReal, BC_FORMAT_LEVEL);
   // Bytecode compile timestamp
-  printNumber(OutReal, sys::TimeValue::now().toEpochTime());
+  printNumber(OutReal, getCompileTimestamp());
   const char *user = getenv("SIGNDUSER");
   // fallback to $USER
   if (!user) user = getenv("USER");
@@ -526,11 +562,97 @@ void ClamBCModule::printModuleHeader(Module &M, unsigned startTID, unsigned
   printFixedNumber(OutReal, 42, 2);
   if (maxLine < 4096)
       maxLine = 4096;
+  if (BinaryFormat) {
+    printNumber(OutReal, maxLine);
+    return;
+  }
   OutReal << ":" << maxLine << "\n";
   // first line must fit into 8k
   assert(OutReal.tell() < 8192);
 }
 
+namespace {
+struct ReversedString {
+  std::string Rev;
+  GlobalVariable *GV;
+  bool Mergeable;
+  bool operator<(const ReversedString &RHS) const { return Rev < RHS.Rev; }
+};
+}
+
+// A constant byte array that is the suffix of another one is replaced with a
+// pointer into the longer one. ConstantMerge only merges equal constants,
+// this also catches the common endings of strings and byte patterns.
+// Only arrays that are used by constant GEPs only are replaced, their GEPs
+// are turned into GEPs of the longer array by adding the offset of the suffix.
+void ClamBCModule::mergeStringSuffixes(Module &M)
+{
+  std::vector<ReversedString> Strings;
+  for (Module::global_iterator I = M.global_begin(), E = M.global_end();
+       I != E; ++I) {
+    if (!I->isConstant() || !I->hasDefinitiveInitializer() ||
+        !I->hasLocalLinkage() || I->hasSection() || I->use_empty() ||
+        globalsMap.count(I->getName()) || I->getName().startswith("__"))
+      continue;
+    ConstantArray *CA = dyn_cast<ConstantArray>(I->getInitializer());
+    if (!CA || !CA->isString())
+      continue;
+    ReversedString S;
+    S.Rev = CA->getAsString();
+    std::reverse(S.Rev.begin(), S.Rev.end());
+    S.GV = I;
+    S.Mergeable = true;
+    for (Value::use_iterator U=I->use_begin(),UE=I->use_end(); U != UE; ++U) {
+      ConstantExpr *CE = dyn_cast<ConstantExpr>(*U);
+      if (!CE || CE->getOpcode() != Instruction::GetElementPtr ||
+          CE->getNumOperands() != 3 || !isa<ConstantInt>(CE->getOperand(1)) ||
+          !cast<ConstantInt>(CE->getOperand(1))->isZero() ||
+          !isa<ConstantInt>(CE->getOperand(2))) {
+        // it can still hold the suffixes of others
+        S.Mergeable = false;
+        break;
+      }
+    }
+    Strings.push_back(S);
+  }
+
+  // After sorting the reversed strings, a string is followed by the strings
+  // it is a suffix of, the last of these is the longest.
+  std::sort(Strings.begin(), Strings.end());
+  unsigned Host = 0;
+  for (int i=Strings.size()-1;i >= 0;i--) {
+    if (i+1 == (int)Strings.size() ||
+        !StringRef(Strings[i+1].Rev).startswith(Strings[i].Rev)) {
+      Host = i;
+      continue;
+    }
+    if (!Strings[i].Mergeable)
+      continue;
+    GlobalVariable *GV = Strings[i].GV;
+    GlobalVariable *HostGV = Strings[Host].GV;
+    uint64_t Offset = Strings[Host].Rev.size() - Strings[i].Rev.size();
+    DEBUG(errs() << "merging " << GV->getName() << " into "
+          << HostGV->getName() << " at offset " << Offset << "\n");
+    std::vector<ConstantExpr*> Uses;
+    for (Value::use_iterator U=GV->use_begin(),UE=GV->use_end(); U != UE; ++U)
+      Uses.push_back(cast<ConstantExpr>(*U));
+    for (unsigned j=0;j<Uses.size();j++) {
+      ConstantExpr *CE = Uses[j];
+      ConstantInt *Idx = cast<ConstantInt>(CE->getOperand(2));
+      Constant *Idxs[2] = {
+        cast<Constant>(CE->getOperand(1)),
+        ConstantInt::get(Idx->getType(), Idx->getZExtValue() + Offset)
+      };
+      Constant *NewCE = cast<GEPOperator>(CE)->isInBounds() ?
+        ConstantExpr::getInBoundsGetElementPtr(HostGV, Idxs, 2) :
+        ConstantExpr::getGetElementPtr(HostGV, Idxs, 2);
+      CE->replaceAllUsesWith(NewCE);
+      CE->destroyConstant();
+    }
+    GV->eraseFromParent();
+  }
+}
+
 void ClamBCModule::printConstant(Module &M, Constant *C)
 {
   if (ConstantExpr *CE = dyn_cast<ConstantExpr>(C)) {
@@ -843,6 +965,20 @@ void ClamBCModule::stop(const Twine& Msg, const Instruction *I)
 
 void ClamBCModule::printNumber(raw_ostream &Out, uint64_t n, bool constant)
 {
+  if (BinaryFormat) {
+    // Bit 0 of the first byte is the constant flag, the number follows 7 bits
+    // per byte (6 in the first byte), least significant first. The high bit
+    // is set on all bytes except the last one.
+    unsigned char b = (constant ? 1 : 0) | ((n & 0x3f) << 1);
+    n >>= 6;
+    while (n) {
+      Out << (char)(b | 0x80);
+      b = n & 0x7f;
+      n >>= 7;
+    }
+    Out << (char)b;
+    return;
+  }
   char number[32];
   unsigned i = 0;
   while (n > 0) {
@@ -857,23 +993,115 @@ void ClamBCModule::printNumber(raw_ostream &Out, uint64_t n, bool constant)
   Out << number;
 }
 
+// Writes one record of the binary format: its length, followed by the data.
+static void printRecord(raw_ostream &Out, StringRef Data)
+{
+  ClamBCModule::printNumber(Out, Data.size());
+  Out << Data;
+}
+
+// Once the output grows above this size, completed lines are moved to a
+// temporary file.
+static const size_t SpoolThreshold = 1 << 20;
+static sys::Path SpoolPath;
+
+static void removeSpool()
+{
+  if (!SpoolPath.isEmpty())
+    SpoolPath.eraseFromDisk();
+}
+
+// Lines are moved out of lineBuffer as soon as they are complete, and large
+// outputs are moved to a temporary file, so that the memory used doesn't
+// grow with the size of the output.
+// They can't be written to the output directly, because the header comes
+// first, and needs the length of the longest line, and the output may not be
+// seekable (a pipe, or the compilation cache's buffer).
 void ClamBCModule::printEOL()
 {
   int diff;
-  Out << "\n";
+  if (!BinaryFormat)
+    Out << "\n";
   Out.flush();
-  diff = lineBuffer.size() - lastLinePos;
-  lastLinePos = lineBuffer.size();
-  assert(diff > 0);
+  diff = lineBuffer.size();
+  assert(diff > 0 || BinaryFormat);
   if (diff > maxLineLength)
     maxLineLength = diff;
+
+  raw_ostream &Body = spool ? *spool : bodyOut;
+  StringRef Line(lineBuffer.data(), lineBuffer.size());
+  if (BinaryFormat)
+    printRecord(Body, Line);
+  else
+    Body << Line;
+  lines++;
+  lineBuffer.clear();
+  Out.resync();
+
+  if (!spool && bodyOut.str().size() > SpoolThreshold) {
+    std::string ErrMsg;
+    SpoolPath = sys::Path("clambc-spool");
+    if (SpoolPath.createTemporaryFileOnDisk(true, &ErrMsg)) {
+      // keep it in memory then
+      SpoolPath.clear();
+      return;
+    }
+    atexit(removeSpool);
+    spool = new raw_fd_ostream(SpoolPath.c_str(), ErrMsg,
+                               raw_fd_ostream::F_Binary);
+    if (!ErrMsg.empty()) {
+      errs() << "Unable to write temporary file: " << ErrMsg << "\n";
+      exit(42);
+    }
+    *spool << body;
+    body.clear();
+  }
+}
+
+// Writes the lines collected by printEOL().
+void ClamBCModule::printBody()
+{
+  if (BinaryFormat)
+    printNumber(OutReal, lines);
+  if (!spool) {
+    OutReal << bodyOut.str();
+    return;
+  }
+  delete spool;
+  spool = 0;
+  std::string ErrStr;
+  MemoryBuffer *MB = MemoryBuffer::getFile(SpoolPath.c_str(), &ErrStr);
+  if (!MB) {
+    errs() << "Unable to read temporary file: " << ErrStr << "\n";
+    exit(42);
+  }
+  OutReal << MB->getBuffer();
+  delete MB;
+  SpoolPath.eraseFromDisk();
+  SpoolPath.clear();
 }
 
 void ClamBCModule::finished(Module &M)
 {
+  // The last line may be incomplete
+  Out.flush();
+  if (!lineBuffer.empty()) {
+    if (BinaryFormat)
+      printEOL();
+    else {
+      raw_ostream &Body = spool ? *spool : bodyOut;
+      Body << StringRef(lineBuffer.data(), lineBuffer.size());
+      lineBuffer.clear();
+      Out.resync();
+    }
+  }
+  if (BinaryFormat) {
+    finishedBinary(M);
+    return;
+  }
   //maxline+1, 1 more for \0
-  printModuleHeader(M, startTID, maxLineLength+1);
-  OutReal << Out.str();
+  printModuleHeader(OutReal, M, startTID, maxLineLength+1);
+  printBody();
   MemoryBuffer *MB = 0;
   const char *start = NULL;
   if (copyright) {
@@ -921,9 +1149,61 @@ void ClamBCModule::finished(Module &M)
     delete MB;
 }
 
+// The binary format has the same structure as the text format, except that
+// numbers and data are stored in binary, and lines are replaced by records:
+//  - the magic and the version byte
+//  - the header record, with the same fields as the text header
+//  - the number of records that follow, and a record for each line of the
+//    text format (lines can be empty)
+//  - 'S', the length of the source code, and the source code itself.
+// The source code is stored unmodified as the last section, so it can be
+// compressed (or stripped) separately from the bytecode.
+void ClamBCModule::finishedBinary(Module &M)
+{
+  std::string Header;
+  raw_string_ostream HeaderOut(Header);
+  printModuleHeader(HeaderOut, M, startTID, maxLineLength);
+  HeaderOut.flush();
+  OutReal << BinaryMagic << (char)BinaryVersion;
+  printRecord(OutReal, Header);
+
+  printBody();
+
+  MemoryBuffer *MB = 0;
+  StringRef Source;
+  if (copyright) {
+    Source = copyright;
+  } else if (!SrcFile.empty()) {
+    std::string ErrStr;
+    MB = MemoryBuffer::getFile(SrcFile, &ErrStr);
+    if (!MB) {
+      stop("Unable to (re)open input file: "+SrcFile, &M);
+    }
+    Source = MB->getBuffer();
+  } else {
+    ClamBCModule::stop("Bytecode should either have source code or include copyright statement\n", &M);
+  }
+  OutReal << "S";
+  printRecord(OutReal, Source);
+  if (copyright) {
+    free(copyright);
+    copyright = 0;
+  }
+  delete MB;
+}
+
 void ClamBCModule::printFixedNumber(raw_ostream &Out, unsigned n,
                                     unsigned fixed)
 {
+  if (BinaryFormat) {
+    // 2 nibbles per byte, little endian
+    for (;fixed > 0; fixed = fixed > 1 ? fixed - 2 : 0) {
+      Out << (char)(n & 0xff);
+      n >>= 8;
+    }
+    assert((n == 0) && "Fixed-width number cannot exceed width");
+    return;
+  }
   char number[32];
   unsigned i=0;
   while (fixed > 0) {
@@ -941,6 +1221,11 @@ void ClamBCModule::printConstData(raw_ostream &Out, const unsigned char *s,
 {
   size_t i;
 
+  if (BinaryFormat) {
+    printNumber(Out, len);
+    Out.write((const char*)s, len);
+    return;
+  }
   Out << "|";
   printNumber(Out, len);
   for (i=0;i<len;i++) {
@@ -62,10 +62,12 @@ class ClamBCModule : public llvm::ModulePass {
   typedef llvm::DenseMap<const llvm::ConstantExpr*, const llvm::GlobalVariable*> CEMapTy;
   typedef llvm::DenseMap<const llvm::MDNode*, unsigned> DbgMapTy;
   llvm::SmallVector<char, 4096> lineBuffer;
-  std::vector<std::string> allLines;
   llvm::raw_svector_ostream Out;
   llvm::formatted_raw_ostream &OutReal;
-  int lastLinePos;
+  std::string body;
+  llvm::raw_string_ostream bodyOut;
+  llvm::raw_ostream *spool;
+  unsigned lines;
   int maxLineLength;
   TypeMapTy typeIDs;
   std::vector<const llvm::Type*> extraTypes;
@@ -158,14 +160,20 @@ public:
   void finished(llvm::Module &M);
   void dumpTypes(llvm::raw_ostream &Out);
 private:
-  void printModuleHeader(llvm::Module &M, unsigned startTID, unsigned maxLine);
+  void printModuleHeader(llvm::raw_ostream &OutReal, llvm::Module &M,
+                         unsigned startTID, unsigned maxLine);
+  void finishedBinary(llvm::Module &M);
+  void printBody();
   void printConstant(llvm::Module &M, llvm::Constant *C);
   void printGlobals(llvm::Module &M, uint16_t startTID);
+  void mergeStringSuffixes(llvm::Module &M);
   void compileLogicalSignature(llvm::Function &F, unsigned target);
 
   void describeType(llvm::raw_ostream &Out, const llvm::Type *Ty, llvm::Module *M);
+public:
   static void printNumber(llvm::raw_ostream &Out, uint64_t n,
                           bool constant=false);
+private:
   static void printFixedNumber(llvm::raw_ostream &Out, unsigned n,
                                unsigned fixed);
   static void printConstData(llvm::raw_ostream &Out, const unsigned char *s,
@@ -204,6 +212,9 @@ public:
   void revdump() const;
 private:
   void handlePHI(llvm::PHINode *PN);
+  void getUsedIDs(const llvm::Instruction *I,
+                  llvm::SmallVectorImpl<unsigned> &IDs) const;
+  void coalesceValues(llvm::Function &F);
   typedef llvm::DenseMap<const llvm::Value*, unsigned> ValueIDMap;
   ValueIDMap ValueMap;
   std::vector<const llvm::Value*> RevValueMap;
@@ -217,6 +228,11 @@ llvm::FunctionPass *createClamBCVerifier(bool final);
 llvm::ModulePass *createClamBCLogicalCompiler();
 llvm::ModulePass *createClamBCLowering(bool final);
 llvm::ModulePass *createClamBCTrace();
+llvm::ModulePass *createClamBCCountBlocks();
 llvm::FunctionPass *createClamBCRebuild();
+llvm::FunctionPass *createClamBCProfileLayout();
+llvm::ModulePass *createClamBCProfileInliner();
+llvm::ModulePass *createClamBCSpecialize();
+llvm::FunctionPass *createClamBCSwitchTables();
 extern const llvm::PassInfo *const ClamBCRegAllocID;
 #endif
@@ -0,0 +1,404 @@
+/*
+ *  Compile LLVM bytecode to logical signatures.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#define DEBUG_TYPE "clambc-prefilter"
+#include "ClamBCPrefilter.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Constants.h"
+#include "llvm/Function.h"
+#include "llvm/Instructions.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Operator.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetData.h"
+using namespace llvm;
+
+// whence of seek() in bytecode_api.h
+enum { API_SEEK_SET=0, API_SEEK_CUR };
+
+char ClamBCPrefilter::ID = 0;
+static RegisterPass<ClamBCPrefilter> X("clambc-prefilter",
+                                       "ClamAV bytecode prefilter extraction",
+                                       false, true);
+
+void ClamBCPrefilter::getAnalysisUsage(AnalysisUsage &AU) const
+{
+  AU.setPreservesAll();
+}
+
+// Known bytes further apart than this go into separate subsignatures.
+static const uint64_t MaxGap = 8;
+
+// Whether BB returns or aborts without doing anything else.
+bool ClamBCPrefilter::isEarlyExit(BasicBlock *BB)
+{
+  SmallPtrSet<BasicBlock*, 4> Visited;
+  while (Visited.insert(BB)) {
+    for (BasicBlock::iterator I=BB->begin(), E=BB->end(); I != E; ++I) {
+      if (isa<TerminatorInst>(I) || isa<DbgInfoIntrinsic>(I))
+        continue;
+      if (CallInst *CI = dyn_cast<CallInst>(I)) {
+        // runtime check failures
+        Function *F = CI->getCalledFunction();
+        if (F && (F->getName() == "abort" ||
+                  F->getName() == "bytecode_rt_error"))
+          continue;
+        return false;
+      }
+      if (I->mayHaveSideEffects())
+        return false;
+    }
+    TerminatorInst *TI = BB->getTerminator();
+    if (isa<ReturnInst>(TI) || isa<UnreachableInst>(TI))
+      return true;
+    BranchInst *BI = dyn_cast<BranchInst>(TI);
+    if (!BI || BI->isConditional())
+      return false;
+    BB = BI->getSuccessor(0);
+  }
+  return false;
+}
+
+// Returns the local variable Ptr points into, and the offset in it.
+Value *ClamBCPrefilter::getBuffer(Value *Ptr, int64_t &Offset)
+{
+  Offset = 0;
+  while (true) {
+    if (isa<AllocaInst>(Ptr))
+      return Ptr;
+    if (BitCastInst *BCI = dyn_cast<BitCastInst>(Ptr)) {
+      Ptr = BCI->getOperand(0);
+      continue;
+    }
+    if (ConstantExpr *CE = dyn_cast<ConstantExpr>(Ptr)) {
+      if (CE->getOpcode() != Instruction::BitCast)
+        return 0;
+      Ptr = CE->getOperand(0);
+      continue;
+    }
+    GEPOperator *GEP = dyn_cast<GEPOperator>(Ptr);
+    if (!GEP || !GEP->hasAllConstantIndices())
+      return 0;
+    SmallVector<Value*, 4> Indices(GEP->idx_begin(), GEP->idx_end());
+    Offset += TD->getIndexedOffset(GEP->getPointerOperandType(),
+                                   Indices.data(), Indices.size());
+    Ptr = GEP->getPointerOperand();
+  }
+}
+
+// Forgets the reads into the buffer that Ptr points into, or into all
+// buffers if it isn't known.
+void ClamBCPrefilter::invalidate(Value *Ptr)
+{
+  int64_t Offset;
+  Value *Buffer = getBuffer(Ptr, Offset);
+  for (unsigned i=0;i<Reads.size();) {
+    if (!Buffer || Reads[i].Buffer == Buffer)
+      Reads.erase(Reads.begin()+i);
+    else
+      i++;
+  }
+}
+
+// Updates the file position and the buffers, returns false if the call can
+// have side effects that the bytecode relies on.
+bool ClamBCPrefilter::visitCall(CallInst *CI)
+{
+  if (isa<DbgInfoIntrinsic>(CI))
+    return true;
+  if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(CI)) {
+    invalidate(MI->getDest());
+    return true;
+  }
+  Function *F = CI->getCalledFunction();
+  if (!F)
+    return false;
+  if (F->getName() == "seek" && CI->getNumOperands() == 3) {
+    ConstantInt *Off = dyn_cast<ConstantInt>(CI->getOperand(1));
+    ConstantInt *Whence = dyn_cast<ConstantInt>(CI->getOperand(2));
+    if (!Off || !Whence) {
+      PosKnown = false;
+      return true;
+    }
+    int64_t O = Off->getSExtValue();
+    switch (Whence->getZExtValue()) {
+    case API_SEEK_SET:
+      PosKnown = O >= 0;
+      Pos = O;
+      break;
+    case API_SEEK_CUR:
+      PosKnown = PosKnown && (int64_t)Pos + O >= 0;
+      Pos += O;
+      break;
+    default:
+      PosKnown = false;
+      break;
+    }
+    return true;
+  }
+  if (F->getName() == "read" && CI->getNumOperands() == 3) {
+    ConstantInt *Size = dyn_cast<ConstantInt>(CI->getOperand(2));
+    int64_t Offset;
+    Value *Buffer = getBuffer(CI->getOperand(1), Offset);
+    invalidate(CI->getOperand(1));
+    if (!Size || Size->getSExtValue() <= 0) {
+      PosKnown = false;
+      return true;
+    }
+    if (Buffer && PosKnown) {
+      FileRead R = { Buffer, Offset, Pos, Size->getZExtValue(), CI };
+      Reads.push_back(R);
+    }
+    Pos += Size->getZExtValue();
+    return true;
+  }
+  return false;
+}
+
+void ClamBCPrefilter::visitLoad(LoadInst *LI)
+{
+  const IntegerType *Ty = dyn_cast<IntegerType>(LI->getType());
+  int64_t Offset;
+  Value *Buffer = getBuffer(LI->getPointerOperand(), Offset);
+  if (!Ty || (Ty->getBitWidth() % 8) || !Buffer)
+    return;
+  std::vector<FileByte> &FileBytes = Loads[LI];
+  for (unsigned i=0;i<Ty->getBitWidth()/8;i++) {
+    int64_t Off = Offset+i;
+    FileByte FB = { -1, 0 };
+    for (unsigned j=Reads.size();j > 0;j--) {
+      const FileRead &R = Reads[j-1];
+      if (R.Buffer == Buffer && Off >= R.BufferOffset &&
+          Off < R.BufferOffset + (int64_t)R.Size) {
+        FB.Offset = R.FileOffset + Off - R.BufferOffset;
+        FB.Read = R.Call;
+        break;
+      }
+    }
+    FileBytes.push_back(FB);
+  }
+}
+
+// Records that the value V loaded from a buffer is equal to C.
+void ClamBCPrefilter::addEquality(Value *V, const APInt &C)
+{
+  APInt K = C;
+  if (ZExtInst *ZI = dyn_cast<ZExtInst>(V)) {
+    V = ZI->getOperand(0);
+    unsigned Bits = V->getType()->getPrimitiveSizeInBits();
+    // never equal otherwise, nothing to learn
+    if (K.getActiveBits() > Bits)
+      return;
+    K.trunc(Bits);
+  } else if (SExtInst *SI = dyn_cast<SExtInst>(V)) {
+    V = SI->getOperand(0);
+    unsigned Bits = V->getType()->getPrimitiveSizeInBits();
+    if (K.getMinSignedBits() > Bits)
+      return;
+    K.trunc(Bits);
+  }
+  // the low bytes of a wider load
+  if (TruncInst *TI = dyn_cast<TruncInst>(V))
+    V = TI->getOperand(0);
+  DenseMap<const Value*, std::vector<FileByte> >::iterator L = Loads.find(V);
+  if (L == Loads.end() || K.getBitWidth() % 8)
+    return;
+  const std::vector<FileByte> &FileBytes = L->second;
+  // Bytecode integers are little endian.
+  for (unsigned i=0;i<K.getBitWidth()/8 && i<FileBytes.size();i++) {
+    if (FileBytes[i].Offset < 0)
+      continue;
+    KnownByte Byte = { K.lshr(8*i).getLoBits(8).getZExtValue(),
+                       FileBytes[i].Read };
+    std::map<uint64_t, KnownByte>::iterator I =
+      Bytes.find(FileBytes[i].Offset);
+    if (I == Bytes.end())
+      Bytes[FileBytes[i].Offset] = Byte;
+    else if (I->second.Value != Byte.Value)
+      Conflict = true;
+  }
+}
+
+// Records that the read CI got all the bytes it asked for, if its result
+// compared with C using Pred must be true.
+void ClamBCPrefilter::addReadCheck(CallInst *CI, ICmpInst::Predicate Pred,
+                                   ConstantInt *C)
+{
+  Function *F = CI->getCalledFunction();
+  if (!F || F->getName() != "read" || CI->getNumOperands() != 3)
+    return;
+  ConstantInt *Size = dyn_cast<ConstantInt>(CI->getOperand(2));
+  if (!Size)
+    return;
+  // read never returns more than Size
+  int64_t Min;
+  switch (Pred) {
+  case ICmpInst::ICMP_EQ:
+  case ICmpInst::ICMP_SGE:
+  case ICmpInst::ICMP_UGE:
+    Min = C->getSExtValue();
+    break;
+  case ICmpInst::ICMP_SGT:
+  case ICmpInst::ICMP_UGT:
+    Min = C->getSExtValue() + 1;
+    break;
+  default:
+    return;
+  }
+  if (Min == Size->getSExtValue())
+    FullReads.insert(CI);
+}
+
+// Records what the loaded values must be equal to if Cond is Holds.
+void ClamBCPrefilter::addConditions(Value *Cond, bool Holds)
+{
+  if (BinaryOperator *BO = dyn_cast<BinaryOperator>(Cond)) {
+    // a && b, !(a || b)
+    if ((BO->getOpcode() == Instruction::And && Holds) ||
+        (BO->getOpcode() == Instruction::Or && !Holds)) {
+      addConditions(BO->getOperand(0), Holds);
+      addConditions(BO->getOperand(1), Holds);
+      return;
+    }
+    // !a
+    if (BO->getOpcode() == Instruction::Xor) {
+      ConstantInt *C = dyn_cast<ConstantInt>(BO->getOperand(1));
+      if (C && C->isOne() && C->getType()->isIntegerTy(1))
+        addConditions(BO->getOperand(0), !Holds);
+    }
+    return;
+  }
+  ICmpInst *ICI = dyn_cast<ICmpInst>(Cond);
+  if (!ICI)
+    return;
+  ICmpInst::Predicate Pred = Holds ? ICI->getPredicate() :
+    ICI->getInversePredicate();
+  Value *V = ICI->getOperand(0);
+  ConstantInt *C = dyn_cast<ConstantInt>(ICI->getOperand(1));
+  if (!C) {
+    V = ICI->getOperand(1);
+    C = dyn_cast<ConstantInt>(ICI->getOperand(0));
+    Pred = ICmpInst::getSwappedPredicate(Pred);
+  }
+  if (!C)
+    return;
+  if (CallInst *CI = dyn_cast<CallInst>(V))
+    addReadCheck(CI, Pred, C);
+  else if (Pred == ICmpInst::ICMP_EQ)
+    addEquality(V, C->getValue());
+}
+
+bool ClamBCPrefilter::runOnFunction(Function &F)
+{
+  Patterns.clear();
+  if (F.getName() != "entrypoint")
+    return false;
+  // This is also run on the fly for a module pass, where the TargetData
+  // pass of the module isn't available.
+  TargetData ModuleTD(F.getParent());
+  TD = &ModuleTD;
+  Reads.clear();
+  Loads.clear();
+  Bytes.clear();
+  FullReads.clear();
+  Conflict = false;
+  // The file is at offset 0 when the bytecode starts.
+  PosKnown = true;
+  Pos = 0;
+
+  BasicBlock *BB = &F.getEntryBlock();
+  SmallPtrSet<BasicBlock*, 16> Visited;
+  while (BB && Visited.insert(BB)) {
+    BasicBlock *Next = 0;
+    bool Stop = false;
+    for (BasicBlock::iterator I=BB->begin(), E=BB->end(); I != E && !Stop;
+         ++I) {
+      if (CallInst *CI = dyn_cast<CallInst>(I))
+        Stop = !visitCall(CI);
+      else if (StoreInst *SI = dyn_cast<StoreInst>(I))
+        invalidate(SI->getPointerOperand());
+      else if (LoadInst *LI = dyn_cast<LoadInst>(I))
+        visitLoad(LI);
+    }
+    if (Stop)
+      break;
+    BranchInst *BI = dyn_cast<BranchInst>(BB->getTerminator());
+    if (!BI)
+      break;
+    if (BI->isUnconditional()) {
+      Next = BI->getSuccessor(0);
+    } else {
+      bool Exit0 = isEarlyExit(BI->getSuccessor(0));
+      bool Exit1 = isEarlyExit(BI->getSuccessor(1));
+      if (Exit0 == Exit1)
+        break;
+      // The bytecode only goes on if the condition selects the successor
+      // that isn't an exit.
+      addConditions(BI->getCondition(), Exit1);
+      Next = BI->getSuccessor(Exit0 ? 1 : 0);
+    }
+    // Other paths could get here without the checks.
+    if (Next->getSinglePredecessor() != BB)
+      break;
+    BB = Next;
+  }
+  if (Conflict) {
+    // The checks can never pass, leave that to the bytecode.
+    Bytes.clear();
+  }
+  // A short read leaves the buffer as it was, the checks of its bytes say
+  // nothing about the file.
+  for (std::map<uint64_t, KnownByte>::iterator I=Bytes.begin(),E=Bytes.end();
+       I != E;) {
+    if (FullReads.count(I->second.Read))
+      ++I;
+    else
+      Bytes.erase(I++);
+  }
+
+  // Each run of bytes with small gaps is a subsignature.
+  for (std::map<uint64_t, KnownByte>::iterator I=Bytes.begin(), E=Bytes.end();
+       I != E;) {
+    uint64_t Start = I->first, End = Start;
+    std::string Hex;
+    unsigned Run = 0, MaxRun = 0;
+    for (;I != E && I->first - End <= MaxGap; ++I) {
+      for (;End < I->first;End++) {
+        Hex += "??";
+        Run = 0;
+      }
+      static const char hex[] = "0123456789abcdef";
+      Hex += hex[I->second.Value >> 4];
+      Hex += hex[I->second.Value & 0xf];
+      MaxRun = std::max(MaxRun, ++Run);
+      End = I->first+1;
+    }
+    // The matchers need at least 2 fixed bytes in a row.
+    if (MaxRun >= 2)
+      Patterns.push_back((Twine(Start)+":"+Hex).str());
+  }
+  DEBUG(for (unsigned i=0;i<Patterns.size();i++)
+          errs() << "Prefilter pattern: " << Patterns[i] << "\n";);
+  return false;
+}
@@ -0,0 +1,109 @@
+/*
+ *  Compile LLVM bytecode to logical signatures.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#ifndef CLAMBC_PREFILTER_H
+#define CLAMBC_PREFILTER_H
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Instructions.h"
+#include "llvm/Pass.h"
+#include "llvm/System/DataTypes.h"
+#include <map>
+#include <string>
+#include <vector>
+
+namespace llvm {
+  class APInt;
+  class BasicBlock;
+  class ConstantInt;
+  class TargetData;
+  class Value;
+}
+
+// Finds the checks of the file's magic that the entrypoint of a bytecode
+// starts with:
+//   seek(0, SEEK_SET);
+//   if (read(buf, 8) != 8) return 0;
+//   if (buf[0] != 'M' || buf[1] != 'Z') return 0;
+// Unless the file has these bytes at these offsets the entrypoint returns
+// without doing anything, so a logical signature matching them can trigger
+// the bytecode instead of running it on every file.
+// Only the straight line of blocks from the entry is followed, where each
+// branch either goes on or returns (or aborts) without side effects. Reads
+// must be from a constant file position into a local buffer, the checks
+// must compare bytes of the buffer to constants, and the result of the read
+// must be checked too: after a short read the buffer doesn't hold the file.
+class ClamBCPrefilter : public llvm::FunctionPass {
+public:
+  static char ID;
+  ClamBCPrefilter() : llvm::FunctionPass(&ID) {}
+  virtual const char *getPassName() const {
+    return "ClamAV Bytecode Prefilter Extraction";
+  }
+  virtual bool runOnFunction(llvm::Function &F);
+  virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
+
+  // The subsignatures ("offset:hexpattern") that all have to match for the
+  // function to get past its checks, empty if none were found.
+  const std::vector<std::string> &getPatterns() const { return Patterns; }
+private:
+  // Bytes of the file that are in a buffer after a read.
+  struct FileRead {
+    llvm::Value *Buffer;
+    int64_t BufferOffset;
+    uint64_t FileOffset, Size;
+    llvm::CallInst *Call;
+  };
+  // A byte of the file, and the read that put it in a buffer.
+  struct FileByte {
+    int64_t Offset;
+    llvm::CallInst *Read;
+  };
+  struct KnownByte {
+    uint8_t Value;
+    llvm::CallInst *Read;
+  };
+
+  bool isEarlyExit(llvm::BasicBlock *BB);
+  llvm::Value *getBuffer(llvm::Value *Ptr, int64_t &Offset);
+  void invalidate(llvm::Value *Ptr);
+  bool visitCall(llvm::CallInst *CI);
+  void visitLoad(llvm::LoadInst *LI);
+  void addConditions(llvm::Value *Cond, bool Holds);
+  void addEquality(llvm::Value *V, const llvm::APInt &C);
+  void addReadCheck(llvm::CallInst *CI, llvm::ICmpInst::Predicate Pred,
+                    llvm::ConstantInt *C);
+
+  const llvm::TargetData *TD;
+  std::vector<FileRead> Reads;
+  // The file offset of each byte of a loaded value, -1 if unknown.
+  llvm::DenseMap<const llvm::Value*, std::vector<FileByte> > Loads;
+  bool PosKnown;
+  uint64_t Pos;
+  // Known bytes of the file by offset.
+  std::map<uint64_t, KnownByte> Bytes;
+  // The reads that are known to have read all the bytes they asked for.
+  llvm::SmallPtrSet<llvm::CallInst*, 4> FullReads;
+  bool Conflict;
+  std::vector<std::string> Patterns;
+};
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ *  Compile LLVM bytecode to ClamAV bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#define DEBUG_TYPE "clambc-profile"
+#include "llvm/System/DataTypes.h"
+#include "ClamBCProfile.h"
+#include "ClamBCModule.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/DebugInfo.h"
+#include "llvm/Attributes.h"
+#include "llvm/Function.h"
+#include "llvm/Instructions.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/LLVMContext.h"
+#include "llvm/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+static cl::opt<std::string>
+ProfileUse("clambc-profile-use",
+           cl::desc("Optimize using the execution counts in this file"),
+           cl::value_desc("profile"), cl::init(""));
+
+STATISTIC(NumHinted, "Number of functions marked for inlining by the profile");
+STATISTIC(NumCold, "Number of never executed functions");
+STATISTIC(NumMoved, "Number of functions with blocks reordered by the profile");
+
+// A block is hot if it runs at least 1/HotRatio as often as the hottest one.
+static const uint64_t HotRatio = 100;
+
+static StringRef getBaseName(StringRef Path)
+{
+  size_t pos = Path.rfind('/');
+  return pos == StringRef::npos ? Path : Path.substr(pos+1);
+}
+
+const ClamBCProfile *ClamBCProfile::get()
+{
+  static ClamBCProfile *Profile;
+  static bool Loaded;
+  if (Loaded)
+    return Profile;
+  Loaded = true;
+  if (ProfileUse.empty())
+    return 0;
+  std::string ErrorInfo;
+  Profile = new ClamBCProfile();
+  if (!Profile->load(ProfileUse, ErrorInfo)) {
+    errs() << "error reading profile " << ProfileUse << ": " << ErrorInfo
+      << "\n";
+    delete Profile;
+    Profile = 0;
+  }
+  return Profile;
+}
+
+bool ClamBCProfile::load(const std::string &File, std::string &ErrorInfo)
+{
+  OwningPtr<MemoryBuffer> Buffer(MemoryBuffer::getFile(File.c_str(),
+                                                       &ErrorInfo));
+  if (!Buffer)
+    return false;
+  MaxCount = 0;
+  StringRef Rest = Buffer->getBuffer();
+  unsigned LineNo = 0;
+  while (!Rest.empty()) {
+    std::pair<StringRef, StringRef> Line = Rest.split('\n');
+    Rest = Line.second;
+    ++LineNo;
+    if (Line.first.empty() || Line.first[0] == '#')
+      continue;
+    std::pair<StringRef, StringRef> F = Line.first.split(' ');
+    std::pair<StringRef, StringRef> Loc = F.second.rsplit(':');
+    unsigned long long Count;
+    unsigned SrcLine;
+    if (F.first.getAsInteger(10, Count) || Loc.first.empty() ||
+        Loc.second.getAsInteger(10, SrcLine)) {
+      raw_string_ostream Msg(ErrorInfo);
+      Msg << "invalid line " << LineNo << ", expected '<count> <file>:<line>'";
+      Msg.flush();
+      return false;
+    }
+    Files[getBaseName(Loc.first)][SrcLine] += Count;
+  }
+  for (StringMap<LineCountMap>::iterator I=Files.begin(),E=Files.end();
+       I != E; ++I) {
+    for (LineCountMap::iterator J=I->second.begin(),JE=I->second.end();
+         J != JE; ++J)
+      MaxCount = std::max(MaxCount, J->second);
+  }
+  return true;
+}
+
+bool ClamBCProfile::getBlockCount(const BasicBlock *BB, uint64_t &Count) const
+{
+  // The line where the block starts, the later lines of the block may have
+  // been merged into it from other blocks. Inlined code is counted at the
+  // call site if the profile doesn't have the inlined function's file.
+  unsigned MDDbgKind = BB->getContext().getMDKindID("dbg");
+  for (BasicBlock::const_iterator I=BB->begin(),E=BB->end(); I != E; ++I) {
+    if (isa<DbgInfoIntrinsic>(I))
+      continue;
+    MDNode *Dbg = I->getMetadata(MDDbgKind);
+    for (DILocation Loc(Dbg); Loc.getNode(); Loc = Loc.getOrigLocation()) {
+      StringMap<LineCountMap>::const_iterator F =
+        Files.find(getBaseName(Loc.getFilename()));
+      if (F != Files.end()) {
+        Count = F->second.lookup(Loc.getLineNumber());
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool ClamBCProfile::getFunctionCount(const Function *F, uint64_t &Count) const
+{
+  // The entry block may consist of allocas only, use the first block that
+  // has a location.
+  for (Function::const_iterator I=F->begin(),E=F->end(); I != E; ++I) {
+    if (getBlockCount(I, Count))
+      return true;
+  }
+  return false;
+}
+
+namespace {
+// Marks the functions that are called from hot blocks for inlining, and
+// optimizes the never executed ones for size. Runs before the inliner.
+class ClamBCProfileInliner : public ModulePass {
+public:
+  static char ID;
+  ClamBCProfileInliner() : ModulePass((intptr_t)&ID) {}
+  virtual const char *getPassName() const {
+    return "ClamAV Bytecode Profile Guided Inlining Hints";
+  }
+  virtual bool runOnModule(Module &M);
+};
+char ClamBCProfileInliner::ID;
+}
+
+bool ClamBCProfileInliner::runOnModule(Module &M)
+{
+  const ClamBCProfile *Profile = ClamBCProfile::get();
+  if (!Profile)
+    return false;
+  uint64_t Hot = std::max(Profile->getMaxCount() / HotRatio, (uint64_t)1);
+  for (Module::iterator F=M.begin(),FE=M.end(); F != FE; ++F) {
+    if (F->isDeclaration())
+      continue;
+    uint64_t Count;
+    if (Profile->getFunctionCount(F, Count) && !Count &&
+        !F->hasFnAttr(Attribute::OptimizeForSize)) {
+      DEBUG(dbgs() << "never executed: " << F->getName() << "\n");
+      F->addFnAttr(Attribute::OptimizeForSize);
+      ++NumCold;
+    }
+    for (Function::iterator BB=F->begin(),E=F->end(); BB != E; ++BB) {
+      if (!Profile->getBlockCount(BB, Count) || Count < Hot)
+        continue;
+      for (BasicBlock::iterator I=BB->begin(),IE=BB->end(); I != IE; ++I) {
+        CallInst *CI = dyn_cast<CallInst>(I);
+        Function *Callee = CI ? CI->getCalledFunction() : 0;
+        if (!Callee || Callee->isDeclaration() ||
+            Callee->hasFnAttr(Attribute::NoInline) ||
+            Callee->hasFnAttr(Attribute::InlineHint))
+          continue;
+        DEBUG(dbgs() << "hot callee: " << Callee->getName() << "\n");
+        Callee->addFnAttr(Attribute::InlineHint);
+        ++NumHinted;
+      }
+    }
+  }
+  return true;
+}
+
+namespace {
+// Lays out the blocks so that the hottest successor of each block follows it,
+// and moves the blocks that were never executed, and the runtime error
+// blocks, to the end of the function.
+// This has to run while the debug locations are still there, the writer
+// keeps the order of the blocks.
+class ClamBCProfileLayout : public FunctionPass {
+public:
+  static char ID;
+  ClamBCProfileLayout() : FunctionPass(&ID) {}
+  virtual const char *getPassName() const {
+    return "ClamAV Bytecode Profile Guided Block Layout";
+  }
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.setPreservesCFG();
+  }
+  virtual bool runOnFunction(Function &F);
+};
+char ClamBCProfileLayout::ID;
+}
+
+bool ClamBCProfileLayout::runOnFunction(Function &F)
+{
+  const ClamBCProfile *Profile = ClamBCProfile::get();
+  if (!Profile)
+    return false;
+
+  std::vector<BasicBlock*> Blocks;
+  DenseMap<BasicBlock*, uint64_t> Counts;
+  SmallPtrSet<BasicBlock*, 16> Cold;
+  for (Function::iterator I=F.begin(),E=F.end(); I != E; ++I) {
+    BasicBlock *BB = &*I;
+    uint64_t Count;
+    Blocks.push_back(BB);
+    if (Profile->getBlockCount(BB, Count)) {
+      Counts[BB] = Count;
+      if (!Count)
+        Cold.insert(BB);
+    }
+    if (BB->getName().startswith("rterr.trig"))
+      Cold.insert(BB);
+    DEBUG(dbgs() << BB->getName() << ": " << (Counts.count(BB) ? "" : "no ")
+          << "count " << Counts.lookup(BB) << "\n");
+  }
+  // the profile doesn't cover this function
+  if (Counts.empty())
+    return false;
+  Cold.erase(&F.getEntryBlock());
+
+  // Build chains starting at the first block not yet placed, following the
+  // hottest successor. Successors without a count are taken only if there is
+  // no successor with a count.
+  std::vector<BasicBlock*> Order;
+  SmallPtrSet<BasicBlock*, 32> Placed;
+  for (unsigned i=0;i<Blocks.size();i++) {
+    BasicBlock *BB = Blocks[i];
+    if (Placed.count(BB) || Cold.count(BB))
+      continue;
+    while (BB) {
+      Placed.insert(BB);
+      Order.push_back(BB);
+      BasicBlock *Next = 0;
+      uint64_t Best = 0;
+      for (succ_iterator S=succ_begin(BB),SE=succ_end(BB); S != SE; ++S) {
+        if (Placed.count(*S) || Cold.count(*S))
+          continue;
+        uint64_t W = Counts.lookup(*S);
+        if (!Next || W > Best) {
+          Next = *S;
+          Best = W;
+        }
+      }
+      BB = Next;
+    }
+  }
+  for (unsigned i=0;i<Blocks.size();i++) {
+    if (!Placed.count(Blocks[i]))
+      Order.push_back(Blocks[i]);
+  }
+  assert(Order.size() == Blocks.size() && Order[0] == Blocks[0]);
+
+  if (Order == Blocks)
+    return false;
+  DEBUG(dbgs() << "new block order: " << Order[0]->getName());
+  for (unsigned i=1;i<Order.size();i++) {
+    DEBUG(dbgs() << " " << Order[i]->getName());
+    Order[i]->moveAfter(Order[i-1]);
+  }
+  DEBUG(dbgs() << "\n");
+  ++NumMoved;
+  return true;
+}
+
+llvm::ModulePass *createClamBCProfileInliner()
+{
+  return new ClamBCProfileInliner();
+}
+
+llvm::FunctionPass *createClamBCProfileLayout()
+{
+  return new ClamBCProfileLayout();
+}
@@ -0,0 +1,58 @@
+/*
+ *  Compile LLVM bytecode to ClamAV bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#ifndef CLAMBC_PROFILE_H
+#define CLAMBC_PROFILE_H
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/System/DataTypes.h"
+#include <string>
+
+namespace llvm {
+  class BasicBlock;
+  class Function;
+  class Module;
+}
+
+// Execution counts collected by running the bytecode on a corpus.
+// The counts are per source line (the number of times a basic block starting
+// at that line was entered), so that they can be applied to a recompiled
+// bytecode. The file has one "<count> <file>:<line>" line per source line,
+// files are matched by their name without the directory. Lines of a file
+// that is in the profile, but that aren't listed, were never executed.
+class ClamBCProfile {
+public:
+  // The profile given by -clambc-profile-use, or 0 if there is none.
+  static const ClamBCProfile *get();
+
+  bool load(const std::string &File, std::string &ErrorInfo);
+  // These return false if the profile has no count for the block/function,
+  // for example because it has no debug info.
+  bool getBlockCount(const llvm::BasicBlock *BB, uint64_t &Count) const;
+  bool getFunctionCount(const llvm::Function *F, uint64_t &Count) const;
+  uint64_t getMaxCount() const { return MaxCount; }
+private:
+  typedef llvm::DenseMap<unsigned, uint64_t> LineCountMap;
+  llvm::StringMap<LineCountMap> Files;
+  uint64_t MaxCount;
+};
+
+#endif
@@ -33,6 +33,7 @@
 #include "llvm/Analysis/Dominators.h"
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Analysis/LiveValues.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/PointerTracking.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ScalarEvolutionExpressions.h"
@@ -45,6 +46,7 @@
 #include "llvm/LLVMContext.h"
 #include "llvm/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CFG.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/DataFlow.h"
 #include "llvm/Support/InstIterator.h"
@@ -54,9 +56,23 @@
 #include "llvm/Target/TargetData.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 #include "llvm/Support/Debug.h"
 
 using namespace llvm;
+
+static cl::opt<bool>
+NoCheckOpt("clambc-no-rtcheck-opt", cl::Hidden, cl::init(false),
+           cl::desc("Insert a runtime check at each memory access, even if a "
+                    "previous check covers it or it could be moved out of a "
+                    "loop"));
+
+static cl::opt<unsigned>
+LoopVersionSize("clambc-loop-version-size", cl::Hidden, cl::init(256),
+                cl::desc("Maximum number of instructions in a loop that is "
+                         "duplicated to run without runtime checks"));
+
 namespace {
 
   class PtrVerifier : public FunctionPass {
@@ -82,6 +98,9 @@ namespace {
       Changed = false;
       BaseMap.clear();
       BoundsMap.clear();
+      Checks.clear();
+      LoopCounts.clear();
+      LoopBounds.clear();
       delInst.clear();
       AbrtBB = 0;
       valid = true;
@@ -120,8 +139,22 @@ namespace {
       SE = &getAnalysis<ScalarEvolution>();
       PT = &getAnalysis<PointerTracking>();
       DT = &getAnalysis<DominatorTree>();
+      LI = &getAnalysis<LoopInfo>();
       expander = new SCEVExpander(*SE);
 
+      // The inserted checks are loop exits too, compute the trip counts
+      // before there are any.
+      for (inst_iterator I=inst_begin(F),E=inst_end(F); I != E;++I) {
+        for (Loop *L = LI->getLoopFor(I->getParent()); L;
+             L = L->getParentLoop()) {
+          if (LoopCounts.count(L))
+            break;
+          const SCEV *Count = SE->getBackedgeTakenCount(L);
+          LoopCounts[L] = isa<SCEVCouldNotCompute>(Count) ? 0 : Count;
+          LoopBounds[L] = getExitBound(L, LoopCounts[L]);
+        }
+      }
+
       std::vector<Instruction*> insns;
 
       for (inst_iterator I=inst_begin(F),E=inst_end(F); I != E;++I) {
@@ -231,6 +264,9 @@ namespace {
       for (unsigned i = 0; i < delInst.size(); ++i)
         delInst[i]->eraseFromParent();
 
+      if (valid && !NoCheckOpt)
+        versionLoops();
+
       delete expander;
       return Changed;
     }
@@ -242,6 +278,7 @@ namespace {
     virtual void getAnalysisUsage(AnalysisUsage &AU) const {
       AU.addRequired<TargetData>();
       AU.addRequired<DominatorTree>();
+      AU.addRequired<LoopInfo>();
       AU.addRequired<ScalarEvolution>();
       AU.addRequired<PointerTracking>();
       AU.addRequired<CallGraph>();
@@ -254,8 +291,28 @@ namespace {
     ScalarEvolution *SE;
     SCEVExpander *expander;
     DominatorTree *DT;
+    LoopInfo *LI;
     DenseMap<Value*, Value*> BaseMap;
     DenseMap<Value*, Value*> BoundsMap;
+    DenseMap<const Loop*, const SCEV*> LoopCounts;
+    // An upper bound of the backedge-taken count of a loop, also for loops
+    // with early exits. Blocks dominated by Body are not executed on the
+    // last iteration.
+    struct LoopBound {
+      const SCEV *Count;
+      BasicBlock *Body;
+    };
+    DenseMap<const Loop*, LoopBound> LoopBounds;
+    // A check inserted so far: Idx < Limit (or Idx <= Limit if not strict)
+    // holds in BB and all blocks dominated by it.
+    struct Check {
+      const SCEV *Idx;
+      const SCEV *Limit;
+      bool strict;
+      BasicBlock *BB;
+      BranchInst *Br;
+    };
+    std::vector<Check> Checks;
     BasicBlock *AbrtBB;
     bool Changed;
     bool valid;
@@ -511,8 +568,26 @@ namespace {
         errs() << "Could not compute limit: " << *I << "\n";
         return false;
       }
-      BasicBlock *BB = I->getParent();
-      BasicBlock::iterator It = I;
+      Instruction *At = I;
+      if (!NoCheckOpt) {
+        At = hoistCheck(Idx, Limit, I, strict);
+        if (!At)
+          return false;
+      }
+      return emitCheck(Idx, Limit, At, I, strict);
+    }
+
+    // Checks Idx < Limit (or Idx <= Limit when not strict) before At, for
+    // the access I.
+    bool emitCheck(const SCEV *Idx, const SCEV *Limit, Instruction *At,
+                   Instruction *I, bool strict)
+    {
+      if (!NoCheckOpt && isCovered(Idx, Limit, At, strict)) {
+        DEBUG(dbgs() << "check of " << *Idx << " is redundant\n");
+        return true;
+      }
+      BasicBlock *BB = At->getParent();
+      BasicBlock::iterator It = At;
       BasicBlock *newBB = SplitBlock(BB, &*It, this);
       PHINode *PN;
       unsigned MDDbgKind = I->getContext().getMDKindID("dbg");
@@ -566,7 +641,7 @@ namespace {
       Value *IdxV = expander->expandCodeFor(Idx, Limit->getType(), TI);
       Value *LimitV = expander->expandCodeFor(Limit, Limit->getType(), TI);
       if (isa<Instruction>(IdxV) &&
-          !DT->dominates(cast<Instruction>(IdxV)->getParent(),I->getParent())) {
+          !DT->dominates(cast<Instruction>(IdxV)->getParent(),At->getParent())) {
         printLocation(I, true);
         errs() << "basic block with value [ " << IdxV->getName();
         errs() << " ] with limit [ " << LimitV->getName();
@@ -574,7 +649,7 @@ namespace {
         return false;
       }
       if (isa<Instruction>(LimitV) && 
-          !DT->dominates(cast<Instruction>(LimitV)->getParent(),I->getParent())) {
+          !DT->dominates(cast<Instruction>(LimitV)->getParent(),At->getParent())) {
         printLocation(I, true);
         errs() << "basic block with limit [" << LimitV->getName();
         errs() << " ] on value [ " << IdxV->getName();
@@ -584,7 +659,7 @@ namespace {
       Value *Cond = new ICmpInst(TI, strict ?
                                  ICmpInst::ICMP_ULT :
                                  ICmpInst::ICMP_ULE, IdxV, LimitV);
-      BranchInst::Create(newBB, AbrtBB, Cond, TI);
+      BranchInst *Br = BranchInst::Create(newBB, AbrtBB, Cond, TI);
       //TI->eraseFromParent();
       delInst.push_back(TI);
       // Update dominator info
@@ -592,9 +667,528 @@ namespace {
         DT->findNearestCommonDominator(BB,
                                        DT->getNode(AbrtBB)->getIDom()->getBlock());
       DT->changeImmediateDominator(AbrtBB, DomBB);
+      Check C = { Idx, Limit, strict, newBB, Br };
+      Checks.push_back(C);
+      return true;
+    }
+
+    // Returns true if a check that dominates At already guarantees that
+    // Idx < Limit (or Idx <= Limit when not strict).
+    bool isCovered(const SCEV *Idx, const SCEV *Limit, Instruction *At,
+                   bool strict)
+    {
+      for (std::vector<Check>::iterator C=Checks.begin(),E=Checks.end();
+           C != E; ++C) {
+        if (C->Limit != Limit || (strict && !C->strict))
+          continue;
+        if (!DT->dominates(C->BB, At->getParent()))
+          continue;
+        // Idx <= C->Idx
+        if (C->Idx == Idx || SE->getUMaxExpr(Idx, C->Idx) == C->Idx)
+          return true;
+      }
+      return false;
+    }
+
+    // Computes in N the largest number of iterations of L for which the
+    // recurrences of L in S don't wrap around.
+    bool getNoWrapCount(const SCEV *S, Loop *L, APInt &N)
+    {
+      if (S->isLoopInvariant(L))
+        return true;
+      if (const SCEVCastExpr *CE = dyn_cast<SCEVCastExpr>(S))
+        return getNoWrapCount(CE->getOperand(), L, N);
+      if (const SCEVAddExpr *AE = dyn_cast<SCEVAddExpr>(S)) {
+        for (unsigned i=0;i<AE->getNumOperands();i++)
+          if (!getNoWrapCount(AE->getOperand(i), L, N))
+            return false;
+        return true;
+      }
+      if (const SCEVMulExpr *ME = dyn_cast<SCEVMulExpr>(S)) {
+        if (ME->getNumOperands() != 2 || !isa<SCEVConstant>(ME->getOperand(0)))
+          return false;
+        return getNoWrapCount(ME->getOperand(1), L, N);
+      }
+      const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(S);
+      if (!AR || AR->getLoop() != L || !AR->isAffine())
+        return false;
+      const SCEVConstant *Step =
+        dyn_cast<SCEVConstant>(AR->getStepRecurrence(*SE));
+      if (!Step)
+        return false;
+      // start + step*n <= max
+      unsigned Bits = SE->getTypeSizeInBits(AR->getType());
+      APInt Start = SE->getUnsignedRange(AR->getStart()).getUnsignedMax();
+      APInt Max = APInt::getMaxValue(Bits) - Start;
+      Max = Max.udiv(Step->getValue()->getValue());
+      if (Max.getActiveBits() <= N.getBitWidth()) {
+        Max.zextOrTrunc(N.getBitWidth());
+        if (Max.ult(N))
+          N = Max;
+      }
+      return true;
+    }
+
+    // Returns the value S has after It iterations of L. If Verify is set, It
+    // must be a constant, and S must not decrease (as an unsigned value)
+    // during the first It iterations, otherwise null is returned.
+    const SCEV *getValueAt(const SCEV *S, Loop *L, const SCEV *It, bool Verify)
+    {
+      if (S->isLoopInvariant(L))
+        return S;
+      const Type *Ty = S->getType();
+      unsigned Bits = SE->getTypeSizeInBits(Ty);
+      if (const SCEVZeroExtendExpr *ZE = dyn_cast<SCEVZeroExtendExpr>(S)) {
+        const SCEV *V = getValueAt(ZE->getOperand(), L, It, Verify);
+        return V ? SE->getZeroExtendExpr(V, Ty) : 0;
+      }
+      if (const SCEVSignExtendExpr *SX = dyn_cast<SCEVSignExtendExpr>(S)) {
+        // all values are between 0 and the last one, if that is not negative
+        const SCEV *V = getValueAt(SX->getOperand(), L, It, Verify);
+        if (!V || (Verify &&
+                   SE->getUnsignedRange(V).getUnsignedMax().isNegative()))
+          return 0;
+        return SE->getSignExtendExpr(V, Ty);
+      }
+      if (const SCEVTruncateExpr *TE = dyn_cast<SCEVTruncateExpr>(S)) {
+        // all values are at most the last one, if that fits they are the same
+        // after truncation
+        const SCEV *V = getValueAt(TE->getOperand(), L, It, Verify);
+        if (!V || (Verify &&
+                   SE->getUnsignedRange(V).getUnsignedMax().getActiveBits() >
+                   Bits))
+          return 0;
+        return SE->getTruncateExpr(V, Ty);
+      }
+      if (const SCEVAddExpr *AE = dyn_cast<SCEVAddExpr>(S)) {
+        // the sum must not wrap around
+        unsigned W = Bits + AE->getNumOperands();
+        APInt Sum(W, 0);
+        SmallVector<const SCEV*, 4> Ops;
+        for (unsigned i=0;i<AE->getNumOperands();i++) {
+          const SCEV *V = getValueAt(AE->getOperand(i), L, It, Verify);
+          if (!V)
+            return 0;
+          APInt Max = SE->getUnsignedRange(V).getUnsignedMax();
+          Max.zext(W);
+          Sum += Max;
+          Ops.push_back(V);
+        }
+        if (Verify && Sum.getActiveBits() > Bits)
+          return 0;
+        return SE->getAddExpr(Ops);
+      }
+      if (const SCEVMulExpr *ME = dyn_cast<SCEVMulExpr>(S)) {
+        // multiplying by a constant must not wrap around
+        if (ME->getNumOperands() != 2)
+          return 0;
+        const SCEVConstant *C = dyn_cast<SCEVConstant>(ME->getOperand(0));
+        const SCEV *V = getValueAt(ME->getOperand(1), L, It, Verify);
+        if (!C || !V)
+          return 0;
+        APInt Max = SE->getUnsignedRange(V).getUnsignedMax();
+        APInt Factor = C->getValue()->getValue();
+        Max.zext(2*Bits);
+        Factor.zext(2*Bits);
+        if (Verify && (Max*Factor).getActiveBits() > Bits)
+          return 0;
+        return SE->getMulExpr(C, V);
+      }
+      const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(S);
+      if (!AR || AR->getLoop() != L || !AR->isAffine())
+        return 0;
+      It = SE->getTruncateOrZeroExtend(It, Ty);
+      return AR->evaluateAtIteration(It, *SE);
+    }
+
+    // Computes in N a number of iterations of L during which Idx doesn't
+    // decrease, and returns the value of Idx after N iterations, or null.
+    const SCEV *getMonotoneRange(const SCEV *Idx, Loop *L, const SCEV *Count,
+                                 APInt &N)
+    {
+      N = APInt::getMaxValue(SE->getTypeSizeInBits(Count->getType()));
+      if (!getNoWrapCount(Idx, L, N))
+        return 0;
+      for (;;) {
+        if (const SCEV *Max = getValueAt(Idx, L, SE->getConstant(N), true))
+          return Max;
+        if (!N)
+          return 0;
+        N = N.lshr(1);
+      }
+    }
+
+    // Returns true if BB is executed on each iteration of L, before the
+    // iteration can have any effect outside the bytecode.
+    // A check in BB can then be done in the preheader instead: if it fails
+    // the bytecode would have been aborted by the check in BB anyway.
+    bool isExecutedOnEachIteration(BasicBlock *BB, Loop *L)
+    {
+      BasicBlock *Latch = L->getLoopLatch();
+      if (!L->getLoopPreheader() || !Latch || !DT->dominates(BB, Latch))
+        return false;
+      for (Loop::block_iterator I=L->block_begin(),E=L->block_end();
+           I != E; ++I) {
+        BasicBlock *LBB = *I;
+        for (BasicBlock::iterator J=LBB->begin(),JE=LBB->end(); J != JE; ++J)
+          if (isa<CallInst>(J) && !isa<IntrinsicInst>(J))
+            return false;
+        // branches to rterr.trig don't leave the loop, they abort
+        TerminatorInst *TI = LBB->getTerminator();
+        for (unsigned i=0;i<TI->getNumSuccessors();i++) {
+          BasicBlock *Succ = TI->getSuccessor(i);
+          if (!L->contains(Succ) && Succ != AbrtBB &&
+              !DT->dominates(BB, LBB))
+            return false;
+        }
+      }
       return true;
     }
+
+    // Moves the check Idx < Limit for I out of the loops around I, as far as
+    // possible. A check that doesn't change in the loop is done once in the
+    // preheader. A check of an increasing index is replaced by a check of
+    // its value on the last iteration, and a check that the loop doesn't run
+    // long enough for the index to wrap around.
+    // Returns the instruction to check before.
+    Instruction *hoistCheck(const SCEV *&Idx, const SCEV *Limit,
+                            Instruction *I, bool strict)
+    {
+      Instruction *At = I;
+      for (Loop *L = LI->getLoopFor(I->getParent()); L;
+           L = L->getParentLoop()) {
+        if (!Limit->isLoopInvariant(L) ||
+            !isExecutedOnEachIteration(At->getParent(), L))
+          break;
+        Instruction *PHTerm = L->getLoopPreheader()->getTerminator();
+        if (!Idx->isLoopInvariant(L)) {
+          const SCEV *Count = LoopCounts.lookup(L);
+          if (!Count)
+            break;
+          APInt N;
+          const SCEV *Max = getMonotoneRange(Idx, L, Count, N);
+          if (!Max)
+            break;
+          if (SE->getUnsignedRange(Count).getUnsignedMax().ugt(N)) {
+            // The original check fails by iteration N, if the loop runs
+            // longer than that.
+            APInt Least = SE->getUnsignedRange(Max).getUnsignedMin();
+            APInt LimitMax = SE->getUnsignedRange(Limit).getUnsignedMax();
+            if (strict ? Least.ult(LimitMax) : Least.ule(LimitMax))
+              break;
+            if (!emitCheck(Count, SE->getConstant(N), PHTerm, I, false))
+              return 0;
+          }
+          Idx = getValueAt(Idx, L, Count, false);
+        }
+        At = PHTerm;
+      }
+      if (At != I)
+        DEBUG(dbgs() << "check for " << *I << " moved to " <<
+              At->getParent()->getName() << "\n");
+      return At;
+    }
    
+    // The checks left in a loop couldn't be moved out of it, because they are
+    // not done on each iteration, the loop has calls, or the loop may stop
+    // before they fail.
+    // Such loops get a copy without the checks, that is run instead of the
+    // loop when a check in the preheader proves that the checks can't fail
+    // on any iteration. Checks that can't fail at all are simply removed.
+    void versionLoops()
+    {
+      std::vector<Loop*> Loops;
+      DenseMap<Loop*, std::vector<const Check*> > LoopChecks;
+      for (std::vector<Check>::iterator C=Checks.begin(),E=Checks.end();
+           C != E; ++C) {
+        Loop *L = LI->getLoopFor(C->Br->getParent());
+        // only innermost loops, so that the copy has no subloops
+        if (!L || !L->empty())
+          continue;
+        std::vector<const Check*> &LC = LoopChecks[L];
+        if (LC.empty())
+          Loops.push_back(L);
+        LC.push_back(&*C);
+      }
+      for (unsigned i=0;i<Loops.size();i++)
+        versionLoop(Loops[i], LoopChecks[Loops[i]]);
+    }
+
+    void versionLoop(Loop *L, const std::vector<const Check*> &LC)
+    {
+      BasicBlock *Preheader = L->getLoopPreheader();
+      LoopBound B = LoopBounds.lookup(L);
+      const SCEV *Count = B.Count;
+      if (!Preheader || !Count)
+        return;
+
+      // The value of each index on the last iteration must be in bounds, and
+      // the loop must stop before an index wraps around.
+      APInt N = APInt::getMaxValue(SE->getTypeSizeInBits(Count->getType()));
+      APInt CountMin = SE->getUnsignedRange(Count).getUnsignedMin();
+      std::vector<const Check*> Elided;
+      for (unsigned i=0;i<LC.size();i++) {
+        const Check *C = LC[i];
+        if (!C->Limit->isLoopInvariant(L))
+          continue;
+        APInt CN;
+        if (!getMonotoneRange(C->Idx, L, Count, CN) || CN.ult(CountMin))
+          continue;
+        if (CN.ult(N))
+          N = CN;
+        Elided.push_back(C);
+      }
+      if (Elided.empty())
+        return;
+
+      // Checks of the last values that are known to hold aren't needed.
+      std::vector<std::pair<const Check*, const SCEV*> > Conds;
+      for (unsigned i=0;i<Elided.size();i++) {
+        const Check *C = Elided[i];
+        // the check runs only on the iterations before the last one, if the
+        // loop exits before reaching it
+        const SCEV *It = Count;
+        if (B.Body && DT->dominates(B.Body, C->Br->getParent()))
+          It = SE->getMinusSCEV(Count,
+                                SE->getIntegerSCEV(1, Count->getType()));
+        const SCEV *Last = getValueAt(C->Idx, L, It, false);
+        APInt LastMax = SE->getUnsignedRange(Last).getUnsignedMax();
+        APInt LimitMin = SE->getUnsignedRange(C->Limit).getUnsignedMin();
+        if (!(C->strict ? LastMax.ult(LimitMin) : LastMax.ule(LimitMin)))
+          Conds.push_back(std::make_pair(C, Last));
+      }
+      bool CheckCount = SE->getUnsignedRange(Count).getUnsignedMax().ugt(N);
+      if (Conds.empty() && !CheckCount) {
+        // the checks can't fail on any iteration
+        DEBUG(dbgs() << "removed " << Elided.size() << " checks from loop "
+              << L->getHeader()->getName() << "\n");
+        for (unsigned i=0;i<Elided.size();i++)
+          removeCheck(Elided[i]->Br);
+        return;
+      }
+
+      unsigned Size = 0;
+      for (Loop::block_iterator I=L->block_begin(),E=L->block_end();
+           I != E; ++I)
+        Size += (*I)->size();
+      if (Size > LoopVersionSize)
+        return;
+
+      TerminatorInst *PHTerm = Preheader->getTerminator();
+      Value *Guard = 0;
+      if (CheckCount) {
+        Value *CountV = expander->expandCodeFor(Count, Count->getType(),
+                                                PHTerm);
+        Guard = new ICmpInst(PHTerm, ICmpInst::ICMP_ULE, CountV,
+                             ConstantInt::get(Count->getType(), N));
+      }
+      for (unsigned i=0;i<Conds.size();i++) {
+        const Check *C = Conds[i].first;
+        const Type *Ty = C->Limit->getType();
+        Value *LastV = expander->expandCodeFor(Conds[i].second, Ty, PHTerm);
+        Value *LimitV = expander->expandCodeFor(C->Limit, Ty, PHTerm);
+        Value *Cond = new ICmpInst(PHTerm, C->strict ?
+                                   ICmpInst::ICMP_ULT :
+                                   ICmpInst::ICMP_ULE, LastV, LimitV);
+        Guard = Guard ? BinaryOperator::CreateAnd(Guard, Cond, "", PHTerm) :
+          Cond;
+      }
+
+      // The loop blocks in dominator tree order, and the blocks after the
+      // loop that are immediately dominated by one of them.
+      BasicBlock *Header = L->getHeader();
+      std::vector<BasicBlock*> Order, ExitDom;
+      for (df_iterator<DomTreeNode*> I=df_begin(DT->getNode(Header)),
+           E=df_end(DT->getNode(Header)); I != E; ++I) {
+        BasicBlock *BB = (*I)->getBlock();
+        if (L->contains(BB))
+          Order.push_back(BB);
+        else if (L->contains((*I)->getIDom()->getBlock()))
+          ExitDom.push_back(BB);
+      }
+
+      Function *F = Preheader->getParent();
+      DenseMap<const Value*, Value*> VMap;
+      std::vector<BasicBlock*> NewBlocks;
+      DenseSet<BasicBlock*> NewSet;
+      for (Loop::block_iterator I=L->block_begin(),E=L->block_end();
+           I != E; ++I) {
+        BasicBlock *NewBB = CloneBasicBlock(*I, VMap, ".nocheck", F);
+        VMap[*I] = NewBB;
+        NewBlocks.push_back(NewBB);
+        NewSet.insert(NewBB);
+      }
+      for (unsigned i=0;i<NewBlocks.size();i++)
+        for (BasicBlock::iterator I=NewBlocks[i]->begin(),
+             E=NewBlocks[i]->end(); I != E; ++I)
+          for (User::op_iterator U=I->op_begin(),UE=I->op_end(); U != UE; ++U)
+            if (Value *V = VMap.lookup(*U))
+              *U = V;
+
+      // The exits of the loop are reached from both copies now.
+      unsigned i = 0;
+      for (Loop::block_iterator I=L->block_begin(),E=L->block_end();
+           I != E; ++I, ++i) {
+        TerminatorInst *TI = NewBlocks[i]->getTerminator();
+        for (unsigned j=0;j<TI->getNumSuccessors();j++) {
+          BasicBlock *Succ = TI->getSuccessor(j);
+          if (NewSet.count(Succ))
+            continue;
+          for (BasicBlock::iterator J=Succ->begin();
+               PHINode *PN = dyn_cast<PHINode>(J); ++J) {
+            Value *V = PN->getIncomingValueForBlock(*I);
+            if (Value *NewV = VMap.lookup(V))
+              V = NewV;
+            PN->addIncoming(V, NewBlocks[i]);
+          }
+        }
+      }
+      for (Loop::block_iterator I=L->block_begin(),E=L->block_end();
+           I != E; ++I) {
+        for (BasicBlock::iterator J=(*I)->begin(),JE=(*I)->end();
+             J != JE; ++J) {
+          SmallVector<Use*, 4> Uses;
+          for (Value::use_iterator U=J->use_begin(),UE=J->use_end();
+               U != UE; ++U) {
+            BasicBlock *UseBB = cast<Instruction>(*U)->getParent();
+            if (PHINode *PN = dyn_cast<PHINode>(*U))
+              UseBB = PN->getIncomingBlock(U);
+            if (!L->contains(UseBB) && !NewSet.count(UseBB))
+              Uses.push_back(&U.getUse());
+          }
+          if (Uses.empty())
+            continue;
+          SSAUpdater SSA;
+          SSA.Initialize(J);
+          SSA.AddAvailableValue(*I, J);
+          SSA.AddAvailableValue(cast<BasicBlock>(VMap[*I]), VMap[J]);
+          for (unsigned k=0;k<Uses.size();k++)
+            SSA.RewriteUse(*Uses[k]);
+        }
+      }
+      BranchInst::Create(cast<BasicBlock>(VMap[Header]), Header, Guard,
+                         PHTerm);
+      // the expander remembers its insertion points
+      expander->clear();
+      PHTerm->eraseFromParent();
+
+      // The copy is dominated like the loop, its header by the preheader.
+      // The blocks after the loop that were dominated by a loop block are
+      // reached from both copies now.
+      DT->addNewBlock(cast<BasicBlock>(VMap[Header]), Preheader);
+      for (unsigned i=1;i<Order.size();i++) {
+        BasicBlock *IDom = DT->getNode(Order[i])->getIDom()->getBlock();
+        DT->addNewBlock(cast<BasicBlock>(VMap[Order[i]]),
+                        cast<BasicBlock>(VMap[IDom]));
+      }
+      for (unsigned i=0;i<ExitDom.size();i++)
+        updateIDom(ExitDom[i]);
+      Loop *NewL = new Loop();
+      if (Loop *P = L->getParentLoop())
+        P->addChildLoop(NewL);
+      else
+        LI->addTopLevelLoop(NewL);
+      for (Loop::block_iterator I=L->block_begin(),E=L->block_end();
+           I != E; ++I)
+        NewL->addBasicBlockToLoop(cast<BasicBlock>(VMap[*I]), LI->getBase());
+
+      for (unsigned i=0;i<Elided.size();i++)
+        removeCheck(cast<BranchInst>(VMap[Elided[i]->Br]));
+      DEBUG(dbgs() << "loop " << Header->getName() << " duplicated without "
+            << Elided.size() << " checks\n");
+    }
+
+    // Returns an upper bound of the number of times the backedge of L is
+    // taken. Count is the exact number if known, otherwise the bound comes
+    // from an exit that is taken when an induction variable reaches a loop
+    // invariant limit.
+    LoopBound getExitBound(Loop *L, const SCEV *Count)
+    {
+      LoopBound B = { Count, 0 };
+      BasicBlock *Latch = L->getLoopLatch();
+      if (!Latch)
+        return B;
+      SmallVector<BasicBlock*, 4> Exiting;
+      L->getExitingBlocks(Exiting);
+      if (Count && Exiting.size() == 1)
+        B.Body = getLoopSuccessor(L, Exiting[0]);
+      for (unsigned i=0;i<Exiting.size() && !B.Count;i++) {
+        if (!DT->dominates(Exiting[i], Latch))
+          continue;
+        BranchInst *BI = dyn_cast<BranchInst>(Exiting[i]->getTerminator());
+        if (!BI || !BI->isConditional())
+          continue;
+        ICmpInst *ICI = dyn_cast<ICmpInst>(BI->getCondition());
+        if (!ICI || !ICI->getOperand(0)->getType()->isIntegerTy())
+          continue;
+        // the condition for staying in the loop
+        ICmpInst::Predicate Pred = ICI->getPredicate();
+        if (!L->contains(BI->getSuccessor(0)))
+          Pred = ICI->getInversePredicate();
+        const SCEV *LHS = SE->getSCEV(ICI->getOperand(0));
+        const SCEV *RHS = SE->getSCEV(ICI->getOperand(1));
+        if (!isa<SCEVAddRecExpr>(LHS)) {
+          std::swap(LHS, RHS);
+          Pred = ICmpInst::getSwappedPredicate(Pred);
+        }
+        const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(LHS);
+        if (!AR || AR->getLoop() != L || !AR->isAffine() ||
+            !AR->getStepRecurrence(*SE)->isOne() ||
+            !RHS->isLoopInvariant(L))
+          continue;
+        // {S,+,1} < X or {S,+,1} != X stops by iteration X - S
+        if (Pred == ICmpInst::ICMP_ULT || Pred == ICmpInst::ICMP_NE) {
+          B.Count = SE->getMinusSCEV(RHS, AR->getStart());
+          B.Body = getLoopSuccessor(L, Exiting[i]);
+        }
+      }
+      return B;
+    }
+
+    // Returns the block of L that is entered only if the exit at Exiting is
+    // not taken.
+    BasicBlock *getLoopSuccessor(Loop *L, BasicBlock *Exiting)
+    {
+      BranchInst *BI = dyn_cast<BranchInst>(Exiting->getTerminator());
+      if (!BI || !BI->isConditional())
+        return 0;
+      BasicBlock *Succ = BI->getSuccessor(0);
+      if (!L->contains(Succ))
+        Succ = BI->getSuccessor(1);
+      if (!L->contains(Succ) || Succ->getSinglePredecessor() != Exiting)
+        return 0;
+      return Succ;
+    }
+
+    // Replaces the branch of a check that can't fail by a branch to the
+    // access.
+    void removeCheck(BranchInst *Br)
+    {
+      AbrtBB->removePredecessor(Br->getParent(), true);
+      BranchInst::Create(Br->getSuccessor(0), Br);
+      Br->eraseFromParent();
+      if (pred_begin(AbrtBB) == pred_end(AbrtBB)) {
+        DT->eraseNode(AbrtBB);
+        DeleteDeadBlock(AbrtBB);
+        AbrtBB = 0;
+      } else
+        updateIDom(AbrtBB);
+    }
+
+    // Sets the immediate dominator of BB after its predecessors changed.
+    void updateIDom(BasicBlock *BB)
+    {
+      BasicBlock *IDom = 0;
+      for (pred_iterator PI=pred_begin(BB),PE=pred_end(BB); PI != PE; ++PI) {
+        // skip unreachable predecessors and backedges
+        if (!DT->getNode(*PI) || DT->dominates(BB, *PI))
+          continue;
+        IDom = IDom ? DT->findNearestCommonDominator(IDom, *PI) : *PI;
+      }
+      if (IDom)
+        DT->changeImmediateDominator(BB, IDom);
+    }
+
     static void MakeCompatible(ScalarEvolution *SE, const SCEV*& LHS, const SCEV*& RHS) 
     {
       if (const SCEVZeroExtendExpr *ZL = dyn_cast<SCEVZeroExtendExpr>(LHS))
@@ -732,6 +1326,15 @@ namespace {
       }
 
       bool valid = true;
+      // offset + len <= limit implies offset < limit, unless len can be 0 or
+      // offset + len can wrap around.
+      APInt MaxOffset = SE->getUnsignedRange(OffsetP).getUnsignedMax();
+      APInt MaxLen = SE->getUnsignedRange(SLen).getUnsignedMax();
+      MaxOffset.zext(65);
+      MaxLen.zext(65);
+      bool LenImpliesOffset = !NoCheckOpt &&
+        SE->getUnsignedRange(SLen).getUnsignedMin() != 0 &&
+        !(MaxOffset + MaxLen).ugt(APInt::getMaxValue(64).zext(65));
       SLen = SE->getAddExpr(OffsetP, SLen);
       // check that offset + slen <= limit; 
       // umax(offset+slen, limit) == limit is a sufficient (but not necessary
@@ -744,7 +1347,7 @@ namespace {
 
       //TODO: nullpointer check
       const SCEV *Max = SE->getUMaxExpr(OffsetP, Limit);
-      if (Max == Limit)
+      if (Max == Limit || LenImpliesOffset)
         return valid;
       DEBUG(dbgs() << "Max != Limit: " << *Max << ", " << *Limit << "\n");
 
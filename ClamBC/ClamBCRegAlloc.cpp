@@ -30,9 +30,18 @@
 #include "llvm/LLVMContext.h"
 #include "llvm/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/InstIterator.h"
 
 using namespace llvm;
+
+static cl::opt<bool>
+NoCoalesce("clambc-no-coalesce", cl::Hidden, cl::init(false),
+           cl::desc("Give each value its own ID, even if the live ranges "
+                    "of values don't overlap"));
+
 // We do have a virtually unlimited number of registers, but it is more cache 
 // efficient at runtime if we use a small number of them.
 // Also it is easier for the interpreter if there are no phi nodes,
@@ -191,12 +200,216 @@ bool ClamBCRegAlloc::runOnFunction(Function &F)
     }
     ++id;
   }
-  //TODO: reduce the number of virtual registers used, by using 
-  // an algorithms that walks the dominatortree and does value liveness
-  // analysis.
+  if (!NoCoalesce)
+    coalesceValues(F);
   return Changed;
 }
 
+// Appends the IDs of the values that the bytecode for I reads.
+// This is usually the operands, but the writer turns a sub of 2 ptrtoints
+// into a ptrdiff of the pointers themselves.
+void ClamBCRegAlloc::getUsedIDs(const Instruction *I,
+                                SmallVectorImpl<unsigned> &IDs) const
+{
+  SmallVector<const Value*, 8> Ops(I->op_begin(), I->op_end());
+  if (I->getOpcode() == Instruction::Sub) {
+    const PtrToIntInst *L = dyn_cast<PtrToIntInst>(I->getOperand(0));
+    const PtrToIntInst *R = dyn_cast<PtrToIntInst>(I->getOperand(1));
+    if (L && R) {
+      Ops.push_back(L->getOperand(0));
+      Ops.push_back(R->getOperand(0));
+    }
+  }
+  for (unsigned i=0;i<Ops.size();i++) {
+    ValueIDMap::const_iterator J = ValueMap.find(Ops[i]);
+    if (J != ValueMap.end() && J->second != ~0u)
+      IDs.push_back(J->second);
+  }
+}
+
+// Lets values with disjoint live ranges and the same type share a value ID.
+// Live ranges are computed by walking backwards from each use to the
+// definition, then the dominator tree is walked in preorder, and each
+// definition gets the lowest ID that is free at that point. Since a value's
+// definition dominates all its uses, all values live at a definition already
+// have an ID, and a value that is live at the definition of another always
+// gets a different ID.
+// Only instructions that own their ID are considered: arguments and allocas
+// (and values stored directly into an alloca) keep their own ID.
+void ClamBCRegAlloc::coalesceValues(Function &F)
+{
+  unsigned N = RevValueMap.size();
+  unsigned NArgs = F.arg_size();
+  std::vector<bool> Candidate(N, false);
+  for (unsigned i=NArgs;i<N;i++) {
+    const Instruction *I = dyn_cast<Instruction>(RevValueMap[i]);
+    if (!I || isa<AllocaInst>(I) || SkipMap.count(I) ||
+        !DT->isReachableFromEntry(const_cast<BasicBlock*>(I->getParent())))
+      continue;
+    Candidate[i] = true;
+  }
+  // Besides its definition an ID can only be shared by the bitcasts that
+  // were folded into it.
+  for (ValueIDMap::iterator I=ValueMap.begin(),E=ValueMap.end(); I != E; ++I) {
+    unsigned id = I->second;
+    if (id == ~0u || id >= N || !Candidate[id] || RevValueMap[id] == I->first)
+      continue;
+    const Instruction *II = dyn_cast<Instruction>(I->first);
+    if (!II || !isa<BitCastInst>(II) || !SkipMap.count(II))
+      Candidate[id] = false;
+  }
+
+  // Collect the uses of each candidate by the instructions that are written
+  // out, and the per-block uses for the backward scan below.
+  std::vector<SmallVector<BasicBlock*, 4> > UseBlocks(N);
+  for (inst_iterator I=inst_begin(F), E=inst_end(F); I != E; ++I) {
+    Instruction *II = &*I;
+    if (isa<AllocaInst>(II) || isa<DbgInfoIntrinsic>(II) || SkipMap.count(II))
+      continue;
+    if (!DT->isReachableFromEntry(II->getParent()))
+      continue;
+    SmallVector<unsigned, 8> IDs;
+    getUsedIDs(II, IDs);
+    for (unsigned i=0;i<IDs.size();i++) {
+      if (Candidate[IDs[i]])
+        UseBlocks[IDs[i]].push_back(II->getParent());
+    }
+  }
+
+  // Live-out sets: walk from each block using a value up to its definition.
+  typedef DenseMap<const BasicBlock*, std::vector<unsigned> > LiveMapTy;
+  LiveMapTy LiveIn, LiveOut;
+  DenseMap<const BasicBlock*, unsigned> InMark, OutMark;
+  for (unsigned id=NArgs;id<N;id++) {
+    if (!Candidate[id])
+      continue;
+    const BasicBlock *DefBB = cast<Instruction>(RevValueMap[id])->getParent();
+    SmallVector<BasicBlock*, 16> Worklist;
+    for (unsigned i=0;i<UseBlocks[id].size();i++) {
+      if (UseBlocks[id][i] != DefBB)
+        Worklist.push_back(UseBlocks[id][i]);
+    }
+    while (!Worklist.empty()) {
+      BasicBlock *BB = Worklist.pop_back_val();
+      unsigned &Mark = InMark[BB];
+      if (Mark == id+1)
+        continue;
+      Mark = id+1;
+      LiveIn[BB].push_back(id);
+      for (pred_iterator P=pred_begin(BB),PE=pred_end(BB); P != PE; ++P) {
+        BasicBlock *Pred = *P;
+        unsigned &OMark = OutMark[Pred];
+        if (OMark != id+1) {
+          OMark = id+1;
+          LiveOut[Pred].push_back(id);
+        }
+        if (Pred != DefBB)
+          Worklist.push_back(Pred);
+      }
+    }
+  }
+
+  std::vector<unsigned> Color(N, ~0u);
+  std::vector<const Type*> ColorType;
+  std::vector<bool> ColorUsed;
+  DenseMap<const Type*, SmallVector<unsigned, 8> > ColorsByType;
+  std::vector<unsigned> Seen(N, 0);
+  unsigned BBNum = 0;
+  for (df_iterator<DomTreeNode*> DI=df_begin(DT->getRootNode()),
+       DE=df_end(DT->getRootNode()); DI != DE; ++DI) {
+    BasicBlock *BB = DI->getBlock();
+    ++BBNum;
+    // Backward scan: find the last use of each value that dies in this
+    // block, and the definitions that are never used.
+    const std::vector<unsigned> &Out = LiveOut[BB];
+    for (unsigned i=0;i<Out.size();i++)
+      Seen[Out[i]] = BBNum;
+    DenseMap<const Instruction*, SmallVector<unsigned, 4> > Kills;
+    for (BasicBlock::iterator I=BB->end(), E=BB->begin(); I != E;) {
+      --I;
+      if (isa<AllocaInst>(I) || isa<DbgInfoIntrinsic>(I) || SkipMap.count(I))
+        continue;
+      SmallVector<unsigned, 8> IDs;
+      getUsedIDs(I, IDs);
+      for (unsigned i=0;i<IDs.size();i++) {
+        unsigned id = IDs[i];
+        if (!Candidate[id] || Seen[id] == BBNum)
+          continue;
+        Seen[id] = BBNum;
+        Kills[I].push_back(id);
+      }
+      ValueIDMap::iterator J = ValueMap.find(I);
+      if (J != ValueMap.end() && J->second != ~0u && Candidate[J->second] &&
+          RevValueMap[J->second] == &*I && Seen[J->second] != BBNum) {
+        Seen[J->second] = BBNum;
+        Kills[I].push_back(J->second);
+      }
+    }
+
+    // Forward scan: assign IDs to the definitions.
+    SmallVector<unsigned, 32> Busy;
+    const std::vector<unsigned> &In = LiveIn[BB];
+    for (unsigned i=0;i<In.size();i++) {
+      unsigned C = Color[In[i]];
+      assert(C != ~0u && "live-in value without ID");
+      ColorUsed[C] = true;
+      Busy.push_back(C);
+    }
+    for (BasicBlock::iterator I=BB->begin(), E=BB->end(); I != E; ++I) {
+      ValueIDMap::iterator J = ValueMap.find(I);
+      if (J != ValueMap.end() && J->second != ~0u && Candidate[J->second] &&
+          RevValueMap[J->second] == &*I) {
+        const Type *Ty = I->getType();
+        SmallVector<unsigned, 8> &Colors = ColorsByType[Ty];
+        unsigned C = ~0u;
+        for (unsigned i=0;i<Colors.size();i++) {
+          if (!ColorUsed[Colors[i]]) {
+            C = Colors[i];
+            break;
+          }
+        }
+        if (C == ~0u) {
+          C = ColorType.size();
+          ColorType.push_back(Ty);
+          ColorUsed.push_back(false);
+          Colors.push_back(C);
+        }
+        Color[J->second] = C;
+        ColorUsed[C] = true;
+        Busy.push_back(C);
+      }
+      DenseMap<const Instruction*, SmallVector<unsigned, 4> >::iterator K =
+        Kills.find(I);
+      if (K != Kills.end()) {
+        for (unsigned i=0;i<K->second.size();i++)
+          ColorUsed[Color[K->second[i]]] = false;
+      }
+    }
+    for (unsigned i=0;i<Busy.size();i++)
+      ColorUsed[Busy[i]] = false;
+  }
+
+  // Renumber: arguments first, then the IDs in order of first appearance.
+  std::vector<unsigned> NewID(N, ~0u);
+  std::vector<unsigned> ColorID(ColorType.size(), ~0u);
+  std::vector<const Value*> NewRevValueMap;
+  for (unsigned i=0;i<N;i++) {
+    unsigned *Slot = &NewID[i];
+    if (Candidate[i] && Color[i] != ~0u)
+      Slot = &ColorID[Color[i]];
+    if (*Slot == ~0u) {
+      *Slot = NewRevValueMap.size();
+      NewRevValueMap.push_back(RevValueMap[i]);
+    }
+    NewID[i] = *Slot;
+  }
+  for (ValueIDMap::iterator I=ValueMap.begin(),E=ValueMap.end(); I != E; ++I) {
+    if (I->second != ~0u)
+      I->second = NewID[I->second];
+  }
+  RevValueMap.swap(NewRevValueMap);
+}
+
 void ClamBCRegAlloc::dump() const {
   for (ValueIDMap::const_iterator I=ValueMap.begin(),E=ValueMap.end();
        I != E; ++I) {
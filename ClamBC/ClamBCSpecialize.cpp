@@ -0,0 +1,399 @@
+/*
+ *  Compile LLVM bytecode to ClamAV bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#define DEBUG_TYPE "clambc-specialize"
+#include "llvm/System/DataTypes.h"
+#include "ClamBCCost.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Attributes.h"
+#include "llvm/Constants.h"
+#include "llvm/Function.h"
+#include "llvm/Instructions.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <algorithm>
+#include <map>
+#include <set>
+using namespace llvm;
+
+static cl::opt<bool>
+Specialize("clambc-specialize", cl::Hidden, cl::init(true),
+           cl::desc("Clone functions for the constant arguments they are "
+                    "called with"));
+
+static cl::opt<unsigned>
+SpecializeThreshold("clambc-specialize-threshold", cl::Hidden, cl::init(25),
+                    cl::desc("Clone a function if the constant arguments "
+                             "remove this percentage of its cost"));
+
+STATISTIC(NumSpecialized, "Number of specialized functions");
+STATISTIC(NumCallsSpecialized, "Number of calls to specialized functions");
+
+// Larger functions are not cloned.
+static const unsigned MaxInstructions = 1000;
+// The most clones of a single function.
+static const unsigned MaxClones = 4;
+
+typedef DenseMap<const Value*, Constant*> KnownMap;
+
+static Constant *getKnown(Value *V, const KnownMap &Known)
+{
+  if (Constant *C = dyn_cast<Constant>(V))
+    return C;
+  return Known.lookup(V);
+}
+
+// The weighted cost of the instructions of F that fold to constants, or that
+// are not reached if the values in Known are constant. Loops are not taken
+// into account, but the weights of API calls make sure that removing them
+// is always worth more than folding some arithmetic.
+static uint64_t getSavings(Function *F, KnownMap Known)
+{
+  typedef std::pair<const BasicBlock*, const BasicBlock*> Edge;
+  std::set<Edge> LiveEdges;
+  SmallPtrSet<const BasicBlock*, 32> Visited;
+  uint64_t Saved = 0;
+  ReversePostOrderTraversal<Function*> RPOT(F);
+  for (ReversePostOrderTraversal<Function*>::rpo_iterator I=RPOT.begin(),
+       E=RPOT.end(); I != E; ++I) {
+    BasicBlock *BB = *I;
+    bool Live = BB == &F->getEntryBlock();
+    for (pred_iterator P=pred_begin(BB),PE=pred_end(BB); P != PE && !Live; ++P)
+      Live = LiveEdges.count(Edge(*P, BB));
+    if (!Live) {
+      for (BasicBlock::iterator J=BB->begin(),JE=BB->end(); J != JE; ++J) {
+        if (!isa<DbgInfoIntrinsic>(J))
+          Saved += ClamBCCostModel::getInstructionWeight(J);
+      }
+      Visited.insert(BB);
+      continue;
+    }
+    for (BasicBlock::iterator J=BB->begin(),JE=BB->end(); J != JE; ++J) {
+      Instruction *Inst = &*J;
+      Constant *C = 0;
+      if (PHINode *PN = dyn_cast<PHINode>(Inst)) {
+        // blocks not visited yet are reached through backedges, which are
+        // live, and their values aren't known yet
+        bool Same = true;
+        for (unsigned k=0;k<PN->getNumIncomingValues() && Same;k++) {
+          BasicBlock *In = PN->getIncomingBlock(k);
+          if (Visited.count(In) && !LiveEdges.count(Edge(In, BB)))
+            continue;
+          Constant *V = getKnown(PN->getIncomingValue(k), Known);
+          if (!V || (C && C != V))
+            Same = false;
+          C = V;
+        }
+        if (!Same)
+          C = 0;
+      } else if (TerminatorInst *TI = dyn_cast<TerminatorInst>(Inst)) {
+        BasicBlock *Taken = 0;
+        if (BranchInst *BI = dyn_cast<BranchInst>(TI)) {
+          if (BI->isConditional()) {
+            ConstantInt *Cond =
+              dyn_cast_or_null<ConstantInt>(getKnown(BI->getCondition(), Known));
+            if (Cond)
+              Taken = BI->getSuccessor(Cond->isZero() ? 1 : 0);
+          }
+        } else if (SwitchInst *SI = dyn_cast<SwitchInst>(TI)) {
+          ConstantInt *Cond =
+            dyn_cast_or_null<ConstantInt>(getKnown(SI->getCondition(), Known));
+          if (Cond)
+            Taken = SI->getSuccessor(SI->findCaseValue(Cond));
+        }
+        if (Taken) {
+          LiveEdges.insert(Edge(BB, Taken));
+          Saved += ClamBCCostModel::getInstructionWeight(TI);
+        } else {
+          for (unsigned k=0;k<TI->getNumSuccessors();k++)
+            LiveEdges.insert(Edge(BB, TI->getSuccessor(k)));
+        }
+        break;
+      } else if (!Inst->mayReadFromMemory() && !Inst->mayHaveSideEffects() &&
+                 !isa<AllocaInst>(Inst)) {
+        SmallVector<Constant*, 4> Ops;
+        for (User::op_iterator O=Inst->op_begin(),OE=Inst->op_end();
+             O != OE; ++O) {
+          Constant *OpC = getKnown(*O, Known);
+          if (!OpC)
+            break;
+          Ops.push_back(OpC);
+        }
+        if (Ops.size() == Inst->getNumOperands()) {
+          if (CmpInst *CI = dyn_cast<CmpInst>(Inst))
+            C = ConstantFoldCompareInstOperands(CI->getPredicate(), Ops[0],
+                                                Ops[1]);
+          else
+            C = ConstantFoldInstOperands(Inst->getOpcode(), Inst->getType(),
+                                         Ops.data(), Ops.size());
+        }
+      }
+      if (C) {
+        Known[Inst] = C;
+        if (!isa<PHINode>(Inst))
+          Saved += ClamBCCostModel::getInstructionWeight(Inst);
+      }
+    }
+    Visited.insert(BB);
+  }
+  return Saved;
+}
+
+static bool isPointerSize(Function *F, unsigned i)
+{
+  const FunctionType *FTy = F->getFunctionType();
+  return i > 0 && isa<PointerType>(FTy->getParamType(i-1));
+}
+
+// The size of a pointer is passed in the parameter after it. If all calls of
+// a clone passed the same constant size, the standard passes would remove
+// that parameter, and the calls could no longer be verified.
+static bool hasConstantSize(Function *F, const std::vector<CallInst*> &Calls)
+{
+  for (unsigned i=1;i<F->getFunctionType()->getNumParams();i++) {
+    if (!isPointerSize(F, i))
+      continue;
+    Constant *C = dyn_cast<Constant>(CallSite(Calls[0]).getArgument(i));
+    unsigned c = 1;
+    while (C && c < Calls.size() && CallSite(Calls[c]).getArgument(i) == C)
+      c++;
+    if (C && c == Calls.size())
+      return true;
+  }
+  return false;
+}
+
+static void rewriteCall(CallInst *CI, Function *NF,
+                        const std::vector<Constant*> &Args)
+{
+  CallSite CS(CI);
+  SmallVector<Value*, 8> NewArgs;
+  for (unsigned i=0;i<Args.size();i++) {
+    if (!Args[i])
+      NewArgs.push_back(CS.getArgument(i));
+  }
+  CallInst *NewCI = CallInst::Create(NF, NewArgs.begin(), NewArgs.end(), "",
+                                     CI);
+  NewCI->setCallingConv(CI->getCallingConv());
+  NewCI->setAttributes(NF->getAttributes());
+  if (MDNode *Dbg = CI->getMetadata("dbg"))
+    NewCI->setMetadata("dbg", Dbg);
+  NewCI->takeName(CI);
+  CI->replaceAllUsesWith(NewCI);
+  CI->eraseFromParent();
+}
+
+namespace {
+// Clones the functions that are called with constant arguments, if the
+// arguments make enough of the function fold away. The helpers in
+// bytecode_local.h are often called with constants, but are too large to be
+// inlined. Runs before the standard module passes, which fold the clones.
+class ClamBCSpecialize : public ModulePass {
+public:
+  static char ID;
+  ClamBCSpecialize() : ModulePass((intptr_t)&ID) {}
+  virtual const char *getPassName() const {
+    return "ClamAV Bytecode Function Specialization";
+  }
+  virtual bool runOnModule(Module &M);
+};
+char ClamBCSpecialize::ID;
+
+// The calls with the same constant arguments, and what a clone for them
+// would save.
+struct CallGroup {
+  std::vector<Constant*> Args;
+  std::vector<CallInst*> Calls;
+  uint64_t Saved;
+};
+
+bool compareSaved(const CallGroup &A, const CallGroup &B)
+{
+  return A.Saved > B.Saved;
+}
+}
+
+typedef DenseMap<Function*, std::vector<CallInst*> > CallSiteMap;
+
+// Adds the calls in F to the calls of their callees, in the order they
+// appear in F, so that the clones don't depend on the order of use lists.
+static void addCallSites(Function *F, CallSiteMap &CallSites)
+{
+  for (Function::iterator BB=F->begin(),E=F->end(); BB != E; ++BB) {
+    for (BasicBlock::iterator I=BB->begin(),IE=BB->end(); I != IE; ++I) {
+      CallInst *CI = dyn_cast<CallInst>(I);
+      Function *Callee = CI ? CI->getCalledFunction() : 0;
+      if (Callee && Callee != F && !Callee->isDeclaration())
+        CallSites[Callee].push_back(CI);
+    }
+  }
+}
+
+bool ClamBCSpecialize::runOnModule(Module &M)
+{
+  if (!Specialize)
+    return false;
+  std::vector<Function*> Functions;
+  for (Module::iterator F=M.begin(),E=M.end(); F != E; ++F) {
+    if (F->isDeclaration() || !F->hasLocalLinkage() || F->isVarArg() ||
+        F->hasFnAttr(Attribute::AlwaysInline) ||
+        F->hasFnAttr(Attribute::OptimizeForSize))
+      continue;
+    Functions.push_back(F);
+  }
+  CallSiteMap CallSites;
+  for (Module::iterator F=M.begin(),E=M.end(); F != E; ++F)
+    addCallSites(F, CallSites);
+
+  bool Changed = false;
+  for (unsigned f=0;f<Functions.size();f++) {
+    Function *F = Functions[f];
+    unsigned Instructions = 0;
+    uint64_t Cost = 0;
+    for (Function::iterator BB=F->begin(),E=F->end(); BB != E; ++BB) {
+      for (BasicBlock::iterator I=BB->begin(),IE=BB->end(); I != IE; ++I) {
+        if (isa<DbgInfoIntrinsic>(I))
+          continue;
+        Instructions++;
+        Cost += ClamBCCostModel::getInstructionWeight(I);
+      }
+    }
+    if (Instructions > MaxInstructions)
+      continue;
+
+    std::vector<Argument*> Params;
+    for (Function::arg_iterator A=F->arg_begin(),AE=F->arg_end(); A != AE; ++A)
+      Params.push_back(A);
+
+    // Group the calls by their constant arguments, in the order of the first
+    // call of each group. Arguments that don't save anything on their own
+    // and pointer sizes are left out, so that calls which differ only in an
+    // offset or a size can share a clone.
+    std::vector<CallGroup> Groups;
+    std::map<std::vector<Constant*>, unsigned> GroupIdx;
+    std::map<std::pair<unsigned, Constant*>, uint64_t> ArgSavings;
+    std::vector<CallInst*> Calls = CallSites.lookup(F);
+    for (unsigned c=0;c<Calls.size();c++) {
+      CallInst *CI = Calls[c];
+      CallSite CS(CI);
+      std::vector<Constant*> Args;
+      bool AnyConstant = false;
+      for (unsigned i=0;i<CS.arg_size();i++) {
+        Constant *C = dyn_cast<Constant>(CS.getArgument(i));
+        if (C && (isa<UndefValue>(C) || isPointerSize(F, i)))
+          C = 0;
+        if (C) {
+          std::pair<unsigned, Constant*> Key(i, C);
+          if (!ArgSavings.count(Key)) {
+            KnownMap Known;
+            Known[Params[i]] = C;
+            ArgSavings[Key] = getSavings(F, Known);
+          }
+          if (!ArgSavings[Key])
+            C = 0;
+        }
+        Args.push_back(C);
+        AnyConstant |= C != 0;
+      }
+      if (!AnyConstant)
+        continue;
+      std::map<std::vector<Constant*>, unsigned>::iterator G =
+        GroupIdx.find(Args);
+      if (G == GroupIdx.end()) {
+        G = GroupIdx.insert(std::make_pair(Args, Groups.size())).first;
+        Groups.push_back(CallGroup());
+        Groups.back().Args = Args;
+      }
+      Groups[G->second].Calls.push_back(CI);
+    }
+
+    // Clone for the groups that save the most, the first call decides ties.
+    std::vector<CallGroup> Worth;
+    for (unsigned g=0;g<Groups.size();g++) {
+      CallGroup &G = Groups[g];
+      KnownMap Known;
+      for (unsigned i=0;i<Params.size();i++) {
+        if (G.Args[i])
+          Known[Params[i]] = G.Args[i];
+      }
+      G.Saved = getSavings(F, Known);
+      DEBUG(dbgs() << F->getName() << ": " << G.Calls.size() << " calls, "
+            << "saves " << G.Saved << " of " << Cost << "\n");
+      if (G.Saved * 100 >= Cost * SpecializeThreshold &&
+          !hasConstantSize(F, G.Calls))
+        Worth.push_back(G);
+    }
+    std::stable_sort(Worth.begin(), Worth.end(), compareSaved);
+    if (Worth.size() > MaxClones)
+      Worth.resize(MaxClones);
+    // the calls that are not rewritten must not get a constant size either
+    while (!Worth.empty()) {
+      std::set<CallInst*> Rewritten;
+      for (unsigned g=0;g<Worth.size();g++)
+        Rewritten.insert(Worth[g].Calls.begin(), Worth[g].Calls.end());
+      std::vector<CallInst*> Rest;
+      for (unsigned c=0;c<Calls.size();c++) {
+        if (!Rewritten.count(Calls[c]))
+          Rest.push_back(Calls[c]);
+      }
+      if (Rest.empty() || !hasConstantSize(F, Rest))
+        break;
+      Worth.pop_back();
+    }
+
+    for (unsigned g=0;g<Worth.size();g++) {
+      const std::vector<Constant*> &Args = Worth[g].Args;
+      DenseMap<const Value*, Value*> VMap;
+      for (unsigned i=0;i<Params.size();i++) {
+        if (Args[i])
+          VMap[Params[i]] = Args[i];
+      }
+      Function *NF = CloneFunction(F, VMap);
+      NF->setName(F->getName()+".spec");
+      NF->setLinkage(GlobalValue::InternalLinkage);
+      M.getFunctionList().push_back(NF);
+      // the calls in the clone may have more constant arguments
+      addCallSites(NF, CallSites);
+      for (unsigned j=0;j<Worth[g].Calls.size();j++)
+        rewriteCall(Worth[g].Calls[j], NF, Args);
+      NumCallsSpecialized += Worth[g].Calls.size();
+      ++NumSpecialized;
+      Changed = true;
+    }
+  }
+  return Changed;
+}
+
+llvm::ModulePass *createClamBCSpecialize()
+{
+  return new ClamBCSpecialize();
+}
@@ -0,0 +1,343 @@
+/*
+ *  Compile LLVM bytecode to ClamAV bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#define DEBUG_TYPE "clambc-switch"
+#include "llvm/System/DataTypes.h"
+#include "ClamBCModule.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Constants.h"
+#include "llvm/DerivedTypes.h"
+#include "llvm/Function.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/Instructions.h"
+#include "llvm/Intrinsics.h"
+#include "llvm/LLVMContext.h"
+#include "llvm/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/IRBuilder.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+using namespace llvm;
+
+static cl::opt<bool>
+SwitchTables("clambc-switch-tables", cl::Hidden, cl::init(true),
+             cl::desc("Turn switches that select constants into table "
+                      "lookups"));
+
+STATISTIC(NumTables, "Number of switches turned into table lookups");
+
+// Smallest switch worth a table, the binary search of LowerSwitch is as fast
+// below this.
+static const unsigned MinCases = 6;
+static const uint64_t MaxTableSize = 256;
+
+namespace {
+// Turns a switch whose cases only select values for the PHIs of a common
+// successor into a range check and a load from a table for each PHI that
+// gets different constants in different cases:
+//   switch i8 %x, label %default [ i8 0, label %a  i8 1, label %b ... ]
+//   a: br label %end      b: br label %end ...
+//   end: %r = phi i32 [ 10, %a ], [ 20, %b ], ...
+// The libclamav interpreter can't index globals, so the tables are copied to
+// the stack, and the lookups index the copies. The copy is made right before
+// the lookup, or in the preheader of the outermost loop around the switch, so
+// that it isn't made on each call, or on each iteration.
+// This has to run before LowerSwitch, which would turn the switch into a
+// binary search with log2(cases) compares and branches.
+class ClamBCSwitchTables : public FunctionPass {
+public:
+  static char ID;
+  ClamBCSwitchTables() : FunctionPass(&ID) {}
+  virtual const char *getPassName() const {
+    return "ClamAV Bytecode Switch Lookup Tables";
+  }
+  virtual bool runOnFunction(Function &F);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<LoopInfo>();
+  }
+private:
+  // Blocks deleted by the conversions, they can't be used for copies.
+  SmallPtrSet<BasicBlock*, 16> Erased;
+  bool getResults(BasicBlock *Pred, BasicBlock *BB, BasicBlock *&Common,
+                  std::vector<Value*> &Results);
+  BasicBlock *getCopyBlock(SwitchInst *SI, LoopInfo &LI);
+  bool convertSwitch(SwitchInst *SI, BasicBlock *CopyBB);
+};
+char ClamBCSwitchTables::ID;
+}
+
+// The values selected for each PHI of Common when the switch in Pred
+// branches to BB. BB is either Common, or a block with just a branch to
+// Common.
+bool ClamBCSwitchTables::getResults(BasicBlock *Pred, BasicBlock *BB,
+                                    BasicBlock *&Common,
+                                    std::vector<Value*> &Results)
+{
+  BasicBlock *From = Pred;
+  if (!isa<PHINode>(BB->begin())) {
+    BranchInst *BI = dyn_cast<BranchInst>(BB->begin());
+    if (!BI || BI->isConditional() || BB->getUniquePredecessor() != Pred)
+      return false;
+    From = BB;
+    BB = BI->getSuccessor(0);
+  }
+  if (Common && BB != Common)
+    return false;
+  Common = BB;
+  Results.clear();
+  for (BasicBlock::iterator I=BB->begin(); isa<PHINode>(I); ++I)
+    Results.push_back(cast<PHINode>(I)->getIncomingValueForBlock(From));
+  return !Results.empty();
+}
+
+// The block at whose end the tables of SI are copied if it is in a loop:
+// the preheader of the outermost loop, or the entry block if there is none.
+// Null if SI is not in a loop, then the lookup block makes the copy.
+BasicBlock *ClamBCSwitchTables::getCopyBlock(SwitchInst *SI, LoopInfo &LI)
+{
+  Loop *L = LI.getLoopFor(SI->getParent());
+  if (!L)
+    return 0;
+  while (Loop *P = L->getParentLoop())
+    L = P;
+  if (BasicBlock *Preheader = L->getLoopPreheader())
+    return Preheader;
+  return &SI->getParent()->getParent()->getEntryBlock();
+}
+
+bool ClamBCSwitchTables::convertSwitch(SwitchInst *SI, BasicBlock *CopyBB)
+{
+  BasicBlock *SwitchBB = SI->getParent();
+  const IntegerType *CondTy = cast<IntegerType>(SI->getCondition()->getType());
+  unsigned NumCases = SI->getNumCases() - 1;
+  if (NumCases < MinCases || CondTy->getBitWidth() > 64)
+    return false;
+
+  // case 0 is the default
+  APInt Min = SI->getCaseValue(1)->getValue();
+  APInt Max = Min;
+  for (unsigned i=2;i<SI->getNumCases();i++) {
+    const APInt &V = SI->getCaseValue(i)->getValue();
+    if (V.slt(Min))
+      Min = V;
+    if (V.sgt(Max))
+      Max = V;
+  }
+  APInt Range = Max - Min;
+  if (Range.getActiveBits() > 32 || Range.getZExtValue() >= MaxTableSize)
+    return false;
+  uint64_t Size = Range.getZExtValue() + 1;
+  // at least 40% of the table must be cases
+  if (NumCases * 10 < Size * 4)
+    return false;
+
+  BasicBlock *Common = 0;
+  std::vector<Value*> Results;
+  std::vector<std::vector<Value*> > Tables;
+  SmallPtrSet<BasicBlock*, 16> Forwarders;
+  for (unsigned i=1;i<SI->getNumCases();i++) {
+    BasicBlock *Dest = SI->getSuccessor(i);
+    if (!getResults(SwitchBB, Dest, Common, Results))
+      return false;
+    if (Tables.empty())
+      Tables.resize(Results.size(), std::vector<Value*>(Size));
+    uint64_t Idx = (SI->getCaseValue(i)->getValue() - Min).getZExtValue();
+    for (unsigned j=0;j<Results.size();j++)
+      Tables[j][Idx] = Results[j];
+    if (Dest != Common)
+      Forwarders.insert(Dest);
+  }
+  BasicBlock *Default = SI->getDefaultDest();
+  if (Forwarders.count(Default))
+    return false;
+
+  // Holes in the table take the default's values if it goes to Common too,
+  // otherwise they go to the default through the range check.
+  std::vector<Value*> DefaultResults;
+  BasicBlock *DefaultCommon = Common;
+  bool DefaultToCommon = getResults(SwitchBB, Default, DefaultCommon,
+                                    DefaultResults);
+  bool Holes = NumCases != Size;
+  if (Holes && !DefaultToCommon)
+    return false;
+  // A PHI gets the same value for all cases, or a constant from a table.
+  std::vector<Value*> Uniform(Tables.size());
+  unsigned NumLookups = 0;
+  for (unsigned j=0;j<Tables.size();j++) {
+    for (uint64_t k=0;k<Size;k++) {
+      if (!Tables[j][k])
+        Tables[j][k] = DefaultResults[j];
+    }
+    Uniform[j] = Tables[j][0];
+    for (uint64_t k=1;k<Size && Uniform[j];k++) {
+      if (Tables[j][k] != Uniform[j])
+        Uniform[j] = 0;
+    }
+    if (Uniform[j])
+      continue;
+    const Type *Ty = Tables[j][0]->getType();
+    if (Ty->isIntegerTy(1) || !Ty->isIntegerTy() ||
+        Ty->getPrimitiveSizeInBits() > 64)
+      return false;
+    for (uint64_t k=0;k<Size;k++) {
+      if (!isa<ConstantInt>(Tables[j][k]))
+        return false;
+    }
+    ++NumLookups;
+  }
+  if (!NumLookups)
+    return false;
+  // A table covering all values of the condition needs no range check.
+  unsigned BitWidth = CondTy->getBitWidth();
+  bool RangeCheck = BitWidth >= 64 || Size != (uint64_t)1 << BitWidth;
+  if (RangeCheck && !Min && isPowerOf2_64(Size)) {
+    APInt Mask = APInt::getHighBitsSet(BitWidth, BitWidth - Log2_64(Size));
+    RangeCheck = !MaskedValueIsZero(SI->getCondition(), Mask);
+  }
+  DEBUG(dbgs() << "switch in " << SwitchBB->getName() << ": " << NumCases
+        << " cases, " << NumLookups << " tables of " << Size
+        << (RangeCheck ? "" : ", no range check") << "\n");
+
+  Function *F = SwitchBB->getParent();
+  Module *M = F->getParent();
+  LLVMContext &C = M->getContext();
+  const Type *I8PtrTy = PointerType::getUnqual(Type::getInt8Ty(C));
+  const Type *I32Ty = Type::getInt32Ty(C);
+  // ClamBCLowering turns this into the 32-bit version
+  const Type *MemCpyTy[] = { Type::getInt64Ty(C) };
+  Function *MemCpy = Intrinsic::getDeclaration(M, Intrinsic::memcpy,
+                                               MemCpyTy, 1);
+
+  BasicBlock *Lookup = BasicBlock::Create(C, "switch.lookup", F, Common);
+  IRBuilder<> builder(SwitchBB, SI);
+  Value *Idx = builder.CreateSub(SI->getCondition(),
+                                 ConstantInt::get(C, Min), "switch.idx");
+  if (RangeCheck) {
+    Value *InRange = builder.CreateICmpULT(Idx, ConstantInt::get(CondTy, Size),
+                                           "switch.inrange");
+    builder.CreateCondBr(InRange, Lookup, Default);
+  } else
+    builder.CreateBr(Lookup);
+  builder.SetInsertPoint(Lookup);
+  if (CondTy->getBitWidth() > 32)
+    Idx = builder.CreateTrunc(Idx, I32Ty);
+  else
+    Idx = builder.CreateZExtOrBitCast(Idx, I32Ty);
+
+  BasicBlock &Entry = F->getEntryBlock();
+  IRBuilder<> copy(Lookup);
+  if (CopyBB)
+    copy.SetInsertPoint(CopyBB, CopyBB->getTerminator());
+  unsigned j = 0;
+  for (BasicBlock::iterator I=Common->begin(); isa<PHINode>(I); ++I, ++j) {
+    PHINode *PN = cast<PHINode>(I);
+    Value *V = Uniform[j];
+    if (!V) {
+      const IntegerType *Ty = cast<IntegerType>(PN->getType());
+      std::vector<Constant*> Elts;
+      for (uint64_t k=0;k<Size;k++)
+        Elts.push_back(cast<Constant>(Tables[j][k]));
+      const ArrayType *ATy = ArrayType::get(Ty, Size);
+      GlobalVariable *GV = new GlobalVariable(*M, ATy, true,
+                                              GlobalValue::InternalLinkage,
+                                              ConstantArray::get(ATy, Elts),
+                                              "switch.table");
+      AllocaInst *Copy = new AllocaInst(ATy, "switch.table", Entry.begin());
+      copy.CreateCall4(MemCpy, copy.CreatePointerCast(Copy, I8PtrTy),
+                       ConstantExpr::getPointerCast(GV, I8PtrTy),
+                       ConstantInt::get(Type::getInt64Ty(C),
+                                        Size*Ty->getBitWidth()/8),
+                       ConstantInt::get(I32Ty, 1));
+      Value *P = builder.CreateGEP(builder.CreateConstGEP2_32(Copy, 0, 0),
+                                   Idx);
+      V = builder.CreateLoad(P, PN->getName()+".load");
+    }
+    // keep one entry for the switch block if the default jumps to Common
+    Value *DefaultV = Default == Common ?
+      PN->getIncomingValueForBlock(SwitchBB) : 0;
+    for (int k=PN->getNumIncomingValues()-1;k>=0;k--) {
+      BasicBlock *In = PN->getIncomingBlock(k);
+      if (In == SwitchBB || Forwarders.count(In))
+        PN->removeIncomingValue(k, false);
+    }
+    if (DefaultV && RangeCheck)
+      PN->addIncoming(DefaultV, SwitchBB);
+    PN->addIncoming(V, Lookup);
+  }
+  builder.CreateBr(Common);
+  // without a range check nothing goes to the default anymore
+  if (!RangeCheck && Default != Common)
+    Default->removePredecessor(SwitchBB);
+  SI->eraseFromParent();
+  if (!RangeCheck && Default != Common &&
+      pred_begin(Default) == pred_end(Default)) {
+    Erased.insert(Default);
+    DeleteDeadBlock(Default);
+  }
+  for (SmallPtrSet<BasicBlock*, 16>::iterator I=Forwarders.begin(),
+       E=Forwarders.end(); I != E; ++I) {
+    Erased.insert(*I);
+    (*I)->eraseFromParent();
+  }
+  ++NumTables;
+  return true;
+}
+
+bool ClamBCSwitchTables::runOnFunction(Function &F)
+{
+  if (!SwitchTables)
+    return false;
+  // The conversions change the CFG, find where the copies go while
+  // LoopInfo is still valid.
+  LoopInfo &LI = getAnalysis<LoopInfo>();
+  std::vector<BasicBlock*> SwitchBBs, CopyBBs;
+  for (Function::iterator I=F.begin(),E=F.end(); I != E; ++I) {
+    if (SwitchInst *SI = dyn_cast<SwitchInst>(I->getTerminator())) {
+      SwitchBBs.push_back(I);
+      CopyBBs.push_back(getCopyBlock(SI, LI));
+    }
+  }
+  bool Changed = false;
+  Erased.clear();
+  for (unsigned i=0;i<SwitchBBs.size();i++) {
+    // a switch in a default that became dead is gone
+    if (Erased.count(SwitchBBs[i]))
+      continue;
+    BasicBlock *CopyBB = CopyBBs[i];
+    if (CopyBB && Erased.count(CopyBB))
+      CopyBB = &F.getEntryBlock();
+    Changed |= convertSwitch(cast<SwitchInst>(SwitchBBs[i]->getTerminator()),
+                             CopyBB);
+  }
+  return Changed;
+}
+
+llvm::FunctionPass *createClamBCSwitchTables()
+{
+  return new ClamBCSwitchTables();
+}
@@ -58,10 +58,19 @@ extern "C" void LLVMInitializeClamBCTarget() {
   RegisterTargetMachine<ClamBCTargetMachine> X(TheClamBCTarget);
 }
 
+// The API list is parsed only once per process, a compiler server preloads it
+// (see ClamBCPreloadAPIMap) before forking the compilers.
+static std::string LoadedAPIMap;
+static std::vector<std::string> LoadedAPIList;
+
 static bool loadAPIList(std::vector<std::string> &APIList)
 {
   if (ApiMap == "")
     return true;
+  if (ApiMap == LoadedAPIMap) {
+    APIList = LoadedAPIList;
+    return true;
+  }
 
   std::string ErrorMessage;
   MemoryBuffer *Buffer =
@@ -103,9 +112,18 @@ static bool loadAPIList(std::vector<std::string> &APIList)
   } while (begin && begin < end);
 
   delete Buffer;
+  LoadedAPIMap = ApiMap;
+  LoadedAPIList = APIList;
   return true;
 }
 
+extern "C" bool ClamBCPreloadAPIMap(const char *File)
+{
+  std::vector<std::string> APIList;
+  ApiMap = File;
+  return loadAPIList(APIList);
+}
+
 
 bool ClamBCTargetMachine::addPassesToEmitWholeFile(PassManager &PM,
                                                    formatted_raw_ostream &o,
@@ -132,8 +150,6 @@ bool ClamBCTargetMachine::addPassesToEmitWholeFile(PassManager &PM,
 
   PM.add(createPromoteMemoryToRegisterPass());
   PM.add(createAlwaysInlinerPass());
-  PM.add(createGlobalOptimizerPass());
-  PM.add(createLowerSwitchPass());
   PM.add(createLowerInvokePass());
   PM.add(createSimplifyLibCallsPass());
   PM.add(createGlobalOptimizerPass());
@@ -141,6 +157,10 @@ bool ClamBCTargetMachine::addPassesToEmitWholeFile(PassManager &PM,
   PM.add(createIndVarSimplifyPass());
   PM.add(createConstantPropagationPass());
   PM.add(createClamBCLowering(false));
+  /* dense switches that select constants become table lookups */
+  PM.add(createClamBCSwitchTables());
+  /* simplifycfg can form new switches, lower them right before they are
+   * verified. The verifier's analyses are reused by the RT checks. */
   PM.add(createLowerSwitchPass());
   PM.add(createClamBCVerifier(false));
   PM.add(createClamBCRTChecks());
@@ -150,6 +170,8 @@ bool ClamBCTargetMachine::addPassesToEmitWholeFile(PassManager &PM,
   PM.add(createInternalizePass(exports));
   PM.add(createGlobalDCEPass());
   PM.add(createInstructionCombiningPass());
+  PM.add(createClamBCProfileLayout());
+  PM.add(createClamBCCountBlocks());
   PM.add(createClamBCRebuild());/* instcombine would undo the transform, must be after */
   PM.add(createDeadTypeEliminationPass());
   if (DumpIR)
@@ -159,7 +181,6 @@ bool ClamBCTargetMachine::addPassesToEmitWholeFile(PassManager &PM,
   PM.add(createDeadCodeEliminationPass());
   PM.add(createLowerSwitchPass());
   PM.add(createClamBCVerifier(false));
-  PM.add(createVerifierPass());
   PM.add(createStripDebugDeclarePass());
   PM.add(createGEPSplitterPass());
   PM.add(createClamBCLowering(true));
@@ -24,6 +24,7 @@
 #include "ClamBCModule.h"
 #include "ClamBCCommon.h"
 #include "llvm/ADT/FoldingSet.h"
+#include "llvm/ADT/OwningPtr.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Analysis/DebugInfo.h"
@@ -54,6 +55,15 @@ static cl::opt<bool>
 InsertTracing("clambc-trace", cl::Hidden, cl::init(false),
               cl::desc("Enable tracing of bytecode execution"));
 
+static cl::opt<bool>
+CountBlocks("clambc-count-blocks", cl::init(false),
+            cl::desc("Count how many times each basic block is executed"));
+
+static cl::opt<std::string>
+CountMap("clambc-count-map",
+         cl::desc("Write the source location of each block counter"),
+         cl::value_desc("File to write the counter map to"), cl::init(""));
+
 namespace {
 class ClamBCTrace : public ModulePass {
 public:
@@ -63,6 +73,116 @@ public:
   virtual bool runOnModule(Module &M);
 };
 char ClamBCTrace::ID;
+
+// Runs before ClamBCRebuild, which drops the debug locations needed for the
+// counter map.
+class ClamBCCountBlocks : public ModulePass {
+public:
+  static char ID;
+  ClamBCCountBlocks() : ModulePass((intptr_t)&ID) {}
+  virtual const char *getPassName() const { return "ClamAV Bytecode Block Counters"; }
+  virtual bool runOnModule(Module &M);
+};
+char ClamBCCountBlocks::ID;
+}
+
+// Each function gets an array of counters on its stack, one for each basic
+// block, preceded by the index of its first counter in the module and the
+// number of counters. The bytecode can't have writable globals, so the
+// counters are handed to trace_ptr whenever the function returns or aborts,
+// the tracer has to add them up.
+// The counter map has a "<index> <function> <file>:<line>" line for each
+// counter, the location is where the block starts.
+bool ClamBCCountBlocks::runOnModule(Module &M)
+{
+  if (!CountBlocks)
+    return false;
+  LLVMContext &C = M.getContext();
+  unsigned MDDbgKind = C.getMDKindID("dbg");
+  const Type *I32Ty = Type::getInt32Ty(C);
+  const Type *I8PtrTy = PointerType::getUnqual(Type::getInt8Ty(C));
+  std::vector<const Type*> args;
+  args.push_back(I8PtrTy);
+  args.push_back(I32Ty);
+  const FunctionType *FTy = FunctionType::get(I32Ty, args, false);
+  Constant *trace_ptr = M.getOrInsertFunction("trace_ptr", FTy);
+  if (!trace_ptr->use_empty())
+    ClamBCModule::stop("Tracing API can only be used by compiler!\n", &M);
+  // ClamBCLowering turns this into the 32-bit version
+  const Type *MemSetTy[] = { Type::getInt64Ty(C) };
+  Function *MemSet = Intrinsic::getDeclaration(&M, Intrinsic::memset,
+                                               MemSetTy, 1);
+  OwningPtr<raw_fd_ostream> MapOut;
+  if (!CountMap.empty()) {
+    std::string ErrorInfo;
+    MapOut.reset(new raw_fd_ostream(CountMap.c_str(), ErrorInfo));
+    if (!ErrorInfo.empty()) {
+      errs() << "error opening counter map " << CountMap << ": " << ErrorInfo
+        << "\n";
+      MapOut.reset();
+    }
+  }
+
+  unsigned base = 0;
+  for (Module::iterator I=M.begin(),E=M.end(); I != E; ++I) {
+    Function &F = *I;
+    if (F.isDeclaration())
+      continue;
+    unsigned n = F.size();
+    const Type *ArrayTy = ArrayType::get(I32Ty, n+2);
+    BasicBlock &Entry = F.getEntryBlock();
+    BasicBlock::iterator InsertPt = Entry.begin();
+    while (isa<AllocaInst>(InsertPt))
+      ++InsertPt;
+    AllocaInst *Counters = new AllocaInst(ArrayTy, "counters", Entry.begin());
+    IRBuilder<> builder(&Entry, InsertPt);
+    Value *Start = builder.CreatePointerCast(Counters, I8PtrTy);
+    builder.CreateCall4(MemSet, Start, ConstantInt::get(Type::getInt8Ty(C), 0),
+                        ConstantInt::get(Type::getInt64Ty(C), (n+2)*4),
+                        ConstantInt::get(I32Ty, 4));
+    builder.CreateStore(ConstantInt::get(I32Ty, base),
+                        builder.CreateConstGEP2_32(Counters, 0, 0));
+    builder.CreateStore(ConstantInt::get(I32Ty, n),
+                        builder.CreateConstGEP2_32(Counters, 0, 1));
+
+    unsigned i = 0;
+    for (Function::iterator BB=F.begin(),BE=F.end(); BB != BE; ++BB, ++i) {
+      if (&*BB == &Entry)
+        builder.SetInsertPoint(BB, builder.GetInsertPoint());
+      else
+        builder.SetInsertPoint(BB, BB->getFirstNonPHI());
+      Value *P = builder.CreateConstGEP2_32(Counters, 0, i+2);
+      builder.CreateStore(builder.CreateAdd(builder.CreateLoad(P),
+                                            ConstantInt::get(I32Ty, 1)), P);
+      for (BasicBlock::iterator II=BB->begin(),IE=BB->end(); II != IE; ++II) {
+        CallInst *CI = dyn_cast<CallInst>(II);
+        Function *Callee = CI ? CI->getCalledFunction() : 0;
+        if (!isa<ReturnInst>(II) &&
+            !(Callee && Callee->getName().equals("abort")))
+          continue;
+        builder.SetInsertPoint(BB, II);
+        builder.CreateCall2(trace_ptr, builder.CreatePointerCast(Counters,
+                                                                 I8PtrTy),
+                            ConstantInt::get(I32Ty, base));
+      }
+      if (!MapOut)
+        continue;
+      *MapOut << (base+i) << " " << F.getName() << " ";
+      MDNode *Dbg = 0;
+      for (BasicBlock::iterator II=BB->begin(),IE=BB->end(); II != IE && !Dbg;
+           ++II) {
+        if (!isa<DbgInfoIntrinsic>(II))
+          Dbg = II->getMetadata(MDDbgKind);
+      }
+      if (Dbg) {
+        DILocation Loc(Dbg);
+        *MapOut << Loc.getFilename() << ":" << Loc.getLineNumber() << "\n";
+      } else
+        *MapOut << "-\n";
+    }
+    base += n;
+  }
+  return true;
 }
 
   bool ClamBCTrace::runOnModule(Module &M) {
@@ -88,7 +208,8 @@ char ClamBCTrace::ID;
             trace_directory && trace_ptr);
     if (!trace_directory->use_empty() || !trace_scope->use_empty()
         || !trace_source->use_empty() || !trace_op->use_empty() ||
-        !trace_value->use_empty() || !trace_ptr->use_empty())
+        !trace_value->use_empty() ||
+        (!trace_ptr->use_empty() && !CountBlocks))
       ClamBCModule::stop("Tracing API can only be used by compiler!\n", &M);
 
     for (Module::iterator I=M.begin(),E=M.end(); I != E; ++I) {
@@ -208,3 +329,8 @@ llvm::ModulePass *createClamBCTrace()
 {
   return new ClamBCTrace();
 }
+
+llvm::ModulePass *createClamBCCountBlocks()
+{
+  return new ClamBCCountBlocks();
+}
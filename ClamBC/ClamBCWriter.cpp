@@ -22,14 +22,17 @@
 #include "llvm/System/DataTypes.h"
 #include "../clang/lib/Headers/bytecode_api.h"
 #include "clambc.h"
+#include "ClamBCCost.h"
 #include "ClamBCModule.h"
 #include "ClamBCTargetMachine.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Analysis/DebugInfo.h"
 #include "llvm/Analysis/Dominators.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/Passes.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Attributes.h"
 #include "llvm/CallingConv.h"
@@ -49,18 +52,44 @@
 #include "llvm/Support/InstIterator.h"
 #include "llvm/Support/InstVisitor.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar.h"
+#include <algorithm>
+#include <map>
 
 using namespace llvm;
 
 static cl::opt<std::string> MapFile("clambc-map",cl::desc("Write compilation map"),
                                     cl::value_desc("File to write the map to"),
                                     cl::init(""));
+static cl::opt<std::string>
+CostFile("clambc-cost",
+         cl::desc("Write the estimated execution cost of each function as JSON"),
+         cl::value_desc("File to write the estimates to"), cl::init(""));
+static cl::opt<bool>
+Fuse("clambc-fuse", cl::init(false),
+     cl::desc("Combine common instruction sequences into superinstructions "
+              "(only if the minimum functionality level allows it)"));
+static cl::opt<std::string>
+OpcodePairs("clambc-opcode-pairs",
+            cl::desc("Add the number of adjacent opcode pairs to a file"),
+            cl::value_desc("File to accumulate the counts in"), cl::init(""));
 static cl::opt<bool>
 DumpDI("clambc-dumpdi", cl::Hidden, cl::init(false),
        cl::desc("Dump LLVM IR with debug info to standard output"));
 
+// The functions written by the last compilation, for the statistics of the
+// driver.
+namespace {
+struct FunctionSize {
+  std::string Name;
+  unsigned Values;
+  unsigned Instructions;
+};
+}
+static std::vector<FunctionSize> FunctionSizes;
+
 class ClamBCWriter : public FunctionPass, public InstVisitor<ClamBCWriter> {
   typedef DenseMap<const BasicBlock*, unsigned> BBIDMap;
   BBIDMap BBMap;
@@ -70,9 +99,17 @@ class ClamBCWriter : public FunctionPass, public InstVisitor<ClamBCWriter> {
   const TargetData* TD;
   unsigned opcodecvt[Instruction::OtherOpsEnd];
   raw_ostream *MapOut;
+  bool EstimateCost;
+  ClamBCCostModel *Cost;
   FunctionPass *Dumper;
   ClamBCRegAlloc *RA;
   unsigned fid, minflvl;
+  bool fuse;
+  // Instructions written as a superinstruction, and the ones merged into it.
+  DenseMap<const Instruction*, unsigned> FusedOps;
+  SmallPtrSet<const Instruction*, 32> FusedAway;
+  unsigned LastOpcode;
+  DenseMap<unsigned, uint64_t> PairCounts;
   MetadataContext *TheMetadata;
   unsigned MDDbgKind;
   std::vector<unsigned> dbgInfo;
@@ -82,7 +119,7 @@ public:
   static char ID;
   explicit ClamBCWriter(ClamBCModule *module)
     : FunctionPass(&ID),
-      OModule(module), TheModule(0), TD(0), MapOut(0), Dumper(0) {
+      OModule(module), TheModule(0), TD(0), MapOut(0), Cost(0), Dumper(0) {
     if (!MapFile.empty()) {
       std::string ErrorInfo;
       MapOut = new raw_fd_ostream(MapFile.c_str(), ErrorInfo);
@@ -91,6 +128,7 @@ public:
         MapOut = 0;
       }
     }
+    EstimateCost = MapOut || !CostFile.empty();
   }
 
   ~ClamBCWriter() {
@@ -102,6 +140,10 @@ public:
 
   void getAnalysisUsage(AnalysisUsage &AU) const {
     AU.addRequiredID(ClamBCRegAllocID);
+    if (EstimateCost) {
+      AU.addRequired<LoopInfo>();
+      AU.addRequired<ScalarEvolution>();
+    }
     AU.setPreservesAll();
   }
 
@@ -118,6 +160,9 @@ public:
     assert(OModule->getFunctionID(&F) == fid);
     RA = &getAnalysis<ClamBCRegAlloc>();
     printFunction(F);
+    if (Cost)
+      Cost->addFunction(F, fid-1, RA, getAnalysis<LoopInfo>(),
+                        getAnalysis<ScalarEvolution>());
     if (Dumper)
       Dumper->runOnFunction(F);
     return false;
@@ -126,10 +171,26 @@ public:
   virtual bool doFinalization(Module &M) {
     printEOL();
     OModule->finished(M);
+    if (Cost) {
+      if (MapOut)
+        Cost->print(*MapOut);
+      if (!CostFile.empty()) {
+        std::string ErrorInfo;
+        raw_fd_ostream CostOut(CostFile.c_str(), ErrorInfo);
+        if (ErrorInfo.empty())
+          Cost->printJSON(CostOut);
+        else
+          errs() << "error opening costfile " << CostFile << ": " << ErrorInfo
+            << "\n";
+      }
+      delete Cost;
+    }
     if (MapOut) {
       OModule->dumpTypes(*MapOut);
       MapOut->flush();
     }
+    if (!OpcodePairs.empty())
+      writeOpcodePairs();
     delete TD;
     if (Dumper)
       delete Dumper;
@@ -146,6 +207,12 @@ private :
   void printEOL() {
     OModule->printEOL();
   }
+  void printOpcode(unsigned Opc) {
+    if (LastOpcode)
+      PairCounts[LastOpcode << 8 | Opc]++;
+    LastOpcode = Opc;
+    printFixedNumber(Opc, 2);
+  }
   void stop(const std::string &Msg, const llvm::Function *F) {
     ClamBCModule::stop(Msg, F);
   }
@@ -157,6 +224,9 @@ private :
   void printFunction(Function &);
   void printMapping(const Value *V, unsigned id, bool newline=false);
   void printBasicBlock(BasicBlock *BB);
+  void findSuperinstructions(BasicBlock *BB);
+  bool printSuperinstruction(Instruction &I);
+  void writeOpcodePairs();
 
   static const AllocaInst *isDirectAlloca(const Value *V) {
     const AllocaInst *AI = dyn_cast<AllocaInst>(V);
@@ -189,7 +259,7 @@ private :
 
     switch (ops) {
     case 1:
-      printFixedNumber(OP_BC_GEP1, 2);
+      printOpcode(OP_BC_GEP1);
       assert(!isa<GlobalVariable>(GEP.getOperand(0)) &&
              !isa<ConstantExpr>(GEP.getOperand(0)) &&
              "would hit libclamav interpreter bug");
@@ -205,7 +275,7 @@ private :
           assert(!isa<GlobalVariable>(GEP.getOperand(0)) &&
                  !isa<ConstantExpr>(GEP.getOperand(0)) &&
                  "would hit libclamav interpreter bug");
-	      printFixedNumber(OP_BC_GEPZ, 2);
+	      printOpcode(OP_BC_GEPZ);
 	      printType(GEP.getPointerOperand()->getType(), 0, &GEP);
 	      printOperand(GEP, GEP.getOperand(0));
 	      printOperand(GEP, GEP.getOperand(2));
@@ -223,7 +293,7 @@ private :
       // fall through
     default:
       stop("GEPN", &GEP);
-      printFixedNumber(OP_BC_GEPN, 2);
+      printOpcode(OP_BC_GEPN);
       // If needed we could use DecomposeGEPExpression here.
       if (ops >= 16)
         stop("GEP with more than 15 indices", &GEP);
@@ -243,12 +313,12 @@ private :
     // Checking is done by the verifier!
     Value *V = LI.getPointerOperand();
     if (isa<AllocaInst>(V) || isa<GlobalVariable>(V)) {
-      printFixedNumber(OP_BC_COPY, 2);
+      printOpcode(OP_BC_COPY);
       printOperand(LI, V);
       printOperand(LI, &LI);
       return;
     }
-    printFixedNumber(OP_BC_LOAD, 2);
+    printOpcode(OP_BC_LOAD);
     printOperand(LI, V);
   }
 
@@ -258,21 +328,21 @@ private :
     // checking is done by the verifier!
     if (isa<GetElementPtrInst>(V) ||
         isa<BitCastInst>(V)) {
-      printFixedNumber(OP_BC_STORE, 2);
+      printOpcode(OP_BC_STORE);
       printOperand(SI, SI.getOperand(0));
       printOperand(SI, V);
       return;
     }
     V = V->stripPointerCasts();
     if (isa<AllocaInst>(V) || isa<GlobalVariable>(V)) {
-      printFixedNumber(OP_BC_COPY, 2);
+      printOpcode(OP_BC_COPY);
       printOperand(SI, SI.getOperand(0));
       printOperand(SI, V);
       return;
     }
     // checking is done by the verifier!
     if (isa<GetElementPtrInst>(V)) {
-      printFixedNumber(OP_BC_STORE, 2);
+      printOpcode(OP_BC_STORE);
       printOperand(SI, SI.getOperand(0));
       printOperand(SI, V);
       return;
@@ -284,7 +354,7 @@ private :
   {
     if (BitCastInst *BCI = dyn_cast<BitCastInst>(&I)) {
       if (BCI->isLosslessCast()) {
-        printFixedNumber(OP_BC_GEPZ, 2);
+        printOpcode(OP_BC_GEPZ);
         printType(BCI->getOperand(0)->getType(), 0, BCI);
         printOperand(*BCI, BCI->getOperand(0));
         printNumber(0, true);
@@ -296,7 +366,7 @@ private :
     assert (!I.isLosslessCast());
     LLVMContext &C = I.getContext();
     if (isa<PtrToIntInst>(I) && I.getType() == Type::getInt64Ty(C)) {
-      printFixedNumber(OP_BC_PTRTOINT64, 2);
+      printOpcode(OP_BC_PTRTOINT64);
       printOperand(I, I.getOperand(0));
       return;
     }
@@ -322,7 +392,7 @@ private :
       stop("Instruction is not mapped", &I);
 
     assert(operand_counts[mapped] == n && "Operand count mismatch");
-    printFixedNumber(mapped, 2);
+    printOpcode(mapped);
     for (Instruction::op_iterator II=I.op_begin(),IE=I.op_end(); II != IE;
          ++II) {
       Value *V = *II;
@@ -342,13 +412,13 @@ private :
   void visitBranchInst(BranchInst &I)
   {
     if (I.isUnconditional()) {
-      printFixedNumber(OP_BC_JMP, 2);
+      printOpcode(OP_BC_JMP);
       printBasicBlockID(I.getSuccessor(0));
       return;
     }
 
     assert(I.getNumSuccessors() == 2);
-    printFixedNumber(OP_BC_BRANCH, 2);
+    printOpcode(OP_BC_BRANCH);
     printOperand(I, I.getCondition());
     printBasicBlockID(I.getSuccessor(0));
     printBasicBlockID(I.getSuccessor(1));
@@ -372,7 +442,7 @@ private :
         PtrToIntInst *L = dyn_cast<PtrToIntInst>(LI);
         PtrToIntInst *R = dyn_cast<PtrToIntInst>(RI);
         if (L && R && I.getType() == Type::getInt32Ty(C)) {
-          printFixedNumber(OP_BC_PTRDIFF32, 2);
+          printOpcode(OP_BC_PTRDIFF32);
           printOperand(I, L->getOperand(0));
           printOperand(I, R->getOperand(0));
           return;
@@ -385,7 +455,7 @@ private :
   {
     if (I.getNumOperands() == 0) {
       // special case ret of void
-      printFixedNumber(OP_BC_RET_VOID, 2);
+      printOpcode(OP_BC_RET_VOID);
       return;
     }
     HandleOpcodes(I, true);
@@ -393,7 +463,7 @@ private :
 
   void visitUnreachableInst(UnreachableInst &I)
   {
-    printFixedNumber(OP_BC_ABORT, 2);
+    printOpcode(OP_BC_ABORT);
     return;
   }
 
@@ -432,9 +502,9 @@ private :
     }
   }
 
-  void visitICmpInst(ICmpInst &I)
+  enum bc_opcode getICmpOpcode(ICmpInst &I)
   {
-    enum bc_opcode opc;
+    enum bc_opcode opc = OP_BC_INVALID;
     switch (I.getPredicate()) {
     case CmpInst::ICMP_EQ:
       opc = OP_BC_ICMP_EQ;
@@ -473,7 +543,12 @@ private :
     default:
       stop("Unsupported icmp predicate", &I);
     }
-    printFixedNumber(opc, 2);
+    return opc;
+  }
+
+  void visitICmpInst(ICmpInst &I)
+  {
+    printOpcode(getICmpOpcode(I));
     printType(I.getOperand(0)->getType());
     for (Instruction::op_iterator II=I.op_begin(),IE=I.op_end(); II != IE;
          ++II) {
@@ -510,17 +585,17 @@ private :
     switch (iid) {
     case Intrinsic::memset:
       assert(CI.getNumOperands() == 5);
-      printFixedNumber(OP_BC_MEMSET, 2);
+      printOpcode(OP_BC_MEMSET);
       numop = 3;
       break;
     case Intrinsic::memcpy:
       assert(CI.getNumOperands() == 5);
-      printFixedNumber(OP_BC_MEMCPY, 2);
+      printOpcode(OP_BC_MEMCPY);
       numop = 3;
       break;
     case Intrinsic::memmove:
       assert(CI.getNumOperands() == 5);
-      printFixedNumber(OP_BC_MEMMOVE, 2);
+      printOpcode(OP_BC_MEMMOVE);
       numop = 3;
       break;
     case Intrinsic::bswap:
@@ -528,13 +603,13 @@ private :
       numop = 1;
       switch (CI.getType()->getPrimitiveSizeInBits()) {
       case 16:
-        printFixedNumber(OP_BC_BSWAP16, 2);
+        printOpcode(OP_BC_BSWAP16);
         break;
       case 32:
-        printFixedNumber(OP_BC_BSWAP32, 2);
+        printOpcode(OP_BC_BSWAP32);
         break;
       case 64:
-        printFixedNumber(OP_BC_BSWAP64, 2);
+        printOpcode(OP_BC_BSWAP64);
         break;
       default:
         stop("Unsupported bswap bitwidth", &CI);
@@ -559,11 +634,11 @@ private :
       stop("Calls to vararg functions are not supported!", &CI);
     }
     if (F->isDeclaration() && F->getName().equals("__is_bigendian")) {
-      printFixedNumber(OP_BC_ISBIGENDIAN, 2);
+      printOpcode(OP_BC_ISBIGENDIAN);
       return;
     }
     if (F->isDeclaration() && F->getName().equals("abort")) {
-      printFixedNumber(OP_BC_ABORT, 2);
+      printOpcode(OP_BC_ABORT);
       return;
     }
     const AttrListPtr &Attrs = CI.getAttributes();
@@ -580,19 +655,19 @@ private :
     }
     if (F->isDeclaration()) {
       if (F->getName().equals("memcmp")) {
-        printFixedNumber(OP_BC_MEMCMP, 2);
+        printOpcode(OP_BC_MEMCMP);
         printOperand(CI, CI.getOperand(1));
         printOperand(CI, CI.getOperand(2));
         printOperand(CI, CI.getOperand(3));
         return;
       }
       unsigned id = OModule->getExternalID(F);
-      printFixedNumber(OP_BC_CALL_API, 2);
+      printOpcode(OP_BC_CALL_API);
       // API calls can have max 15 args
       printFixedNumber(F->arg_size(), 1);
       printNumber(id);
     } else {
-      printFixedNumber(OP_BC_CALL_DIRECT, 2);
+      printOpcode(OP_BC_CALL_DIRECT);
       if (F->arg_size() > 255)
         stop("Calls can have max 15 parameters", &CI);
       printFixedNumber(F->arg_size(), 1);
@@ -633,8 +708,11 @@ bool ClamBCWriter::doInitialization(Module &M) {
   opcodecvt[Instruction::Ret] = OP_BC_RET;
   opcodecvt[Instruction::Select] = OP_BC_SELECT;
   TheModule = &M;
+  FunctionSizes.clear();
 
   TD = new TargetData(&M);
+  if (EstimateCost)
+    Cost = new ClamBCCostModel(TD);
 
   /* extract minimum flevel from lsig (used for BC_OP_ICMP_SLE check) */
   NamedMDNode *Node = M.getNamedMetadata("clambc.logicalsignature");
@@ -650,10 +728,28 @@ bool ClamBCWriter::doInitialization(Module &M) {
       minflvl = 0;
   }
 
+  /* superinstructions need an engine that knows them, engines older than
+   * the bytecode's minimum functionality level don't load it */
+  unsigned minfunc = minflvl;
+  if (NamedMDNode *MinFunc = M.getNamedMetadata("clambc.funcmin")) {
+    unsigned v = cast<ConstantInt>(MinFunc->getOperand(0)->getOperand(0))->
+      getZExtValue();
+    minfunc = std::max(minfunc, v);
+  }
+  fuse = Fuse && minfunc >= FUNC_LEVEL_100;
+  LastOpcode = 0;
+
   if (DumpDI)
     Dumper = createDbgInfoPrinterPass();
   fid = 0;
   OModule->writeGlobalMap(MapOut);
+  // Selectivity of the subsignatures, see ClamBCLogicalCompiler.
+  NamedMDNode *Scores = M.getNamedMetadata("clambc.subsignatures");
+  if (MapOut && Scores) {
+    for (unsigned i=0;i<Scores->getNumOperands();i++)
+      *MapOut << cast<MDString>(Scores->getOperand(i)->getOperand(0))->
+        getString() << "\n";
+  }
   MDDbgKind = M.getContext().getMDKindID("dbg");
   return false;
 }
@@ -743,6 +839,13 @@ void ClamBCWriter::printFunction(Function &F) {
     printFixedNumber(isa<AllocaInst>(V), 1);
   }
 
+  FusedOps.clear();
+  FusedAway.clear();
+  if (fuse) {
+    for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB)
+      findSuperinstructions(BB);
+  }
+
   OModule->printOne('F');
   unsigned instructions=0;
   for(inst_iterator II=inst_begin(F),IE=inst_end(F); II != IE; ++II) {
@@ -751,9 +854,13 @@ void ClamBCWriter::printFunction(Function &F) {
     if (!isa<TerminatorInst>(&*II) && RA->skipInstruction(&*II)) {
       continue;
     }
+    if (FusedAway.count(&*II))
+      continue;
     instructions++;
   }
   printNumber(instructions);
+  FunctionSize Size = { F.getName(), id - F.arg_size(), instructions };
+  FunctionSizes.push_back(Size);
 
   id = 0;// entry BB gets ID 0, because it can have no predecessors
   for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
@@ -778,9 +885,216 @@ void ClamBCWriter::printFunction(Function &F) {
   }
 }
 
+// Superinstructions replace a sequence of adjacent instructions in a block,
+// where all but the last one only have a single use in the sequence. The last
+// instruction is written as the superinstruction, the others are not written
+// at all, their value IDs just stay unused.
+void ClamBCWriter::findSuperinstructions(BasicBlock *BB)
+{
+  SmallVector<Instruction*, 32> Written;
+  for (BasicBlock::iterator II = BB->begin(), E = BB->end(); II != E; ++II) {
+    if (isa<AllocaInst>(II) || isa<DbgInfoIntrinsic>(II))
+      continue;
+    if (!isa<TerminatorInst>(II) && RA->skipInstruction(&*II))
+      continue;
+    Written.push_back(&*II);
+  }
+
+  for (unsigned i=1;i<Written.size();i++) {
+    Instruction *I = Written[i];
+    Instruction *Prev = Written[i-1];
+    if (BranchInst *BI = dyn_cast<BranchInst>(I)) {
+      // icmp + br, the copies into PHI slots in between are moved before the
+      // compare, unless they overwrite one of its operands.
+      ICmpInst *ICI = BI->isConditional() ?
+        dyn_cast<ICmpInst>(BI->getCondition()) : 0;
+      if (!ICI || ICI->getParent() != BB || !ICI->hasOneUse() ||
+          FusedOps.count(ICI) || FusedAway.count(ICI))
+        continue;
+      unsigned j = i-1;
+      for (;j > 0 && Written[j] != ICI; j--) {
+        StoreInst *SI = dyn_cast<StoreInst>(Written[j]);
+        Value *Ptr = SI ? SI->getPointerOperand()->stripPointerCasts() : 0;
+        if (!Ptr || !isa<AllocaInst>(Ptr) || FusedOps.count(SI))
+          break;
+        unsigned id = RA->getValueID(Ptr);
+        if ((!isa<Constant>(ICI->getOperand(0)) &&
+             id == RA->getValueID(ICI->getOperand(0))) ||
+            (!isa<Constant>(ICI->getOperand(1)) &&
+             id == RA->getValueID(ICI->getOperand(1))))
+          break;
+      }
+      if (Written[j] != ICI)
+        continue;
+      FusedOps[I] = OP_BC_ICMP_BRANCH;
+      FusedAway.insert(ICI);
+      continue;
+    }
+    if (FusedOps.count(Prev) || FusedAway.count(Prev) || !Prev->hasOneUse())
+      continue;
+    unsigned Opc = 0;
+    if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
+      // gep1 + load
+      GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(Prev);
+      if (GEP && LI->getPointerOperand() == GEP && !LI->isVolatile() &&
+          GEP->getNumIndices() == 1 &&
+          !isa<Constant>(GEP->getPointerOperand()) &&
+          OModule->getTypeID(GEP->getPointerOperand()->getType()) <= 65)
+        Opc = OP_BC_GEP1_LOAD;
+    } else if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
+      // load + add + store to the same pointer, for counters
+      Value *Ptr = SI->getPointerOperand();
+      LoadInst *LI = i > 1 ? dyn_cast<LoadInst>(Written[i-2]) : 0;
+      if (LI && SI->getOperand(0) == Prev && !SI->isVolatile() &&
+          Prev->getOpcode() == Instruction::Add &&
+          (isa<GetElementPtrInst>(Ptr) || isa<BitCastInst>(Ptr)) &&
+          !FusedOps.count(LI) && !FusedAway.count(LI) && LI->hasOneUse() &&
+          !LI->isVolatile() && LI->getPointerOperand() == Ptr &&
+          (Prev->getOperand(0) == LI || Prev->getOperand(1) == LI)) {
+        FusedAway.insert(LI);
+        Opc = OP_BC_LOAD_ADD_STORE;
+      }
+    } else if (ICmpInst *ICI = dyn_cast<ICmpInst>(I)) {
+      // memcmp + icmp eq/ne 0
+      CallInst *CI = dyn_cast<CallInst>(Prev);
+      Function *Callee = CI ? CI->getCalledFunction() : 0;
+      if (ICI->getOperand(0) != Prev && ICI->getOperand(1) != Prev)
+        continue;
+      Value *Other = ICI->getOperand(ICI->getOperand(0) == Prev ? 1 : 0);
+      if (Callee && Callee->isDeclaration() &&
+          Callee->getName().equals("memcmp") && ICI->isEquality() &&
+          isa<Constant>(Other) && cast<Constant>(Other)->isNullValue())
+        Opc = ICI->getPredicate() == CmpInst::ICMP_EQ ?
+          OP_BC_MEMCMP_EQ : OP_BC_MEMCMP_NE;
+    }
+    if (!Opc)
+      continue;
+    FusedOps[I] = Opc;
+    FusedAway.insert(Prev);
+  }
+}
+
+bool ClamBCWriter::printSuperinstruction(Instruction &I)
+{
+  unsigned Opc = FusedOps.lookup(&I);
+  if (!Opc)
+    return false;
+  printOpcode(Opc);
+  switch (Opc) {
+  case OP_BC_ICMP_BRANCH:
+    {
+      BranchInst &BI = cast<BranchInst>(I);
+      ICmpInst *ICI = cast<ICmpInst>(BI.getCondition());
+      printFixedNumber(getICmpOpcode(*ICI), 2);
+      printType(ICI->getOperand(0)->getType());
+      printOperand(*ICI, ICI->getOperand(0));
+      printOperand(*ICI, ICI->getOperand(1));
+      printBasicBlockID(BI.getSuccessor(0));
+      printBasicBlockID(BI.getSuccessor(1));
+      break;
+    }
+  case OP_BC_GEP1_LOAD:
+    {
+      GetElementPtrInst *GEP =
+        cast<GetElementPtrInst>(cast<LoadInst>(I).getPointerOperand());
+      printType(GEP->getPointerOperand()->getType(), 0, GEP);
+      printOperand(*GEP, GEP->getOperand(0));
+      printOperand(*GEP, GEP->getOperand(1));
+      break;
+    }
+  case OP_BC_LOAD_ADD_STORE:
+    {
+      StoreInst &SI = cast<StoreInst>(I);
+      Instruction *Add = cast<Instruction>(SI.getOperand(0));
+      bool LoadFirst = isa<LoadInst>(Add->getOperand(0)) &&
+        FusedAway.count(cast<LoadInst>(Add->getOperand(0)));
+      printOperand(SI, SI.getPointerOperand());
+      printOperand(*Add, Add->getOperand(LoadFirst ? 1 : 0));
+      break;
+    }
+  case OP_BC_MEMCMP_EQ:
+  case OP_BC_MEMCMP_NE:
+    {
+      CallInst *CI = dyn_cast<CallInst>(I.getOperand(0));
+      if (!CI)
+        CI = cast<CallInst>(I.getOperand(1));
+      for (unsigned i=1;i<4;i++)
+        printOperand(*CI, CI->getOperand(i));
+      break;
+    }
+  default:
+    llvm_unreachable("unknown superinstruction");
+  }
+  return true;
+}
+
+static const char *const OpcodeNames[] = {
+  "",
+  "ADD", "SUB", "MUL", "UDIV", "SDIV", "UREM", "SREM", "SHL", "LSHR", "ASHR",
+  "AND", "OR", "XOR",
+  "TRUNC", "SEXT", "ZEXT",
+  "BRANCH", "JMP", "RET", "RET_VOID",
+  "ICMP_EQ", "ICMP_NE", "ICMP_UGT", "ICMP_UGE", "ICMP_ULT", "ICMP_ULE",
+  "ICMP_SGT", "ICMP_SGE", "ICMP_SLE", "ICMP_SLT",
+  "SELECT", "CALL_DIRECT", "CALL_API", "COPY", "GEP1", "GEPZ", "GEPN",
+  "STORE", "LOAD", "MEMSET", "MEMCPY", "MEMMOVE", "MEMCMP", "ISBIGENDIAN",
+  "ABORT", "BSWAP16", "BSWAP32", "BSWAP64", "PTRDIFF32", "PTRTOINT64",
+  "ICMP_BRANCH", "GEP1_LOAD", "LOAD_ADD_STORE", "MEMCMP_EQ", "MEMCMP_NE"
+};
+
+static bool comparePairCount(const std::pair<std::string, uint64_t> &A,
+                             const std::pair<std::string, uint64_t> &B)
+{
+  if (A.second != B.second)
+    return A.second > B.second;
+  return A.first < B.first;
+}
+
+// The file has a line for each pair: its count, then the two opcodes. The
+// counts of this module are added to the ones already in the file, so that it
+// can be used to collect statistics for many compilations.
+void ClamBCWriter::writeOpcodePairs()
+{
+  assert(sizeof(OpcodeNames)/sizeof(OpcodeNames[0]) == OP_BC_INVALID &&
+         "opcode names out of sync");
+  std::map<std::string, uint64_t> Counts;
+  if (MemoryBuffer *Old = MemoryBuffer::getFile(OpcodePairs.c_str())) {
+    StringRef Rest = Old->getBuffer();
+    while (!Rest.empty()) {
+      std::pair<StringRef, StringRef> Line = Rest.split('\n');
+      Rest = Line.second;
+      std::pair<StringRef, StringRef> F = Line.first.split(' ');
+      unsigned long long N;
+      if (F.second.empty() || F.first.getAsInteger(10, N))
+        continue;
+      Counts[F.second.str()] += N;
+    }
+    delete Old;
+  }
+  for (DenseMap<unsigned, uint64_t>::iterator I=PairCounts.begin(),
+       E=PairCounts.end(); I != E; ++I) {
+    std::string Pair = std::string(OpcodeNames[I->first >> 8]) + " " +
+      OpcodeNames[I->first & 0xff];
+    Counts[Pair] += I->second;
+  }
+
+  std::vector<std::pair<std::string, uint64_t> > Sorted(Counts.begin(),
+                                                        Counts.end());
+  std::sort(Sorted.begin(), Sorted.end(), comparePairCount);
+  std::string ErrorInfo;
+  raw_fd_ostream Out(OpcodePairs.c_str(), ErrorInfo);
+  if (!ErrorInfo.empty()) {
+    errs() << "error opening " << OpcodePairs << ": " << ErrorInfo << "\n";
+    return;
+  }
+  for (unsigned i=0;i<Sorted.size();i++)
+    Out << Sorted[i].second << " " << Sorted[i].first << "\n";
+}
+
 void ClamBCWriter::printBasicBlock(BasicBlock *BB) {
   printEOL();
   OModule->printOne('B');
+  LastOpcode = 0;
 
   for (BasicBlock::iterator II = BB->begin(), E = --BB->end(); II != E;
        ++II) {
@@ -788,7 +1102,7 @@ void ClamBCWriter::printBasicBlock(BasicBlock *BB) {
       continue;
     if (isInlineAsm(*II))
       stop("Inline assembly is not allowed", II);
-    if (RA->skipInstruction(&*II))
+    if (RA->skipInstruction(&*II) || FusedAway.count(&*II))
       continue;
     const Type *Ty = II->getType();
     if (StoreInst *SI = dyn_cast<StoreInst>(II)) {
@@ -800,7 +1114,8 @@ void ClamBCWriter::printBasicBlock(BasicBlock *BB) {
       printNumber(RA->getValueID(&*II));
     else
       printNumber(0);
-    visit(*II);
+    if (!printSuperinstruction(*II))
+      visit(*II);
     if (OModule->hasDbgIds() && MDDbgKind) {
       MDNode *Dbg = II->getMetadata(MDDbgKind);
       if (Dbg) {
@@ -813,7 +1128,8 @@ void ClamBCWriter::printBasicBlock(BasicBlock *BB) {
   }
 
   OModule->printOne('T');
-  visit(*BB->getTerminator());
+  if (!printSuperinstruction(*BB->getTerminator()))
+    visit(*BB->getTerminator());
   if (OModule->hasDbgIds() && MDDbgKind) {
     MDNode *Dbg = BB->getTerminator()->getMetadata(MDDbgKind);
     if (Dbg) {
@@ -829,3 +1145,20 @@ llvm::FunctionPass *createClamBCWriter(ClamBCModule *module)
 {
   return new ClamBCWriter(module);
 }
+
+// Writes the number of values and instructions of each function written by
+// the last compilation, as a JSON array.
+extern "C" void ClamBCPrintFunctionSizes(raw_ostream *Out)
+{
+  *Out << "[";
+  for (unsigned i=0;i<FunctionSizes.size();i++) {
+    const FunctionSize &S = FunctionSizes[i];
+    if (i)
+      *Out << ", ";
+    *Out << "{\"name\": \"";
+    Out->write_escaped(S.Name);
+    *Out << "\", \"values\": " << S.Values << ", \"instructions\": "
+      << S.Instructions << "}";
+  }
+  *Out << "]";
+}
@@ -90,6 +90,12 @@ enum bc_opcode {
   OP_BC_BSWAP64,
   OP_BC_PTRDIFF32,
   OP_BC_PTRTOINT64,
+  /* superinstructions, written only for FUNC_LEVEL_100 and later */
+  OP_BC_ICMP_BRANCH,
+  OP_BC_GEP1_LOAD,
+  OP_BC_LOAD_ADD_STORE,
+  OP_BC_MEMCMP_EQ,
+  OP_BC_MEMCMP_NE,
   OP_BC_INVALID /* last */
 };
 
@@ -116,7 +122,11 @@ static const unsigned char operand_counts[] = {
   /* OP_BC_ISBIGENDIAN */
   0,
   /* OP_BC_ABORT, OP_BSWAP*, OP_PTRDIFF32, OP_PTRINT64 */
-  0, 1, 1, 1, 2, 1
+  0, 1, 1, 1, 2, 1,
+  /* OP_BC_ICMP_BRANCH has the icmp opcode before its operands */
+  4,
+  /* OP_BC_GEP1_LOAD, OP_BC_LOAD_ADD_STORE, OP_BC_MEMCMP_EQ, OP_BC_MEMCMP_NE */
+  3, 2, 3, 3
 };
 
 enum bc_global {
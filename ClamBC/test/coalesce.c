@@ -0,0 +1,51 @@
+// RUN: clambc-compiler %s -O2 -o %t1 -- -clambc-map=%t1.map
+// RUN: FileCheck %s -check-prefix=MAP < %t1.map
+// RUN: clambc-run -bytecode-debug %t1 %s |& FileCheck %s -check-prefix=OUT
+// RUN: clambc-compiler %s -O2 -o %t2 -- -clambc-map=%t2.map -clambc-no-coalesce
+// RUN: FileCheck %s -check-prefix=NOCOALESCE < %t2.map
+// RUN: clambc-run -bytecode-debug %t2 %s |& FileCheck %s -check-prefix=OUT
+
+// Values with disjoint live ranges share a value ID, values that are live at
+// the same time don't, and the result is the same as without coalescing.
+
+// MAP: Function 0: entrypoint
+// MAP: Value id 12:
+// MAP-NOT: Value id 13:
+// MAP: Cost of function 0
+// NOCOALESCE: Function 0: entrypoint
+// NOCOALESCE: Value id 53:
+// NOCOALESCE: Cost of function 0
+
+#define PRINT(x) do {\
+  debug_print_str_start("value ", 6);\
+  debug_print_uint(x);\
+  debug_print_str_nonl("\n", 1);\
+} while (0)
+
+int entrypoint(void)
+{
+  uint8_t buf[16];
+  uint32_t a, b, c, d, s;
+  unsigned i;
+  if (read(buf, 16) != 16)
+    return 0;
+  // a is dead when b is defined
+  a = buf[0] * 3 + buf[1];
+  // OUT: value 188
+  PRINT(a);
+  b = buf[2] * 5 + buf[3];
+  // OUT: value 242
+  PRINT(b);
+  // c and d are live at the same time
+  c = buf[4] + 7;
+  d = buf[5] ^ 0x55;
+  // OUT: value 2549
+  PRINT(c * d + c - d);
+  // s is a PHI, that is turned into stores to an alloca
+  s = 0;
+  for (i=0;i<16;i++)
+    s = s*31 + buf[i];
+  // OUT: value 2156322109
+  PRINT(s);
+  return 0;
+}
@@ -0,0 +1,18 @@
+// RUN: clambc-compiler %s -O2 -g -o %t -- -clambc-count-blocks -clambc-count-map=%t.map
+// RUN: not clambc-run -q %t %s -count-map=%t.map -profile-out=%t.profile
+// RUN: FileCheck %s < %t.profile
+
+// The access is out of bounds on this file, the counters of the blocks that
+// ran before the abort are still written.
+// CHECK: {{^}}1 {{.*}}count-blocks-abort.c:13
+// CHECK: {{^}}1 {{.*}}count-blocks-abort.c:15
+int entrypoint(void)
+{
+  uint8_t buf[10];
+  unsigned i;
+  if (read(buf, 10) != 10)
+    return 0;
+  i = buf[3];
+  debug_print_uint(buf[i]);
+  return 0;
+}
@@ -0,0 +1,92 @@
+// RUN: clambc-compiler %s -O2 -o %t
+// RUN: FileCheck %s < %t
+// RUN: not clambc-compiler %s -O2 -o %t.noopt -- -clambc-lsig-optimize=0 |& FileCheck %s -check-prefix=NOOPT
+VIRUSNAME_PREFIX("Test.Many")
+VIRUSNAMES("")
+TARGET(0)
+
+SIGNATURES_DECL_BEGIN
+DECLARE_SIGNATURE(p0)
+DECLARE_SIGNATURE(p1)
+DECLARE_SIGNATURE(p2)
+DECLARE_SIGNATURE(s0)
+DECLARE_SIGNATURE(s1)
+DECLARE_SIGNATURE(s2)
+DECLARE_SIGNATURE(s3)
+DECLARE_SIGNATURE(s4)
+DECLARE_SIGNATURE(s5)
+DECLARE_SIGNATURE(s6)
+DECLARE_SIGNATURE(s7)
+DECLARE_SIGNATURE(s8)
+DECLARE_SIGNATURE(s9)
+DECLARE_SIGNATURE(s10)
+DECLARE_SIGNATURE(s11)
+DECLARE_SIGNATURE(s12)
+DECLARE_SIGNATURE(s13)
+DECLARE_SIGNATURE(s14)
+DECLARE_SIGNATURE(s15)
+DECLARE_SIGNATURE(s16)
+DECLARE_SIGNATURE(s17)
+DECLARE_SIGNATURE(s18)
+DECLARE_SIGNATURE(s19)
+DECLARE_SIGNATURE(s20)
+DECLARE_SIGNATURE(s21)
+DECLARE_SIGNATURE(s22)
+DECLARE_SIGNATURE(s23)
+SIGNATURES_DECL_END
+
+SIGNATURES_DEF_BEGIN
+DEFINE_SIGNATURE(p0, "4d5a900000112233445566778899aabbccddee")
+DEFINE_SIGNATURE(p1, "4d5a900001112233445566778899aabbccddee")
+DEFINE_SIGNATURE(p2, "4d5a900002112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s0, "5045000000112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s1, "5045000001112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s2, "5045000002112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s3, "5045000003112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s4, "5045000004112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s5, "5045000005112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s6, "5045000006112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s7, "5045000007112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s8, "5045000008112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s9, "5045000009112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s10, "504500000a112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s11, "504500000b112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s12, "504500000c112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s13, "504500000d112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s14, "504500000e112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s15, "504500000f112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s16, "5045000010112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s17, "5045000011112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s18, "5045000012112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s19, "5045000013112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s20, "5045000014112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s21, "5045000015112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s22, "5045000016112233445566778899aabbccddee")
+DEFINE_SIGNATURE(s23, "5045000017112233445566778899aabbccddee")
+SIGNATURES_END
+
+// Each of the 3 prefixes followed by any of the 24 suffixes: the 72 (p&s)
+// terms need 188 subexpressions, more than the 64 libclamav allows, until
+// the common operands are factored out.
+// CHECK: Test.Many.{};Engine:{{[0-9]+}}-255,Target:0;((0|1|2)&(3|4|5|6|7|8|9|10|11|12|13|14|15|16|17|18|19|20|21|22|23|24|25|26));
+// NOOPT: a maximum of 64 subexpressions are supported, but logical signature has 188 groups
+#define M(s) matches(Signatures.s)
+#define SUFFIX(p) \
+  (M(p) && M(s0)) || (M(p) && M(s1)) || (M(p) && M(s2)) || \
+  (M(p) && M(s3)) || (M(p) && M(s4)) || (M(p) && M(s5)) || \
+  (M(p) && M(s6)) || (M(p) && M(s7)) || (M(p) && M(s8)) || \
+  (M(p) && M(s9)) || (M(p) && M(s10)) || (M(p) && M(s11)) || \
+  (M(p) && M(s12)) || (M(p) && M(s13)) || (M(p) && M(s14)) || \
+  (M(p) && M(s15)) || (M(p) && M(s16)) || (M(p) && M(s17)) || \
+  (M(p) && M(s18)) || (M(p) && M(s19)) || (M(p) && M(s20)) || \
+  (M(p) && M(s21)) || (M(p) && M(s22)) || (M(p) && M(s23))
+bool logical_trigger(void)
+{
+  return SUFFIX(p0) || SUFFIX(p1) || SUFFIX(p2);
+}
+
+int entrypoint(void)
+{
+  foundVirus("");
+  return 0;
+}
@@ -0,0 +1,75 @@
+// RUN: clambc-compiler %s -O2 -o %t.absorb -DABSORB
+// RUN: FileCheck %s -check-prefix=ABSORB < %t.absorb
+// RUN: clambc-compiler %s -O2 -o %t.range -DRANGE
+// RUN: FileCheck %s -check-prefix=RANGE < %t.range
+// RUN: clambc-compiler %s -O2 -o %t.propagate -DPROPAGATE
+// RUN: FileCheck %s -check-prefix=PROPAGATE < %t.propagate
+// RUN: clambc-compiler %s -O2 -o %t.factor -DFACTOR
+// RUN: FileCheck %s -check-prefix=FACTOR < %t.factor
+// RUN: clambc-compiler %s -O2 -o %t.order -DORDER
+// RUN: FileCheck %s -check-prefix=ORDER < %t.order
+// RUN: clambc-compiler %s -O2 -o %t.swap -DORDER -DSWAP
+// RUN: FileCheck %s -check-prefix=ORDER < %t.swap
+VIRUSNAME_PREFIX("Test.Lsig")
+VIRUSNAMES("")
+TARGET(0)
+
+SIGNATURES_DECL_BEGIN
+DECLARE_SIGNATURE(a)
+DECLARE_SIGNATURE(b)
+DECLARE_SIGNATURE(c)
+SIGNATURES_DECL_END
+
+SIGNATURES_DEF_BEGIN
+DEFINE_SIGNATURE(a, "00112233445566778899aabbccddeeff")
+DEFINE_SIGNATURE(b, "102132435465768798a9bacbdcedfe0f")
+DEFINE_SIGNATURE(c, "2031425364758697a8b9cadbecfd0e1f")
+SIGNATURES_END
+
+// (0|1|2)&0 loses the operand implied by the other one.
+// ABSORB: Test.Lsig.{};Engine:{{[0-9]+}}-255,Target:0;0;
+// Comparisons of the same count are intersected.
+// RANGE: Test.Lsig.{};Engine:{{[0-9]+}}-255,Target:0;((0>2)&(0<5));
+// 0>2 is assumed in the other operands: 0<2 becomes false and 0>1 true.
+// PROPAGATE: Test.Lsig.{};Engine:{{[0-9]+}}-255,Target:0;((0>2)&(1>1));
+// (0&1)|(0&2) needs fewer subexpressions with 0 factored out.
+// FACTOR: Test.Lsig.{};Engine:{{[0-9]+}}-255,Target:0;(0&(1|2));
+// Operands that only differ in the number of different subsignatures are
+// ordered the same way whatever order the source has them in.
+// ORDER: Test.Lsig.{};Engine:{{[0-9]+}}-255,Target:0;(((1|2)=2,2)|((0|1)=2));
+bool logical_trigger(void)
+{
+  unsigned a = count_match(Signatures.a);
+#if defined(RANGE)
+  return a > 1 && a < 5 && a > 2;
+#else
+  unsigned b = count_match(Signatures.b), c = count_match(Signatures.c);
+#if defined(ABSORB)
+  return (a || b || c) && a;
+#elif defined(PROPAGATE)
+  return a > 2 && (a < 2 || b > 1) && (a > 1 || c);
+#elif defined(FACTOR)
+  return (a && b) || (a && c);
+#else
+  unsigned mb = matches(Signatures.b), mc = matches(Signatures.c);
+#ifdef SWAP
+  if (b + c == 2 && mb + mc == 2)
+    return true;
+  if (a + b == 2)
+    return true;
+#else
+  if (a + b == 2)
+    return true;
+  if (b + c == 2 && mb + mc == 2)
+    return true;
+#endif
+  return false;
+#endif
+#endif
+}
+
+int entrypoint(void)
+{
+  foundVirus("");
+  return 0;
+}
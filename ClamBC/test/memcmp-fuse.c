@@ -0,0 +1,35 @@
+// RUN: rm -f %t.pairs
+// RUN: clambc-compiler %s -O2 -o %t -- -clambc-fuse -clambc-opcode-pairs=%t.pairs
+// RUN: FileCheck %s < %t.pairs
+// RUN: clambc-compiler %s -O2 -o %t.nofuse
+// RUN: clambc-run -bytecode-debug %t %s |& FileCheck %s -check-prefix=OUT
+// RUN: clambc-run -bytecode-debug %t.nofuse %s |& FileCheck %s -check-prefix=OUT
+VIRUSNAME_PREFIX("Test.Fuse")
+VIRUSNAMES("")
+FUNCTIONALITY_LEVEL_MIN(FUNC_LEVEL_100);
+
+// The first memcmp is fused with the compare of its result. The second one
+// is followed by a compare of something else with 0, that is not fused.
+
+// CHECK: 1 MEMCMP ICMP_EQ
+// CHECK: 1 MEMCMP_EQ BRANCH
+
+// OUT: match
+// OUT: value 1
+
+int entrypoint(void)
+{
+  uint8_t hdr[8];
+  unsigned n;
+  int r;
+  n = read(hdr, 8);
+  if (memcmp(hdr, "// RU", 5) == 0)
+    debug_print_str_start("match\n", 6);
+  debug_print_str_start("value ", 6);
+  r = memcmp(hdr, "// RUM", 6);
+  debug_print_uint((n == 0) + r);
+  debug_print_str_nonl("\n", 1);
+  if (r == 42)
+    foundVirus("");
+  return 0;
+}
@@ -0,0 +1,31 @@
+// RUN: clambc-compiler %s -O2 -o %t -- -clambc-prefilter
+// RUN: FileCheck %s < %t
+// RUN: clambc-compiler %s -O2 -o %t.ne -DCHECK_NE -- -clambc-prefilter
+// RUN: FileCheck %s < %t.ne
+// RUN: clambc-compiler %s -O2 -o %t.unchecked -DUNCHECKED -- -clambc-prefilter
+// RUN: FileCheck %s -check-prefix=NONE < %t.unchecked
+// RUN: clambc-compiler %s -O2 -o %t.default
+// RUN: FileCheck %s -check-prefix=NONE < %t.default
+VIRUSNAME_PREFIX("Test.Prefilter")
+VIRUSNAMES("")
+
+// The checks of the magic become the logical signature, but only if the
+// result of the read is checked too: after a short read the buffer doesn't
+// hold the file. The prefilter is only generated with -clambc-prefilter.
+// CHECK: Test.Prefilter.{};Engine:{{[0-9]+}}-255,Target:0;0;0:4d5a
+// NONE: {{^}}Test.Prefilter.{}{{$}}
+int entrypoint(void)
+{
+  uint8_t buf[4];
+#if defined(UNCHECKED)
+  read(buf, 4);
+  if (buf[0] != 'M' || buf[1] != 'Z')
+#elif defined(CHECK_NE)
+  if (read(buf, 4) != 4 || buf[0] != 'M' || buf[1] != 'Z')
+#else
+  if (read(buf, 4) < 4 || buf[0] != 'M' || buf[1] != 'Z')
+#endif
+    return 0;
+  foundVirus("");
+  return 0;
+}
@@ -0,0 +1,26 @@
+// RUN: clambc-compiler %s -O2 -g -o %t -- -clambc-count-blocks -clambc-count-map=%t.map
+// RUN: clambc-run -q %t %s %s -count-map=%t.map -profile-out=%t.profile
+// RUN: FileCheck %s < %t.profile
+// RUN: count 4 < %t.profile
+// RUN: clambc-compiler %s -O2 -o %t.pgo -- -clambc-profile-use=%t.profile
+// RUN: not clambc-run -q %t %s -profile-out=%t.profile |& FileCheck %s -check-prefix=NOMAP
+
+// The counters of both runs are added up, and the profile lists the lines
+// where executed blocks start: the loop body is two blocks that run 32 times
+// per run. The early return is never executed.
+// CHECK: {{^}}2 {{.*}}profile-out.c:19
+// CHECK-NEXT: {{^}}2 {{.*}}profile-out.c:22
+// CHECK-NEXT: {{^}}128 {{.*}}profile-out.c:23
+// CHECK-NEXT: {{^}}2 {{.*}}profile-out.c:24
+// NOMAP: -profile-out needs the counter map, use -count-map
+int entrypoint(void)
+{
+  uint8_t buf[10];
+  if (read(buf, 10) != 10)
+    return 0;
+  unsigned i, s = 0;
+  for (i = 0; i < buf[2]; i++)
+    s = s * 31 + buf[i % 10];
+  debug_print_uint(s);
+  return 0;
+}
@@ -0,0 +1,37 @@
+// RUN: clambc-compiler %s -O2 -o %t -- -clambc-dumpir | llvm-dis | FileCheck %s
+// RUN: clambc-compiler %s -O2 -o %t.noopt -- -clambc-no-rtcheck-opt
+// RUN: clambc-run -bytecode-debug %t %s |& FileCheck %s -check-prefix=OUT
+// RUN: clambc-run -bytecode-debug %t.noopt %s |& FileCheck %s -check-prefix=OUT
+
+// The loop may exit before it accesses buf[j], so the check can't be moved
+// to the preheader. buf[j] is accessed only if j < 64 and the check is
+// removed, without making a copy of the loop.
+
+// CHECK: define i32 @entrypoint
+// CHECK-NOT: rterr.trig
+// CHECK-NOT: nocheck
+// CHECK: {{^}}}
+
+// OUT: value 16
+// OUT: value 54
+
+int entrypoint(void)
+{
+  uint8_t hdr[8];
+  uint8_t buf[64];
+  unsigned j;
+  if (read(hdr, 8) != 8 || read(buf, 64) != 64)
+    return 0;
+  for (j = 0; j < 64; j++) {
+    if (buf[j] == '%')
+      break;
+    buf[j] ^= 0x55;
+  }
+  debug_print_str_start("value ", 6);
+  debug_print_uint(j);
+  debug_print_str_nonl("\n", 1);
+  debug_print_str_start("value ", 6);
+  debug_print_uint(buf[0]);
+  debug_print_str_nonl("\n", 1);
+  return 0;
+}
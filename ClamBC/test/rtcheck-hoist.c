@@ -0,0 +1,36 @@
+// RUN: clambc-compiler %s -O2 -o %t -- -clambc-dumpir | llvm-dis | FileCheck %s
+// RUN: clambc-compiler %s -O2 -o %t.noopt -- -clambc-no-rtcheck-opt
+// RUN: clambc-run -bytecode-debug %t %s |& FileCheck %s -check-prefix=OUT
+// RUN: clambc-run -bytecode-debug %t.noopt %s |& FileCheck %s -check-prefix=OUT
+// RUN: tr R 0 < %s > %t.bad
+// RUN: not clambc-run %t %t.bad | FileCheck %s -check-prefix=BAD
+// RUN: not clambc-run %t.noopt %t.bad | FileCheck %s -check-prefix=BAD
+
+// buf[i] is loop invariant and is accessed on every iteration, so its check
+// is hoisted to the preheader; buf[j] is covered by the loop bound.
+
+// CHECK: bb.nph:
+// CHECK: label %rterr.trig
+// CHECK: for.body:
+// CHECK-NOT: rterr.trig
+// CHECK: ret i32 0
+
+// OUT: value 32
+// BAD: runtime error
+
+int entrypoint(void)
+{
+  uint8_t hdr[8];
+  uint8_t buf[64];
+  unsigned i, j;
+  if (read(hdr, 8) != 8 || read(buf, 64) != 64)
+    return 0;
+  // 'R' - 72, and out of bounds once the R is replaced
+  i = hdr[3] - 72;
+  for (j = 0; j < 32; j++)
+    buf[j] ^= buf[i];
+  debug_print_str_start("value ", 6);
+  debug_print_uint(buf[31]);
+  debug_print_str_nonl("\n", 1);
+  return 0;
+}
@@ -0,0 +1,35 @@
+// RUN: clambc-compiler %s -O2 -o %t -- -clambc-dumpir | llvm-dis | grep "label %rterr.trig" | count 2
+// RUN: clambc-compiler %s -O2 -o %t.noopt -- -clambc-dumpir -clambc-no-rtcheck-opt | llvm-dis | grep "label %rterr.trig" | count 6
+// RUN: clambc-run -bytecode-debug %t %s |& FileCheck %s -check-prefix=OUT
+// RUN: clambc-run -bytecode-debug %t.noopt %s |& FileCheck %s -check-prefix=OUT
+// RUN: tr R 0 < %s > %t.bad
+// RUN: not clambc-run %t %t.bad | FileCheck %s -check-prefix=BAD
+// RUN: not clambc-run %t.noopt %t.bad | FileCheck %s -check-prefix=BAD
+
+// The store to buf[i] and the second load are dominated by the checks of the
+// first load from buf[i], so they don't need checks of their own.
+
+// OUT: value 112
+// OUT: value 37
+// BAD: runtime error
+
+int entrypoint(void)
+{
+  uint8_t hdr[8];
+  uint8_t buf[64];
+  unsigned i;
+  uint8_t x;
+  if (read(hdr, 8) != 8 || read(buf, 64) != 64)
+    return 0;
+  // 'R' - 72, and out of bounds once the R is replaced
+  i = hdr[3] - 72;
+  x = buf[i];
+  debug_print_str_start("value ", 6);
+  debug_print_uint(x);
+  debug_print_str_nonl("\n", 1);
+  buf[i] = x ^ 0x55;
+  debug_print_str_start("value ", 6);
+  debug_print_uint(buf[i]);
+  debug_print_str_nonl("\n", 1);
+  return 0;
+}
@@ -0,0 +1,38 @@
+// RUN: clambc-compiler %s -O2 -o %t -- -clambc-dumpir | llvm-dis | FileCheck %s
+// RUN: clambc-compiler %s -O2 -o %t.noopt -- -clambc-no-rtcheck-opt
+// RUN: clambc-run -bytecode-debug %t %s |& FileCheck %s -check-prefix=OUT
+// RUN: clambc-run -bytecode-debug %t.noopt %s |& FileCheck %s -check-prefix=OUT
+
+// The call keeps the check of buf[j] in the loop, but the loop always stops
+// before j reaches 64. The check that would guard a copy of the loop is
+// known to hold, so the check is removed instead.
+
+// CHECK: define i32 @entrypoint
+// CHECK-NOT: rterr.trig
+// CHECK-NOT: nocheck
+// CHECK: {{^}}}
+
+// OUT: value 0
+// OUT: value 60
+// OUT: value 19
+
+int entrypoint(void)
+{
+  uint8_t hdr[8];
+  uint8_t buf[64];
+  unsigned j;
+  if (read(hdr, 8) != 8 || read(buf, 64) != 64)
+    return 0;
+  for (j = 0; j < 64; j++) {
+    buf[j] ^= 0x55;
+    if (j % 60 == 0) {
+      debug_print_str_start("value ", 6);
+      debug_print_uint(j);
+      debug_print_str_nonl("\n", 1);
+    }
+  }
+  debug_print_str_start("value ", 6);
+  debug_print_uint(buf[60]);
+  debug_print_str_nonl("\n", 1);
+  return 0;
+}
@@ -0,0 +1,41 @@
+// RUN: clambc-compiler %s -O2 -o %t -- -clambc-dumpir | llvm-dis | FileCheck %s
+// RUN: clambc-compiler %s -O2 -o %t.noopt -- -clambc-no-rtcheck-opt
+// RUN: clambc-run -bytecode-debug %t %s |& FileCheck %s -check-prefix=OUT
+// RUN: clambc-run -bytecode-debug %t.noopt %s |& FileCheck %s -check-prefix=OUT
+// RUN: tr U z < %s > %t.bad
+// RUN: not clambc-run %t %t.bad | FileCheck %s -check-prefix=BAD
+// RUN: not clambc-run %t.noopt %t.bad | FileCheck %s -check-prefix=BAD
+
+// The call keeps the check of buf[j] in the loop. The loop gets a copy
+// without the check, that runs when the preheader finds that the loop stops
+// before j reaches 64.
+
+// CHECK: bb.nph:
+// CHECK: br i1 {{.*}}, label %for.body.nocheck, label %for.body
+// CHECK: rterr.trig:
+// CHECK: for.body.nocheck:
+// CHECK-NOT: rterr.trig
+// CHECK: }
+
+// OUT: value 19
+// BAD: runtime error
+
+int entrypoint(void)
+{
+  uint8_t hdr[8];
+  uint8_t buf[64];
+  unsigned j, n;
+  if (read(hdr, 8) != 8 || read(buf, 64) != 64)
+    return 0;
+  // 'U' - 24, and past the end once the U is replaced
+  n = hdr[4] - 24;
+  for (j = 0; j < n; j++) {
+    buf[j] ^= 0x55;
+    if (j == 60) {
+      debug_print_str_start("value ", 6);
+      debug_print_uint(buf[j]);
+      debug_print_str_nonl("\n", 1);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,38 @@
+// RUN: clambc-compiler %s -O2 -o %t -- -clambc-dumpir | llvm-dis | FileCheck %s
+// RUN: clambc-compiler %s -O2 -o %t.noopt -- -clambc-no-rtcheck-opt
+// RUN: clambc-run -bytecode-debug %t %s |& FileCheck %s -check-prefix=OUT
+// RUN: clambc-run -bytecode-debug %t.noopt %s |& FileCheck %s -check-prefix=OUT
+// RUN: tr U z < %s > %t.bad
+// RUN: not clambc-run %t %t.bad | FileCheck %s -check-prefix=BAD
+// RUN: not clambc-run %t.noopt %t.bad | FileCheck %s -check-prefix=BAD
+
+// The index is affine in j, so checking its first and last value in the
+// preheader covers the whole loop, but only if j*4099 can't wrap around:
+// the preheader also checks the trip count against about 2^31/4099.
+
+// CHECK: bb.nph:
+// CHECK: icmp ult i32 {{.*}}, 523905
+// CHECK: for.body:
+// CHECK-NOT: rterr.trig
+// CHECK: for.end.loopexit:
+
+// OUT: value 57
+// BAD: runtime error
+
+int entrypoint(void)
+{
+  uint8_t hdr[8];
+  uint8_t buf[128];
+  unsigned i, j, n;
+  if (read(hdr, 8) != 8 || read(buf, 128) != 128)
+    return 0;
+  // 'R' and 'U' - 84: a single iteration, more once the U is replaced
+  i = hdr[3];
+  n = hdr[4] - 84;
+  for (j = 0; j < n; j++)
+    buf[j*4099 + i] ^= 0x55;
+  debug_print_str_start("value ", 6);
+  debug_print_uint(buf[i]);
+  debug_print_str_nonl("\n", 1);
+  return 0;
+}
@@ -0,0 +1,62 @@
+// RUN: clambc-compiler %s -O2 -o %t -- -clambc-dumpir | llvm-dis | FileCheck %s
+// RUN: clambc-compiler %s -O2 -o %t.nospec -- -clambc-specialize=0
+// RUN: clambc-run -bytecode-debug %t %s |& FileCheck %s -check-prefix=OUT
+// RUN: clambc-run -bytecode-debug %t.nospec %s |& FileCheck %s -check-prefix=OUT
+
+// The calls of work are grouped by mode, and each group calls a clone that
+// still gets the size of buf. A clone for the single call of other would
+// only ever get a size of 8, which would be removed from its parameters.
+static int __attribute__((noinline)) work(int mode, uint8_t *buf, int n)
+{
+  int i, s = 0;
+  for (i = 0; i < n; i++) {
+    if (mode == 1)
+      s += buf[i] * 3;
+    else if (mode == 2)
+      s ^= buf[i];
+    else if (mode == 3)
+      s += debug_print_uint(buf[i]);
+    else
+      s -= buf[i] >> 1;
+  }
+  return s;
+}
+
+static int __attribute__((noinline)) other(int mode, uint8_t *buf, int n)
+{
+  int i, s = 0;
+  for (i = 0; i < n; i++) {
+    if (mode == 1)
+      s += buf[i] * 3;
+    else if (mode == 2)
+      s ^= buf[i];
+    else if (mode == 3)
+      s += debug_print_uint(buf[i]);
+    else
+      s -= buf[i] >> 1;
+  }
+  return s;
+}
+
+// CHECK: define i32 @entrypoint()
+// CHECK: call i32 @work.spec(i8* {{.*}}, i32 16)
+// CHECK: call i32 @work.spec1(i8* {{.*}}, i32 8)
+// CHECK: call i32 @work.spec(i8* {{.*}}, i32 4)
+// CHECK: call i32 @work.spec1(i8* {{.*}}, i32 16)
+// CHECK: call i32 @other(i32 2, i8* {{.*}}, i32 16)
+// CHECK: call i32 @other(i32 1, i8* {{.*}}, i32 8)
+// CHECK: call i32 @other(i32 2, i8* {{.*}}, i32 4)
+// CHECK: define internal i32 @other(i32, i8*, i32)
+// CHECK: define internal i32 @work.spec(i8*, i32)
+// CHECK: define internal i32 @work.spec1(i8*, i32)
+// OUT: 52051560
+int entrypoint(void)
+{
+  uint8_t buf[16];
+  if (read(buf, 16) != 16)
+    return 0;
+  debug_print_uint(work(2, buf, 16) + work(1, buf, 8) + work(2, buf, 4) +
+                   work(1, buf, 16));
+  debug_print_uint(other(2, buf, 16) + other(1, buf, 8) + other(2, buf, 4));
+  return 0;
+}
@@ -0,0 +1,42 @@
+// RUN: clambc-compiler %s -O2 -o %t -- -clambc-dumpir | llvm-dis | FileCheck %s
+// RUN: clambc-compiler %s -O2 -o %t.noswitch -- -clambc-switch-tables=0
+// RUN: clambc-run -bytecode-debug %t %s |& FileCheck %s -check-prefix=OUT
+// RUN: clambc-run -bytecode-debug %t.noswitch %s |& FileCheck %s -check-prefix=OUT
+
+// The switch becomes a lookup in a table, that is copied to the stack only
+// when the lookup is done.
+
+// CHECK: define i32 @entrypoint
+// CHECK: entry:
+// CHECK-NOT: memcpy
+// CHECK: switch.lookup:
+// CHECK: call void @llvm.memcpy
+
+// OUT: value 96
+
+int entrypoint(void)
+{
+  uint8_t hdr[8];
+  uint8_t c;
+  int v;
+  if (read(hdr, 8) != 8)
+    return 0;
+  c = hdr[3] + 'a' - 'R';
+  if (c & 0x80)
+    return 1;
+  switch (c) {
+  case 'a': v = 1; break;
+  case 'b': v = 38; break;
+  case 'c': v = 75; break;
+  case 'd': v = 112; break;
+  case 'e': v = 149; break;
+  case 'f': v = 186; break;
+  case 'g': v = 223; break;
+  case 'h': v = 9; break;
+  default: v = 0;
+  }
+  debug_print_str_start("value ", 6);
+  debug_print_uint(v ^ c);
+  debug_print_str_nonl("\n", 1);
+  return 0;
+}
@@ -0,0 +1,233 @@
+#!/usr/bin/perl
+# Compiles the examples several times, and compares the compile time of each
+# stage, the peak memory usage, the size of the output and the size of each
+# function with a baseline. Exits with 1 if any of them got worse by more
+# than the threshold.
+# The sizes are the same on every machine, their baseline is in the source
+# tree. The times and the memory usage are kept in a separate baseline, that
+# is only comparable with runs on the same machine.
+#
+# Usage: benchmark_examples.pl [options] [files...]
+#   -compiler <path>       clambc-compiler to use
+#                          (default: obj/Release/bin/clambc-compiler)
+#   -runs <n>              compile each file this many times (default: 3)
+#   -baseline <file>       baseline of the sizes to compare with
+#                          (default: benchmark_examples.csv), created if it
+#                          doesn't exist
+#   -timing-baseline <file>
+#                          baseline of the times and memory usage
+#                          (default: benchmark_timing.csv), created if it
+#                          doesn't exist
+#   -output <file>         write the results to this file too
+#   -update                replace the baseline with the results
+#   -time-threshold <%>    allowed increase of compile times (default: 25)
+#   -min-time <seconds>    ignore smaller increases of times (default: 0.01)
+#   -memory-threshold <%>  allowed increase of the peak memory (default: 20)
+#   -size-threshold <%>    allowed increase of output and function sizes
+#                          (default: 5)
+#   -O<n>                  optimization level (default: 2)
+use strict;
+use warnings;
+use File::Spec::Functions qw(rel2abs);
+use File::Temp qw(tempdir);
+use Getopt::Long;
+use JSON::PP;
+use Time::HiRes qw(time);
+
+my $compiler = "obj/Release/bin/clambc-compiler";
+my $runs = 3;
+my $baseline = "benchmark_examples.csv";
+my $timing_baseline = "benchmark_timing.csv";
+my $output;
+my $update = 0;
+my $time_threshold = 25;
+my $min_time = 0.01;
+my $memory_threshold = 20;
+my $size_threshold = 5;
+my $optimize = 2;
+Getopt::Long::Configure("bundling_override");
+GetOptions("compiler=s" => \$compiler,
+           "runs=i" => \$runs,
+           "baseline=s" => \$baseline,
+           "timing-baseline=s" => \$timing_baseline,
+           "output=s" => \$output,
+           "update" => \$update,
+           "time-threshold=f" => \$time_threshold,
+           "min-time=f" => \$min_time,
+           "memory-threshold=f" => \$memory_threshold,
+           "size-threshold=f" => \$size_threshold,
+           "O=i" => \$optimize) or die "invalid options\n";
+die "-runs must be at least 1\n" if $runs < 1;
+
+my @files = @ARGV ? @ARGV : sort glob("examples/in/*.c");
+die "no files to compile\n" unless @files;
+
+# The cache would hide the compile time.
+delete $ENV{CLAMBC_CACHE_DIR};
+# The header of the output has the time and the user name.
+$ENV{SOURCE_DATE_EPOCH} = 1;
+$ENV{SIGNDUSER} = "benchmark";
+my $tmp = tempdir(CLEANUP => 1);
+# Compile in the temporary directory, so that the bugreports of crashes don't
+# end up here.
+$compiler = rel2abs($compiler) if $compiler =~ m|/|;
+@files = map { rel2abs($_) } @files;
+$baseline = rel2abs($baseline);
+$timing_baseline = rel2abs($timing_baseline);
+$output = rel2abs($output) if defined $output;
+chdir $tmp or die "$tmp: $!\n";
+my $stats = "$tmp/stats.json";
+my $json = JSON::PP->new;
+
+# metric => value for each file, times are the fastest of the runs, memory
+# the largest.
+my %results;
+for my $file (@files) {
+    (my $name = $file) =~ s|.*/||;
+    my %r;
+    for my $run (1..$runs) {
+        unlink $stats;
+        my $start = time;
+        my $ret = system($compiler, "-w", $file, "-O$optimize",
+                         "-o", "$tmp/out.cbc", "--", "-clambc-stats=$stats");
+        my $total = time - $start;
+        die "failed to run $compiler: $!\n" if $ret == -1;
+        if ($ret) {
+            %r = (failed => 1);
+            last;
+        }
+        open STATS, $stats or die "$stats: $!\n";
+        my $s = $json->decode(scalar <STATS>);
+        close STATS;
+        my %t = ("time.re2c" => $s->{re2c},
+                 "time.frontend" => $s->{frontend},
+                 "time.optimizer" => $s->{optimizer},
+                 "time.backend" => $s->{backend},
+                 "time.total" => $total);
+        for my $m (keys %t) {
+            $r{$m} = $t{$m} if !defined $r{$m} || $t{$m} < $r{$m};
+        }
+        $r{peak_rss_kb} = $s->{peak_rss_kb}
+            if !defined $r{peak_rss_kb} || $s->{peak_rss_kb} > $r{peak_rss_kb};
+        $r{size} = $s->{size};
+        for my $f (@{$s->{functions}}) {
+            $r{"function.$f->{name}.values"} = $f->{values};
+            $r{"function.$f->{name}.instructions"} = $f->{instructions};
+        }
+    }
+    $results{$name} = \%r;
+    if ($r{failed}) {
+        print "$name: failed to compile\n";
+    } else {
+        printf "%s: %d bytes, %.3f s, %d KB\n", $name, $r{size},
+            $r{"time.total"}, $r{peak_rss_kb};
+    }
+}
+
+# The totals are only comparable when all examples are compiled.
+unless (@ARGV) {
+    my %total;
+    for my $r (values %results) {
+        next if $r->{failed};
+        for my $m (keys %$r) {
+            next if $m =~ /^function\./ || $m eq "peak_rss_kb";
+            $total{$m} += $r->{$m};
+        }
+        $total{peak_rss_kb} = $r->{peak_rss_kb}
+            if !defined $total{peak_rss_kb} ||
+               $r->{peak_rss_kb} > $total{peak_rss_kb};
+    }
+    $results{TOTAL} = \%total;
+    printf "Total: %d bytes, %.3f s, %d KB peak\n", $total{size} || 0,
+        $total{"time.total"} || 0, $total{peak_rss_kb} || 0;
+}
+
+sub format_value {
+    my ($m, $v) = @_;
+    return $m =~ /^time\./ ? sprintf("%.4f", $v) : $v;
+}
+
+# Whether the metric depends on the machine.
+sub is_timing {
+    my ($m) = @_;
+    return $m =~ /^time\./ || $m eq "peak_rss_kb";
+}
+
+# Writes the metrics for which $select returns true.
+sub write_results {
+    my ($path, $select) = @_;
+    open OUT, ">", $path or die "$path: $!\n";
+    print OUT "file,metric,value\n";
+    for my $name (sort keys %results) {
+        my $r = $results{$name};
+        for my $m (sort keys %$r) {
+            next unless $select->($m);
+            print OUT "$name,$m,", format_value($m, $r->{$m}), "\n";
+        }
+    }
+    close OUT;
+}
+
+my %writers = ($baseline => sub { !is_timing($_[0]) },
+               $timing_baseline => \&is_timing);
+
+write_results($output, sub { 1 }) if defined $output;
+
+my %base;
+for my $path ($baseline, $timing_baseline) {
+    if (! -e $path) {
+        write_results($path, $writers{$path});
+        print "Created baseline $path\n";
+        next;
+    }
+    open BASE, $path or die "$path: $!\n";
+    while (<BASE>) {
+        chomp;
+        next if $. == 1;
+        my ($name, $m, $v) = split /,/;
+        $base{$name}{$m} = $v;
+    }
+    close BASE;
+}
+
+my $regressions = 0;
+sub regressed {
+    my ($msg) = @_;
+    print "REGRESSION: $msg\n";
+    $regressions++;
+}
+
+for my $name (sort keys %base) {
+    my $r = $results{$name};
+    next unless $r;
+    if ($r->{failed}) {
+        regressed("$name doesn't compile anymore")
+            unless $base{$name}{failed};
+        next;
+    }
+    for my $m (sort keys %{$base{$name}}) {
+        my ($old, $new) = ($base{$name}{$m}, $r->{$m});
+        # functions can disappear when inlined
+        next if !defined $new || $m eq "failed";
+        my $threshold = $m =~ /^time\./ ? $time_threshold :
+            $m eq "peak_rss_kb" ? $memory_threshold : $size_threshold;
+        next if $new <= $old * (1 + $threshold / 100);
+        next if $m =~ /^time\./ && $new - $old < $min_time;
+        regressed(sprintf("%s %s: %s -> %s (+%.1f%%)", $name, $m, $old,
+                          format_value($m, $new),
+                          $old ? ($new - $old) * 100 / $old : 100));
+    }
+}
+
+if ($update) {
+    for my $path ($baseline, $timing_baseline) {
+        write_results($path, $writers{$path});
+        print "Updated baseline $path\n";
+    }
+}
+if ($regressions) {
+    print "$regressions metrics regressed\n";
+    exit 1;
+}
+print "No regressions\n";
+exit 0;
@@ -0,0 +1,348 @@
+/*
+ *  Content-addressed cache of compiled bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#include "cache.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/System/Path.h"
+#include "llvm/System/TimeValue.h"
+#include <algorithm>
+#include <set>
+#include <vector>
+#include <cstring>
+
+using namespace llvm;
+
+// Bump this when the entry format changes
+#define CACHE_MAGIC "ClamBCcache1"
+// Temporary files older than this (in seconds) are leftovers of a crashed
+// compiler, and are removed during eviction.
+#define CACHE_STALE_TMP 3600
+
+// MD5 as described in RFC 1321.
+static const uint32_t md5_k[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+  0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+  0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+  0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+  0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+  0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned md5_r[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+CacheKey::CacheKey() : Length(0)
+{
+  State[0] = 0x67452301;
+  State[1] = 0xefcdab89;
+  State[2] = 0x98badcfe;
+  State[3] = 0x10325476;
+}
+
+void CacheKey::transform(const unsigned char *Block)
+{
+  uint32_t W[16];
+  for (unsigned i=0;i<16;i++)
+    W[i] = Block[i*4] | (Block[i*4+1] << 8) | (Block[i*4+2] << 16) |
+      ((uint32_t)Block[i*4+3] << 24);
+  uint32_t a = State[0], b = State[1], c = State[2], d = State[3];
+  for (unsigned i=0;i<64;i++) {
+    uint32_t f;
+    unsigned g;
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      g = i;
+    } else if (i < 32) {
+      f = (d & b) | (~d & c);
+      g = (5*i + 1) % 16;
+    } else if (i < 48) {
+      f = b ^ c ^ d;
+      g = (3*i + 5) % 16;
+    } else {
+      f = c ^ (b | ~d);
+      g = (7*i) % 16;
+    }
+    uint32_t tmp = d;
+    d = c;
+    c = b;
+    uint32_t x = a + f + md5_k[i] + W[g];
+    b = b + ((x << md5_r[i]) | (x >> (32 - md5_r[i])));
+    a = tmp;
+  }
+  State[0] += a;
+  State[1] += b;
+  State[2] += c;
+  State[3] += d;
+}
+
+void CacheKey::update(const unsigned char *Data, size_t Len)
+{
+  unsigned used = Length % 64;
+  Length += Len;
+  if (used) {
+    unsigned n = std::min((size_t)(64 - used), Len);
+    memcpy(Buffer + used, Data, n);
+    Data += n;
+    Len -= n;
+    if (used + n < 64)
+      return;
+    transform(Buffer);
+  }
+  for (; Len >= 64; Data += 64, Len -= 64)
+    transform(Data);
+  memcpy(Buffer, Data, Len);
+}
+
+void CacheKey::add(StringRef Data)
+{
+  unsigned char Size[8];
+  uint64_t N = Data.size();
+  for (unsigned i=0;i<8;i++)
+    Size[i] = N >> (i*8);
+  update(Size, 8);
+  update((const unsigned char*)Data.data(), Data.size());
+}
+
+std::string CacheKey::final()
+{
+  unsigned char Pad[72];
+  uint64_t Bits = Length * 8;
+  unsigned used = Length % 64;
+  unsigned n = used < 56 ? 56 - used : 120 - used;
+  memset(Pad, 0, sizeof(Pad));
+  Pad[0] = 0x80;
+  for (unsigned i=0;i<8;i++)
+    Pad[n+i] = Bits >> (i*8);
+  update(Pad, n + 8);
+
+  static const char hex[] = "0123456789abcdef";
+  std::string Result;
+  for (unsigned i=0;i<16;i++) {
+    unsigned char c = State[i/4] >> ((i%4)*8);
+    Result += hex[c >> 4];
+    Result += hex[c & 0xf];
+  }
+  return Result;
+}
+
+static std::string checksum(StringRef Data)
+{
+  CacheKey Sum;
+  Sum.add(Data);
+  return Sum.final();
+}
+
+CompileCache::CompileCache(const std::string &Dir, uint64_t MaxSize)
+  : Dir(Dir), MaxSize(MaxSize)
+{
+}
+
+// Entries are spread over 256 subdirectories by the first byte of the key.
+std::string CompileCache::entryPath(const std::string &Key) const
+{
+  sys::Path P(Dir);
+  P.appendComponent(Key.substr(0, 2));
+  P.appendComponent(Key + ".cbc");
+  return P.str();
+}
+
+// An entry is a header line with the checksum and size of the output,
+// followed by the output itself.
+bool CompileCache::readEntry(const std::string &Path, std::string &Data)
+{
+  OwningPtr<MemoryBuffer> Buf(MemoryBuffer::getFile(Path));
+  if (!Buf)
+    return false;
+  StringRef Entry(Buf->getBufferStart(), Buf->getBufferSize());
+  size_t eol = Entry.find('\n');
+  if (eol == StringRef::npos)
+    return false;
+  StringRef Header = Entry.substr(0, eol);
+  StringRef Payload = Entry.substr(eol+1);
+  std::pair<StringRef, StringRef> Magic = Header.split(' ');
+  std::pair<StringRef, StringRef> Sum = Magic.second.split(' ');
+  unsigned long long Size;
+  if (Magic.first != CACHE_MAGIC ||
+      Sum.second.getAsInteger(10, Size) || Size != Payload.size() ||
+      Sum.first != checksum(Payload))
+    return false;
+  Data.assign(Payload.data(), Payload.size());
+  return true;
+}
+
+bool CompileCache::lookup(const std::string &Key, std::string &Data)
+{
+  sys::PathWithStatus P(entryPath(Key));
+  if (!P.exists())
+    return false;
+  if (!readEntry(P.str(), Data)) {
+    // Corrupted (or from an incompatible compiler), drop it
+    P.eraseFromDisk();
+    return false;
+  }
+  // Update the modification time, eviction removes the least recently used
+  // entries first.
+  if (const sys::FileStatus *FS = P.getFileStatus()) {
+    sys::FileStatus Status = *FS;
+    Status.modTime = sys::TimeValue::now();
+    P.setStatusInfoOnDisk(Status);
+  }
+  return true;
+}
+
+bool CompileCache::store(const std::string &Key, StringRef Data)
+{
+  sys::Path Final(entryPath(Key));
+  sys::Path EntryDir(Final.getDirname());
+  if (!EntryDir.exists() && EntryDir.createDirectoryOnDisk(true))
+    return false;
+
+  // Write to a temporary file and rename it, so that concurrent compilers
+  // never see a partially written entry.
+  sys::Path Tmp(EntryDir);
+  Tmp.appendComponent(".tmp-" + Key);
+  if (Tmp.createTemporaryFileOnDisk(true))
+    return false;
+  {
+    std::string ErrInfo;
+    raw_fd_ostream Out(Tmp.c_str(), ErrInfo, raw_fd_ostream::F_Binary);
+    if (!ErrInfo.empty())
+      return false;
+    Out << CACHE_MAGIC << " " << checksum(Data) << " " << Data.size() << "\n";
+    Out << Data;
+    Out.close();
+    if (Out.has_error()) {
+      Out.clear_error();
+      Tmp.eraseFromDisk();
+      return false;
+    }
+  }
+  if (Tmp.renamePathOnDisk(Final, 0)) {
+    Tmp.eraseFromDisk();
+    return false;
+  }
+  evict();
+  return true;
+}
+
+namespace {
+struct CacheEntry {
+  CacheEntry() : ModTime(0, 0), Size(0) {}
+  sys::TimeValue ModTime;
+  unsigned long long Size;
+  sys::Path Path;
+  bool operator<(const CacheEntry &Other) const {
+    return ModTime < Other.ModTime;
+  }
+};
+}
+
+// Lists the entries of the cache, and removes stale temporary files.
+static bool listEntries(const std::string &Dir,
+                        std::vector<CacheEntry> &Entries)
+{
+  std::set<sys::Path> SubDirs;
+  if (sys::Path(Dir).getDirectoryContents(SubDirs, 0))
+    return false;
+  sys::TimeValue Now = sys::TimeValue::now();
+  for (std::set<sys::Path>::iterator I=SubDirs.begin(), E=SubDirs.end();
+       I != E; ++I) {
+    std::set<sys::Path> Files;
+    if (!I->isDirectory() || I->getDirectoryContents(Files, 0))
+      continue;
+    for (std::set<sys::Path>::iterator J=Files.begin(), JE=Files.end();
+         J != JE; ++J) {
+      sys::PathWithStatus P(*J);
+      const sys::FileStatus *FS = P.getFileStatus();
+      if (!FS || !FS->isFile)
+        continue;
+      if (P.getLast().startswith(".tmp-")) {
+        if (Now.seconds() - FS->modTime.seconds() > CACHE_STALE_TMP)
+          P.eraseFromDisk();
+        continue;
+      }
+      CacheEntry Entry;
+      Entry.ModTime = FS->modTime;
+      Entry.Size = FS->fileSize;
+      Entry.Path = *J;
+      Entries.push_back(Entry);
+    }
+  }
+  return true;
+}
+
+// Removes the least recently used entries until the cache is below 90% of its
+// maximum size. Entries removed concurrently by another compiler are ignored.
+void CompileCache::evict()
+{
+  std::vector<CacheEntry> Entries;
+  if (!listEntries(Dir, Entries))
+    return;
+  uint64_t Total = 0;
+  for (unsigned i=0;i<Entries.size();i++)
+    Total += Entries[i].Size;
+  if (Total <= MaxSize)
+    return;
+  std::sort(Entries.begin(), Entries.end());
+  uint64_t Target = MaxSize / 10 * 9;
+  for (unsigned i=0;i<Entries.size() && Total > Target;i++) {
+    Entries[i].Path.eraseFromDisk();
+    Total -= Entries[i].Size;
+  }
+}
+
+int CompileCache::verify(raw_ostream &Err)
+{
+  std::vector<CacheEntry> Entries;
+  if (!listEntries(Dir, Entries)) {
+    Err << "Cannot read cache directory " << Dir << "\n";
+    return -1;
+  }
+  unsigned corrupt = 0;
+  uint64_t Total = 0;
+  for (unsigned i=0;i<Entries.size();i++) {
+    std::string Data;
+    if (!readEntry(Entries[i].Path.str(), Data)) {
+      Err << "Removing corrupted cache entry " << Entries[i].Path.str() << "\n";
+      Entries[i].Path.eraseFromDisk();
+      corrupt++;
+      continue;
+    }
+    Total += Entries[i].Size;
+  }
+  Err << "Cache " << Dir << ": " << Entries.size() - corrupt << " entries, " <<
+    Total << " bytes";
+  if (corrupt)
+    Err << ", removed " << corrupt << " corrupted";
+  Err << "\n";
+  return corrupt;
+}
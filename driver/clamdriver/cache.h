@@ -0,0 +1,74 @@
+/*
+ *  Content-addressed cache of compiled bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#ifndef CLAMBC_CACHE_H
+#define CLAMBC_CACHE_H
+#include "llvm/ADT/StringRef.h"
+#include "llvm/System/DataTypes.h"
+#include <string>
+
+namespace llvm {
+class raw_ostream;
+}
+
+// Computes the cache key of a compilation: an MD5 digest over everything
+// that can influence the output (source, flags, compiler version, API map).
+class CacheKey {
+public:
+  CacheKey();
+  // Adds one input to the key. Inputs are length-prefixed, so ("ab","c") and
+  // ("a","bc") give different keys.
+  void add(llvm::StringRef Data);
+  // Returns the digest as 32 hex characters. No more data can be added
+  // afterwards.
+  std::string final();
+private:
+  void update(const unsigned char *Data, size_t Len);
+  void transform(const unsigned char *Block);
+  uint32_t State[4];
+  uint64_t Length;
+  unsigned char Buffer[64];
+};
+
+// An on-disk cache directory of compiled .cbc files, that can be shared by
+// concurrent compilers. Entries are written atomically, verified by a checksum
+// when read, and the least recently used ones are evicted once the total size
+// exceeds MaxSize bytes.
+class CompileCache {
+public:
+  CompileCache(const std::string &Dir, uint64_t MaxSize);
+  // Returns true and the cached output on a hit. Corrupted entries are removed
+  // and reported as a miss.
+  bool lookup(const std::string &Key, std::string &Data);
+  // Stores an output in the cache, and evicts old entries if needed.
+  bool store(const std::string &Key, llvm::StringRef Data);
+  // Checks the checksum of all entries, removing corrupted ones. Returns the
+  // number of corrupted entries found, or -1 if the cache can't be read.
+  int verify(llvm::raw_ostream &Err);
+private:
+  std::string entryPath(const std::string &Key) const;
+  bool readEntry(const std::string &Path, std::string &Data);
+  void evict();
+  std::string Dir;
+  uint64_t MaxSize;
+};
+
+#endif
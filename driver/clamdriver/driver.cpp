@@ -13,10 +13,12 @@
 #include "llvm/Config/config.h"
 #include "llvm/LLVMContext.h"
 #include "llvm/Module.h"
+#include "llvm/Pass.h"
 #include "llvm/PassManager.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/IRReader.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/MemoryBuffer.h"
@@ -27,10 +29,12 @@
 #include "llvm/System/Path.h"
 #include "llvm/System/Program.h"
 #include "llvm/System/Signals.h"
+#include "llvm/System/TimeValue.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetRegistry.h"
 #include "llvm/Target/TargetData.h"
 #include "../tools/clang/include/clang/Basic/Version.h"
+#include "clang/Basic/FileManager.h"
 #include "clang/Basic/SourceManager.h"
 #include "clang/Basic/TargetInfo.h"
 #include "clang/Basic/Version.h"
@@ -45,9 +49,11 @@
 #include "clang/Frontend/FrontendActions.h"
 #include "clang/Frontend/FrontendDiagnostic.h"
 #include "clang/Frontend/FrontendPluginRegistry.h"
+#include "clang/Frontend/PCHReader.h"
 #include "clang/Frontend/FrontendOptions.h"
 #include "clang/Frontend/TextDiagnosticBuffer.h"
 #include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Frontend/Utils.h"
 #include "clang/Frontend/VerifyDiagnosticsClient.h"
 #include "llvm/LLVMContext.h"
 #include "llvm/ADT/OwningPtr.h"
@@ -61,13 +67,18 @@
 #include "llvm/System/Signals.h"
 #include "llvm/Target/TargetSelect.h"
 #include "driver.h"
+#include "cache.h"
 #include <cstdio>
 #ifdef LLVM_ON_UNIX
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #endif
 extern "C" {
 #include "tar.h"
@@ -75,6 +86,9 @@ extern "C" {
 #include <fcntl.h>
 #include <cstring>
 #include <cerrno>
+#include <algorithm>
+#include <map>
+#include <set>
 
 using namespace llvm;
 using namespace clang;
@@ -108,9 +122,15 @@ static void printVersion(raw_ostream &Err, bool printVer = true)
     cl::PrintVersionMessage();
 }
 
+static int CompileUnit(int argc, const char **argv, sys::Path &ResourceDir,
+                       sys::Path &apiMapPath, const sys::Path* out,
+                       const sys::Path* err, raw_ostream &Err, bool bugreport,
+                       bool versionOnly);
+
 static int printICE(int Res, const char **Argv, raw_ostream &Err,
                     bool insidebugreport,
-                    int argc, const char **argv, const sys::Path* orig_err)
+                    int argc, const char **argv, const sys::Path* orig_err,
+                    sys::Path &ResourceDir, sys::Path &apiMapPath)
 {
   Err << "Program arguments:";
   while (*Argv) {
@@ -146,9 +166,11 @@ static int printICE(int Res, const char **Argv, raw_ostream &Err,
     ErrMsg.clear();
     raw_fd_ostream TmpErrF(TmpErr.c_str(), ErrMsg);
     // Create version info for bugreport
-    CompileFile(argc, argv, &Tmp, &TmpErr, TmpErrF, true, true);
+    CompileUnit(argc, argv, ResourceDir, apiMapPath, &Tmp, &TmpErr, TmpErrF,
+                true, true);
     // Create preprocessed file for bugreport
-    CompileFile(argc, argv, &Tmp, &TmpErr, TmpErrF, true);
+    CompileUnit(argc, argv, ResourceDir, apiMapPath, &Tmp, &TmpErr, TmpErrF,
+                true, false);
     TmpErrF.close();
     int fd = open(TmpOut.c_str(), O_WRONLY);
     if (fd < 0) {
@@ -183,33 +205,93 @@ static void printFile(const sys::Path *err)
   delete buf;
 }
 
+llvm::ModulePass *createClamBCProfileInliner();
+llvm::ModulePass *createClamBCSpecialize();
+extern "C" void ClamBCPrintFunctionSizes(llvm::raw_ostream *Out);
+
 extern int cc1_main(const char **ArgBegin, const char **ArgEnd,
                     const char *Argv0, void *MainAddr);
 
-static int compileInternal(const char *input, int optimize, int optsize,
-                           const char *argv0,
-                           raw_fd_ostream *fd, CompilerInstance &Clang)
+static cl::opt<bool>
+TimePasses("clambc-time-passes",
+           cl::desc("Print the time and memory used by each optimizer and "
+                    "backend pass of the compiled file"));
+
+static cl::opt<std::string>
+StatsFile("clambc-stats",
+          cl::desc("Append the time spent in each stage, the peak memory "
+                   "usage and the size of the output to a file"),
+          cl::value_desc("File to append a line of JSON to"));
+
+// Measurements of the compilation for -clambc-stats.
+namespace {
+struct CompileStats {
+  double Re2c, Frontend, Optimizer, Backend;
+  uint64_t OutputSize;
+};
+}
+static CompileStats Stats;
+
+static double getElapsed(const sys::TimeValue &Start)
 {
-  std::string ErrMsg;
-  LLVMContext &Context = getGlobalContext();
-  std::auto_ptr<Module> M;
+  sys::TimeValue T = sys::TimeValue::now() - Start;
+  return T.seconds() + T.nanoseconds() / 1e9;
+}
 
-  MemoryBuffer *Buffer = MemoryBuffer::getFileOrSTDIN(input, &ErrMsg);
-  if (!Buffer) {
-    errs() << "Could not open temp input file '" << input << "'\n";
-    return 2;
-  }
-  M.reset(ParseBitcodeFile(Buffer, Context, &ErrMsg));
-  delete Buffer;
+static void writeStats(StringRef Input, unsigned OptLevel, bool Cached)
+{
+  if (StatsFile.empty())
+    return;
+  struct rusage Usage;
+  getrusage(RUSAGE_SELF, &Usage);
+  std::string Line;
+  raw_string_ostream OS(Line);
+  OS << "{\"file\": \"";
+  OS.write_escaped(Input);
+  OS << "\", \"optimize\": " << OptLevel << ", \"cached\": "
+    << (Cached ? "true" : "false")
+    << format(", \"re2c\": %.6f, \"frontend\": %.6f", Stats.Re2c,
+              Stats.Frontend)
+    << format(", \"optimizer\": %.6f, \"backend\": %.6f", Stats.Optimizer,
+              Stats.Backend)
+    << ", \"peak_rss_kb\": " << (uint64_t)Usage.ru_maxrss
+    << ", \"size\": " << Stats.OutputSize << ", \"functions\": ";
+  if (Cached)
+    OS << "[]";
+  else
+    ClamBCPrintFunctionSizes(&OS);
+  OS << "}\n";
+  OS.flush();
+  // A single write, so that the lines of parallel compilations don't mix.
+  int fd = open(StatsFile.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd == -1 ||
+      write(fd, Line.data(), Line.size()) != (ssize_t)Line.size())
+    errs() << "error writing " << StatsFile << ": " << sys::StrError() << "\n";
+  if (fd != -1)
+    close(fd);
+}
+
+static int compileInternal(Module *Mod, int optimize, int optsize,
+                           const char *argv0,
+                           raw_ostream *fd, CompilerInstance &Clang)
+{
+  // The module is handed over by the frontend in memory, there is no need to
+  // serialize it to bitcode and parse it back.
+  std::auto_ptr<Module> M(Mod);
   if (M.get() == 0) {
-    errs() << "Cannot parse temp input file '" << input << "'" << ErrMsg << "\n";
+    errs() << "Frontend did not generate a module\n";
     return 2;
   }
 
+  // The frontend resets this, so turn it on only now.
+  if (TimePasses)
+    TimePassesIsEnabled = true;
+
   // FIXME: Remove TargetData!
   //XXX  M->setTargetTriple("");
   //XXX  M->setDataLayout("");
 
+  sys::TimeValue Start = sys::TimeValue::now();
   // TODO: let clang handle these
   PassManager Passes;
   FunctionPassManager *FPasses = NULL;
@@ -220,6 +302,16 @@ static int compileInternal(const char *input, int optimize, int optsize,
   }
 //  Passes.add(new TargetData(M.get()));//XXX
   unsigned threshold = optsize ? 75 : optimize > 2 ? 275 : 225;
+  if (optimize > 1) {
+    // With -clambc-profile-use the callees in hot blocks get the (higher)
+    // inlinehint threshold, and inlining into never executed functions uses
+    // the optsize one.
+    Passes.add(createClamBCProfileInliner());
+    // Clone the helpers called with constant arguments. The function passes
+    // have run already, so the arguments are out of the allocas, and the
+    // module passes fold the clones.
+    Passes.add(createClamBCSpecialize());
+  }
   createStandardModulePasses(&Passes, optimize,
                              optsize,
                              true,
@@ -237,6 +329,8 @@ static int compileInternal(const char *input, int optimize, int optsize,
     Passes.add(createVerifierPass());
     Passes.run(*M.get());
   }
+  Stats.Optimizer = getElapsed(Start);
+  Start = sys::TimeValue::now();
 
   std::string Err2;
   //TODO: directly construct our target
@@ -274,6 +368,9 @@ static int compileInternal(const char *input, int optimize, int optsize,
       return 2;
   }
   PM.run(*M.get());
+  Out2->flush();
+  Stats.OutputSize = fd->tell();
+  Stats.Backend = getElapsed(Start);
   delete Out2;
   return 0;
 }
@@ -294,12 +391,208 @@ static FrontendAction *CreateFrontendAction(CompilerInstance &CI) {
   default:
     llvm_unreachable("Invalid program action!");
 
-  case EmitBC:                 return new EmitBCAction();
+  // The module is passed to the ClamBC backend in memory, see
+  // compileInternal().
+  case EmitBC:                 return new EmitLLVMOnlyAction();
   case PrintPreprocessedInput: return new PrintPreprocessedAction();
+  case GeneratePCH:            return new GeneratePCHAction();
   }
 }
 
+static cl::opt<std::string>
+CacheDir("clambc-cache-dir",
+         cl::desc("Reuse compiled bytecode from this cache directory "
+                  "(default: $CLAMBC_CACHE_DIR)"),
+         cl::value_desc("directory"));
+
+static cl::opt<unsigned>
+CacheSize("clambc-cache-size", cl::init(512),
+          cl::desc("Maximum size of the compilation cache in MiB"));
+
+static std::string getCacheDir()
+{
+  if (!CacheDir.empty())
+    return CacheDir;
+  const char *dir = getenv("CLAMBC_CACHE_DIR");
+  return dir ? dir : "";
+}
+
+namespace {
+// Preprocesses the main file into a string, used for the cache key.
+class PreprocessToStringAction : public PreprocessorFrontendAction {
+  std::string &Out;
+public:
+  PreprocessToStringAction(std::string &Out) : Out(Out) {}
+protected:
+  void ExecuteAction() {
+    CompilerInstance &CI = getCompilerInstance();
+    raw_string_ostream OS(Out);
+    DoPrintPreprocessedInput(CI.getPreprocessor(), &OS,
+                             CI.getPreprocessorOutputOpts());
+    OS.flush();
+  }
+};
+}
+
+namespace {
+struct PreloadedFile {
+  std::string Name;
+  const MemoryBuffer *Buffer;
+  time_t ModTime;
+};
+}
+
+// Headers read into memory by the compiler server, shared with the compilers
+// it forks.
+static std::vector<PreloadedFile> PreloadedHeaders;
+
+// Creates the file manager, source manager and preprocessor for compiling
+// Input, with the main file remapped to MainBuf.
+static void createSourceManagers(CompilerInstance &Clang,
+                                 const std::string &Input,
+                                 const MemoryBuffer *MainBuf)
+{
+  // Create a file manager object to provide access to and cache the
+  // filesystem.
+  Clang.createFileManager();
+
+  // Create the source manager.
+  Clang.createSourceManager();
+
+  if (MainBuf) {
+    // Remap the main file to the in-memory buffer
+    const FileEntry *FE =
+      Clang.getFileManager().getVirtualFile(Input, MainBuf->getBufferSize(), 0);
+    Clang.getSourceManager().overrideFileContents(FE, MainBuf);
+  }
+
+  for (std::vector<PreloadedFile>::iterator I=PreloadedHeaders.begin(),
+       E=PreloadedHeaders.end(); I != E; ++I) {
+    const FileEntry *FE =
+      Clang.getFileManager().getVirtualFile(I->Name, I->Buffer->getBufferSize(),
+                                            I->ModTime);
+    if (FE)
+      Clang.getSourceManager().overrideFileContents(FE,
+        MemoryBuffer::getMemBuffer(I->Buffer->getBufferStart(),
+                                   I->Buffer->getBufferEnd(),
+                                   I->Name.c_str()));
+  }
+
+  // Create the preprocessor.
+  Clang.createPreprocessor();
+}
+
+// Adds everything that influences the compiled output, besides the source
+// itself, to the cache key.
+static void addCompileInputs(CacheKey &Key, const char **argv, int argc,
+                             const sys::Path &apiMapPath)
+{
+  Key.add(clambc_getversion());
+  Key.add(CLANG_VERSION_STRING);
+  for (int i=1;i<argc;i++) {
+    StringRef Arg(argv[i]);
+    // the output filename doesn't influence the output
+    if (Arg == "-o") {
+      i++;
+      continue;
+    }
+    if (Arg.startswith("-o") || Arg.startswith("-clambc-cache-"))
+      continue;
+    Key.add(Arg);
+    // the contents of the profile matter, not its name
+    StringRef Profile;
+    if (Arg.startswith("-clambc-profile-use="))
+      Profile = Arg.substr(strlen("-clambc-profile-use="));
+    else if (Arg == "-clambc-profile-use" && i+1 < argc)
+      Profile = argv[i+1];
+    if (!Profile.empty()) {
+      OwningPtr<MemoryBuffer> Buf(MemoryBuffer::getFile(Profile));
+      Key.add(Buf ? Buf->getBuffer() : "");
+    }
+  }
+  OwningPtr<MemoryBuffer> API(MemoryBuffer::getFile(apiMapPath.str()));
+  Key.add(API ? API->getBuffer() : "");
+  // printModuleHeader() embeds these
+  const char *user = getenv("SIGNDUSER");
+  if (!user) user = getenv("USER");
+  Key.add(user ? user : "");
+  const char *epoch = getenv("SOURCE_DATE_EPOCH");
+  Key.add(epoch ? epoch : "");
+}
+
+// Precompiled bytecode.h, one for each setting of the optimization related
+// language options, since the PCH must match those.
+static const char *getPCHName(bool Optimize, bool OptimizeSize)
+{
+  if (OptimizeSize)
+    return "bytecode-Os.pch";
+  return Optimize ? "bytecode-O.pch" : "bytecode-O0.pch";
+}
+
+static sys::TimeValue getModTime(const sys::Path &P)
+{
+  sys::PathWithStatus PS(P);
+  const sys::FileStatus *FS = PS.getFileStatus();
+  return FS ? FS->getTimestamp() : sys::TimeValue::MaxTime;
+}
+
+// Returns the precompiled bytecode.h to use instead of parsing bytecode.h, or
+// an empty string if there is no PCH, or it can't be used for these options.
+static std::string findPCH(CompilerInstance &Clang, const char **argv,
+                           int cc1_argc, const sys::Path &ResourceDir)
+{
+  const FrontendOptions &FrontendOpts = Clang.getFrontendOpts();
+  if (FrontendOpts.Inputs.empty() ||
+      FrontendOpts.Inputs[0].first != FrontendOptions::IK_C)
+    return "";
+  // The PCH is rejected if macros used in the headers, or language options
+  // are changed.
+  for (int i=1;i<cc1_argc;i++) {
+    StringRef Arg(argv[i]);
+    if (Arg.startswith("-D") || Arg.startswith("-U") ||
+        Arg.startswith("-include") || Arg.startswith("-imacros") ||
+        Arg.startswith("-std") || Arg.startswith("-f") ||
+        Arg.startswith("-x") || Arg == "-undef" || Arg == "-ansi" ||
+        Arg == "-trigraphs")
+      return "";
+  }
+
+  sys::Path IncludeDir(ResourceDir);
+  IncludeDir.appendComponent("include");
+  sys::Path PCH(IncludeDir);
+  const LangOptions &LangOpts = Clang.getLangOpts();
+  PCH.appendComponent(getPCHName(LangOpts.Optimize, LangOpts.OptimizeSize));
+  if (!PCH.exists())
+    return "";
+
+  // Don't use a PCH older than the headers, or the compiler
+  sys::TimeValue PCHTime = getModTime(PCH);
+  if (PCHTime < getModTime(GetExecutablePath(argv[0])))
+    return "";
+  std::set<sys::Path> Headers;
+  if (IncludeDir.getDirectoryContents(Headers, 0))
+    return "";
+  for (std::set<sys::Path>::iterator I=Headers.begin(), E=Headers.end();
+       I != E; ++I) {
+    if (I->getSuffix() == "h" && PCHTime < getModTime(*I))
+      return "";
+  }
+
+  // The PCH must have been built from this bytecode.h
+  sys::PathWithStatus Header(IncludeDir);
+  Header.appendComponent("bytecode.h");
+  sys::PathWithStatus Original(
+    PCHReader::getOriginalSourceFile(PCH.str(), Clang.getDiagnostics()));
+  const sys::FileStatus *HS = Header.getFileStatus();
+  const sys::FileStatus *OS = Original.getFileStatus();
+  if (!HS || !OS || HS->getUniqueID() != OS->getUniqueID())
+    return "";
+  return PCH.str();
+}
+
 int re2c_main(int argc, char *argv[]);
+int re2c_main_buffer(int argc, char *argv[], const char *buffer, size_t length,
+                     char **outbuf, size_t *outlen);
 static int CompileSubprocess(const char **argv, int argc, 
                              sys::Path &ResourceDir, bool bugreport,
                              bool versionOnly, sys::Path &apiMapPath)
@@ -360,7 +653,8 @@ static int CompileSubprocess(const char **argv, int argc,
   if (bugreport)
     HeaderSearchOpts.Verbose = 1;
 
-  if (FrontendOpts.ProgramAction != frontend::PrintPreprocessedInput)
+  if (FrontendOpts.ProgramAction != frontend::PrintPreprocessedInput &&
+      FrontendOpts.ProgramAction != frontend::GeneratePCH)
     FrontendOpts.ProgramAction = frontend::EmitBC;
   if (bugreport)
     FrontendOpts.ProgramAction = frontend::PrintPreprocessedInput;
@@ -386,8 +680,18 @@ static int CompileSubprocess(const char **argv, int argc,
 
   // Set triple
   Clang.getInvocation().getTargetOpts().Triple = "clambc-generic-generic";
-  // Set default include
-  Clang.getInvocation().getPreprocessorOpts().Includes.push_back("bytecode.h");
+  // Set default include, from the precompiled header if there is a usable one
+  PreprocessorOptions &PPOpts = Clang.getInvocation().getPreprocessorOpts();
+  std::string PCH;
+  if (FrontendOpts.ProgramAction == frontend::EmitBC)
+    PCH = findPCH(Clang, argv, cc1_argc, ResourceDir);
+  if (!PCH.empty()) {
+    // Like -include-pch: the PCH replaces the include of its original file
+    PPOpts.ImplicitPCHInclude = PCH;
+    PPOpts.Includes.push_back(
+      PCHReader::getOriginalSourceFile(PCH, Clang.getDiagnostics()));
+  } else if (FrontendOpts.ProgramAction != frontend::GeneratePCH)
+    PPOpts.Includes.push_back("bytecode.h");
 
   // Set an LLVM error handler.
   llvm::llvm_install_error_handler(LLVMErrorHandler,
@@ -430,8 +734,8 @@ static int CompileSubprocess(const char **argv, int argc,
     return 2;
   raw_fd_ostream *fd = 0;
   if (FrontendOpts.ProgramAction == frontend::EmitBC) {
-    // replace output file of compiler with a tempfile,
-    // and save the final output filename.
+    // open the final output file, the frontend itself doesn't write any
+    // output.
     std::string FinalOutput = FrontendOpts.OutputFile;
     if (FinalOutput.empty()) {
       if (Input == "-")
@@ -442,131 +746,216 @@ static int CompileSubprocess(const char **argv, int argc,
         FinalOutput = P.str();
       }
     }
-    llvm::raw_fd_ostream *tmpfd;
     std::string Err2;
     fd = Clang.createOutputFile(FinalOutput, Err2, false);
     if (!fd) {
       Clang.getDiagnostics().Report(clang::diag::err_drv_unable_to_make_temp) << Err2;
       return 1;
     }
-    sys::Path P(sys::Path(FinalOutput).getBasename());
-    P.appendSuffix("tmp.bc");
-    FrontendOpts.OutputFile = P.str();
-    tmpfd = Clang.createOutputFile(P.str(), Err2, true);
-    if (!tmpfd) {
-      Clang.getDiagnostics().Report(clang::diag::err_drv_unable_to_make_temp) << Err2;
-      return 1;
-    }
-    delete tmpfd;
-
-    sys::RemoveFileOnSignal(sys::Path(FrontendOpts.OutputFile));
   }
 
+  char srcp[] = "-clambc-src";
   if (!FrontendOpts.Inputs.empty()) {
-    char srcp[] = "-clambc-src";
     llvmArgs.push_back(srcp);
     llvmArgs.push_back(strdup(Input.c_str()));
   }
 
+  // -clambc-time-passes reports memory usage too, which is LLVM's
+  // -track-memory.
+  char trackm[] = "-track-memory";
+  for (unsigned i=0;i<llvmArgs.size();i++) {
+    if (StringRef(llvmArgs[i]) == "-clambc-time-passes") {
+      llvmArgs.push_back(trackm);
+      break;
+    }
+  }
+
   // Parse LLVM commandline args
   cl::ParseCommandLineOptions(llvmArgs.size(), &llvmArgs[0]);
 
 
-  sys::Path TmpRe2C("clambc-compiler-re2c-out");
-  if (!FrontendOpts.Inputs.empty()) {
-    char re2c_args[] = "--no-generation-date";
-    char re2c_o[] = "-o";
-    char name[] = "";
-    char *args[6] = {
-      name,
-      re2c_args,
-      re2c_o,
-      NULL,
-      NULL,
-      NULL
-    };
-    args[4] = strdup(Input.c_str());
-    std::string ErrMsg("");
-    if (TmpRe2C.createTemporaryFileOnDisk(true, &ErrMsg)) {
-      Clang.getDiagnostics().Report(clang::diag::err_drv_unable_to_make_temp) <<
-        ErrMsg;
+  // Read the source into memory, and run re2c on it if it contains any
+  // re2c blocks. Clang is handed the (possibly re2c generated) buffer directly,
+  // so no temporary files are needed.
+  const MemoryBuffer *MainBuf = 0;
+  std::string Dir = getCacheDir();
+  bool UseCache = !Dir.empty() &&
+    FrontendOpts.ProgramAction == frontend::EmitBC;
+  CacheKey Key;
+  // The header is precompiled straight from disk, so that the PCH records the
+  // real file.
+  if (!FrontendOpts.Inputs.empty() &&
+      FrontendOpts.ProgramAction != frontend::GeneratePCH) {
+    std::string ErrMsg;
+    MemoryBuffer *Src = MemoryBuffer::getFileOrSTDIN(Input, &ErrMsg);
+    if (!Src) {
+      Clang.getDiagnostics().Report(clang::diag::err_fe_error_reading) << Input;
       return 1;
     }
-    sys::RemoveFileOnSignal(TmpRe2C);
-    args[3] = strdup(TmpRe2C.str().c_str());
-    int ret = re2c_main(5, args);
-    if (ret) {
-      Clang.getDiagnostics().Report(clang::diag::err_drv_command_failed) <<
-        "re2c" << ret;
-      return 1;
+    if (Input == "-")
+      Input = "<stdin>";
+    MainBuf = Src;
+    StringRef Data(Src->getBufferStart(), Src->getBufferSize());
+    // the original source is embedded into the output too
+    Key.add(Data);
+    if (Data.find("/*!") != StringRef::npos) {
+      char re2c_args[] = "--no-generation-date";
+      char re2c_o[] = "-o";
+      char name[] = "";
+      char *args[6] = {
+        name,
+        re2c_args,
+        re2c_o,
+        NULL,
+        NULL,
+        NULL
+      };
+      std::string OutName = Input + ".re2c";
+      args[3] = strdup(OutName.c_str());
+      args[4] = strdup(Input.c_str());
+      char *Out;
+      size_t OutLen;
+      sys::TimeValue Start = sys::TimeValue::now();
+      int ret = re2c_main_buffer(5, args, Src->getBufferStart(),
+                                 Src->getBufferSize(), &Out, &OutLen);
+      Stats.Re2c = getElapsed(Start);
+      free(args[3]);
+      free(args[4]);
+      delete Src;
+      if (ret) {
+        Clang.getDiagnostics().Report(clang::diag::err_drv_command_failed) <<
+          "re2c" << ret;
+        return 1;
+      }
+      MainBuf = MemoryBuffer::getMemBufferCopy(Out, Out + OutLen,
+                                               Input.c_str());
+      free(Out);
     }
-    Input = TmpRe2C.str();
   }
 
-  // Create a file manager object to provide access to and cache the
-  // filesystem.
-  Clang.createFileManager();
+  OwningPtr<CompileCache> Cache;
+  std::string CacheKeyStr;
+  if (UseCache && MainBuf) {
+    // The key is computed from the preprocessed source, so that changes in
+    // included headers are noticed. Run the preprocessor with diagnostics
+    // suppressed, they are reported by the real compilation on a miss.
+    Cache.reset(new CompileCache(Dir, (uint64_t)CacheSize << 20));
+    addCompileInputs(Key, argv, argc, apiMapPath);
+    const MemoryBuffer *Copy =
+      MemoryBuffer::getMemBufferCopy(MainBuf->getBufferStart(),
+                                     MainBuf->getBufferEnd(), Input.c_str());
+    // The headers must be part of the key, so don't use the PCH here
+    PPOpts.ImplicitPCHInclude.clear();
+    createSourceManagers(Clang, Input, MainBuf);
+    MainBuf = Copy;
+    std::string Preprocessed;
+    PreprocessToStringAction PPAct(Preprocessed);
+    Clang.getDiagnostics().setSuppressAllDiagnostics(true);
+    if (PPAct.BeginSourceFile(Clang, Input, false)) {
+      PPAct.Execute();
+      PPAct.EndSourceFile();
+    }
+    Clang.getDiagnostics().setSuppressAllDiagnostics(false);
+    Key.add(Preprocessed);
+    CacheKeyStr = Key.final();
 
-  // Create the source manager.
-  Clang.createSourceManager();
+    std::string Data;
+    if (Cache->lookup(CacheKeyStr, Data)) {
+      *fd << Data;
+      delete fd;
+      Stats.OutputSize = Data.size();
+      writeStats(Input, Opts.OptimizationLevel, true);
+      return 0;
+    }
+    // The preprocessor can't be reused, start over for the real compile
+    PPOpts.ImplicitPCHInclude = PCH;
+    Clang.takePreprocessor();
+    Clang.takeSourceManager();
+    Clang.takeFileManager();
+  }
 
-  // Create the preprocessor.
-  Clang.createPreprocessor();
+  createSourceManagers(Clang, Input, MainBuf);
 
   llvm::OwningPtr<FrontendAction> Act(CreateFrontendAction(Clang));
 
+  Module *M = 0;
+  sys::TimeValue Start = sys::TimeValue::now();
   if (Act && Act->BeginSourceFile(Clang, Input, false)) {
     Act->Execute();
     Act->EndSourceFile();
+    if (FrontendOpts.ProgramAction == frontend::EmitBC)
+      M = static_cast<CodeGenAction*>(Act.get())->takeModule();
   }
+  Stats.Frontend = getElapsed(Start);
 
-  TmpRe2C.eraseFromDisk();// erase tempfile
   int ret = Clang.getDiagnostics().getNumErrors() != 0;
-  if (ret)
+  if (ret) {
+    delete M;
     return ret;
+  }
 
   if (FrontendOpts.ProgramAction != frontend::EmitBC) {
     // stop processing if not compiling a final .cbc file
     return 0;
   }
 
-  ret = compileInternal(FrontendOpts.OutputFile.c_str(), Opts.OptimizationLevel,
-                        Opts.OptimizeSize, argv[0], fd, Clang);
-  // Erase temp file, we need to do this here since OutputFile is a tempfile
-  // only if action was EmitBC
-  sys::Path(FrontendOpts.OutputFile).eraseFromDisk();
-  return ret;
+  if (!Cache) {
+    ret = compileInternal(M, Opts.OptimizationLevel, Opts.OptimizeSize,
+                          argv[0], fd, Clang);
+    if (!ret)
+      writeStats(Input, Opts.OptimizationLevel, false);
+    return ret;
+  }
+
+  // Compile into memory, so that the output can be stored in the cache too
+  std::string Output;
+  ret = compileInternal(M, Opts.OptimizationLevel, Opts.OptimizeSize,
+                        argv[0], new raw_string_ostream(Output), Clang);
+  if (ret) {
+    delete fd;
+    return ret;
+  }
+  *fd << Output;
+  delete fd;
+  Cache->store(CacheKeyStr, Output);
+  writeStats(Input, Opts.OptimizationLevel, false);
+  return 0;
 }
 
-int CompileFile(int argc, const char **argv, const sys::Path* out,
-                const sys::Path* err, raw_ostream &Err, bool bugreport,
-                bool versionOnly)
+static bool findAPIMap(const char *argv0, sys::Path &ResourceDir,
+                       sys::Path &apiMapPath, raw_ostream &Err)
 {
-  sys::PrintStackTraceOnErrorSignal();
-  PrettyStackTraceProgram X(argc, argv);
-  llvm_shutdown_obj Y;
-
-  std::string ErrMsg;
   // Find API map file
-  sys::Path ResourceDir(CompilerInvocation::GetResourcesPath(argv[0],
-                                                             (void*)(intptr_t)GetExecutablePath));
-  sys::Path apiMapPath(ResourceDir);
+  ResourceDir = sys::Path(CompilerInvocation::GetResourcesPath(argv0,
+                                                               (void*)(intptr_t)GetExecutablePath));
+  apiMapPath = ResourceDir;
   apiMapPath.appendComponent("include");
   apiMapPath.appendComponent("bytecode_api_decl.c.h");
   if (!apiMapPath.exists()) {
     Err << "Cannot find ClamAV API map: " + apiMapPath.str() << "\n";
-    return 2;
+    return false;
   }
+  return true;
+}
 
+// Starts compiling one unit in a child process. Returns the pid of the child,
+// or -1 on failure. If err is NULL a temporary file is created for the
+// child's stderr, and returned in err.
+static pid_t StartUnit(int argc, const char **argv, sys::Path &ResourceDir,
+                       sys::Path &apiMapPath, const sys::Path* out,
+                       const sys::Path* &err, raw_ostream &Err, bool bugreport,
+                       bool versionOnly)
+{
+  std::string ErrMsg;
   // Create tempfile for stderr, unless already specified
-  sys::Path empty;
   const sys::Path* orig_err = err;
   if (!err) {
     sys::Path *newerr = new sys::Path("clambc-compiler-stderr");
     ErrMsg.clear();
     if (newerr->createTemporaryFileOnDisk(true, &ErrMsg)) {
       Err << "Failed to create temporary file for stderr!\n";
-      return 2;
+      delete newerr;
+      return -1;
     } else {
       err = newerr;
     }
@@ -577,7 +966,12 @@ int CompileFile(int argc, const char **argv, const sys::Path* out,
   pid_t pid = fork();
   if (pid == -1) {
     Err << "fork() failed: " << sys::StrError() << "\n";
-    return 2;
+    if (err != orig_err) {
+      err->eraseFromDisk();
+      delete err;
+      err = orig_err;
+    }
+    return -1;
   }
 
   if (!pid) {
@@ -592,16 +986,25 @@ int CompileFile(int argc, const char **argv, const sys::Path* out,
       dup2(fd, fileno(stderr));
     }
 
-    _Exit(CompileSubprocess(argv, argc, ResourceDir, bugreport, versionOnly,
-                           apiMapPath));
-  }
-  int Res = 0;
-  while (waitpid(pid, &Res, 0) != pid) {
-    if (errno == EINTR)
-      continue;
-    Err << "waitpid failed" << sys::StrError() << "\n";
-    return 2;
+    int ret = CompileSubprocess(argv, argc, ResourceDir, bugreport,
+                                versionOnly, apiMapPath);
+    // The pass timing report is printed when LLVM shuts down, static
+    // destructors don't run on _Exit.
+    if (TimePassesIsEnabled)
+      llvm_shutdown();
+    _Exit(ret);
   }
+  return pid;
+}
+
+// Reports the result of a unit started by StartUnit, given the status
+// returned by waitpid(). Creates the bugreport if the child crashed, and
+// removes the temporary stderr file (if StartUnit created one).
+static int FinishUnit(int Res, int argc, const char **argv,
+                      sys::Path &ResourceDir, sys::Path &apiMapPath,
+                      const sys::Path* err, const sys::Path* orig_err,
+                      raw_ostream &Err, bool bugreport)
+{
   if (WIFEXITED(Res))
     Res = WEXITSTATUS(Res);
   else if (WIFSIGNALED(Res))
@@ -610,7 +1013,8 @@ int CompileFile(int argc, const char **argv, const sys::Path* out,
     printFile(err);
   }
   if (Res < 0) {
-    Res = printICE(-Res, argv, Err, bugreport, argc, argv, err);
+    Res = printICE(-Res, argv, Err, bugreport, argc, argv, err, ResourceDir,
+                   apiMapPath);
   } else if (Res > 0) {
     Err << "\nCompiler exited with code " << Res << "!\n";
   }
@@ -621,3 +1025,758 @@ int CompileFile(int argc, const char **argv, const sys::Path* out,
   return Res;
 }
 
+static int CompileUnit(int argc, const char **argv, sys::Path &ResourceDir,
+                       sys::Path &apiMapPath, const sys::Path* out,
+                       const sys::Path* err, raw_ostream &Err, bool bugreport,
+                       bool versionOnly)
+{
+  const sys::Path* orig_err = err;
+  pid_t pid = StartUnit(argc, argv, ResourceDir, apiMapPath, out, err, Err,
+                        bugreport, versionOnly);
+  if (pid == -1)
+    return 2;
+  int Res = 0;
+  while (waitpid(pid, &Res, 0) != pid) {
+    if (errno == EINTR)
+      continue;
+    Err << "waitpid failed" << sys::StrError() << "\n";
+    return 2;
+  }
+  return FinishUnit(Res, argc, argv, ResourceDir, apiMapPath, err, orig_err,
+                    Err, bugreport);
+}
+
+int CompileFile(int argc, const char **argv, const sys::Path* out,
+                const sys::Path* err, raw_ostream &Err, bool bugreport,
+                bool versionOnly)
+{
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  sys::Path ResourceDir, apiMapPath;
+  if (!findAPIMap(argv[0], ResourceDir, apiMapPath, Err))
+    return 2;
+  return CompileUnit(argc, argv, ResourceDir, apiMapPath, out, err, Err,
+                     bugreport, versionOnly);
+}
+
+// A compilation unit of a batch: the full argument vector for one
+// clambc-compiler invocation, NULL terminated (printICE relies on that).
+namespace {
+struct BatchUnit {
+  std::vector<std::string> Args;
+  std::vector<const char*> Argv;
+  std::string Input;
+  uint64_t Size;
+  int Result;
+
+  void finalize() {
+    Argv.clear();
+    for (std::vector<std::string>::iterator I=Args.begin(), E=Args.end();
+         I != E; ++I)
+      Argv.push_back(I->c_str());
+    Argv.push_back(0);
+  }
+  int argc() const { return Argv.size() - 1; }
+  const char **argv() { return &Argv[0]; }
+};
+
+// A unit being compiled by a child process.
+struct RunningUnit {
+  BatchUnit *Unit;
+  const llvm::sys::Path *Err;
+};
+}
+
+static void splitArgs(StringRef Line, std::vector<std::string> &Out)
+{
+  const char *WS = " \t\r\v\f";
+  while (!Line.empty()) {
+    size_t Start = Line.find_first_not_of(WS);
+    if (Start == StringRef::npos)
+      break;
+    Line = Line.substr(Start);
+    size_t End = Line.find_first_of(WS);
+    Out.push_back(Line.substr(0, End).str());
+    if (End == StringRef::npos)
+      break;
+    Line = Line.substr(End);
+  }
+}
+
+// Options whose value is the next argument.
+static bool hasSeparateValue(StringRef Arg)
+{
+  static const char *const SeparateOpts[] = {
+    "-o", "-I", "-D", "-U", "-include", "-x", "-MF", "-MT", "-MQ", 0
+  };
+  for (const char *const *O = SeparateOpts; *O; O++)
+    if (Arg == *O)
+      return true;
+  return false;
+}
+
+// Returns the input file among the arguments of a unit, skipping the values of
+// options that take a separate argument.
+static std::string findInput(const std::vector<std::string> &Args)
+{
+  for (unsigned i=0;i<Args.size();i++) {
+    StringRef Arg(Args[i]);
+    if (Arg.startswith("-")) {
+      if (hasSeparateValue(Arg))
+        i++;
+      continue;
+    }
+    return Args[i];
+  }
+  return "";
+}
+
+// Builds the list of units from the commandline:
+//  clambc-compiler <common opts> [-j N] -batch <input>... [-- <llvm opts>]
+//  clambc-compiler <common opts> [-j N] -batch-file <manifest> [-- <llvm opts>]
+//  clambc-compiler <common opts> -j N <input>... [-- <llvm opts>]
+// Each line of the manifest holds the inputs and per-unit options of one unit
+// (for example "foo.c -o out/foo.cbc -DFOO"), lines starting with # are
+// comments. Common options are prepended to each unit.
+static bool parseBatch(int argc, const char **argv,
+                       std::vector<BatchUnit> &Units, unsigned &Jobs,
+                       raw_ostream &Err)
+{
+  std::vector<std::string> Common, LLVMArgs, Inputs, Manifests;
+  // Positions in Common of the arguments that are inputs when there is
+  // neither -batch nor -batch-file, only -j.
+  std::vector<unsigned> Bare;
+  bool inBatch = false, hasOutput = false;
+  int i;
+  Jobs = 1;
+  for (i=1;i<argc;i++) {
+    StringRef Arg(argv[i]);
+    if (Arg == "--") {
+      for (i++;i<argc;i++)
+        LLVMArgs.push_back(argv[i]);
+      break;
+    }
+    if (Arg.startswith("-j")) {
+      StringRef Val = Arg.substr(2);
+      if (Val.empty() && i+1 < argc)
+        Val = argv[++i];
+      if (Val.getAsInteger(10, Jobs) || !Jobs) {
+        Err << "Invalid number of jobs for -j: '" << Val << "'\n";
+        return false;
+      }
+      continue;
+    }
+    if (Arg == "-batch") {
+      inBatch = true;
+      continue;
+    }
+    if (Arg == "-batch-file") {
+      if (i+1 == argc) {
+        Err << "-batch-file requires a manifest file argument\n";
+        return false;
+      }
+      Manifests.push_back(argv[++i]);
+      continue;
+    }
+    if (Arg.startswith("-batch-file=")) {
+      Manifests.push_back(Arg.substr(strlen("-batch-file=")).str());
+      continue;
+    }
+    if (inBatch && !Arg.startswith("-")) {
+      Inputs.push_back(Arg.str());
+      continue;
+    }
+    if (Arg == "-o")
+      hasOutput = true;
+    if (!Arg.startswith("-"))
+      Bare.push_back(Common.size());
+    Common.push_back(Arg.str());
+    if (hasSeparateValue(Arg) && i+1 < argc)
+      Common.push_back(argv[++i]);
+  }
+  if (!inBatch && Manifests.empty()) {
+    for (unsigned j=Bare.size();j > 0;j--) {
+      Inputs.insert(Inputs.begin(), Common[Bare[j-1]]);
+      Common.erase(Common.begin() + Bare[j-1]);
+    }
+  }
+
+  std::vector<std::vector<std::string> > UnitArgs;
+  for (std::vector<std::string>::iterator I=Inputs.begin(), E=Inputs.end();
+       I != E; ++I)
+    UnitArgs.push_back(std::vector<std::string>(1, *I));
+  for (std::vector<std::string>::iterator I=Manifests.begin(),
+       E=Manifests.end(); I != E; ++I) {
+    std::string ErrMsg;
+    MemoryBuffer *Buffer = MemoryBuffer::getFileOrSTDIN(*I, &ErrMsg);
+    if (!Buffer) {
+      Err << "Cannot open batch manifest '" << *I << "': " << ErrMsg << "\n";
+      return false;
+    }
+    StringRef Data(Buffer->getBufferStart(), Buffer->getBufferSize());
+    while (!Data.empty()) {
+      std::pair<StringRef, StringRef> Split = Data.split('\n');
+      Data = Split.second;
+      std::vector<std::string> Args;
+      splitArgs(Split.first, Args);
+      if (Args.empty() || Args[0][0] == '#')
+        continue;
+      UnitArgs.push_back(Args);
+    }
+    delete Buffer;
+  }
+
+  if (UnitArgs.empty()) {
+    Err << "No inputs given for batch compilation\n";
+    return false;
+  }
+  if (hasOutput && UnitArgs.size() > 1) {
+    Err << "Cannot specify -o for more than one batch unit, "
+      "use a manifest with per-unit -o instead\n";
+    return false;
+  }
+
+  Units.resize(UnitArgs.size());
+  for (unsigned u=0;u<UnitArgs.size();u++) {
+    BatchUnit &U = Units[u];
+    U.Args.push_back(argv[0]);
+    U.Args.insert(U.Args.end(), Common.begin(), Common.end());
+    U.Args.insert(U.Args.end(), UnitArgs[u].begin(), UnitArgs[u].end());
+    if (!LLVMArgs.empty()) {
+      U.Args.push_back("--");
+      U.Args.insert(U.Args.end(), LLVMArgs.begin(), LLVMArgs.end());
+    }
+    U.finalize();
+    U.Input = findInput(UnitArgs[u]);
+    U.Result = 0;
+    struct stat st;
+    U.Size = stat(U.Input.c_str(), &st) ? 0 : st.st_size;
+  }
+  return true;
+}
+
+bool IsBatchInvocation(int argc, const char **argv)
+{
+  for (int i=1;i<argc;i++) {
+    StringRef Arg(argv[i]);
+    if (Arg == "--")
+      break;
+    if (Arg == "-batch" || Arg == "-batch-file" ||
+        Arg.startswith("-batch-file=") || Arg.startswith("-j"))
+      return true;
+  }
+  return false;
+}
+
+static bool compareUnitSize(const BatchUnit *A, const BatchUnit *B)
+{
+  return A->Size > B->Size;
+}
+
+int CompileBatch(int argc, const char **argv, raw_ostream &Err)
+{
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  std::vector<BatchUnit> Units;
+  unsigned Jobs;
+  if (!parseBatch(argc, argv, Units, Jobs, Err))
+    return 2;
+
+  // Do the per-process setup once, the forked compiler for each unit inherits
+  // it.
+  sys::Path ResourceDir, apiMapPath;
+  if (!findAPIMap(argv[0], ResourceDir, apiMapPath, Err))
+    return 2;
+  LLVMInitializeClamBCTargetInfo();
+  LLVMInitializeClamBCTarget();
+
+  // Start the largest units first, so that a big unit started last doesn't
+  // leave the other workers idle at the end of the build.
+  std::vector<BatchUnit*> Queue;
+  for (std::vector<BatchUnit>::iterator I=Units.begin(), E=Units.end();
+       I != E; ++I)
+    Queue.push_back(&*I);
+  if (Jobs > 1)
+    std::stable_sort(Queue.begin(), Queue.end(), compareUnitSize);
+
+  // Keep up to Jobs children running, each idle worker slot takes the next
+  // unit from the queue. Diagnostics of a unit are written to its own stderr
+  // file and printed when it finishes, so output of units doesn't interleave.
+  std::map<pid_t, RunningUnit> Active;
+  unsigned next = 0;
+  while (next < Queue.size() || !Active.empty()) {
+    while (next < Queue.size() && Active.size() < Jobs) {
+      BatchUnit *U = Queue[next++];
+      const sys::Path *UErr = 0;
+      pid_t pid = StartUnit(U->argc(), U->argv(), ResourceDir, apiMapPath, 0,
+                            UErr, Err, false, false);
+      if (pid == -1) {
+        U->Result = 2;
+        continue;
+      }
+      RunningUnit R = { U, UErr };
+      Active[pid] = R;
+    }
+    if (Active.empty())
+      continue;
+    int Res = 0;
+    pid_t pid = waitpid(-1, &Res, 0);
+    if (pid == -1) {
+      if (errno == EINTR)
+        continue;
+      Err << "waitpid failed" << sys::StrError() << "\n";
+      return 2;
+    }
+    std::map<pid_t, RunningUnit>::iterator I = Active.find(pid);
+    if (I == Active.end())
+      continue;
+    RunningUnit R = I->second;
+    Active.erase(I);
+    R.Unit->Result = FinishUnit(Res, R.Unit->argc(), R.Unit->argv(),
+                                ResourceDir, apiMapPath, R.Err, 0, Err, false);
+  }
+
+  unsigned failed = 0;
+  int Ret = 0;
+  for (std::vector<BatchUnit>::iterator I=Units.begin(), E=Units.end();
+       I != E; ++I) {
+    if (!I->Result)
+      continue;
+    if (!failed)
+      Err << "\nFailed units:\n";
+    failed++;
+    Err << "  " << (I->Input.empty() ? "<no input>" : I->Input.c_str()) <<
+      ": exit code " << I->Result << " (";
+    for (const char **A = I->argv()+1; *A; A++)
+      Err << (A == I->argv()+1 ? "" : " ") << *A;
+    Err << ")\n";
+    // Keep the internal compiler error code if there was one
+    if (Ret != 42)
+      Ret = I->Result;
+  }
+  Err << "Batch compiled " << (Units.size() - failed) << " of " <<
+    Units.size() << " units";
+  if (failed)
+    Err << ", " << failed << " failed";
+  if (Jobs > 1)
+    Err << " using " << Jobs << " jobs";
+  Err << "\n";
+  return Ret;
+}
+
+bool IsCacheInvocation(int argc, const char **argv)
+{
+  return argc > 1 && StringRef(argv[1]) == "-verify-cache";
+}
+
+// clambc-compiler -verify-cache [directory]
+// Checks all entries of the compilation cache, and removes corrupted ones.
+int VerifyCache(int argc, const char **argv, raw_ostream &Err)
+{
+  std::string Dir = argc > 2 ? argv[2] : getCacheDir();
+  if (Dir.empty()) {
+    Err << "No cache directory given, and CLAMBC_CACHE_DIR is not set\n";
+    return 2;
+  }
+  CompileCache Cache(Dir, 0);
+  int corrupt = Cache.verify(Err);
+  return corrupt < 0 ? 2 : corrupt > 0;
+}
+
+// Compiler server
+//
+// clambc-compiler --server[=socket] keeps the target, the parsed API map and
+// the ClamAV headers loaded, and forks a handler for each request received on
+// a Unix domain socket. The handler compiles exactly like the commandline
+// driver does (in yet another child process), so an internal compiler error
+// only affects that request.
+//
+// Request: the working directory followed by the compiler arguments (without
+// argv[0]), each terminated by a NUL byte, and an empty string at the end.
+// Response: a "<exit code> <length>\n" line, followed by <length> bytes of
+// compiler diagnostics.
+
+extern "C" bool ClamBCPreloadAPIMap(const char *File);
+
+static bool startsWithOpt(const char *Arg, const char *Opt)
+{
+  StringRef A(Arg);
+  return A == Opt || A.startswith(std::string(Opt) + "=");
+}
+
+static std::string getServerSocket(const char *Arg)
+{
+  const char *eq = strchr(Arg, '=');
+  if (eq)
+    return eq+1;
+  if (const char *path = getenv("CLAMBC_SERVER_SOCKET"))
+    return path;
+  std::string Path;
+  raw_string_ostream OS(Path);
+  OS << "/tmp/clambc-compiler-" << getuid() << ".sock";
+  return OS.str();
+}
+
+bool IsServerInvocation(int argc, const char **argv)
+{
+  return argc > 1 && (startsWithOpt(argv[1], "--server") ||
+                      startsWithOpt(argv[1], "--client"));
+}
+
+static bool writeAll(int fd, const char *Data, size_t Len)
+{
+  while (Len) {
+    ssize_t n = write(fd, Data, Len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    Data += n;
+    Len -= n;
+  }
+  return true;
+}
+
+static bool readAll(int fd, std::string &Data)
+{
+  char buf[4096];
+  for (;;) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (!n)
+      return true;
+    Data.append(buf, n);
+  }
+}
+
+static void sendResponse(int conn, int Res, StringRef Output)
+{
+  std::string Header;
+  raw_string_ostream OS(Header);
+  OS << Res << " " << Output.size() << "\n";
+  OS.flush();
+  writeAll(conn, Header.data(), Header.size());
+  writeAll(conn, Output.data(), Output.size());
+}
+
+// Reads the ClamAV headers into memory, they are remapped by
+// createSourceManagers() in each compiler forked by the server.
+static void preloadHeaders(const sys::Path &ResourceDir)
+{
+  sys::Path IncludeDir(ResourceDir);
+  IncludeDir.appendComponent("include");
+  std::set<sys::Path> Files;
+  if (IncludeDir.getDirectoryContents(Files, 0))
+    return;
+  for (std::set<sys::Path>::iterator I=Files.begin(), E=Files.end();
+       I != E; ++I) {
+    sys::PathWithStatus P(*I);
+    const sys::FileStatus *FS = P.getFileStatus();
+    if (!FS || !FS->isFile || P.getSuffix() != "h")
+      continue;
+    PreloadedFile F;
+    // must match the name the header search uses
+    F.Name = IncludeDir.str() + "/" + P.getLast().str();
+    F.Buffer = MemoryBuffer::getFile(P.str());
+    F.ModTime = FS->modTime.toEpochTime();
+    if (F.Buffer)
+      PreloadedHeaders.push_back(F);
+  }
+}
+
+// Reads a request, up to the terminating empty string.
+static bool readRequest(int conn, std::vector<std::string> &Args)
+{
+  std::string Request;
+  size_t pos = 0;
+  char buf[4096];
+  for (;;) {
+    size_t end;
+    while ((end = Request.find('\0', pos)) != std::string::npos) {
+      if (end == pos)
+        return true;
+      Args.push_back(Request.substr(pos, end - pos));
+      pos = end + 1;
+    }
+    ssize_t n = read(conn, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    Request.append(buf, n);
+  }
+}
+
+static void serveRequest(int conn, const char *argv0, sys::Path &ResourceDir,
+                         sys::Path &apiMapPath)
+{
+  std::vector<std::string> Args;
+  if (!readRequest(conn, Args) || Args.empty()) {
+    sendResponse(conn, 2, "Malformed request\n");
+    return;
+  }
+  if (chdir(Args[0].c_str())) {
+    sendResponse(conn, 2, "Cannot change to directory " + Args[0] + ": " +
+                 strerror(errno) + "\n");
+    return;
+  }
+
+  std::vector<const char*> Argv;
+  Argv.push_back(argv0);
+  for (unsigned i=1;i<Args.size();i++)
+    Argv.push_back(Args[i].c_str());
+  Argv.push_back(0);
+  int argc = Argv.size() - 1;
+
+  // Collect everything the driver prints
+  std::string ErrMsg;
+  sys::Path Out("clambc-server-out");
+  if (Out.createTemporaryFileOnDisk(true, &ErrMsg)) {
+    sendResponse(conn, 2, "Cannot create temporary file: " + ErrMsg + "\n");
+    return;
+  }
+  int fd = open(Out.c_str(), O_WRONLY);
+  if (fd < 0) {
+    sendResponse(conn, 2, "Cannot open temporary file\n");
+    Out.eraseFromDisk();
+    return;
+  }
+  dup2(fd, 1);
+  dup2(fd, 2);
+  close(fd);
+
+  int Res;
+  if (IsBatchInvocation(argc, &Argv[0]))
+    Res = CompileBatch(argc, &Argv[0], errs());
+  else
+    Res = CompileUnit(argc, &Argv[0], ResourceDir, apiMapPath, 0, 0, errs(),
+                      false, false);
+  outs().flush();
+  errs().flush();
+
+  OwningPtr<MemoryBuffer> Output(MemoryBuffer::getFile(Out.str()));
+  Out.eraseFromDisk();
+  sendResponse(conn, Res, Output ? Output->getBuffer() : "");
+}
+
+static char ServerSocketPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static void removeServerSocket(int sig)
+{
+  unlink(ServerSocketPath);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+// Reaps the finished request handlers as soon as they exit, so that an idle
+// server doesn't keep zombies around.
+static void reapHandlers(int)
+{
+  int saved_errno = errno;
+  while (waitpid(-1, 0, WNOHANG) > 0) {}
+  errno = saved_errno;
+}
+
+static int RunServer(int argc, const char **argv, raw_ostream &Err)
+{
+  sys::PrintStackTraceOnErrorSignal();
+  llvm_shutdown_obj Y;
+
+  sys::Path ResourceDir, apiMapPath;
+  if (!findAPIMap(argv[0], ResourceDir, apiMapPath, Err))
+    return 2;
+  // Do all the work that is the same for every compilation only once
+  LLVMInitializeClamBCTargetInfo();
+  LLVMInitializeClamBCTarget();
+  if (!ClamBCPreloadAPIMap(apiMapPath.c_str()))
+    return 2;
+  preloadHeaders(ResourceDir);
+
+  std::string Path = getServerSocket(argv[1]);
+  struct sockaddr_un addr;
+  if (Path.size() >= sizeof(addr.sun_path)) {
+    Err << "Socket path too long: " << Path << "\n";
+    return 2;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, Path.c_str());
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    Err << "Cannot create socket: " << sys::StrError() << "\n";
+    return 2;
+  }
+  if (!connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    Err << "A server is already listening on " << Path << "\n";
+    return 2;
+  }
+  close(sock);
+  // Remove the socket left behind by a server that was killed
+  unlink(Path.c_str());
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  // Only the user running the server may connect
+  mode_t old_umask = umask(077);
+  if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(sock, 64)) {
+    Err << "Cannot listen on " << Path << ": " << sys::StrError() << "\n";
+    return 2;
+  }
+  umask(old_umask);
+  strcpy(ServerSocketPath, Path.c_str());
+  signal(SIGINT, removeServerSocket);
+  signal(SIGTERM, removeServerSocket);
+  signal(SIGCHLD, reapHandlers);
+  Err << "Listening on " << Path << "\n";
+  Err.flush();
+
+  for (;;) {
+    int conn = accept(sock, 0, 0);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      Err << "accept failed: " << sys::StrError() << "\n";
+      return 2;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(sock);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      // the handler waits for its own children
+      signal(SIGCHLD, SIG_DFL);
+      serveRequest(conn, argv[0], ResourceDir, apiMapPath);
+      close(conn);
+      _Exit(0);
+    }
+    if (pid == -1) {
+      sendResponse(conn, 2, "Cannot fork\n");
+    }
+    close(conn);
+  }
+}
+
+// clambc-compiler --client[=socket] <compiler arguments>
+// Compiles using a running compiler server.
+static int RunClient(int argc, const char **argv, raw_ostream &Err)
+{
+  std::string Path = getServerSocket(argv[1]);
+  struct sockaddr_un addr;
+  if (Path.size() >= sizeof(addr.sun_path)) {
+    Err << "Socket path too long: " << Path << "\n";
+    return 2;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, Path.c_str());
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    Err << "Cannot connect to compiler server at " << Path << ": " <<
+      sys::StrError() << "\n";
+    return 2;
+  }
+
+  std::string Request = sys::Path::GetCurrentDirectory().str();
+  Request += '\0';
+  for (int i=2;i<argc;i++) {
+    Request += argv[i];
+    Request += '\0';
+  }
+  Request += '\0';
+  std::string Response;
+  if (!writeAll(sock, Request.data(), Request.size()) ||
+      shutdown(sock, SHUT_WR) || !readAll(sock, Response)) {
+    Err << "Communication with compiler server failed: " << sys::StrError() <<
+      "\n";
+    close(sock);
+    return 2;
+  }
+  close(sock);
+
+  size_t eol = Response.find('\n');
+  std::pair<StringRef, StringRef> Header =
+    StringRef(Response).substr(0, eol).split(' ');
+  int Res;
+  unsigned long long Len;
+  if (eol == std::string::npos || Header.first.getAsInteger(10, Res) ||
+      Header.second.getAsInteger(10, Len) || Len != Response.size() - eol - 1) {
+    Err << "Malformed response from compiler server\n";
+    return 2;
+  }
+  Err << StringRef(Response).substr(eol + 1);
+  return Res;
+}
+
+int ServerMain(int argc, const char **argv, raw_ostream &Err)
+{
+  if (startsWithOpt(argv[1], "--server"))
+    return RunServer(argc, argv, Err);
+  return RunClient(argc, argv, Err);
+}
+
+bool IsCreatePCHInvocation(int argc, const char **argv)
+{
+  return argc > 1 && StringRef(argv[1]) == "--create-pch";
+}
+
+// clambc-compiler --create-pch
+// Precompiles bytecode.h in the compiler's resource directory, findPCH() then
+// uses it automatically. Run by the build and by make install.
+int CreatePCH(int argc, const char **argv, raw_ostream &Err)
+{
+  sys::PrintStackTraceOnErrorSignal();
+  llvm_shutdown_obj Y;
+
+  sys::Path ResourceDir, apiMapPath;
+  if (!findAPIMap(argv[0], ResourceDir, apiMapPath, Err))
+    return 2;
+  sys::Path IncludeDir(ResourceDir);
+  IncludeDir.appendComponent("include");
+  sys::Path Header(IncludeDir);
+  Header.appendComponent("bytecode.h");
+
+  static const struct {
+    const char *Flag;
+    bool Optimize, OptimizeSize;
+  } Variants[] = {
+    {"-O0", false, false},
+    {"-O2", true, false},
+    {"-Os", true, true}
+  };
+  for (unsigned i=0;i<sizeof(Variants)/sizeof(Variants[0]);i++) {
+    sys::Path PCH(IncludeDir);
+    PCH.appendComponent(getPCHName(Variants[i].Optimize,
+                                   Variants[i].OptimizeSize));
+    // Compilers running concurrently must not see a partially written PCH
+    sys::Path Tmp(PCH);
+    std::string ErrMsg;
+    if (Tmp.createTemporaryFileOnDisk(true, &ErrMsg)) {
+      Err << "Cannot create temporary file: " << ErrMsg << "\n";
+      return 2;
+    }
+    const char *Args[] = {
+      argv[0], "-x", "c-header", Header.c_str(), "-emit-pch",
+      "-o", Tmp.c_str(), Variants[i].Flag, 0
+    };
+    int Res = CompileUnit(sizeof(Args)/sizeof(Args[0]) - 1, Args, ResourceDir,
+                          apiMapPath, 0, 0, Err, false, false);
+    if (!Res && Tmp.renamePathOnDisk(PCH, &ErrMsg)) {
+      Err << "Cannot create " << PCH.str() << ": " << ErrMsg << "\n";
+      Res = 2;
+    }
+    if (Res) {
+      Tmp.eraseFromDisk();
+      return Res;
+    }
+  }
+  return 0;
+}
@@ -10,4 +10,12 @@ int CompileFile(int argc, const char **argv,
                 const llvm::sys::Path* out, const llvm::sys::Path* err,
                 llvm::raw_ostream &Err, bool bugreport=false,
                 bool versiononly=false);
+bool IsBatchInvocation(int argc, const char **argv);
+int CompileBatch(int argc, const char **argv, llvm::raw_ostream &Err);
+bool IsCacheInvocation(int argc, const char **argv);
+int VerifyCache(int argc, const char **argv, llvm::raw_ostream &Err);
+bool IsServerInvocation(int argc, const char **argv);
+int ServerMain(int argc, const char **argv, llvm::raw_ostream &Err);
+bool IsCreatePCHInvocation(int argc, const char **argv);
+int CreatePCH(int argc, const char **argv, llvm::raw_ostream &Err);
 #endif
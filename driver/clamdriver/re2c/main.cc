@@ -7,8 +7,10 @@
 
 #include <fstream>
 #include <iostream>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 
 #include "globals.h"
 #include "parser.h"
@@ -203,6 +205,28 @@ static void usage()
 
 using namespace re2c;
 
+// When set, the source is read from this buffer instead of the file named on
+// the commandline, and the output is written to memOutput.
+static const char *memSource = 0;
+static size_t memSourceLen = 0;
+static FILE *memOutput = 0;
+static std::vector<FILE*> memStreams;
+
+static bool open_source(re2c::ifstream_lc &source, const char *sourceFileName)
+{
+	if (memSource)
+	{
+		FILE *fp = fmemopen((void*)memSource, memSourceLen, "r");
+		if (!fp)
+		{
+			return false;
+		}
+		memStreams.push_back(fp);
+		return source.open(fp).is_open();
+	}
+	return source.open(sourceFileName).is_open();
+}
+
 int re2c_main(int argc, char *argv[])
 {
 	int c;
@@ -403,7 +427,7 @@ int re2c_main(int argc, char *argv[])
 		sourceFileName = "<stdin>";
 		source.open(stdin);
 	}
-	else if (!source.open(sourceFileName).is_open())
+	else if (!open_source(source, sourceFileName))
 	{
 		cerr << "re2c: error: cannot open " << sourceFileName << "\n";
 		return 1;
@@ -413,7 +437,15 @@ int re2c_main(int argc, char *argv[])
 	re2c::ofstream_lc output;
 	re2c::ofstream_lc header;
 
-	if (outputFileName == 0 || (sourceFileName[0] == '-' && sourceFileName[1] == '\0'))
+	if (memOutput)
+	{
+		if (outputFileName == 0)
+		{
+			outputFileName = "<stdout>";
+		}
+		output.open(memOutput);
+	}
+	else if (outputFileName == 0 || (sourceFileName[0] == '-' && sourceFileName[1] == '\0'))
 	{
 		outputFileName = "<stdout>";
 		output.open(stdout);
@@ -442,7 +474,7 @@ int re2c_main(int argc, char *argv[])
 
 		re2c::ifstream_lc null_source;
 		
-		if (!null_source.open(sourceFileName).is_open())
+		if (!open_source(null_source, sourceFileName))
 		{
 			cerr << "re2c: error: cannot re-open " << sourceFileName << "\n";
 			return 1;
@@ -464,3 +496,41 @@ int re2c_main(int argc, char *argv[])
 	parse(scanner, output, header.is_open() ? &header : NULL);
 	return 0;
 }
+
+// Runs re2c on the given source buffer instead of a file. The source file name
+// in argv is only used for diagnostics and #line directives. On success the
+// generated code is returned in a malloc()-ed buffer in outbuf, which must be
+// freed by the caller.
+int re2c_main_buffer(int argc, char *argv[], const char *buffer, size_t length,
+                     char **outbuf, size_t *outlen)
+{
+	*outbuf = 0;
+	*outlen = 0;
+	memOutput = open_memstream(outbuf, outlen);
+	if (!memOutput)
+	{
+		cerr << "re2c: error: cannot open output buffer\n";
+		return 1;
+	}
+	memSource = buffer;
+	memSourceLen = length;
+	// the streams are flushed when re2c_main's locals go out of scope,
+	// close the underlying FILEs only afterwards
+	int ret = re2c_main(argc, argv);
+	for (unsigned i = 0; i < memStreams.size(); i++)
+	{
+		fclose(memStreams[i]);
+	}
+	memStreams.clear();
+	memSource = 0;
+	memSourceLen = 0;
+	fclose(memOutput);
+	memOutput = 0;
+	if (ret)
+	{
+		free(*outbuf);
+		*outbuf = 0;
+		*outlen = 0;
+	}
+	return ret;
+}
@@ -5,6 +5,14 @@
 
 int main(int argc, char **argv)
 {
+  if (IsCreatePCHInvocation(argc, (const char**)argv))
+    return CreatePCH(argc, (const char**)argv, llvm::errs());
+  if (IsServerInvocation(argc, (const char**)argv))
+    return ServerMain(argc, (const char**)argv, llvm::errs());
+  if (IsCacheInvocation(argc, (const char**)argv))
+    return VerifyCache(argc, (const char**)argv, llvm::errs());
+  if (IsBatchInvocation(argc, (const char**)argv))
+    return CompileBatch(argc, (const char**)argv, llvm::errs());
   return CompileFile(argc, (const char**)argv, 0, 0, llvm::errs());
 }
 
@@ -0,0 +1,700 @@
+/*
+ *  Standalone runner for compiled bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#include "interpreter.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cmath>
+#include <cstring>
+
+using namespace llvm;
+
+// The API calls of bytecode_api.h, with the semantics of libclamav's
+// bytecode_api.c.
+namespace {
+enum APIKind {
+  API_UNSUPPORTED,
+  API_TEST1, API_TEST2,
+  API_READ, API_WRITE, API_SEEK,
+  API_SETVIRUSNAME,
+  API_DEBUG_PRINT_STR, API_DEBUG_PRINT_STR_START, API_DEBUG_PRINT_STR_NONL,
+  API_DEBUG_PRINT_UINT, API_TRACE, API_TRACE_PTR, API_BYTECODE_RT_ERROR,
+  API_FILE_FIND, API_FILE_FIND_LIMIT, API_FILE_BYTEAT, API_FILL_BUFFER,
+  API_READ_NUMBER,
+  API_MALLOC,
+  API_HASHSET_NEW, API_HASHSET_ADD, API_HASHSET_REMOVE, API_HASHSET_CONTAINS,
+  API_HASHSET_DONE, API_HASHSET_EMPTY,
+  API_PIPE_NEW, API_PIPE_NEW_FROMFILE, API_PIPE_READ_AVAIL, API_PIPE_READ_GET,
+  API_PIPE_READ_STOPPED, API_PIPE_WRITE_AVAIL, API_PIPE_WRITE_GET,
+  API_PIPE_WRITE_STOPPED, API_PIPE_DONE,
+  API_MAP_NEW, API_MAP_ADDKEY, API_MAP_SETVALUE, API_MAP_REMOVE, API_MAP_FIND,
+  API_MAP_GETVALUESIZE, API_MAP_GETVALUE, API_MAP_DONE,
+  API_ILOG2, API_IPOW, API_IEXP, API_ISIN, API_ICOS,
+  API_MEMSTR, API_HEX2UI, API_ATOI, API_ENTROPY_BUFFER, API_VERSION_COMPARE,
+  API_ENGINE_LEVEL, API_ZERO
+};
+}
+
+// The level of the engine the bytecode is told it runs on, FUNC_LEVEL_100.
+static const unsigned EngineLevel = 100;
+// Longest pattern for file_find, like in libclamav.
+static const unsigned MaxFindLen = 1024;
+// A buffer_pipe reading from the file makes this much available at once.
+static const unsigned PipeFileChunk = 8192;
+
+static unsigned getAPIKind(StringRef Name)
+{
+  if (Name == "trace_ptr")
+    return API_TRACE_PTR;
+  if (Name.startswith("trace_"))
+    return API_TRACE;
+  return StringSwitch<unsigned>(Name)
+    .Case("test1", API_TEST1)
+    .Case("test2", API_TEST2)
+    .Case("read", API_READ)
+    .Case("write", API_WRITE)
+    .Case("seek", API_SEEK)
+    .Case("setvirusname", API_SETVIRUSNAME)
+    .Case("debug_print_str", API_DEBUG_PRINT_STR)
+    .Case("debug_print_str_start", API_DEBUG_PRINT_STR_START)
+    .Case("debug_print_str_nonl", API_DEBUG_PRINT_STR_NONL)
+    .Case("debug_print_uint", API_DEBUG_PRINT_UINT)
+    .Case("bytecode_rt_error", API_BYTECODE_RT_ERROR)
+    .Case("file_find", API_FILE_FIND)
+    .Case("file_find_limit", API_FILE_FIND_LIMIT)
+    .Case("file_byteat", API_FILE_BYTEAT)
+    .Case("fill_buffer", API_FILL_BUFFER)
+    .Case("read_number", API_READ_NUMBER)
+    .Case("malloc", API_MALLOC)
+    .Case("hashset_new", API_HASHSET_NEW)
+    .Case("hashset_add", API_HASHSET_ADD)
+    .Case("hashset_remove", API_HASHSET_REMOVE)
+    .Case("hashset_contains", API_HASHSET_CONTAINS)
+    .Case("hashset_done", API_HASHSET_DONE)
+    .Case("hashset_empty", API_HASHSET_EMPTY)
+    .Case("buffer_pipe_new", API_PIPE_NEW)
+    .Case("buffer_pipe_new_fromfile", API_PIPE_NEW_FROMFILE)
+    .Case("buffer_pipe_read_avail", API_PIPE_READ_AVAIL)
+    .Case("buffer_pipe_read_get", API_PIPE_READ_GET)
+    .Case("buffer_pipe_read_stopped", API_PIPE_READ_STOPPED)
+    .Case("buffer_pipe_write_avail", API_PIPE_WRITE_AVAIL)
+    .Case("buffer_pipe_write_get", API_PIPE_WRITE_GET)
+    .Case("buffer_pipe_write_stopped", API_PIPE_WRITE_STOPPED)
+    .Case("buffer_pipe_done", API_PIPE_DONE)
+    .Case("map_new", API_MAP_NEW)
+    .Case("map_addkey", API_MAP_ADDKEY)
+    .Case("map_setvalue", API_MAP_SETVALUE)
+    .Case("map_remove", API_MAP_REMOVE)
+    .Case("map_find", API_MAP_FIND)
+    .Case("map_getvaluesize", API_MAP_GETVALUESIZE)
+    .Case("map_getvalue", API_MAP_GETVALUE)
+    .Case("map_done", API_MAP_DONE)
+    .Case("ilog2", API_ILOG2)
+    .Case("ipow", API_IPOW)
+    .Case("iexp", API_IEXP)
+    .Case("isin", API_ISIN)
+    .Case("icos", API_ICOS)
+    .Case("memstr", API_MEMSTR)
+    .Case("hex2ui", API_HEX2UI)
+    .Case("atoi", API_ATOI)
+    .Case("entropy_buffer", API_ENTROPY_BUFFER)
+    .Case("version_compare", API_VERSION_COMPARE)
+    .Case("engine_functionality_level", API_ENGINE_LEVEL)
+    .Case("engine_dconf_level", API_ENGINE_LEVEL)
+    // nothing to report, or nothing to disable
+    .Case("engine_scan_options", API_ZERO)
+    .Case("engine_db_options", API_ZERO)
+    .Case("extract_set_container", API_ZERO)
+    .Case("disable_bytecode_if", API_ZERO)
+    .Case("disable_jit_if", API_ZERO)
+    .Case("check_platform", API_ZERO)
+    .Case("running_on_jit", API_ZERO)
+    .Case("get_file_reliability", API_ZERO)
+    .Default(API_UNSUPPORTED);
+}
+
+static uint32_t readUInt32(const uint8_t *P)
+{
+  return P[0] | (P[1] << 8) | (P[2] << 16) | ((uint32_t)P[3] << 24);
+}
+
+static int hexValue(unsigned C)
+{
+  if (C >= '0' && C <= '9')
+    return C - '0';
+  if (C >= 'a' && C <= 'f')
+    return C - 'a' + 10;
+  if (C >= 'A' && C <= 'F')
+    return C - 'A' + 10;
+  return -1;
+}
+
+// The math functions round to the nearest integer.
+static int64_t roundToInt(double F)
+{
+  return (int64_t)(F < 0 ? ceil(F - 0.5) : floor(F + 0.5));
+}
+
+static int32_t versionCompare(const uint8_t *L, uint32_t LLen,
+                              const uint8_t *R, uint32_t RLen)
+{
+  uint32_t i = 0, j = 0;
+  while (i < LLen && j < RLen) {
+    if (isdigit(L[i]) && isdigit(R[j])) {
+      uint64_t A = 0, B = 0;
+      while (i < LLen && isdigit(L[i]))
+        A = A*10 + L[i++] - '0';
+      while (j < RLen && isdigit(R[j]))
+        B = B*10 + R[j++] - '0';
+      if (A != B)
+        return A < B ? -1 : 1;
+      continue;
+    }
+    if (L[i] != R[j])
+      return L[i] < R[j] ? -1 : 1;
+    i++;
+    j++;
+  }
+  if (i < LLen)
+    return 1;
+  return j < RLen ? -1 : 0;
+}
+
+// Like cli_dbgmsg: debug_print_str_start opens a message, the _nonl and
+// _uint variants continue it, and debug_print_str is a whole line.
+void BCInterpreter::debugMessage(const char *Data, uint64_t Len, bool Prefix,
+                                 bool Newline)
+{
+  if (!Debug)
+    return;
+  if (Prefix)
+    errs() << "bytecode debug: ";
+  errs().write(Data, Len);
+  if (Newline)
+    errs() << "\n";
+}
+
+bool BCInterpreter::callAPI(unsigned Idx, const uint64_t *Args,
+                            uint64_t &Result)
+{
+  if (APIKinds.empty()) {
+    for (unsigned i=0;i<M.APICalls.size();i++)
+      APIKinds.push_back(getAPIKind(M.APICalls[i].Name));
+  }
+  int32_t A0 = Args[0], A1 = Args[1], A2 = Args[2];
+  uint64_t Size = File.size();
+  Result = 0;
+  switch (APIKinds[Idx]) {
+  case API_TEST1:
+    Result = (Args[0] == 0xf00dbeef && Args[1] == 0xbeeff00d) ?
+      0x12345678 : 0x55;
+    break;
+  case API_TEST2:
+    Result = Args[0] == 0xf00d ? 0xd00f : 0x5555;
+    break;
+  case API_READ:
+    {
+      if (A1 < 0 || (uint64_t)A1 > (182 << 20)) {
+        Result = -1;
+        break;
+      }
+      uint64_t N = FilePos >= Size ? 0 : std::min<uint64_t>(A1, Size - FilePos);
+      uint8_t *Buf = getMemory(Args[0], N, true);
+      if (!Buf)
+        return false;
+      memcpy(Buf, File.data() + FilePos, N);
+      FilePos += N;
+      Result = N;
+      break;
+    }
+  case API_WRITE:
+    // there is no temporary file to write to
+    Result = A1;
+    break;
+  case API_SEEK:
+    {
+      int64_t Off;
+      switch (Args[1]) {
+      case 0:
+        Off = A0;
+        break;
+      case 1:
+        Off = FilePos + A0;
+        break;
+      case 2:
+        Off = Size + A0;
+        break;
+      default:
+        Off = -1;
+        break;
+      }
+      if (Off < 0 || (uint64_t)Off > Size) {
+        Result = -1;
+        break;
+      }
+      FilePos = Off;
+      Result = Off;
+      break;
+    }
+  case API_SETVIRUSNAME:
+    {
+      const uint8_t *Name = getMemory(Args[0], Args[1], false);
+      if (!Name)
+        return false;
+      VirusName.assign((const char*)Name,
+                       strnlen((const char*)Name, Args[1]));
+      break;
+    }
+  case API_DEBUG_PRINT_STR:
+  case API_DEBUG_PRINT_STR_START:
+  case API_DEBUG_PRINT_STR_NONL:
+    {
+      const uint8_t *Str = getMemory(Args[0], Args[1], false);
+      if (!Str)
+        return false;
+      debugMessage((const char*)Str, strnlen((const char*)Str, Args[1]),
+                   APIKinds[Idx] != API_DEBUG_PRINT_STR_NONL,
+                   APIKinds[Idx] == API_DEBUG_PRINT_STR);
+      break;
+    }
+  case API_DEBUG_PRINT_UINT:
+    {
+      std::string Str = utostr((uint32_t)Args[0]);
+      debugMessage(Str.data(), Str.size(), false, false);
+      break;
+    }
+  case API_TRACE:
+    break;
+  case API_TRACE_PTR:
+    {
+      // -clambc-count-blocks passes the counters of a function: the index of
+      // its first counter, the number of counters, then the counters.
+      if (!CountBlocks)
+        break;
+      const uint8_t *Head = getMemory(Args[0], 8, false);
+      if (!Head)
+        return false;
+      uint32_t First = readUInt32(Head), N = readUInt32(Head + 4);
+      const uint8_t *Counters = getMemory(Args[0], 8 + (uint64_t)N*4, false);
+      if (!Counters)
+        return false;
+      if (BlockCounts.size() < (uint64_t)First + N)
+        BlockCounts.resize((uint64_t)First + N);
+      for (unsigned i=0;i<N;i++)
+        BlockCounts[First + i] += readUInt32(Counters + 8 + 4*i);
+      break;
+    }
+  case API_BYTECODE_RT_ERROR:
+    if (Debug)
+      errs() << "bytecode runtime error at " << (Args[0] >> 8) << ":"
+        << (Args[0] & 0xff) << "\n";
+    break;
+  case API_FILE_FIND:
+  case API_FILE_FIND_LIMIT:
+    {
+      int64_t MaxPos = APIKinds[Idx] == API_FILE_FIND ? (int64_t)Size : A2;
+      uint32_t Len = Args[1];
+      if (!Len || Len > MaxFindLen || MaxPos <= 0) {
+        Result = -1;
+        break;
+      }
+      const uint8_t *Pattern = getMemory(Args[0], Len, false);
+      if (!Pattern)
+        return false;
+      uint64_t End = std::min<uint64_t>(MaxPos, Size);
+      Result = -1;
+      if (FilePos >= End || End - FilePos < Len)
+        break;
+      StringRef Haystack = File.slice(FilePos, End);
+      size_t Pos = Haystack.find(StringRef((const char*)Pattern, Len));
+      if (Pos != StringRef::npos)
+        Result = FilePos + Pos;
+      break;
+    }
+  case API_FILE_BYTEAT:
+    Result = Args[0] >= Size ? -1 : (unsigned char)File[Args[0]];
+    break;
+  case API_FILL_BUFFER:
+    {
+      uint32_t BufLen = Args[1], Filled = Args[2], Cursor = Args[3];
+      if (FilePos >= Size)
+        break;
+      if (Cursor > Filled || Filled > BufLen) {
+        Result = -1;
+        break;
+      }
+      uint8_t *Buf = getMemory(Args[0], BufLen, true);
+      if (!Buf)
+        return false;
+      uint32_t Remaining = Filled - Cursor;
+      memmove(Buf, Buf + Cursor, Remaining);
+      uint64_t N = std::min<uint64_t>(BufLen - Remaining, Size - FilePos);
+      memcpy(Buf + Remaining, File.data() + FilePos, N);
+      FilePos += N;
+      Result = N ? Remaining + N : 0;
+      break;
+    }
+  case API_READ_NUMBER:
+    {
+      Result = -1;
+      if (Args[0] != 10 && Args[0] != 16)
+        break;
+      uint64_t Pos = FilePos;
+      while (Pos < Size && !isdigit((unsigned char)File[Pos]))
+        Pos++;
+      if (Pos == Size) {
+        FilePos = Pos;
+        break;
+      }
+      uint32_t N = 0;
+      for (; Pos < Size; Pos++) {
+        int D = hexValue((unsigned char)File[Pos]);
+        if (D < 0 || D >= (int)Args[0])
+          break;
+        N = N * Args[0] + D;
+      }
+      FilePos = Pos;
+      Result = N;
+      break;
+    }
+  case API_MALLOC:
+    Result = allocate((uint32_t)Args[0]);
+    break;
+  case API_HASHSET_NEW:
+    HashSets[NextHashSet];
+    Result = NextHashSet++;
+    break;
+  case API_HASHSET_ADD:
+  case API_HASHSET_REMOVE:
+  case API_HASHSET_CONTAINS:
+  case API_HASHSET_DONE:
+  case API_HASHSET_EMPTY:
+    {
+      std::map<int32_t, std::set<uint32_t> >::iterator I = HashSets.find(A0);
+      if (I == HashSets.end()) {
+        Result = -1;
+        break;
+      }
+      uint32_t Key = Args[1];
+      switch (APIKinds[Idx]) {
+      case API_HASHSET_ADD:
+        I->second.insert(Key);
+        break;
+      case API_HASHSET_REMOVE:
+        I->second.erase(Key);
+        break;
+      case API_HASHSET_CONTAINS:
+        Result = I->second.count(Key);
+        break;
+      case API_HASHSET_DONE:
+        HashSets.erase(I);
+        break;
+      default:
+        Result = I->second.empty();
+        break;
+      }
+      break;
+    }
+  case API_PIPE_NEW:
+    {
+      BufferPipe P = { allocate((uint32_t)Args[0]), (uint32_t)Args[0], 0, 0 };
+      if (!P.Buffer) {
+        Result = -1;
+        break;
+      }
+      Pipes[NextPipe] = P;
+      Result = NextPipe++;
+      break;
+    }
+  case API_PIPE_NEW_FROMFILE:
+    {
+      BufferPipe P = { 0, 0, (uint32_t)Args[0], 0 };
+      Pipes[NextPipe] = P;
+      Result = NextPipe++;
+      break;
+    }
+  case API_PIPE_READ_AVAIL:
+  case API_PIPE_READ_GET:
+  case API_PIPE_READ_STOPPED:
+  case API_PIPE_WRITE_AVAIL:
+  case API_PIPE_WRITE_GET:
+  case API_PIPE_WRITE_STOPPED:
+  case API_PIPE_DONE:
+    {
+      std::map<int32_t, BufferPipe>::iterator I = Pipes.find(A0);
+      bool ReturnsPointer = APIKinds[Idx] == API_PIPE_READ_GET ||
+        APIKinds[Idx] == API_PIPE_WRITE_GET;
+      if (I == Pipes.end()) {
+        Result = ReturnsPointer ? 0 : -1;
+        break;
+      }
+      BufferPipe &P = I->second;
+      uint64_t ReadAvail, WriteAvail;
+      if (P.Buffer) {
+        ReadAvail = P.WritePos - P.ReadPos;
+        WriteAvail = P.Size - P.WritePos;
+      } else {
+        ReadAvail = P.ReadPos >= Size ? 0 :
+          std::min<uint64_t>(Size - P.ReadPos, PipeFileChunk);
+        WriteAvail = 0;
+      }
+      uint32_t Amount = Args[1];
+      switch (APIKinds[Idx]) {
+      case API_PIPE_READ_AVAIL:
+        Result = ReadAvail;
+        break;
+      case API_PIPE_READ_GET:
+        if (Amount > ReadAvail)
+          break;
+        Result = P.Buffer ? P.Buffer + P.ReadPos :
+          getPointer(FileRegion, P.ReadPos);
+        break;
+      case API_PIPE_READ_STOPPED:
+        P.ReadPos += std::min<uint64_t>(Amount, ReadAvail);
+        // an emptied buffer starts over
+        if (P.Buffer && P.ReadPos == P.WritePos)
+          P.ReadPos = P.WritePos = 0;
+        break;
+      case API_PIPE_WRITE_AVAIL:
+        Result = WriteAvail;
+        break;
+      case API_PIPE_WRITE_GET:
+        if (Amount && Amount <= WriteAvail)
+          Result = P.Buffer + P.WritePos;
+        break;
+      case API_PIPE_WRITE_STOPPED:
+        P.WritePos += std::min<uint64_t>(Amount, WriteAvail);
+        break;
+      default:
+        Pipes.erase(I);
+        break;
+      }
+      break;
+    }
+  case API_MAP_NEW:
+    {
+      if (A0 <= 0 || A1 < 0) {
+        Result = -1;
+        break;
+      }
+      Map &Mp = Maps[NextMap];
+      Mp.KeySize = A0;
+      Mp.ValueSize = A1;
+      Mp.HasLastKey = Mp.HasFound = false;
+      Result = NextMap++;
+      break;
+    }
+  case API_MAP_ADDKEY:
+  case API_MAP_SETVALUE:
+  case API_MAP_REMOVE:
+  case API_MAP_FIND:
+    {
+      std::map<int32_t, Map>::iterator I = Maps.find(A2);
+      if (I == Maps.end() || A1 < 0) {
+        Result = -1;
+        break;
+      }
+      Map &Mp = I->second;
+      // keys must have the size given to map_new, values too unless that
+      // was 0
+      int32_t Expected = APIKinds[Idx] == API_MAP_SETVALUE ? Mp.ValueSize :
+        Mp.KeySize;
+      if (A1 != Expected && (Expected || APIKinds[Idx] != API_MAP_SETVALUE)) {
+        Result = -1;
+        break;
+      }
+      const uint8_t *Data = getMemory(Args[0], A1, false);
+      if (!Data)
+        return false;
+      std::string Str((const char*)Data, A1);
+      switch (APIKinds[Idx]) {
+      case API_MAP_ADDKEY:
+        Result = !Mp.Entries.count(Str);
+        Mp.Entries[Str];
+        Mp.LastKey = Str;
+        Mp.HasLastKey = true;
+        break;
+      case API_MAP_SETVALUE:
+        if (!Mp.HasLastKey) {
+          Result = -1;
+          break;
+        }
+        Mp.Entries[Mp.LastKey] = Str;
+        break;
+      case API_MAP_REMOVE:
+        Result = Mp.Entries.erase(Str);
+        if (Mp.HasLastKey && Mp.LastKey == Str)
+          Mp.HasLastKey = false;
+        break;
+      default:
+        {
+          std::map<std::string, std::string>::iterator E =
+            Mp.Entries.find(Str);
+          Mp.HasFound = E != Mp.Entries.end();
+          if (Mp.HasFound)
+            Mp.Found = E->second;
+          Result = Mp.HasFound;
+          break;
+        }
+      }
+      break;
+    }
+  case API_MAP_GETVALUESIZE:
+  case API_MAP_GETVALUE:
+  case API_MAP_DONE:
+    {
+      std::map<int32_t, Map>::iterator I = Maps.find(A0);
+      if (I == Maps.end()) {
+        Result = APIKinds[Idx] == API_MAP_GETVALUE ? 0 : -1;
+        break;
+      }
+      Map &Mp = I->second;
+      if (APIKinds[Idx] == API_MAP_DONE) {
+        Maps.erase(I);
+        break;
+      }
+      if (!Mp.HasFound) {
+        Result = APIKinds[Idx] == API_MAP_GETVALUE ? 0 : -1;
+        break;
+      }
+      if (APIKinds[Idx] == API_MAP_GETVALUESIZE) {
+        Result = Mp.Found.size();
+        break;
+      }
+      // a copy, writing to it doesn't change the map
+      if (A1 != (int32_t)Mp.Found.size() || Mp.Found.empty())
+        break;
+      Result = allocate(A1);
+      if (Result)
+        memcpy(getMemory(Result, A1, true), Mp.Found.data(), A1);
+      break;
+    }
+  case API_ILOG2:
+    Result = !Args[1] ? 0x7fffffff :
+      roundToInt((1<<26) * log((double)(uint32_t)Args[0] /
+                               (uint32_t)Args[1]) / log(2.0));
+    break;
+  case API_IPOW:
+    Result = (!A0 && A1 < 0) ? 0x7fffffff :
+      roundToInt(A2 * pow((double)A0, A1));
+    break;
+  case API_IEXP:
+  case API_ISIN:
+  case API_ICOS:
+    {
+      if (!A1) {
+        Result = 0x7fffffff;
+        break;
+      }
+      double X = (double)A0 / A1;
+      double F = APIKinds[Idx] == API_IEXP ? exp(X) :
+        APIKinds[Idx] == API_ISIN ? sin(X) : cos(X);
+      Result = roundToInt(A2 * F);
+      break;
+    }
+  case API_MEMSTR:
+    {
+      int32_t HaySize = A1, NeedleSize = Args[3];
+      Result = -1;
+      if (HaySize <= 0 || NeedleSize <= 0)
+        break;
+      const uint8_t *Hay = getMemory(Args[0], HaySize, false);
+      const uint8_t *Needle = getMemory(Args[2], NeedleSize, false);
+      if (!Hay || !Needle)
+        return false;
+      size_t Pos = StringRef((const char*)Hay, HaySize)
+        .find(StringRef((const char*)Needle, NeedleSize));
+      if (Pos != StringRef::npos)
+        Result = Pos;
+      break;
+    }
+  case API_HEX2UI:
+    {
+      int Hi = hexValue(Args[0]), Lo = hexValue(Args[1]);
+      Result = (Hi < 0 || Lo < 0) ? -1 : (Hi << 4) | Lo;
+      break;
+    }
+  case API_ATOI:
+    {
+      Result = -1;
+      if (A1 <= 0)
+        break;
+      const uint8_t *Str = getMemory(Args[0], A1, false);
+      if (!Str)
+        return false;
+      int32_t i = 0;
+      while (i < A1 && isspace(Str[i]))
+        i++;
+      if (i == A1 || !isdigit(Str[i]))
+        break;
+      uint64_t N = 0;
+      while (i < A1 && isdigit(Str[i]) && N <= 0x7fffffff)
+        N = N*10 + Str[i++] - '0';
+      Result = std::min<uint64_t>(N, 0x7fffffff);
+      break;
+    }
+  case API_ENTROPY_BUFFER:
+    {
+      if (A1 <= 0)
+        break;
+      const uint8_t *Buf = getMemory(Args[0], A1, false);
+      if (!Buf)
+        return false;
+      unsigned Counts[256];
+      memset(Counts, 0, sizeof(Counts));
+      for (int32_t i=0;i<A1;i++)
+        Counts[Buf[i]]++;
+      double Entropy = 0;
+      for (unsigned i=0;i<256;i++) {
+        if (!Counts[i])
+          continue;
+        double P = (double)Counts[i] / A1;
+        Entropy -= P * log(P) / log(2.0);
+      }
+      Result = (uint32_t)(Entropy * (1<<26));
+      break;
+    }
+  case API_VERSION_COMPARE:
+    {
+      const uint8_t *L = getMemory(Args[0], Args[1], false);
+      const uint8_t *R = getMemory(Args[2], Args[3], false);
+      if (!L || !R)
+        return false;
+      Result = versionCompare(L, Args[1], R, Args[3]);
+      break;
+    }
+  case API_ENGINE_LEVEL:
+    Result = EngineLevel;
+    break;
+  case API_ZERO:
+    break;
+  default:
+    {
+      // fail like libclamav does without the data: -1, or a null pointer
+      const BCType &T = M.Types[M.APICalls[Idx].Type];
+      Result = M.Types[T.Elements[0]].Kind == BCPointerType ? 0 : -1;
+      UnsupportedCalls[Idx]++;
+      break;
+    }
+  }
+  return true;
+}
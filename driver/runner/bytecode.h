@@ -0,0 +1,143 @@
+/*
+ *  Standalone runner for compiled bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#ifndef CLAMBC_RUNNER_BYTECODE_H
+#define CLAMBC_RUNNER_BYTECODE_H
+#include "llvm/ADT/StringRef.h"
+#include "llvm/System/DataTypes.h"
+#include <string>
+#include <vector>
+
+// A .cbc file (text or binary format) as written by ClamBCModule and
+// ClamBCWriter, decoded for the interpreter.
+
+enum BCTypeKind {
+  BCVoidType,
+  BCIntegerType,
+  BCFunctionType,
+  BCStructType,
+  BCArrayType,
+  BCPointerType
+};
+
+struct BCType {
+  BCTypeKind Kind;
+  // Integers: the bit width. Arrays: the number of elements.
+  unsigned Count;
+  // Function: return type and parameters. Struct: fields. Array and pointer:
+  // the element type.
+  std::vector<unsigned> Elements;
+  // Struct field offsets, computed with the layout the compiler uses: integers
+  // are aligned to their size, pointers are 8 bytes and not aligned.
+  std::vector<unsigned> Offsets;
+  bool Packed;
+  uint64_t Size;
+  unsigned Align;
+  bool LayoutDone;
+};
+
+struct BCAPICall {
+  unsigned ID;
+  unsigned Type;
+  std::string Name;
+};
+
+// A pointer to a global stored in the initializer of another global.
+struct BCReloc {
+  uint64_t Offset;
+  unsigned Global;
+  uint64_t Addend;
+};
+
+struct BCGlobal {
+  unsigned Type;
+  std::vector<uint8_t> Data;
+  std::vector<BCReloc> Relocs;
+};
+
+// Operands are register numbers: the function's values come first (arguments
+// first among them), followed by the constants it uses. The interpreter
+// initializes the constant registers when a function is called.
+struct BCInst {
+  uint8_t Opcode;
+  // Bit width of the result, of the operands of compares, and of the value
+  // loaded or stored.
+  uint8_t Width;
+  // Bit width of the source of sext, of the GEP index, or the compare opcode
+  // of OP_BC_ICMP_BRANCH.
+  uint8_t Aux;
+  // Bytes loaded or stored.
+  uint8_t Size;
+  unsigned Dest;
+  // Branch targets are instruction indices. Calls: the index of the first
+  // argument in BCFunction::CallArgs, and the number of arguments.
+  unsigned Ops[4];
+  // GEP element size, callee function, or index of the API call.
+  uint64_t Imm;
+};
+
+struct BCConstant {
+  uint64_t Value;
+  // A pointer to Offset in this global (0 is the null pointer), instead of an
+  // integer.
+  bool IsGlobal;
+  uint64_t Offset;
+};
+
+struct BCAlloca {
+  unsigned Reg;
+  uint64_t Offset;
+};
+
+struct BCFunction {
+  unsigned NumArgs;
+  unsigned ReturnType;
+  unsigned NumValues;
+  std::vector<unsigned> ValueTypes;
+  std::vector<BCConstant> Constants;
+  std::vector<BCAlloca> Allocas;
+  uint64_t FrameSize;
+  std::vector<BCInst> Code;
+  std::vector<unsigned> BlockStart;
+  std::vector<unsigned> CallArgs;
+  unsigned NumRegs() const { return NumValues + Constants.size(); }
+};
+
+struct BCModule {
+  bool Binary;
+  unsigned FormatLevel;
+  uint64_t Timestamp;
+  std::string SigMaker;
+  std::string Compiler;
+  unsigned Kind;
+  unsigned MinFunc, MaxFunc;
+  std::string Trigger;
+  std::vector<BCType> Types;
+  std::vector<BCAPICall> APICalls;
+  // Index 0 is the null pointer placeholder.
+  std::vector<BCGlobal> Globals;
+  std::vector<BCFunction> Functions;
+};
+
+// Decodes a .cbc file. Returns false and sets ErrorInfo if it is malformed.
+bool readBytecode(llvm::StringRef Data, BCModule &M, std::string &ErrorInfo);
+
+#endif
@@ -0,0 +1,558 @@
+/*
+ *  Standalone runner for compiled bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#include "interpreter.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/System/TimeValue.h"
+#include "../../ClamBC/clambc.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+using namespace llvm;
+
+// Pointers are a region number in the upper 32 bits and an offset in the
+// lower ones. Region 0 is the null pointer, the stack frames have the top
+// bit set.
+static const unsigned FrameRegion = 0x80000000;
+// Largest allocation, like CLI_MAX_ALLOCATION in libclamav.
+static const uint64_t MaxAllocation = 182*1024*1024;
+static const unsigned MaxCallDepth = 10000;
+// libclamav's PE data is 1 KB with no PE parsed.
+static const unsigned PEDataSize = 1024;
+
+static inline uint64_t mask(uint64_t V, unsigned W)
+{
+  return W >= 64 ? V : V & ((1ull << W) - 1);
+}
+
+static inline int64_t sext(uint64_t V, unsigned W)
+{
+  return W >= 64 || !W ? (int64_t)V : (int64_t)(V << (64 - W)) >> (64 - W);
+}
+
+static bool compare(unsigned Opc, uint64_t A, uint64_t B, unsigned W)
+{
+  switch (Opc) {
+  case OP_BC_ICMP_EQ:
+    return A == B;
+  case OP_BC_ICMP_NE:
+    return A != B;
+  case OP_BC_ICMP_UGT:
+    return A > B;
+  case OP_BC_ICMP_UGE:
+    return A >= B;
+  case OP_BC_ICMP_ULT:
+    return A < B;
+  case OP_BC_ICMP_ULE:
+    return A <= B;
+  case OP_BC_ICMP_SGT:
+    return sext(A, W) > sext(B, W);
+  case OP_BC_ICMP_SGE:
+    return sext(A, W) >= sext(B, W);
+  case OP_BC_ICMP_SLT:
+    return sext(A, W) < sext(B, W);
+  default:
+    return sext(A, W) <= sext(B, W);
+  }
+}
+
+static inline uint64_t loadValue(const uint8_t *P, unsigned Size)
+{
+  uint64_t V = 0;
+  for (unsigned i=0;i<Size;i++)
+    V |= (uint64_t)P[i] << (8*i);
+  return V;
+}
+
+static inline void storeValue(uint8_t *P, unsigned Size, uint64_t V)
+{
+  for (unsigned i=0;i<Size;i++)
+    P[i] = V >> (8*i);
+}
+
+BCInterpreter::BCInterpreter(const BCModule &M)
+  : Debug(false), AssumeMatches(false), MaxInstructions(0), Timeout(0),
+    CountBlocks(false), Instructions(0), M(M), FileRegion(0), NextHashSet(0),
+    NextPipe(0), NextMap(0)
+{
+  APICallCounts.resize(M.APICalls.size());
+  UnsupportedCalls.resize(M.APICalls.size());
+
+  Region Null = { 0, 0, true };
+  Regions.push_back(Null);
+  for (unsigned i=1;i<M.Globals.size();i++) {
+    const BCGlobal &G = M.Globals[i];
+    uint8_t *Data = (uint8_t*)calloc(G.Data.size() + 1, 1);
+    Owned.push_back(Data);
+    if (!G.Data.empty())
+      memcpy(Data, &G.Data[0], G.Data.size());
+    for (unsigned j=0;j<G.Relocs.size();j++) {
+      const BCReloc &R = G.Relocs[j];
+      storeValue(Data + R.Offset, 8, getGlobalPointer(R.Global, R.Addend));
+    }
+    Region Rg = { Data, G.Data.size(), true };
+    Regions.push_back(Rg);
+  }
+
+  // The special globals, in the order of their IDs.
+  MatchCounts.resize(64*4);
+  MatchOffsets.resize(64*4);
+  Kind.resize(2);
+  VirusNames.resize(8);
+  PEData.resize(PEDataSize);
+  FileSize.resize(4);
+  std::vector<uint8_t> *Specials[] = {
+    &MatchCounts, &Kind, &VirusNames, &PEData, &FileSize, &MatchOffsets
+  };
+  for (unsigned i=0;i<sizeof(Specials)/sizeof(Specials[0]);i++) {
+    Region Rg = { &(*Specials[i])[0], Specials[i]->size(), true };
+    Regions.push_back(Rg);
+  }
+  FirstHeapRegion = Regions.size();
+  storeValue(&Kind[0], 2, M.Kind);
+
+  // Constant registers don't change between calls.
+  ConstantRegs.resize(M.Functions.size());
+  for (unsigned i=0;i<M.Functions.size();i++) {
+    const BCFunction &F = M.Functions[i];
+    for (unsigned j=0;j<F.Constants.size();j++) {
+      const BCConstant &C = F.Constants[j];
+      uint64_t V = C.Value;
+      if (C.IsGlobal)
+        V = getGlobalPointer(V, C.Offset);
+      ConstantRegs[i].push_back(V);
+    }
+  }
+}
+
+BCInterpreter::~BCInterpreter()
+{
+  for (unsigned i=0;i<Heap.size();i++)
+    free(Heap[i]);
+  for (unsigned i=0;i<Owned.size();i++)
+    free(Owned[i]);
+}
+
+uint64_t BCInterpreter::getPointer(unsigned Region, uint64_t Offset) const
+{
+  return ((uint64_t)Region << 32) | (Offset & 0xffffffff);
+}
+
+// The special globals follow the globals of the module in Regions.
+uint64_t BCInterpreter::getGlobalPointer(unsigned Global, uint64_t Offset) const
+{
+  if (!Global)
+    return 0;
+  if (Global >= _FIRST_GLOBAL)
+    Global = M.Globals.size() + Global - _FIRST_GLOBAL;
+  return getPointer(Global, Offset);
+}
+
+bool BCInterpreter::error(const Twine &Msg)
+{
+  if (ErrorMsg.empty())
+    ErrorMsg = Msg.str();
+  return false;
+}
+
+// Ends execute() with a runtime error.
+bool BCInterpreter::stop(uint64_t Count, const Twine &Msg)
+{
+  Instructions = Count;
+  if (!Msg.isTriviallyEmpty())
+    error(Msg);
+  return false;
+}
+
+// Returns the memory at Ptr if Size bytes are valid there, otherwise sets
+// the error.
+uint8_t *BCInterpreter::getMemory(uint64_t Ptr, uint64_t Size, bool Write)
+{
+  unsigned R = Ptr >> 32;
+  uint64_t Off = Ptr & 0xffffffff;
+  uint8_t *Data;
+  uint64_t Len;
+  bool ReadOnly;
+  if (R & FrameRegion) {
+    unsigned Depth = R & ~FrameRegion;
+    if (Depth >= Frames.size()) {
+      error("access to the stack of a function that returned");
+      return 0;
+    }
+    std::vector<uint8_t> &Mem = Frames[Depth].Memory;
+    Data = Mem.empty() ? 0 : &Mem[0];
+    Len = Mem.size();
+    ReadOnly = false;
+  } else {
+    if (!R) {
+      error("null pointer dereference");
+      return 0;
+    }
+    if (R >= Regions.size()) {
+      error("invalid pointer");
+      return 0;
+    }
+    Data = Regions[R].Data;
+    Len = Regions[R].Size;
+    ReadOnly = Regions[R].ReadOnly;
+  }
+  if (Off > Len || Size > Len - Off) {
+    error(Twine("out of bounds access: ") + Twine(Size) + " bytes at offset " +
+          Twine(Off) + " of " + Twine(Len));
+    return 0;
+  }
+  if (Write && ReadOnly) {
+    error("write to a constant global");
+    return 0;
+  }
+  return Data + Off;
+}
+
+uint64_t BCInterpreter::allocate(uint64_t Size)
+{
+  if (!Size || Size > MaxAllocation)
+    return 0;
+  uint8_t *Data = (uint8_t*)calloc(Size, 1);
+  if (!Data)
+    return 0;
+  Heap.push_back(Data);
+  Region Rg = { Data, Size, false };
+  Regions.push_back(Rg);
+  return getPointer(Regions.size()-1, 0);
+}
+
+void BCInterpreter::enterFunction(unsigned Fn, const uint64_t *Args,
+                                  unsigned Dest)
+{
+  const BCFunction &F = M.Functions[Fn];
+  Frames.push_back(Frame());
+  Frame &Fr = Frames.back();
+  Fr.Function = Fn;
+  Fr.PC = 0;
+  Fr.Dest = Dest;
+  // unused operands read register 0, so there is always one
+  Fr.Regs.resize(std::max(F.NumRegs(), 1u));
+  Fr.Memory.resize(F.FrameSize);
+  for (unsigned i=0;i<F.NumArgs;i++)
+    Fr.Regs[i] = Args[i];
+  if (!F.Constants.empty())
+    memcpy(&Fr.Regs[F.NumValues], &ConstantRegs[Fn][0],
+           F.Constants.size()*sizeof(uint64_t));
+  unsigned Region = FrameRegion | (Frames.size()-1);
+  for (unsigned i=0;i<F.Allocas.size();i++)
+    Fr.Regs[F.Allocas[i].Reg] = getPointer(Region, F.Allocas[i].Offset);
+}
+
+bool BCInterpreter::run(StringRef Data, uint64_t &Result,
+                        std::string &ErrorInfo)
+{
+  File = Data;
+  FilePos = 0;
+  Instructions = 0;
+  VirusName.clear();
+  ErrorMsg.clear();
+  HashSets.clear();
+  NextHashSet = 0;
+  Pipes.clear();
+  NextPipe = 0;
+  Maps.clear();
+  NextMap = 0;
+  for (unsigned i=0;i<Heap.size();i++)
+    free(Heap[i]);
+  Heap.clear();
+  Regions.resize(FirstHeapRegion);
+  Frames.clear();
+
+  Region Rg = { (uint8_t*)File.data(), File.size(), true };
+  FileRegion = Regions.size();
+  Regions.push_back(Rg);
+
+  for (unsigned i=0;i<64;i++) {
+    storeValue(&MatchCounts[4*i], 4, AssumeMatches);
+    storeValue(&MatchOffsets[4*i], 4, AssumeMatches ? 0 : ~0u);
+  }
+  storeValue(&FileSize[0], 4, File.size());
+
+  bool Ok;
+  if (M.Functions.empty())
+    Ok = error("no functions");
+  else if (M.Functions[0].NumArgs)
+    Ok = error("entrypoint has arguments");
+  else {
+    Frames.reserve(64);
+    enterFunction(0, 0, 0);
+    Ok = execute(Result);
+    Frames.clear();
+  }
+  if (!Ok)
+    ErrorInfo = ErrorMsg;
+  return Ok;
+}
+
+bool BCInterpreter::execute(uint64_t &Result)
+{
+  Frame *Fr = &Frames.back();
+  const BCFunction *F = &M.Functions[Fr->Function];
+  const BCInst *Code = &F->Code[0];
+  uint64_t *R = &Fr->Regs[0];
+  unsigned PC = 0;
+  uint64_t Count = 0;
+  sys::TimeValue Start = sys::TimeValue::now();
+  uint64_t CallArgs[16];
+
+  for (;;) {
+    const BCInst &I = Code[PC++];
+    if (!(++Count & 0xffff)) {
+      if (MaxInstructions && Count > MaxInstructions) {
+        return stop(Count, "instruction limit reached");
+      }
+      if (Timeout &&
+          (sys::TimeValue::now() - Start).msec() > (int64_t)Timeout) {
+        return stop(Count, "timeout");
+      }
+    }
+    uint64_t A = R[I.Ops[0]], B = R[I.Ops[1]];
+    unsigned W = I.Width;
+    switch (I.Opcode) {
+    case OP_BC_ADD:
+      R[I.Dest] = mask(A + B, W);
+      break;
+    case OP_BC_SUB:
+      R[I.Dest] = mask(A - B, W);
+      break;
+    case OP_BC_MUL:
+      R[I.Dest] = mask(A * B, W);
+      break;
+    case OP_BC_UDIV:
+    case OP_BC_UREM:
+      if (!B)
+        return stop(Count, "division by zero");
+      R[I.Dest] = I.Opcode == OP_BC_UDIV ? A / B : A % B;
+      break;
+    case OP_BC_SDIV:
+    case OP_BC_SREM:
+      {
+        int64_t SA = sext(A, W), SB = sext(B, W);
+        if (!SB || (SB == -1 && A == (1ull << (W-1))))
+          return stop(Count, "division by zero or overflow");
+        R[I.Dest] = mask(I.Opcode == OP_BC_SDIV ? SA / SB : SA % SB, W);
+        break;
+      }
+    case OP_BC_SHL:
+    case OP_BC_LSHR:
+    case OP_BC_ASHR:
+      if (B >= W)
+        return stop(Count, "shift by more than the bit width");
+      R[I.Dest] = mask(I.Opcode == OP_BC_SHL ? A << B :
+                       I.Opcode == OP_BC_LSHR ? A >> B :
+                       (uint64_t)(sext(A, W) >> B), W);
+      break;
+    case OP_BC_AND:
+      R[I.Dest] = A & B;
+      break;
+    case OP_BC_OR:
+      R[I.Dest] = A | B;
+      break;
+    case OP_BC_XOR:
+      R[I.Dest] = A ^ B;
+      break;
+    case OP_BC_TRUNC:
+      R[I.Dest] = mask(A, W);
+      break;
+    case OP_BC_SEXT:
+      R[I.Dest] = mask(sext(A, I.Aux), W);
+      break;
+    case OP_BC_ZEXT:
+    case OP_BC_COPY:
+      R[I.Dest] = A;
+      break;
+    case OP_BC_BRANCH:
+      PC = (A & 1) ? I.Ops[1] : I.Ops[2];
+      break;
+    case OP_BC_JMP:
+      PC = I.Ops[0];
+      break;
+    case OP_BC_ICMP_BRANCH:
+      PC = compare(I.Aux, A, B, W) ? I.Ops[2] : I.Ops[3];
+      break;
+    case OP_BC_RET:
+    case OP_BC_RET_VOID:
+      {
+        uint64_t V = I.Opcode == OP_BC_RET ? A : 0;
+        unsigned Dest = Fr->Dest;
+        Frames.pop_back();
+        if (Frames.empty()) {
+          Instructions = Count;
+          Result = V;
+          return true;
+        }
+        Fr = &Frames.back();
+        F = &M.Functions[Fr->Function];
+        Code = &F->Code[0];
+        R = &Fr->Regs[0];
+        PC = Fr->PC;
+        R[Dest] = V;
+        break;
+      }
+    case OP_BC_ICMP_EQ: case OP_BC_ICMP_NE: case OP_BC_ICMP_UGT:
+    case OP_BC_ICMP_UGE: case OP_BC_ICMP_ULT: case OP_BC_ICMP_ULE:
+    case OP_BC_ICMP_SGT: case OP_BC_ICMP_SGE: case OP_BC_ICMP_SLE:
+    case OP_BC_ICMP_SLT:
+      R[I.Dest] = compare(I.Opcode, A, B, W);
+      break;
+    case OP_BC_SELECT:
+      R[I.Dest] = (A & 1) ? B : R[I.Ops[2]];
+      break;
+    case OP_BC_CALL_DIRECT:
+      {
+        if (Frames.size() >= MaxCallDepth)
+          return stop(Count, "call stack too deep");
+        for (unsigned i=0;i<I.Ops[1];i++)
+          CallArgs[i] = R[F->CallArgs[I.Ops[0] + i]];
+        Fr->PC = PC;
+        enterFunction(I.Imm, CallArgs, I.Dest);
+        Fr = &Frames.back();
+        F = &M.Functions[Fr->Function];
+        Code = &F->Code[0];
+        R = &Fr->Regs[0];
+        PC = 0;
+        break;
+      }
+    case OP_BC_CALL_API:
+      {
+        for (unsigned i=0;i<I.Ops[1];i++)
+          CallArgs[i] = R[F->CallArgs[I.Ops[0] + i]];
+        uint64_t V;
+        APICallCounts[I.Imm]++;
+        if (!callAPI(I.Imm, CallArgs, V)) {
+          return stop(Count);
+        }
+        R[I.Dest] = mask(V, W);
+        break;
+      }
+    case OP_BC_GEP1:
+    case OP_BC_GEPZ:
+    case OP_BC_GEP1_LOAD:
+      {
+        uint64_t P = (A & ~0xffffffffull) |
+          ((A + sext(B, I.Aux) * I.Imm) & 0xffffffff);
+        if (I.Opcode != OP_BC_GEP1_LOAD) {
+          R[I.Dest] = P;
+          break;
+        }
+        const uint8_t *Mem = getMemory(P, I.Size, false);
+        if (!Mem)
+          return stop(Count);
+        R[I.Dest] = mask(loadValue(Mem, I.Size), W);
+        break;
+      }
+    case OP_BC_STORE:
+      {
+        uint8_t *Mem = getMemory(B, I.Size, true);
+        if (!Mem)
+          return stop(Count);
+        storeValue(Mem, I.Size, A);
+        break;
+      }
+    case OP_BC_LOAD:
+      {
+        const uint8_t *Mem = getMemory(A, I.Size, false);
+        if (!Mem)
+          return stop(Count);
+        R[I.Dest] = mask(loadValue(Mem, I.Size), W);
+        break;
+      }
+    case OP_BC_LOAD_ADD_STORE:
+      {
+        uint8_t *Mem = getMemory(A, I.Size, true);
+        if (!Mem)
+          return stop(Count);
+        storeValue(Mem, I.Size, loadValue(Mem, I.Size) + B);
+        break;
+      }
+    case OP_BC_MEMSET:
+      {
+        uint64_t Len = R[I.Ops[2]];
+        uint8_t *Mem = getMemory(A, Len, true);
+        if (!Mem)
+          return stop(Count);
+        memset(Mem, B, Len);
+        break;
+      }
+    case OP_BC_MEMCPY:
+    case OP_BC_MEMMOVE:
+      {
+        uint64_t Len = R[I.Ops[2]];
+        const uint8_t *Src = getMemory(B, Len, false);
+        uint8_t *Dst = getMemory(A, Len, true);
+        if (!Src || !Dst)
+          return stop(Count);
+        memmove(Dst, Src, Len);
+        break;
+      }
+    case OP_BC_MEMCMP:
+    case OP_BC_MEMCMP_EQ:
+    case OP_BC_MEMCMP_NE:
+      {
+        uint64_t Len = R[I.Ops[2]];
+        const uint8_t *P1 = getMemory(A, Len, false);
+        const uint8_t *P2 = getMemory(B, Len, false);
+        if (!P1 || !P2)
+          return stop(Count);
+        int Cmp = memcmp(P1, P2, Len);
+        if (I.Opcode == OP_BC_MEMCMP)
+          R[I.Dest] = mask(Cmp < 0 ? -1 : Cmp > 0, W);
+        else
+          R[I.Dest] = (Cmp == 0) == (I.Opcode == OP_BC_MEMCMP_EQ);
+        break;
+      }
+    case OP_BC_ISBIGENDIAN:
+      R[I.Dest] = 0;
+      break;
+    case OP_BC_ABORT:
+      return stop(Count, "bytecode called abort()");
+    case OP_BC_BSWAP16:
+      R[I.Dest] = ((A & 0xff) << 8) | ((A >> 8) & 0xff);
+      break;
+    case OP_BC_BSWAP32:
+    case OP_BC_BSWAP64:
+      {
+        unsigned Bytes = I.Opcode == OP_BC_BSWAP32 ? 4 : 8;
+        uint64_t V = 0;
+        for (unsigned i=0;i<Bytes;i++)
+          V |= ((A >> (8*i)) & 0xff) << (8*(Bytes-1-i));
+        R[I.Dest] = V;
+        break;
+      }
+    case OP_BC_PTRDIFF32:
+      if ((A >> 32) != (B >> 32))
+        return stop(Count, "difference of pointers to different objects");
+      R[I.Dest] = mask(A - B, 32);
+      break;
+    case OP_BC_PTRTOINT64:
+      R[I.Dest] = A;
+      break;
+    default:
+      return stop(Count, Twine("unknown opcode ") + Twine(I.Opcode));
+    }
+  }
+}
@@ -0,0 +1,131 @@
+/*
+ *  Standalone runner for compiled bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#ifndef CLAMBC_RUNNER_INTERPRETER_H
+#define CLAMBC_RUNNER_INTERPRETER_H
+#include "bytecode.h"
+#include "llvm/ADT/Twine.h"
+#include <map>
+#include <set>
+#include <string>
+
+// Executes the entrypoint of a bytecode on the contents of a file. This is
+// not libclamav's interpreter: the API calls are emulated well enough to
+// measure how a bytecode performs on a corpus, which is what clambc-run is
+// for. Calls that need the rest of libclamav (unpackers, PE parsing, PDF,
+// JSON, extracting files) fail the way they do when the data isn't
+// available, and are counted in UnsupportedCalls.
+class BCInterpreter {
+public:
+  BCInterpreter(const BCModule &M);
+  ~BCInterpreter();
+
+  // Print debug messages of the bytecode.
+  bool Debug;
+  // Pretend that all subsignatures of the logical signature matched once at
+  // offset 0, otherwise they didn't match.
+  bool AssumeMatches;
+  // Stop with an error after this many instructions, or this much time
+  // (milliseconds). 0 means no limit.
+  uint64_t MaxInstructions;
+  unsigned Timeout;
+  // Add up the block counters that -clambc-count-blocks passes to trace_ptr.
+  bool CountBlocks;
+
+  // Runs the entrypoint on File. Returns false on a runtime error.
+  bool run(llvm::StringRef File, uint64_t &Result, std::string &ErrorInfo);
+
+  // Results of the last run.
+  uint64_t Instructions;
+  std::string VirusName;
+  // Totals of all runs, indexed like BCModule::APICalls.
+  std::vector<uint64_t> APICallCounts;
+  std::vector<uint64_t> UnsupportedCalls;
+  // Totals of the block counters, indexed like the counter map.
+  std::vector<uint64_t> BlockCounts;
+private:
+  struct Region {
+    uint8_t *Data;
+    uint64_t Size;
+    bool ReadOnly;
+  };
+  struct BufferPipe {
+    // Memory buffer, or 0 if the pipe reads from the file.
+    uint64_t Buffer;
+    uint32_t Size;
+    uint64_t ReadPos, WritePos;
+  };
+  struct Map {
+    int32_t KeySize, ValueSize;
+    std::map<std::string, std::string> Entries;
+    // The key of the last map_addkey, and the value of the last map_find.
+    std::string LastKey, Found;
+    bool HasLastKey, HasFound;
+  };
+  struct Frame {
+    unsigned Function;
+    unsigned PC;
+    unsigned Dest;
+    std::vector<uint64_t> Regs;
+    std::vector<uint8_t> Memory;
+  };
+
+  uint64_t getPointer(unsigned Region, uint64_t Offset) const;
+  uint64_t getGlobalPointer(unsigned Global, uint64_t Offset) const;
+  uint8_t *getMemory(uint64_t Ptr, uint64_t Size, bool Write);
+  uint64_t allocate(uint64_t Size);
+  bool error(const llvm::Twine &Msg);
+  bool stop(uint64_t Count, const llvm::Twine &Msg = llvm::Twine());
+  void enterFunction(unsigned F, const uint64_t *Args, unsigned Dest);
+  bool execute(uint64_t &Result);
+  bool callAPI(unsigned Idx, const uint64_t *Args, uint64_t &Result);
+  void debugMessage(const char *Data, uint64_t Len, bool Prefix,
+                    bool Newline);
+
+  const BCModule &M;
+  std::vector<Region> Regions;
+  // The globals and special globals come first in Regions, then the file
+  // and the memory allocated during a run.
+  unsigned FirstHeapRegion;
+  std::vector<uint8_t*> Owned;
+  std::vector<uint8_t*> Heap;
+  std::vector<Frame> Frames;
+  // Special globals with their contents.
+  std::vector<uint8_t> MatchCounts, MatchOffsets, Kind, VirusNames, PEData,
+    FileSize;
+  std::vector<unsigned> APIKinds;
+  // Constant registers of each function, computed once.
+  std::vector<std::vector<uint64_t> > ConstantRegs;
+
+  // The file being scanned, it is mapped read-only at FileRegion.
+  llvm::StringRef File;
+  unsigned FileRegion;
+  uint64_t FilePos;
+  std::map<int32_t, std::set<uint32_t> > HashSets;
+  int32_t NextHashSet;
+  std::map<int32_t, BufferPipe> Pipes;
+  int32_t NextPipe;
+  std::map<int32_t, Map> Maps;
+  int32_t NextMap;
+  std::string ErrorMsg;
+};
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ *  Standalone runner for compiled bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#include "interpreter.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/System/Path.h"
+#include "llvm/System/Signals.h"
+#include "llvm/System/TimeValue.h"
+#include <algorithm>
+#include <map>
+#include <set>
+
+using namespace llvm;
+
+static cl::opt<std::string>
+BytecodeFile(cl::Positional, cl::desc("<bytecode.cbc>"), cl::Required);
+
+static cl::list<std::string>
+Inputs(cl::Positional, cl::desc("<files or directories to scan>"),
+       cl::OneOrMore);
+
+static cl::opt<unsigned>
+Repeat("repeat", cl::init(1),
+       cl::desc("Run the bytecode this many times on each file"));
+
+static cl::opt<bool>
+Quiet("q", cl::desc("Only print the totals"));
+
+static cl::opt<bool>
+BytecodeDebug("bytecode-debug",
+              cl::desc("Print the debug messages of the bytecode"));
+
+static cl::opt<bool>
+AssumeMatches("assume-matches",
+              cl::desc("Pretend that every subsignature of the logical "
+                       "signature matched"));
+
+static cl::opt<unsigned>
+Timeout("timeout", cl::init(60000),
+        cl::desc("Stop the bytecode after this many milliseconds on a file "
+                 "(0: no limit)"));
+
+static cl::opt<unsigned long long>
+MaxInstructions("max-instructions", cl::init(0),
+                cl::desc("Stop the bytecode after this many instructions on "
+                         "a file (0: no limit)"));
+
+static cl::opt<std::string>
+CountMap("count-map",
+         cl::desc("The counter map of a bytecode compiled with "
+                  "-clambc-count-blocks"),
+         cl::value_desc("file"));
+
+static cl::opt<std::string>
+ProfileOut("profile-out",
+           cl::desc("Write the block counters as a profile for "
+                    "-clambc-profile-use, needs -count-map"),
+           cl::value_desc("file"));
+
+static void addInputs(const sys::Path &P, std::vector<sys::Path> &Files)
+{
+  if (!P.isDirectory()) {
+    Files.push_back(P);
+    return;
+  }
+  std::set<sys::Path> Contents;
+  std::string ErrMsg;
+  if (P.getDirectoryContents(Contents, &ErrMsg)) {
+    errs() << P.str() << ": " << ErrMsg << "\n";
+    return;
+  }
+  for (std::set<sys::Path>::iterator I=Contents.begin(),E=Contents.end();
+       I != E; ++I)
+    addInputs(*I, Files);
+}
+
+static double getMBPerSec(uint64_t Bytes, double Seconds)
+{
+  return Seconds > 0 ? Bytes / Seconds / (1024*1024) : 0;
+}
+
+static double getSeconds(const sys::TimeValue &T)
+{
+  return T.seconds() + T.nanoseconds() / 1e9;
+}
+
+// Adds up the counters of the blocks that start on the same source line,
+// the counter map has a "<index> <function> <file>:<line>" line for each
+// counter, with "-" as the location of blocks without one.
+static bool writeProfile(const std::vector<uint64_t> &Counts,
+                         std::string &ErrorInfo)
+{
+  OwningPtr<MemoryBuffer> Map(MemoryBuffer::getFile(CountMap, &ErrorInfo));
+  if (!Map) {
+    ErrorInfo = CountMap + ": " + ErrorInfo;
+    return false;
+  }
+  std::map<std::pair<std::string, unsigned>, uint64_t> Lines;
+  StringRef Rest = Map->getBuffer();
+  unsigned LineNo = 0;
+  while (!Rest.empty()) {
+    std::pair<StringRef, StringRef> Line = Rest.split('\n');
+    Rest = Line.second;
+    ++LineNo;
+    if (Line.first.empty())
+      continue;
+    std::pair<StringRef, StringRef> Index = Line.first.split(' ');
+    StringRef Loc = Index.second.split(' ').second;
+    std::pair<StringRef, StringRef> FileLine = Loc.rsplit(':');
+    unsigned Idx, SrcLine;
+    if (Index.first.getAsInteger(10, Idx) ||
+        (Loc != "-" && (FileLine.first.empty() ||
+                        FileLine.second.getAsInteger(10, SrcLine)))) {
+      ErrorInfo = CountMap + ": invalid line " + utostr(LineNo);
+      return false;
+    }
+    if (Loc != "-" && Idx < Counts.size() && Counts[Idx])
+      Lines[std::make_pair(FileLine.first.str(), SrcLine)] += Counts[Idx];
+  }
+  raw_fd_ostream Out(ProfileOut.c_str(), ErrorInfo);
+  if (!ErrorInfo.empty())
+    return false;
+  for (std::map<std::pair<std::string, unsigned>, uint64_t>::iterator
+       I=Lines.begin(),E=Lines.end(); I != E; ++I)
+    Out << I->second << " " << I->first.first << ":" << I->first.second
+      << "\n";
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+  cl::ParseCommandLineOptions(argc, argv,
+                              "ClamAV bytecode runner and benchmark\n");
+
+  if (!ProfileOut.empty() && CountMap.empty()) {
+    errs() << "-profile-out needs the counter map, use -count-map\n";
+    return 1;
+  }
+
+  std::string ErrorInfo;
+  OwningPtr<MemoryBuffer> Buffer(MemoryBuffer::getFile(BytecodeFile,
+                                                       &ErrorInfo));
+  if (!Buffer) {
+    errs() << "Could not open " << BytecodeFile << ": " << ErrorInfo << "\n";
+    return 1;
+  }
+  BCModule M;
+  if (!readBytecode(Buffer->getBuffer(), M, ErrorInfo)) {
+    errs() << BytecodeFile << ": " << ErrorInfo << "\n";
+    return 1;
+  }
+  if (!Quiet)
+    outs() << BytecodeFile << ": " << M.Functions.size() << " functions, "
+      << M.Globals.size()-1 << " globals, " << M.APICalls.size()
+      << " API calls, kind " << M.Kind << "\n";
+
+  std::vector<sys::Path> Files;
+  for (unsigned i=0;i<Inputs.size();i++)
+    addInputs(sys::Path(Inputs[i]), Files);
+
+  BCInterpreter Interp(M);
+  Interp.Debug = BytecodeDebug;
+  Interp.AssumeMatches = AssumeMatches;
+  Interp.Timeout = Timeout;
+  Interp.MaxInstructions = MaxInstructions;
+  Interp.CountBlocks = !ProfileOut.empty();
+
+  uint64_t TotalBytes = 0, TotalInstructions = 0;
+  unsigned Scanned = 0, Errors = 0, Detected = 0;
+  sys::TimeValue TotalTime(0.0);
+  for (unsigned i=0;i<Files.size();i++) {
+    const std::string &Name = Files[i].str();
+    OwningPtr<MemoryBuffer> Data(MemoryBuffer::getFile(Name, &ErrorInfo));
+    if (!Data) {
+      errs() << Name << ": " << ErrorInfo << "\n";
+      Errors++;
+      continue;
+    }
+    uint64_t Result = 0, Instructions = 0;
+    bool Ok = true;
+    sys::TimeValue Start = sys::TimeValue::now();
+    for (unsigned r=0;r<Repeat && Ok;r++) {
+      Ok = Interp.run(Data->getBuffer(), Result, ErrorInfo);
+      Instructions += Interp.Instructions;
+    }
+    sys::TimeValue Elapsed = sys::TimeValue::now() - Start;
+    uint64_t Bytes = (uint64_t)Data->getBufferSize() * Repeat;
+    TotalTime += Elapsed;
+    TotalBytes += Bytes;
+    TotalInstructions += Instructions;
+    Scanned++;
+    if (!Ok)
+      Errors++;
+    if (!Interp.VirusName.empty())
+      Detected++;
+    if (Quiet)
+      continue;
+    outs() << Name << ": " << Data->getBufferSize() << " bytes, "
+      << format("%.3f ms, %.2f MB/s, ", getSeconds(Elapsed) * 1000 / Repeat,
+                getMBPerSec(Bytes, getSeconds(Elapsed)))
+      << Instructions / Repeat << " instructions, ";
+    if (Ok)
+      outs() << "returned " << Result;
+    else
+      outs() << "runtime error: " << ErrorInfo;
+    if (!Interp.VirusName.empty())
+      outs() << ", " << Interp.VirusName << " FOUND";
+    outs() << "\n";
+  }
+
+  double Seconds = getSeconds(TotalTime);
+  outs() << "\nFiles: " << Scanned << ", detected: " << Detected
+    << ", runtime errors: " << Errors << "\n"
+    << "Scanned: " << TotalBytes << " bytes in "
+    << format("%.3f s, %.2f MB/s\n", Seconds,
+              getMBPerSec(TotalBytes, Seconds))
+    << "Instructions: " << TotalInstructions;
+  if (TotalBytes)
+    outs() << format(" (%.3f per byte)",
+                     (double)TotalInstructions / TotalBytes);
+  outs() << "\n";
+
+  std::vector<std::pair<uint64_t, unsigned> > Calls;
+  for (unsigned i=0;i<M.APICalls.size();i++) {
+    if (Interp.APICallCounts[i])
+      Calls.push_back(std::make_pair(Interp.APICallCounts[i], i));
+  }
+  std::sort(Calls.rbegin(), Calls.rend());
+  if (!Calls.empty())
+    outs() << "API calls:\n";
+  for (unsigned i=0;i<Calls.size();i++) {
+    unsigned Idx = Calls[i].second;
+    outs() << format("%12llu ", (unsigned long long)Calls[i].first)
+      << M.APICalls[Idx].Name;
+    if (Interp.UnsupportedCalls[Idx])
+      outs() << " (" << Interp.UnsupportedCalls[Idx] << " not supported)";
+    outs() << "\n";
+  }
+
+  if (!ProfileOut.empty() && !writeProfile(Interp.BlockCounts, ErrorInfo)) {
+    errs() << "error writing profile " << ProfileOut << ": " << ErrorInfo
+      << "\n";
+    return 1;
+  }
+  return Errors ? 1 : 0;
+}
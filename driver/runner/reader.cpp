@@ -0,0 +1,1138 @@
+/*
+ *  Standalone runner for compiled bytecode.
+ *
+ *  Copyright (C) 2026 agent
+ *
+ *  Authors: agent
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#include "bytecode.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "../../ClamBC/clambc.h"
+#include <map>
+#include <set>
+
+using namespace llvm;
+
+// Must match ClamBCModule.cpp
+static const char BinaryMagic[] = "ClamBCB";
+static const unsigned char BinaryVersion = 1;
+// Type IDs below this are the integer types and the pointers to i8 - i64,
+// see clamav::initTypeIDs.
+static const unsigned FirstExtraType = 69;
+
+namespace {
+class BytecodeReader {
+public:
+  BytecodeReader(BCModule &M, std::string &ErrorInfo)
+    : M(M), ErrorInfo(ErrorInfo), Failed(false), LineNo(0), F(0) {}
+  bool read(StringRef Data);
+private:
+  bool error(const Twine &Msg);
+  bool nextLine();
+  bool atEnd() const { return Pos >= Line.size(); }
+  bool peek(char C) const { return Pos < Line.size() && Line[Pos] == C; }
+  bool expect(char C);
+  uint64_t readNumber(bool *Constant = 0);
+  unsigned readFixed(unsigned Digits);
+  std::string readData();
+
+  bool readHeader(StringRef Header);
+  bool readTypes();
+  bool computeLayout(unsigned Ty, unsigned Depth = 0);
+  bool readAPICalls();
+  bool readGlobals();
+  bool decodeConstant(BCGlobal &G, const std::vector<uint64_t> &Numbers);
+  bool readFunction();
+  bool readBlock(unsigned BB, bool &Last);
+  bool readInstruction(BCInst &I, unsigned Ty);
+  bool readTerminator(BCInst &I);
+  unsigned readOperand(unsigned *Width = 0, bool Address = false);
+  unsigned readBlockID();
+  unsigned getConstant(uint64_t Value, bool IsGlobal, uint64_t Offset = 0,
+                       bool Unique = false);
+  unsigned getGlobalConstant(uint64_t Global, bool Address);
+  bool isMemory(unsigned Reg) const;
+  unsigned getWidth(unsigned Ty) const;
+  uint64_t getSize(unsigned Ty) const;
+
+  BCModule &M;
+  std::string &ErrorInfo;
+  bool Failed;
+  // Text: the lines after the header. Binary: the records.
+  StringRef Rest;
+  uint64_t RecordsLeft;
+  StringRef Line;
+  size_t Pos;
+  unsigned LineNo;
+  // The function being read.
+  BCFunction *F;
+  std::vector<bool> IsAlloca;
+  typedef std::pair<std::pair<uint64_t, uint64_t>, bool> ConstantKey;
+  std::map<ConstantKey, unsigned> ConstantRegs;
+  unsigned ScratchReg;
+};
+}
+
+bool BytecodeReader::error(const Twine &Msg)
+{
+  if (!Failed) {
+    raw_string_ostream OS(ErrorInfo);
+    if (LineNo)
+      OS << "line " << LineNo << ": ";
+    OS << Msg;
+    OS.flush();
+  }
+  Failed = true;
+  return false;
+}
+
+bool BytecodeReader::nextLine()
+{
+  if (Failed)
+    return false;
+  ++LineNo;
+  Pos = 0;
+  if (!M.Binary) {
+    if (Rest.empty())
+      return error("unexpected end of file");
+    std::pair<StringRef, StringRef> L = Rest.split('\n');
+    Line = L.first;
+    Rest = L.second;
+    return true;
+  }
+  if (!RecordsLeft)
+    return error("unexpected end of file");
+  --RecordsLeft;
+  Line = Rest;
+  uint64_t Len = readNumber();
+  if (Failed || Len > Rest.size() - Pos)
+    return error("truncated record");
+  Line = Rest.substr(Pos, Len);
+  Rest = Rest.substr(Pos + Len);
+  Pos = 0;
+  return true;
+}
+
+bool BytecodeReader::expect(char C)
+{
+  if (!peek(C))
+    return error(Twine("expected '") + Twine(C) + "'");
+  ++Pos;
+  return true;
+}
+
+// See ClamBCModule::printNumber.
+uint64_t BytecodeReader::readNumber(bool *Constant)
+{
+  if (atEnd()) {
+    error("unexpected end of line");
+    return 0;
+  }
+  uint64_t N = 0;
+  bool C;
+  if (M.Binary) {
+    unsigned char B = Line[Pos++];
+    C = B & 1;
+    N = (B >> 1) & 0x3f;
+    unsigned Shift = 6;
+    while (B & 0x80) {
+      if (atEnd() || Shift > 63) {
+        error("invalid number");
+        return 0;
+      }
+      B = Line[Pos++];
+      N |= (uint64_t)(B & 0x7f) << Shift;
+      Shift += 7;
+    }
+  } else {
+    // the length of a 16 digit number overflows into the next bit
+    unsigned char B = Line[Pos++];
+    C = B < 0x60;
+    unsigned Len = B - (C ? 0x40 : 0x60);
+    if (B < 0x40 || Len > 16 || Pos + Len > Line.size()) {
+      error("invalid number");
+      return 0;
+    }
+    for (unsigned i=0;i<Len;i++) {
+      unsigned char D = Line[Pos++];
+      if ((D & 0xf0) != 0x60) {
+        error("invalid number");
+        return 0;
+      }
+      N |= (uint64_t)(D & 0xf) << (4*i);
+    }
+  }
+  if (Constant)
+    *Constant = C;
+  return N;
+}
+
+unsigned BytecodeReader::readFixed(unsigned Digits)
+{
+  unsigned N = 0;
+  if (M.Binary) {
+    for (unsigned i=0;i<(Digits+1)/2;i++) {
+      if (atEnd()) {
+        error("unexpected end of line");
+        return 0;
+      }
+      N |= (unsigned char)Line[Pos++] << (8*i);
+    }
+    return N;
+  }
+  for (unsigned i=0;i<Digits;i++) {
+    if (atEnd() || (Line[Pos] & 0xf0) != 0x60) {
+      error("invalid fixed width number");
+      return 0;
+    }
+    N |= (Line[Pos++] & 0xf) << (4*i);
+  }
+  return N;
+}
+
+std::string BytecodeReader::readData()
+{
+  if (!M.Binary && !expect('|'))
+    return "";
+  uint64_t Len = readNumber();
+  if (Failed)
+    return "";
+  if (M.Binary) {
+    if (Len > Line.size() - Pos) {
+      error("truncated data");
+      return "";
+    }
+    std::string S = Line.substr(Pos, Len).str();
+    Pos += Len;
+    return S;
+  }
+  if (Len > (Line.size() - Pos) / 2) {
+    error("truncated data");
+    return "";
+  }
+  std::string S;
+  for (uint64_t i=0;i<Len;i++) {
+    unsigned char Lo = Line[Pos++], Hi = Line[Pos++];
+    S += (char)((Lo & 0xf) | ((Hi & 0xf) << 4));
+  }
+  return S;
+}
+
+// See ClamBCModule::printModuleHeader.
+bool BytecodeReader::readHeader(StringRef Header)
+{
+  Line = Header;
+  Pos = 0;
+  LineNo = 1;
+  M.FormatLevel = readNumber();
+  M.Timestamp = readNumber();
+  M.SigMaker = readData();
+  readNumber(); // target exclude
+  M.Kind = readNumber();
+  M.MinFunc = readNumber();
+  M.MaxFunc = readNumber();
+  readNumber(); // maximum resource
+  M.Compiler = readData();
+  uint64_t NumTypes = readNumber();
+  uint64_t NumFunctions = readNumber();
+  uint64_t Magic1 = readNumber();
+  unsigned Magic2 = readFixed(2);
+  if (Failed)
+    return false;
+  if (M.FormatLevel != BC_FORMAT_096 && M.FormatLevel != BC_FORMAT_LEVEL)
+    return error(Twine("unsupported bytecode format level ") +
+                 Twine(M.FormatLevel));
+  if (Magic1 != 0x53e5493e9f3d1c30ull || Magic2 != 42)
+    return error("invalid header magic");
+  if (NumTypes < FirstExtraType - 64 || NumTypes > 65536 ||
+      NumFunctions > 65536)
+    return error("invalid header");
+  M.Types.resize(64 + NumTypes);
+  M.Functions.resize(NumFunctions);
+  return true;
+}
+
+// Types 0 - 68 are implicit, the others are described on the 'T' line, see
+// ClamBCModule::describeType.
+bool BytecodeReader::readTypes()
+{
+  for (unsigned i=0;i<M.Types.size();i++) {
+    BCType &T = M.Types[i];
+    T.Count = 0;
+    T.Packed = false;
+    T.LayoutDone = false;
+    if (!i)
+      T.Kind = BCVoidType;
+    else if (i <= 64) {
+      T.Kind = BCIntegerType;
+      T.Count = i;
+    } else if (i < FirstExtraType) {
+      T.Kind = BCPointerType;
+      T.Elements.push_back(8 << (i - 65));
+    }
+  }
+  if (!nextLine() || !expect('T'))
+    return false;
+  unsigned Start = readFixed(2);
+  if (Start != FirstExtraType)
+    return error("unexpected first type ID");
+  for (unsigned i=Start;i<M.Types.size() && !Failed;i++) {
+    BCType &T = M.Types[i];
+    unsigned Kind = readFixed(1);
+    uint64_t N;
+    switch (Kind) {
+    case 1:
+      T.Kind = BCFunctionType;
+      N = readNumber();
+      for (uint64_t j=0;j<N && !Failed;j++)
+        T.Elements.push_back(readNumber());
+      break;
+    case 2:
+    case 3:
+      T.Kind = BCStructType;
+      T.Packed = Kind == 2;
+      N = readNumber();
+      for (uint64_t j=0;j<N && !Failed;j++)
+        T.Elements.push_back(readNumber());
+      break;
+    case 4:
+      T.Kind = BCArrayType;
+      T.Count = readNumber();
+      T.Elements.push_back(readNumber());
+      break;
+    case 5:
+      T.Kind = BCPointerType;
+      T.Elements.push_back(readNumber());
+      break;
+    default:
+      return error(Twine("unknown kind of type ") + Twine(i));
+    }
+    for (unsigned j=0;j<T.Elements.size();j++) {
+      if (T.Elements[j] >= M.Types.size())
+        return error(Twine("type ") + Twine(i) + " refers to unknown type");
+    }
+  }
+  if (Failed)
+    return false;
+  if (!atEnd())
+    return error("too many types");
+  for (unsigned i=0;i<M.Types.size();i++) {
+    if (!computeLayout(i))
+      return false;
+  }
+  return true;
+}
+
+// The layout of the compiler's TargetData ("e-p:64:8:8-i1:8:8-i8:8:8-
+// i16:16:16-i32:32:32-i64:64:64").
+bool BytecodeReader::computeLayout(unsigned Ty, unsigned Depth)
+{
+  BCType &T = M.Types[Ty];
+  if (T.LayoutDone)
+    return true;
+  if (Depth > 64)
+    return error(Twine("recursive type ") + Twine(Ty));
+  T.Size = 0;
+  T.Align = 1;
+  switch (T.Kind) {
+  case BCVoidType:
+  case BCFunctionType:
+    break;
+  case BCIntegerType:
+    T.Size = (T.Count + 7) / 8;
+    T.Align = T.Size;
+    break;
+  case BCPointerType:
+    T.Size = 8;
+    break;
+  case BCArrayType:
+    {
+      if (!computeLayout(T.Elements[0], Depth+1))
+        return false;
+      const BCType &E = M.Types[T.Elements[0]];
+      T.Size = T.Count * E.Size;
+      T.Align = E.Align;
+      break;
+    }
+  case BCStructType:
+    for (unsigned i=0;i<T.Elements.size();i++) {
+      if (!computeLayout(T.Elements[i], Depth+1))
+        return false;
+      const BCType &E = M.Types[T.Elements[i]];
+      if (!T.Packed) {
+        T.Size = (T.Size + E.Align - 1) / E.Align * E.Align;
+        T.Align = std::max(T.Align, E.Align);
+      }
+      T.Offsets.push_back(T.Size);
+      T.Size += E.Size;
+    }
+    T.Size = (T.Size + T.Align - 1) / T.Align * T.Align;
+    break;
+  }
+  T.LayoutDone = true;
+  return true;
+}
+
+bool BytecodeReader::readAPICalls()
+{
+  if (!nextLine() || !expect('E'))
+    return false;
+  readNumber(); // maximum API ID
+  uint64_t N = readNumber();
+  for (uint64_t i=0;i<N && !Failed;i++) {
+    BCAPICall A;
+    A.ID = readNumber();
+    A.Type = readNumber();
+    A.Name = readData();
+    if (!A.Name.empty() && A.Name[A.Name.size()-1] == '\0')
+      A.Name.resize(A.Name.size()-1);
+    if (A.Type >= M.Types.size() || M.Types[A.Type].Kind != BCFunctionType)
+      return error("API call " + A.Name + " has no function type");
+    M.APICalls.push_back(A);
+  }
+  return !Failed;
+}
+
+bool BytecodeReader::readGlobals()
+{
+  if (!nextLine() || !expect('G'))
+    return false;
+  readNumber(); // maximum special global ID
+  uint64_t N = readNumber();
+  if (Failed)
+    return false;
+  if (!N || N >= 32768)
+    return error("invalid number of globals");
+  M.Globals.resize(N);
+  for (uint64_t i=0;i<N && !Failed;i++) {
+    BCGlobal &G = M.Globals[i];
+    G.Type = readNumber();
+    if (G.Type >= M.Types.size())
+      return error("global has unknown type");
+    std::vector<uint64_t> Numbers;
+    for (;;) {
+      bool Constant;
+      uint64_t V = readNumber(&Constant);
+      if (Failed)
+        return false;
+      if (!Constant)
+        break;
+      Numbers.push_back(V);
+    }
+    // the first one is the null pointer placeholder
+    if (i && !decodeConstant(G, Numbers))
+      return error(Twine("invalid initializer for global ") + Twine(i));
+  }
+  return !Failed;
+}
+
+namespace {
+// The initializer of a global is written as the sequence of its integers
+// (ClamBCModule::printConstant), pointers are written as an offset and a
+// global ID. A null pointer, or an aggregate that is all zero, is written as a
+// single 0 instead, so where a 0 starts a pointer or an aggregate it isn't
+// known how many numbers belong to it. The decoder tries both (the single 0
+// first, since that is what the compiler writes for zeros), and backtracks if
+// the numbers don't add up.
+class ConstantDecoder {
+public:
+  ConstantDecoder(const BCModule &M, const std::vector<uint64_t> &Numbers)
+    : M(M), Numbers(Numbers) {}
+  bool decode(BCGlobal &G);
+private:
+  struct Node {
+    unsigned Type;
+    uint64_t Offset;
+    // the node after the subtree of this one
+    unsigned End;
+  };
+  void addNodes(unsigned Ty, uint64_t Offset);
+  bool search(unsigned N, size_t Pos, unsigned Depth);
+  const BCModule &M;
+  const std::vector<uint64_t> &Numbers;
+  std::vector<Node> Nodes;
+  std::vector<char> Collapsed;
+  std::set<std::pair<unsigned, size_t> > Failed;
+};
+}
+
+void ConstantDecoder::addNodes(unsigned Ty, uint64_t Offset)
+{
+  unsigned Idx = Nodes.size();
+  Node N = { Ty, Offset, 0 };
+  Nodes.push_back(N);
+  const BCType &T = M.Types[Ty];
+  if (T.Kind == BCStructType) {
+    for (unsigned i=0;i<T.Elements.size();i++)
+      addNodes(T.Elements[i], Offset + T.Offsets[i]);
+  } else if (T.Kind == BCArrayType) {
+    uint64_t Size = M.Types[T.Elements[0]].Size;
+    for (unsigned i=0;i<T.Count;i++)
+      addNodes(T.Elements[0], Offset + i*Size);
+  }
+  Nodes[Idx].End = Nodes.size();
+}
+
+bool ConstantDecoder::search(unsigned N, size_t Pos, unsigned Depth)
+{
+  while (N < Nodes.size()) {
+    if (Pos >= Numbers.size())
+      return false;
+    const Node &X = Nodes[N];
+    BCTypeKind Kind = M.Types[X.Type].Kind;
+    if (Kind == BCIntegerType) {
+      N++;
+      Pos++;
+      continue;
+    }
+    if (!Numbers[Pos] && Depth < 10000) {
+      std::pair<unsigned, size_t> Key(N, Pos);
+      if (Failed.count(Key))
+        return false;
+      Collapsed[N] = 1;
+      if (search(X.End, Pos+1, Depth+1))
+        return true;
+      Collapsed[N] = 0;
+      if (Kind == BCPointerType ? search(X.End, Pos+2, Depth+1)
+                                : search(N+1, Pos, Depth+1))
+        return true;
+      Failed.insert(Key);
+      return false;
+    }
+    if (Kind == BCPointerType)
+      Pos += 2;
+    N = Kind == BCPointerType ? X.End : N+1;
+  }
+  return Pos == Numbers.size();
+}
+
+bool ConstantDecoder::decode(BCGlobal &G)
+{
+  const BCType &T = M.Types[G.Type];
+  G.Data.assign(T.Size, 0);
+  if (Numbers.size() == 1 && !Numbers[0])
+    return true;
+  addNodes(G.Type, 0);
+  Collapsed.assign(Nodes.size(), 0);
+  if (!search(0, 0, 0))
+    return false;
+  size_t Pos = 0;
+  for (unsigned N=0;N<Nodes.size();) {
+    const Node &X = Nodes[N];
+    const BCType &XT = M.Types[X.Type];
+    if (Collapsed[N]) {
+      Pos++;
+      N = X.End;
+      continue;
+    }
+    if (XT.Kind == BCIntegerType) {
+      uint64_t V = Numbers[Pos++];
+      for (unsigned i=0;i<XT.Size;i++)
+        G.Data[X.Offset + i] = V >> (8*i);
+    } else if (XT.Kind == BCPointerType) {
+      BCReloc R = { X.Offset, (unsigned)Numbers[Pos+1], Numbers[Pos] };
+      if (R.Global >= M.Globals.size() &&
+          (R.Global < _FIRST_GLOBAL || R.Global >= _LAST_GLOBAL))
+        return false;
+      G.Relocs.push_back(R);
+      Pos += 2;
+    }
+    N++;
+  }
+  return true;
+}
+
+bool BytecodeReader::decodeConstant(BCGlobal &G,
+                                    const std::vector<uint64_t> &Numbers)
+{
+  ConstantDecoder D(M, Numbers);
+  return D.decode(G);
+}
+
+unsigned BytecodeReader::getWidth(unsigned Ty) const
+{
+  const BCType &T = M.Types[Ty];
+  if (T.Kind == BCIntegerType)
+    return T.Count;
+  if (T.Kind == BCPointerType)
+    return 64;
+  return 0;
+}
+
+uint64_t BytecodeReader::getSize(unsigned Ty) const
+{
+  return M.Types[Ty].Size;
+}
+
+// Returns the register of a constant. A Unique one can be written to.
+unsigned BytecodeReader::getConstant(uint64_t Value, bool IsGlobal,
+                                     uint64_t Offset, bool Unique)
+{
+  ConstantKey Key(std::make_pair(Value, Offset), IsGlobal);
+  std::map<ConstantKey, unsigned>::iterator I = ConstantRegs.find(Key);
+  if (I != ConstantRegs.end() && !Unique)
+    return I->second;
+  unsigned Reg = F->NumRegs();
+  BCConstant C = { Value, IsGlobal, Offset };
+  F->Constants.push_back(C);
+  if (!Unique)
+    ConstantRegs[Key] = Reg;
+  return Reg;
+}
+
+// The value of a global used as an operand is its contents, like in
+// libclamav: operands that refer to constant expressions, like the address of
+// a string, refer to a global that holds the pointer. Only copies (loads of
+// globals) use the address of the global.
+unsigned BytecodeReader::getGlobalConstant(uint64_t Global, bool Address)
+{
+  if (Address || !Global || Global >= M.Globals.size())
+    return getConstant(Global, true);
+  const BCGlobal &G = M.Globals[Global];
+  const BCType &T = M.Types[G.Type];
+  if (T.Kind == BCPointerType) {
+    for (unsigned i=0;i<G.Relocs.size();i++) {
+      if (!G.Relocs[i].Offset)
+        return getConstant(G.Relocs[i].Global, true, G.Relocs[i].Addend);
+    }
+    return getConstant(0, false);
+  }
+  if (T.Kind == BCIntegerType) {
+    uint64_t V = 0;
+    for (unsigned i=0;i<T.Size;i++)
+      V |= (uint64_t)G.Data[i] << (8*i);
+    return getConstant(V, false);
+  }
+  return getConstant(Global, true);
+}
+
+// Allocas, and globals used directly as operands, refer to memory: copies
+// from and to them are loads and stores.
+bool BytecodeReader::isMemory(unsigned Reg) const
+{
+  if (Reg < F->NumValues)
+    return IsAlloca[Reg];
+  const BCConstant &C = F->Constants[Reg - F->NumValues];
+  return C.IsGlobal && C.Value;
+}
+
+// See ClamBCWriter::printOperand.
+unsigned BytecodeReader::readOperand(unsigned *Width, bool Address)
+{
+  bool Constant;
+  uint64_t V = readNumber(&Constant);
+  if (Failed)
+    return 0;
+  if (!Constant) {
+    if (V >= F->NumValues) {
+      error("operand refers to unknown value");
+      return 0;
+    }
+    if (Width)
+      *Width = IsAlloca[V] ? 64 : getWidth(F->ValueTypes[V]);
+    return V;
+  }
+  unsigned Bytes = readFixed(1);
+  // a constant of width 0 is a global variable
+  if (!Bytes) {
+    if (V >= M.Globals.size() && (V < _FIRST_GLOBAL || V >= _LAST_GLOBAL)) {
+      error("operand refers to unknown global");
+      return 0;
+    }
+    if (Width)
+      *Width = 64;
+    return getGlobalConstant(V, Address);
+  }
+  if (Bytes > 8) {
+    error("constant too wide");
+    return 0;
+  }
+  if (Width)
+    *Width = Bytes*8;
+  return getConstant(V, false);
+}
+
+unsigned BytecodeReader::readBlockID()
+{
+  uint64_t BB = readNumber();
+  if (BB >= F->BlockStart.size()) {
+    error("branch to unknown basic block");
+    return 0;
+  }
+  return BB;
+}
+
+bool BytecodeReader::readFunction()
+{
+  if (!nextLine() || !expect('A'))
+    return false;
+  F->NumArgs = readFixed(1);
+  F->ReturnType = readNumber();
+  if (!expect('L'))
+    return false;
+  uint64_t NumLocals = readNumber();
+  if (Failed)
+    return false;
+  if (NumLocals > 65536)
+    return error("too many values");
+  F->NumValues = F->NumArgs + NumLocals;
+  F->FrameSize = 0;
+  IsAlloca.clear();
+  ConstantRegs.clear();
+  ScratchReg = 0;
+  for (unsigned i=0;i<F->NumValues && !Failed;i++) {
+    unsigned Ty = readNumber();
+    bool Alloca = readFixed(1);
+    if (Ty >= M.Types.size())
+      return error("value has unknown type");
+    F->ValueTypes.push_back(Ty);
+    IsAlloca.push_back(Alloca);
+    if (Alloca) {
+      const BCType &T = M.Types[Ty];
+      F->FrameSize = (F->FrameSize + T.Align - 1) / T.Align * T.Align;
+      BCAlloca A = { i, F->FrameSize };
+      F->Allocas.push_back(A);
+      F->FrameSize += T.Size;
+    }
+  }
+  if (!expect('F'))
+    return false;
+  uint64_t NumInsts = readNumber();
+  uint64_t NumBlocks = readNumber();
+  if (Failed)
+    return false;
+  if (!NumBlocks || NumBlocks > 65536 || NumInsts > 65536*16)
+    return error("invalid function size");
+  F->Code.reserve(NumInsts);
+  F->BlockStart.resize(NumBlocks);
+  bool Last = false;
+  for (unsigned BB=0;BB<NumBlocks;BB++) {
+    if (!nextLine() || !readBlock(BB, Last))
+      return false;
+    if (Last != (BB == NumBlocks-1))
+      return error("function ends in the wrong basic block");
+  }
+  // branch targets were read as basic block IDs
+  for (unsigned i=0;i<F->Code.size();i++) {
+    BCInst &I = F->Code[i];
+    switch (I.Opcode) {
+    case OP_BC_JMP:
+      I.Ops[0] = F->BlockStart[I.Ops[0]];
+      break;
+    case OP_BC_BRANCH:
+      I.Ops[1] = F->BlockStart[I.Ops[1]];
+      I.Ops[2] = F->BlockStart[I.Ops[2]];
+      break;
+    case OP_BC_ICMP_BRANCH:
+      I.Ops[2] = F->BlockStart[I.Ops[2]];
+      I.Ops[3] = F->BlockStart[I.Ops[3]];
+      break;
+    }
+  }
+  return true;
+}
+
+static bool writesDest(unsigned Opcode)
+{
+  switch (Opcode) {
+  case OP_BC_STORE:
+  case OP_BC_LOAD_ADD_STORE:
+  case OP_BC_MEMSET:
+  case OP_BC_MEMCPY:
+  case OP_BC_MEMMOVE:
+    return false;
+  default:
+    return true;
+  }
+}
+
+bool BytecodeReader::readBlock(unsigned BB, bool &Last)
+{
+  if (!expect('B'))
+    return false;
+  F->BlockStart[BB] = F->Code.size();
+  while (!peek('T') && !Failed) {
+    BCInst I;
+    memset(&I, 0, sizeof(I));
+    unsigned Ty = readNumber();
+    I.Dest = readNumber();
+    I.Opcode = readFixed(2);
+    if (Failed)
+      return false;
+    if (Ty >= M.Types.size())
+      return error("instruction has unknown type");
+    if (I.Dest >= F->NumValues)
+      return error("instruction writes to unknown value");
+    if (!readInstruction(I, Ty))
+      return false;
+    if (!writesDest(I.Opcode)) {
+      F->Code.push_back(I);
+      continue;
+    }
+    if (!ScratchReg)
+      ScratchReg = getConstant(0, false, 0, true);
+    // calls without a result
+    if (!Ty)
+      I.Dest = ScratchReg;
+    if (IsAlloca[I.Dest]) {
+      // The only use of the value is a store to this alloca, and the
+      // register allocator gave them the same ID: write to its memory.
+      BCInst S;
+      memset(&S, 0, sizeof(S));
+      S.Opcode = OP_BC_STORE;
+      S.Width = I.Width;
+      S.Size = I.Size;
+      S.Ops[0] = ScratchReg;
+      S.Ops[1] = I.Dest;
+      I.Dest = ScratchReg;
+      F->Code.push_back(I);
+      F->Code.push_back(S);
+      continue;
+    }
+    F->Code.push_back(I);
+  }
+  if (!expect('T'))
+    return false;
+  BCInst I;
+  memset(&I, 0, sizeof(I));
+  I.Opcode = readFixed(2);
+  if (!readTerminator(I))
+    return false;
+  F->Code.push_back(I);
+  Last = peek('E');
+  if (!Last) {
+    if (!atEnd())
+      return error("garbage after terminator");
+    return true;
+  }
+  ++Pos;
+  // line numbers of the instructions
+  if (peek('D')) {
+    if (!expect('D') || !expect('B') || !expect('G'))
+      return false;
+    uint64_t N = readNumber();
+    for (uint64_t i=0;i<N && !Failed;i++)
+      readNumber();
+  }
+  if (!atEnd())
+    return error("garbage after end of function");
+  return !Failed;
+}
+
+// See ClamBCWriter's visit* and printSuperinstruction.
+bool BytecodeReader::readInstruction(BCInst &I, unsigned Ty)
+{
+  I.Width = getWidth(Ty);
+  I.Size = getSize(Ty) <= 255 ? getSize(Ty) : 0;
+  unsigned Width;
+  switch (I.Opcode) {
+  case OP_BC_ADD: case OP_BC_SUB: case OP_BC_MUL: case OP_BC_UDIV:
+  case OP_BC_SDIV: case OP_BC_UREM: case OP_BC_SREM: case OP_BC_SHL:
+  case OP_BC_LSHR: case OP_BC_ASHR: case OP_BC_AND: case OP_BC_OR:
+  case OP_BC_XOR:
+    I.Ops[0] = readOperand();
+    I.Ops[1] = readOperand();
+    break;
+  case OP_BC_TRUNC:
+  case OP_BC_ZEXT:
+  case OP_BC_SEXT:
+    I.Ops[0] = readOperand(&Width);
+    I.Aux = Width;
+    break;
+  case OP_BC_ICMP_EQ: case OP_BC_ICMP_NE: case OP_BC_ICMP_UGT:
+  case OP_BC_ICMP_UGE: case OP_BC_ICMP_ULT: case OP_BC_ICMP_ULE:
+  case OP_BC_ICMP_SGT: case OP_BC_ICMP_SGE: case OP_BC_ICMP_SLE:
+  case OP_BC_ICMP_SLT:
+    {
+      unsigned OpTy = readNumber();
+      if (OpTy >= M.Types.size())
+        return error("compare of unknown type");
+      I.Width = getWidth(OpTy);
+      I.Ops[0] = readOperand();
+      I.Ops[1] = readOperand();
+      break;
+    }
+  case OP_BC_SELECT:
+    I.Ops[0] = readOperand();
+    I.Ops[1] = readOperand();
+    I.Ops[2] = readOperand();
+    break;
+  case OP_BC_CALL_DIRECT:
+  case OP_BC_CALL_API:
+    {
+      unsigned N = readFixed(1);
+      uint64_t Callee = readNumber();
+      if (Failed)
+        return false;
+      if (I.Opcode == OP_BC_CALL_DIRECT) {
+        // function IDs start at 1
+        if (!Callee || Callee > M.Functions.size())
+          return error("call to unknown function");
+        I.Imm = Callee - 1;
+      } else {
+        unsigned i;
+        for (i=0;i<M.APICalls.size();i++) {
+          if (M.APICalls[i].ID == Callee)
+            break;
+        }
+        if (i == M.APICalls.size())
+          return error("call to unknown API");
+        if (M.Types[M.APICalls[i].Type].Elements.size() != N+1)
+          return error("wrong number of arguments for " + M.APICalls[i].Name);
+        I.Imm = i;
+      }
+      I.Ops[0] = F->CallArgs.size();
+      I.Ops[1] = N;
+      for (unsigned i=0;i<N && !Failed;i++)
+        F->CallArgs.push_back(readOperand());
+      break;
+    }
+  case OP_BC_COPY:
+    {
+      unsigned Src = readOperand(0, true);
+      unsigned Dst = readOperand(0, true);
+      if (Failed)
+        return false;
+      if (Dst >= F->NumValues)
+        return error("copy to a constant");
+      I.Dest = 0;
+      if (isMemory(Src) && isMemory(Dst)) {
+        I.Opcode = OP_BC_MEMCPY;
+        I.Ops[0] = Dst;
+        I.Ops[1] = Src;
+        I.Ops[2] = getConstant(getSize(Ty), false);
+      } else if (isMemory(Src)) {
+        I.Opcode = OP_BC_LOAD;
+        I.Dest = Dst;
+        I.Ops[0] = Src;
+      } else if (isMemory(Dst)) {
+        I.Opcode = OP_BC_STORE;
+        I.Ops[0] = Src;
+        I.Ops[1] = Dst;
+      } else {
+        I.Dest = Dst;
+        I.Ops[0] = Src;
+      }
+      break;
+    }
+  case OP_BC_GEP1:
+  case OP_BC_GEPZ:
+  case OP_BC_GEP1_LOAD:
+    {
+      unsigned PtrTy = readNumber();
+      if (Failed)
+        return false;
+      if (PtrTy >= M.Types.size() || M.Types[PtrTy].Kind != BCPointerType)
+        return error("GEP of a non-pointer");
+      const BCType &T = M.Types[M.Types[PtrTy].Elements[0]];
+      I.Ops[0] = readOperand();
+      I.Ops[1] = readOperand(&Width);
+      I.Aux = Width;
+      if (Failed)
+        return false;
+      if (I.Opcode != OP_BC_GEPZ || (T.Kind != BCStructType &&
+                                     T.Kind != BCArrayType)) {
+        I.Imm = T.Size;
+        break;
+      }
+      if (T.Kind == BCArrayType) {
+        I.Imm = M.Types[T.Elements[0]].Size;
+        break;
+      }
+      // struct fields are selected by a constant index
+      if (I.Ops[1] < F->NumValues ||
+          F->Constants[I.Ops[1] - F->NumValues].IsGlobal)
+        return error("struct GEP with a variable index");
+      uint64_t Field = F->Constants[I.Ops[1] - F->NumValues].Value;
+      if (Field >= T.Offsets.size())
+        return error("struct GEP out of range");
+      I.Ops[1] = getConstant(T.Offsets[Field], false);
+      I.Aux = 64;
+      I.Imm = 1;
+      break;
+    }
+  case OP_BC_GEPN:
+    return error("GEPN is not supported");
+  case OP_BC_STORE:
+    I.Ops[0] = readOperand();
+    I.Ops[1] = readOperand();
+    break;
+  case OP_BC_LOAD:
+    I.Ops[0] = readOperand();
+    break;
+  case OP_BC_MEMSET:
+  case OP_BC_MEMCPY:
+  case OP_BC_MEMMOVE:
+  case OP_BC_MEMCMP:
+  case OP_BC_MEMCMP_EQ:
+  case OP_BC_MEMCMP_NE:
+    I.Ops[0] = readOperand();
+    I.Ops[1] = readOperand();
+    I.Ops[2] = readOperand();
+    break;
+  case OP_BC_ISBIGENDIAN:
+  case OP_BC_ABORT:
+    break;
+  case OP_BC_BSWAP16:
+  case OP_BC_BSWAP32:
+  case OP_BC_BSWAP64:
+  case OP_BC_PTRTOINT64:
+    I.Ops[0] = readOperand();
+    break;
+  case OP_BC_PTRDIFF32:
+  case OP_BC_LOAD_ADD_STORE:
+    I.Ops[0] = readOperand();
+    I.Ops[1] = readOperand();
+    break;
+  default:
+    return error(Twine("unknown opcode ") + Twine(I.Opcode));
+  }
+  return !Failed;
+}
+
+bool BytecodeReader::readTerminator(BCInst &I)
+{
+  switch (I.Opcode) {
+  case OP_BC_JMP:
+    I.Ops[0] = readBlockID();
+    break;
+  case OP_BC_BRANCH:
+    I.Ops[0] = readOperand();
+    I.Ops[1] = readBlockID();
+    I.Ops[2] = readBlockID();
+    break;
+  case OP_BC_ICMP_BRANCH:
+    {
+      I.Aux = readFixed(2);
+      unsigned OpTy = readNumber();
+      if (Failed)
+        return false;
+      if (I.Aux < OP_BC_ICMP_EQ || I.Aux > OP_BC_ICMP_SLT ||
+          OpTy >= M.Types.size())
+        return error("invalid compare and branch");
+      I.Width = getWidth(OpTy);
+      I.Ops[0] = readOperand();
+      I.Ops[1] = readOperand();
+      I.Ops[2] = readBlockID();
+      I.Ops[3] = readBlockID();
+      break;
+    }
+  case OP_BC_RET:
+    {
+      unsigned Ty = readNumber();
+      if (Failed)
+        return false;
+      if (Ty >= M.Types.size())
+        return error("return of unknown type");
+      I.Width = getWidth(Ty);
+      I.Ops[0] = readOperand();
+      break;
+    }
+  case OP_BC_RET_VOID:
+  case OP_BC_ABORT:
+    break;
+  default:
+    return error(Twine("unknown terminator opcode ") + Twine(I.Opcode));
+  }
+  return !Failed;
+}
+
+bool BytecodeReader::read(StringRef Data)
+{
+  M.Binary = Data.startswith(BinaryMagic);
+  StringRef Header;
+  if (M.Binary) {
+    size_t HdrLen = sizeof(BinaryMagic) - 1;
+    if (Data.size() <= HdrLen || (unsigned char)Data[HdrLen] != BinaryVersion)
+      return error("unsupported binary bytecode version");
+    // the header record, and the number of records that follow
+    Line = Data.substr(HdrLen + 1);
+    Pos = 0;
+    uint64_t Len = readNumber();
+    if (Failed || Len > Line.size() - Pos)
+      return error("truncated header");
+    Header = Line.substr(Pos, Len);
+    Line = Line.substr(Pos + Len);
+    Pos = 0;
+    RecordsLeft = readNumber();
+    if (Failed)
+      return error("truncated header");
+    Rest = Line.substr(Pos);
+  } else {
+    if (!Data.startswith("ClamBC"))
+      return error("not a bytecode file");
+    std::pair<StringRef, StringRef> L = Data.split('\n');
+    Header = L.first.substr(6);
+    // the length of the longest line follows
+    size_t Colon = Header.rfind(':');
+    if (Colon == StringRef::npos)
+      return error("invalid header");
+    Header = Header.substr(0, Colon);
+    Rest = L.second;
+  }
+  if (!readHeader(Header))
+    return false;
+
+  if (!nextLine())
+    return false;
+  M.Trigger = Line.str();
+  if (!readTypes() || !readAPICalls() || !readGlobals())
+    return false;
+
+  StringRef SavedRest = Rest;
+  uint64_t SavedRecords = RecordsLeft;
+  unsigned SavedLineNo = LineNo;
+  // debug information
+  while (nextLine() && peek('D')) {
+    SavedRest = Rest;
+    SavedRecords = RecordsLeft;
+    SavedLineNo = LineNo;
+  }
+  if (Failed)
+    return false;
+  Rest = SavedRest;
+  RecordsLeft = SavedRecords;
+  LineNo = SavedLineNo;
+
+  for (unsigned i=0;i<M.Functions.size();i++) {
+    F = &M.Functions[i];
+    if (!readFunction())
+      return false;
+  }
+  F = 0;
+  // check the calls now that all functions are known
+  for (unsigned i=0;i<M.Functions.size();i++) {
+    const BCFunction &Fn = M.Functions[i];
+    for (unsigned j=0;j<Fn.Code.size();j++) {
+      const BCInst &I = Fn.Code[j];
+      if (I.Opcode == OP_BC_CALL_DIRECT &&
+          M.Functions[I.Imm].NumArgs != I.Ops[1]) {
+        LineNo = 0;
+        return error(Twine("wrong number of arguments in call from function ")
+                     + Twine(i));
+      }
+    }
+  }
+  return true;
+}
+
+bool readBytecode(StringRef Data, BCModule &M, std::string &ErrorInfo)
+{
+  BytecodeReader R(M, ErrorInfo);
+  return R.read(Data);
+}